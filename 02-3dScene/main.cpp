@@ -401,7 +401,7 @@ void renderScene()
   glBindVertexArray(cube->GetVAO());
 
   // The actual draw
-  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0));
 
   // Unbind the shader program and other resources
   glBindVertexArray(0);
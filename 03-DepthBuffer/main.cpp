@@ -641,7 +641,7 @@ void renderScene()
 
   // Draw the quad
   glBindVertexArray(quad->GetVAO());
-  glDrawElements(GL_TRIANGLES, quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  glDrawElements(GL_TRIANGLES, quad->GetIBOSize(), quad->GetIndexType(), reinterpret_cast<void*>(0));
 #endif
 
   // Update transformation matrix for the cube
@@ -651,7 +651,7 @@ void renderScene()
 
   // Draw the cube
   glBindVertexArray(cube->GetVAO());
-  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0));
 
 #if _DEPTH_PRECISION_TEST
   for (int i = 0; i < 10; ++i)
@@ -662,7 +662,7 @@ void renderScene()
 
     // Draw the cube
     glBindVertexArray(cube->GetVAO());
-    glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+    glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0));
   }
 #endif
 
@@ -469,7 +469,7 @@ void renderScene()
 
   // Draw the quad
   glBindVertexArray(quad->GetVAO());
-  glDrawElements(GL_TRIANGLES, quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  glDrawElements(GL_TRIANGLES, quad->GetIBOSize(), quad->GetIndexType(), reinterpret_cast<void*>(0));
 #endif
 
 #if _TUNNEL
@@ -480,7 +480,7 @@ void renderScene()
 
   // Draw the cube
   glBindVertexArray(cube->GetVAO());
-  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0));
 #elif _CUBE
   // Update transformation matrix for the cube
   transformation = glm::mat4x4(1.0f);
@@ -489,7 +489,7 @@ void renderScene()
 
   // Draw the cube
   glBindVertexArray(cube->GetVAO());
-  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0));
 #endif
 
   // --------------------------------------------------------------------------
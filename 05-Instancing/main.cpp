@@ -5,23 +5,23 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/transform.hpp>
 
+#include <Benchmark.h>
 #include <Camera.h>
 #include <Geometry.h>
+#include <JobSystem.h>
+#include <Profiler.h>
 #include <Textures.h>
+#include <TransformKernels.h>
 
 #include "shaders.h"
 
-// Chooses instancing method, there's also third via SSBO which requires OpenGL 4.3
-// (see _ALLOW_SSBO_INSTANCING in shaders.h)
-#define _VERTEX_PARAMS_INSTANCING 0
-#define _UNIFORM_BLOCK_INSTANCING 1
-
 // Set to 1 to create debugging context that reports errors, requires OpenGL 4.3!
 #define _ENABLE_OPENGL_DEBUG 0
 
@@ -93,13 +93,36 @@ static constexpr float CameraTurboSpeed = 50.0f;
 
 // ----------------------------------------------------------------------------
 
-#if _UNIFORM_BLOCK_INSTANCING
+// Instancing methods selectable at runtime, the storage buffer based ones require OpenGL 4.3
+// (see _ALLOW_SSBO_INSTANCING in shaders.h)
+namespace InstancingMode
+{
+  enum
+  {
+    // Instanced vertex attributes uploaded every frame
+    VertexParams,
+    // Chains of uniform buffer instances uploaded every frame
+    UniformBlock,
+    // Storage buffer uploaded every frame
+    StorageBuffer,
+    // Storage buffer generated by a compute shader once and kept resident on the GPU
+    GpuResident,
+    // Resident instances culled against the view frustum by a compute shader, drawn indirectly
+    GpuCulled,
+    NumModes
+  };
+}
+
+// Names of the instancing methods for the window title and benchmark output
+static const char *instancingModeNames[InstancingMode::NumModes] = {"VertexParams", "UniformBlock", "StorageBuffer", "GpuResident", "GpuCulled"};
+
 // Maximum number of instances per single instanced draw call
 static const unsigned int MAX_INSTANCE_CHAIN_LENGTH = 1024; // must match the instancing vertex shader!
-#endif
 
 // Maximum number of allowed instances - SSBO can be up to 128 MB! - it'd be safer to ask driver, though
 static const unsigned int MAX_INSTANCES = 1000000;
+// Number of instances filled by a single job
+static const int INSTANCE_BATCH_SIZE = 1024;
 // Max buffer length
 static const unsigned int MAX_TEXT_LENGTH = 256;
 // MSAA samples
@@ -119,14 +142,28 @@ bool vsync = true;
 bool depthTest = true;
 // Use instancing?
 bool useInstancing = false;
+// Current instancing method
+int instancingMode = InstancingMode::UniformBlock;
 // Current number of instances per cube side in the scene
 int instancesPerSide = 1;
 // Current number of instances in the scene
 int numInstances = 1;
-// Instancing buffer handle
+// Instancing buffer handle, shared by the instanced vertex attributes and the storage buffer methods
 GLuint instancingBuffer = 0;
+// Uniform buffer handle for the instance chains
+GLuint instanceChainBuffer = 0;
+// Storage buffer handle for the GPU generated instances
+GLuint residentInstancingBuffer = 0;
+// Grid size the resident instances were generated for, 0 if not generated yet
+int residentInstancesPerSide = 0;
+// Storage buffer handle for the visible instances after culling
+GLuint visibleInstancingBuffer = 0;
+// Indirect draw command buffer handle filled by the culling
+GLuint drawCommandBuffer = 0;
 // Transformation matrices uniform buffer object
 GLuint transformBlockUBO = 0;
+// Benchmark mode settings and output
+Benchmark benchmark;
 
 // Data for a single object instance
 struct InstanceData
@@ -135,8 +172,27 @@ struct InstanceData
   glm::mat3x4 transformation;
 };
 
+// Parameters of glDrawElementsIndirect() as laid out in the indirect buffer
+struct DrawElementsIndirectCommand
+{
+  GLuint count;
+  GLuint instanceCount;
+  GLuint firstIndex;
+  GLuint baseVertex;
+  GLuint baseInstance;
+};
+
 // ----------------------------------------------------------------------------
 
+// Is the instancing method available in the current context?
+bool isInstancingModeSupported(int mode)
+{
+  if (mode == InstancingMode::StorageBuffer || mode == InstancingMode::GpuResident || mode == InstancingMode::GpuCulled)
+    return shaderProgram[ShaderProgram::InstancingBuffer] != 0;
+
+  return mode >= 0 && mode < InstancingMode::NumModes;
+}
+
 // Callback for handling GLFW errors
 void errorCallback(int error, const char* description)
 {
@@ -220,12 +276,21 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
       glfwSwapInterval(0);
   }
 
-  // Enable/disable vsync
+  // Enable/disable instancing
   if (key == GLFW_KEY_F6 && action == GLFW_PRESS)
   {
     useInstancing = !useInstancing;
   }
 
+  // Cycle through the available instancing methods
+  if (key == GLFW_KEY_F7 && action == GLFW_PRESS)
+  {
+    do
+    {
+      instancingMode = (instancingMode + 1) % InstancingMode::NumModes;
+    } while (!isInstancingModeSupported(instancingMode));
+  }
+
   // Zoom in
   if (key == GLFW_KEY_KP_ADD || key == GLFW_KEY_EQUAL && action == GLFW_PRESS)
   {
@@ -292,11 +357,10 @@ void createGeometry()
   // Prepare meshes
   cube = Geometry::CreateCubeTex();
 
-#if _VERTEX_PARAMS_INSTANCING
-  // Bind and update the VAO with instanced vertex attributes
+  // Bind and update the VAO with instanced vertex attributes, they're simply ignored by the other methods
   glBindVertexArray(cube->GetVAO());
 
-  // Generate the instancing buffer but don't fill it with data
+  // Generate the instancing buffer but don't fill it with data, it serves as an SSBO too
   glGenBuffers(1, &instancingBuffer);
   glBindBuffer(GL_ARRAY_BUFFER, instancingBuffer);
   glBufferData(GL_ARRAY_BUFFER, MAX_INSTANCES * sizeof(InstanceData), nullptr, GL_DYNAMIC_DRAW);
@@ -316,21 +380,14 @@ void createGeometry()
   glEnableVertexAttribArray(4);
   glVertexAttribDivisor(4, 1); // Tell OpenGL to update this attribute for each instance
 
-  // Unbind the VAO
+  // Unbind the VAO and the buffer
   glBindVertexArray(0);
-#elif _ALLOW_SSBO_INSTANCING
-  // Generate the instancing buffer but don't fill it with data
-  glGenBuffers(1, &instancingBuffer);
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, instancingBuffer);
-  glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_INSTANCES * sizeof(InstanceData), nullptr, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-  // Unbind the buffer for now
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-#elif _UNIFORM_BLOCK_INSTANCING
   {
-    // Generate the instancing buffer as Uniform Buffer Object
-    glGenBuffers(1, &instancingBuffer);
-    glBindBuffer(GL_UNIFORM_BUFFER, instancingBuffer);
+    // Generate the instance chain buffer as Uniform Buffer Object
+    glGenBuffers(1, &instanceChainBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, instanceChainBuffer);
 
     // Obtain UBO index and size from the instancing shader program
     GLuint uboIndex = glGetUniformBlockIndex(shaderProgram[ShaderProgram::InstancingUniformBlock], "InstanceBuffer");
@@ -343,7 +400,27 @@ void createGeometry()
     // Unbind the GL_UNIFORM_BUFFER target for now
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
   }
-#endif
+
+  if (isInstancingModeSupported(InstancingMode::GpuResident))
+  {
+    // Storage for the GPU generated instances, written and read by the GPU only
+    glGenBuffers(1, &residentInstancingBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, residentInstancingBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_INSTANCES * sizeof(InstanceData), nullptr, GL_STATIC_COPY);
+    residentInstancesPerSide = 0;
+
+    // Compacted visible instances, at most all of them
+    glGenBuffers(1, &visibleInstancingBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleInstancingBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_INSTANCES * sizeof(InstanceData), nullptr, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // Indirect draw command, the instance count is written by the culling shader
+    glGenBuffers(1, &drawCommandBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  }
 
   // Generate the transform UBO handle
   glGenBuffers(1, &transformBlockUBO);
@@ -380,10 +457,10 @@ bool initOpenGL()
   // Initialize the GLFW library
   if (!glfwInit()) return false;
 
-  // Request OpenGL 3.3 core profile upon window creation
+  // Request OpenGL 4.3 core profile upon window creation for the storage buffer methods, 3.3 otherwise
 #if _ALLOW_SSBO_INSTANCING
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 #else
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -396,6 +473,16 @@ bool initOpenGL()
 
   // Create the window
   mainWindow.handle = glfwCreateWindow(Window::DefaultWidth, Window::DefaultHeight, "", nullptr, nullptr);
+#if _ALLOW_SSBO_INSTANCING
+  if (mainWindow.handle == nullptr)
+  {
+    // Older GPU, fall back to OpenGL 3.3 and the vertex attribute and uniform buffer methods only
+    printf("OpenGL 4.3 is not available, storage buffer instancing disabled.\n");
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    mainWindow.handle = glfwCreateWindow(Window::DefaultWidth, Window::DefaultHeight, "", nullptr, nullptr);
+  }
+#endif
   if (mainWindow.handle == nullptr)
   {
     printf("Failed to create the GLFW window!");
@@ -419,7 +506,6 @@ bool initOpenGL()
   glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, &unusedIds, true);
 #endif
 
-#if _UNIFORM_BLOCK_INSTANCING
   // Check for available UBO size in bytes
   GLint maxUboSize;
   const GLint expectedUboSize = 4096 * 4 * 4;
@@ -429,7 +515,6 @@ bool initOpenGL()
     printf("Implementation allowed UBO size: %d B smaller than expected (%d B)!", maxUboSize, expectedUboSize);
     return false;
   }
-#endif
 
   // Enable vsync
   if (vsync)
@@ -466,6 +551,9 @@ bool initOpenGL()
 // Helper method for graceful shutdown
 void shutDown()
 {
+  // Stop the worker threads
+  JobSystem::GetInstance().Release();
+
   // Release shader programs
   for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
   {
@@ -476,8 +564,12 @@ void shutDown()
   delete cube;
   cube = nullptr;
 
-  // Release the instancing buffer
+  // Release the instancing buffers
   glDeleteBuffers(1, &instancingBuffer);
+  glDeleteBuffers(1, &instanceChainBuffer);
+  glDeleteBuffers(1, &residentInstancingBuffer);
+  glDeleteBuffers(1, &visibleInstancingBuffer);
+  glDeleteBuffers(1, &drawCommandBuffer);
 
   // Release the window
   glfwDestroyWindow(mainWindow.handle);
@@ -563,6 +655,66 @@ void updateTransformBlock()
   glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
+// Helper method for filling the CPU side instance data, the grid only changes with the number of instances
+const std::vector<InstanceData> &updateInstanceData()
+{
+  // Instance data CPU side buffer and the grid size it was built for
+  static std::vector<InstanceData> instanceData(MAX_INSTANCES);
+  static int instanceDataPerSide = 0;
+
+  if (instanceDataPerSide != instancesPerSide)
+  {
+    // Batches of the grid are filled in parallel
+    const int side = instancesPerSide;
+    JobSystem::GetInstance().ParallelFor(side * side * side, INSTANCE_BATCH_SIZE, [side](int begin, int end)
+    {
+      // Grid positions of the batch, x goes first
+      glm::vec3 positions[INSTANCE_BATCH_SIZE];
+      for (int i = begin; i < end; ++i)
+      {
+        int x = i % side;
+        int y = (i / side) % side;
+        int z = i / (side * side);
+        positions[i - begin] = glm::vec3((float)(2 * x - side), (float)(2 * y - side), (float)(2 * z - side));
+      }
+
+      TransformKernels::Translate(positions, end - begin, &instanceData[begin], sizeof(InstanceData));
+    });
+    instanceDataPerSide = instancesPerSide;
+  }
+
+  return instanceData;
+}
+
+// Helper method for copying the instance data to the instancing buffer bound to the target
+void uploadInstanceData(GLenum target, const std::vector<InstanceData> &instanceData, int offset, int count)
+{
+  // Map the used range to the system memory, perform memcpy and unmap - invalidation lets the driver skip waiting
+  // for the previous frame, beware of reading the buffer -> it incurs slowdown
+  void *ptr = glMapBufferRange(target, 0, count * sizeof(InstanceData), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (ptr)
+  {
+    memcpy(ptr, &*(instanceData.begin() + offset), count * sizeof(InstanceData));
+    glUnmapBuffer(target);
+  }
+}
+
+// Helper method for generating the resident instances on the GPU, only does the work when the grid changes
+void generateResidentInstances()
+{
+  if (residentInstancesPerSide == instancesPerSide)
+    return;
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, residentInstancingBuffer);
+  glUseProgram(shaderProgram[ShaderProgram::GenerateInstances]);
+  glUniform1i(0, instancesPerSide);
+  glDispatchCompute((numInstances + 63) / 64, 1, 1);
+
+  // Make the compute shader writes visible to the following shader reads
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  residentInstancesPerSide = instancesPerSide;
+}
+
 void renderScene()
 {
   // Enable/disable depth test and write
@@ -599,83 +751,136 @@ void renderScene()
 
   // Create transformation matrix - 4 columns, 3 rows, last (0, 0, 0, 1) implicit to save space
   glm::mat4x3 transformation = glm::mat4x3(1.0f);
-  // Instance data CPU side buffer
-  static std::vector<InstanceData> instanceData(MAX_INSTANCES);
 
   updateTransformBlock();
 
   if (useInstancing)
   {
-    // Update transformation matrices for all cubes
-    for (int x = 0; x < instancesPerSide; ++x)
+    switch (instancingMode)
     {
-      for (int y = 0; y < instancesPerSide; ++y)
-      {
-        for (int z = 0; z < instancesPerSide; ++z)
-        {
-          transformation = glm::translate(glm::vec3((float)(2 * x - instancesPerSide), (2 * y - instancesPerSide), (float)(2 * z - instancesPerSide)));
-          instanceData[x + instancesPerSide * (y + instancesPerSide * z)].transformation = glm::transpose(transformation);
-        }
-      }
+    case InstancingMode::VertexParams:
+    {
+      // It is possible to update the buffer using the glBufferSubData() call but that may incur overhead. So unless you have very
+      // good reason like updating only part of the buffer, mapping is advised
+      glBindBuffer(GL_ARRAY_BUFFER, instancingBuffer);
+      uploadInstanceData(GL_ARRAY_BUFFER, updateInstanceData(), 0, numInstances);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+      // Select shader program
+      glUseProgram(shaderProgram[ShaderProgram::VertexParamInstancing]);
+
+      // Draw all cubes
+      glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0), numInstances);
+      break;
     }
 
-    // Update the instance data
-#if _VERTEX_PARAMS_INSTANCING
-    // It is possible to update the buffer using the glBufferSubData() call but that may incur overhead. So unless you have very
-    // good reason like updating only part of the buffer, the latter method is advised
-    //glBufferSubData(GL_ARRAY_BUFFER, 0, numInstances * sizeof(InstanceData), static_cast<void*>(&*instanceData.begin()));
+    case InstancingMode::UniformBlock:
+    {
+      const std::vector<InstanceData> &instanceData = updateInstanceData();
 
-    // Map the whole buffer to the system memory, perform memcpy and unmap - beware of reading the buffer -> it incurs slowdown
-    void *ptr = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-    memcpy(ptr, &*instanceData.begin(), numInstances * sizeof(InstanceData));
-    glUnmapBuffer(GL_ARRAY_BUFFER);
+      // Bind the whole instancing buffer to the index 1
+      glBindBuffer(GL_UNIFORM_BUFFER, instanceChainBuffer);
+      glBindBufferBase(GL_UNIFORM_BUFFER, 1, instanceChainBuffer);
 
-    // Select shader program
-    glUseProgram(shaderProgram[ShaderProgram::VertexParamInstancing]);
+      // Select shader program
+      glUseProgram(shaderProgram[ShaderProgram::InstancingUniformBlock]);
+
+      // Build instance chains and render them
+      for (int offset = 0, remaining = numInstances; remaining > 0; offset += MAX_INSTANCE_CHAIN_LENGTH, remaining -= MAX_INSTANCE_CHAIN_LENGTH)
+      {
+        const int unsigned chainLength = std::min((unsigned int)remaining, MAX_INSTANCE_CHAIN_LENGTH);
 
-    // Draw all cubes
-    glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), numInstances);
-#elif _UNIFORM_BLOCK_INSTANCING
-    // Bind the whole instancing buffer to the index 1
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, instancingBuffer);
+        // Update the buffer data using mapping
+        uploadInstanceData(GL_UNIFORM_BUFFER, instanceData, offset, chainLength);
 
-    // Select shader program
-    glUseProgram(shaderProgram[ShaderProgram::InstancingUniformBlock]);
+        // Draw the instance chain
+        glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0), chainLength);
+      }
+
+      // Unbind the instancing buffer
+      glBindBufferBase(GL_UNIFORM_BUFFER, 1, 0);
+      break;
+    }
 
-    // Build instance chains and render them
-    for (int offset = 0, remaining = numInstances; remaining > 0; offset += MAX_INSTANCE_CHAIN_LENGTH, remaining -= MAX_INSTANCE_CHAIN_LENGTH)
+    case InstancingMode::StorageBuffer:
     {
-      const int unsigned chainLength = std::min((unsigned int)remaining, MAX_INSTANCE_CHAIN_LENGTH);
+      // Bind the whole instancing buffer to the index 0
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, instancingBuffer);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instancingBuffer);
 
       // Update the buffer data using mapping
-      void *ptr = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-      memcpy(ptr, &*(instanceData.begin() + offset), chainLength * sizeof(InstanceData));
-      glUnmapBuffer(GL_UNIFORM_BUFFER);
+      uploadInstanceData(GL_SHADER_STORAGE_BUFFER, updateInstanceData(), 0, numInstances);
 
-      // Draw the instance chain
-      glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), chainLength);
+      // Select shader program
+      glUseProgram(shaderProgram[ShaderProgram::InstancingBuffer]);
+
+      // Draw all cubes
+      glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0), numInstances);
+
+      // Unbind the instancing buffer
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+      break;
     }
 
-    // Unbind the instancing buffer
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, 0);
-#elif _ALLOW_SSBO_INSTANCING
-    // Bind the whole instancing buffer to the index 0
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instancingBuffer);
+    case InstancingMode::GpuResident:
+    {
+      // Generate the instances only when the grid changes, nothing is uploaded otherwise
+      generateResidentInstances();
 
-    // Update the buffer data using mapping
-    void *ptr = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
-    memcpy(ptr, &*instanceData.begin(), numInstances * sizeof(InstanceData));
-    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+      // Bind the resident instancing buffer to the index 0
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, residentInstancingBuffer);
 
-    // Select shader program
-    glUseProgram(shaderProgram[ShaderProgram::InstancingBuffer]);
+      // Select shader program
+      glUseProgram(shaderProgram[ShaderProgram::InstancingBuffer]);
 
-    // Draw all cubes
-    glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), numInstances);
+      // Draw all cubes
+      glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0), numInstances);
 
-    // Unbind the instancing buffer
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
-#endif
+      // Unbind the instancing buffer
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+      break;
+    }
+
+    case InstancingMode::GpuCulled:
+    {
+      generateResidentInstances();
+
+      // Reset the draw command, the culling only accumulates the instance count
+      const DrawElementsIndirectCommand command = {(GLuint)cube->GetIBOSize(), 0, 0, 0, 0};
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer);
+      glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(DrawElementsIndirectCommand), &command);
+
+      // Unit cube bounding sphere and the current view frustum
+      glm::vec4 frustumPlanes[6];
+      camera.GetFrustumPlanes(frustumPlanes);
+
+      // Cull the resident instances and compact the visible ones
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, residentInstancingBuffer);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visibleInstancingBuffer);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, drawCommandBuffer);
+      glUseProgram(shaderProgram[ShaderProgram::CullInstances]);
+      glUniform4fv(0, 6, glm::value_ptr(frustumPlanes[0]));
+      glUniform1i(6, numInstances);
+      glUniform1f(7, 0.5f * sqrtf(3.0f));
+      glDispatchCompute((numInstances + 63) / 64, 1, 1);
+
+      // The draw reads the command and the visible instances written by the compute shader
+      glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, 0);
+
+      // Draw the visible cubes, the instance count never leaves the GPU
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, visibleInstancingBuffer);
+      glUseProgram(shaderProgram[ShaderProgram::InstancingBuffer]);
+      glDrawElementsIndirect(GL_TRIANGLES, cube->GetIndexType(), reinterpret_cast<void*>(0));
+
+      // Unbind the buffers
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      break;
+    }
+    }
   }
   else
   {
@@ -693,7 +898,7 @@ void renderScene()
           glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(transformation));
 
           // Draw the cube
-          glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+          glDrawElements(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0));
         }
       }
     }
@@ -720,8 +925,9 @@ void mainLoop()
 
     // Print it to the title bar
     static char title[MAX_TEXT_LENGTH];
-    static char instacing[] = "[Instancing] ";
-    snprintf(title, MAX_TEXT_LENGTH, "%sNum cubes = %d, dt = %.2fms, FPS = %.1f", useInstancing ? instacing : "", numInstances, dt * 1000.0f, 1.0f / dt);
+    static char instancing[MAX_TEXT_LENGTH];
+    snprintf(instancing, MAX_TEXT_LENGTH, "[Instancing: %s] ", instancingModeNames[instancingMode]);
+    snprintf(title, MAX_TEXT_LENGTH, "%sNum cubes = %d, dt = %.2fms, FPS = %.1f", useInstancing ? instancing : "", numInstances, dt * 1000.0f, 1.0f / dt);
     glfwSetWindowTitle(mainWindow.handle, title);
 
     // Poll the events like keyboard, mouse, etc.
@@ -738,8 +944,80 @@ void mainLoop()
   }
 }
 
-int main()
+// Helper method for running the benchmark, replays the camera path for all requested numbers of cubes
+void benchmarkLoop()
 {
+  const int numFrames = benchmark.GetTotalFrames();
+
+  for (int sideSize : benchmark.GetSweep("cubes", 10))
+  {
+    for (int instancing : benchmark.GetSweep("instancing", 1))
+    {
+      for (int mode : benchmark.GetSweep("mode", InstancingMode::UniformBlock))
+      {
+        if (!isInstancingModeSupported(mode))
+        {
+          printf("Instancing mode %i is not supported, skipping.\n", mode);
+          continue;
+        }
+        instancingMode = mode;
+
+        // Cubes are placed in a grid, clamp it to the maximum allowed number of instances
+        instancesPerSide = std::max(sideSize, 1);
+        while (instancesPerSide * instancesPerSide * instancesPerSide > (int)MAX_INSTANCES)
+          --instancesPerSide;
+        numInstances = instancesPerSide * instancesPerSide * instancesPerSide;
+        useInstancing = instancing != 0;
+
+        // Keep the whole grid within the view frustum
+        float radius = 2.5f * instancesPerSide + 3.0f;
+        camera.SetProjection(fov, (float)mainWindow.width / (float)mainWindow.height, nearClipPlane, std::max(farClipPlane, 2.0f * radius));
+
+        char config[MAX_TEXT_LENGTH];
+        snprintf(config, MAX_TEXT_LENGTH, "cubes=%d instancing=%i mode=%s", numInstances, useInstancing ? 1 : 0, instancingModeNames[instancingMode]);
+        benchmark.BeginRun(config);
+
+        for (int frame = 0; frame < numFrames && !glfwWindowShouldClose(mainWindow.handle); ++frame)
+        {
+          // Start measuring the frame and write out the oldest one read back
+          Profiler::GetInstance().BeginFrame();
+          benchmark.Record();
+
+          // Poll the events so that the window stays responsive
+          glfwPollEvents();
+
+          // Replay the camera path
+          Benchmark::SetCameraOnPath(camera, frame, numFrames, glm::vec3(0.0f, 0.0f, 0.0f), radius, (float)instancesPerSide);
+
+          {
+            ProfilerScope frameScope("Frame");
+            renderScene();
+          }
+
+          // Finish measuring the frame
+          Profiler::GetInstance().EndFrame();
+
+          // Swap actual buffers on the GPU
+          glfwSwapBuffers(mainWindow.handle);
+        }
+
+        benchmark.EndRun();
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  // Read the benchmark settings
+  if (!benchmark.ParseCommandLine(argc, argv))
+    return -1;
+
+  // Benchmark must not be limited by the display refresh rate, the window stays visible
+  // as we render directly to the default framebuffer and hidden pixels could be skipped
+  if (benchmark.IsEnabled())
+    vsync = false;
+
   // Initialize the OpenGL context and create a window
   if (!initOpenGL())
   {
@@ -756,11 +1034,26 @@ int main()
     return -1;
   }
 
+  // Create the profiler queries
+  Profiler::GetInstance().Init();
+
+  // Start the worker threads of the parallel scene updates
+  JobSystem::GetInstance().Init();
+
   // Create the scene geometry
   createGeometry();
 
-  // Enter the application main loop
-  mainLoop();
+  if (benchmark.IsEnabled())
+  {
+    // Run all benchmark configurations and quit
+    if (benchmark.Open())
+      benchmarkLoop();
+  }
+  else
+  {
+    // Enter the application main loop
+    mainLoop();
+  }
 
   // Release used resources and exit
   shutDown();
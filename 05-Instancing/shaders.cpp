@@ -11,9 +11,10 @@ bool compileShaders()
 {
   GLuint vertexShader[VertexShader::NumVertexShaders] = {0};
   GLuint fragmentShader[FragmentShader::NumFragmentShaders] = {0};
+  GLuint computeShader[ComputeShader::NumComputeShaders] = {0};
 
   // Cleanup lambda
-  auto cleanUp = [&vertexShader, &fragmentShader]()
+  auto cleanUp = [&vertexShader, &fragmentShader, &computeShader]()
   {
     // First detach shaders from programs
     GLsizei count = 0;
@@ -41,6 +42,12 @@ bool compileShaders()
       if (glIsShader(fragmentShader[i]))
         glDeleteShader(fragmentShader[i]);
     }
+
+    for (int i = 0; i < ComputeShader::NumComputeShaders; ++i)
+    {
+      if (glIsShader(computeShader[i]))
+        glDeleteShader(computeShader[i]);
+    }
   };
 
   // UBO explicit binding lambda - call after program linking
@@ -52,12 +59,15 @@ bool compileShaders()
     glUniformBlockBinding(program, uboIndex, binding);
   };
 
-  // Compile all vertex shaders
+  // Storage buffers and compute shaders are only available since OpenGL 4.3
 #if _ALLOW_SSBO_INSTANCING
-  const int numVertexShaders = VertexShader::NumVertexShaders;
+  const bool allowStorage = GLAD_GL_VERSION_4_3 != 0;
 #else
-  const int numVertexShaders = VertexShader::InstancingBuffer;
+  const bool allowStorage = false;
 #endif
+
+  // Compile all vertex shaders
+  const int numVertexShaders = allowStorage ? VertexShader::NumVertexShaders : VertexShader::InstancingBuffer;
   for (int i = 0; i < numVertexShaders; ++i)
   {
     vertexShader[i] = ShaderCompiler::CompileShader(vsSource, i, GL_VERTEX_SHADER);
@@ -79,6 +89,17 @@ bool compileShaders()
     }
   }
 
+  // Compile all compute shaders
+  for (int i = 0; allowStorage && i < ComputeShader::NumComputeShaders; ++i)
+  {
+    computeShader[i] = ShaderCompiler::CompileShader(csSource, i, GL_COMPUTE_SHADER);
+    if (!computeShader[i])
+    {
+      cleanUp();
+      return false;
+    }
+  }
+
   // Create all shader programs:
   shaderProgram[ShaderProgram::Default] = glCreateProgram();
   glAttachShader(shaderProgram[ShaderProgram::Default], vertexShader[VertexShader::Default]);
@@ -111,17 +132,34 @@ bool compileShaders()
   uniformBlockBinding(shaderProgram[ShaderProgram::InstancingUniformBlock]);
   uniformBlockBinding(shaderProgram[ShaderProgram::InstancingUniformBlock], "InstanceBuffer", 1);
 
-#if _ALLOW_SSBO_INSTANCING
-  shaderProgram[ShaderProgram::InstancingBuffer] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::InstancingBuffer], vertexShader[VertexShader::InstancingBuffer]);
-  glAttachShader(shaderProgram[ShaderProgram::InstancingBuffer], fragmentShader[FragmentShader::Default]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancingBuffer]))
+  if (allowStorage)
   {
-    cleanUp();
-    return false;
+    shaderProgram[ShaderProgram::InstancingBuffer] = glCreateProgram();
+    glAttachShader(shaderProgram[ShaderProgram::InstancingBuffer], vertexShader[VertexShader::InstancingBuffer]);
+    glAttachShader(shaderProgram[ShaderProgram::InstancingBuffer], fragmentShader[FragmentShader::Default]);
+    if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancingBuffer]))
+    {
+      cleanUp();
+      return false;
+    }
+    uniformBlockBinding(shaderProgram[ShaderProgram::InstancingBuffer]);
+
+    shaderProgram[ShaderProgram::GenerateInstances] = glCreateProgram();
+    glAttachShader(shaderProgram[ShaderProgram::GenerateInstances], computeShader[ComputeShader::GenerateInstances]);
+    if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::GenerateInstances]))
+    {
+      cleanUp();
+      return false;
+    }
+
+    shaderProgram[ShaderProgram::CullInstances] = glCreateProgram();
+    glAttachShader(shaderProgram[ShaderProgram::CullInstances], computeShader[ComputeShader::CullInstances]);
+    if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::CullInstances]))
+    {
+      cleanUp();
+      return false;
+    }
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingBuffer]);
-#endif
 
   cleanUp();
   return true;
@@ -7,15 +7,15 @@
 
 #include <ShaderCompiler.h>
 
-// Uses instancing via SSBO buffer, requires OpenGL 4.3 and higher
-#define _ALLOW_SSBO_INSTANCING 0
+// Allows instancing via SSBO buffer and GPU generated instance data, requires OpenGL 4.3 and higher
+#define _ALLOW_SSBO_INSTANCING 1
 
 // Shader programs
 namespace ShaderProgram
 {
   enum
   {
-    Default, VertexParamInstancing, InstancingUniformBlock, InstancingBuffer, NumShaderPrograms
+    Default, VertexParamInstancing, InstancingUniformBlock, InstancingBuffer, GenerateInstances, CullInstances, NumShaderPrograms
   };
 }
 
@@ -181,7 +181,7 @@ void main()
 // Instancing vertex shader using instancing buffer via SSBO
 // ----------------------------------------------------------------------------
 R"(
-#version 460 core
+#version 430 core
 
 // Uniform blocks, i.e., constants
 layout (std140, binding = 0) uniform TransformBlock
@@ -203,7 +203,7 @@ struct InstanceData
 };
 
 // Storage buffer used for instances using interface block syntax
-layout (binding = 0) buffer InstanceBuffer
+layout (std430, binding = 0) readonly buffer InstanceBuffer
 {
   // Only one variable length array allowed inside the storage buffer block
   InstanceData data[];
@@ -266,3 +266,141 @@ void main()
   color = vec4(texSample, 1.0f);
 }
 )", ""};
+
+// ============================================================================
+
+// Compute shader types
+namespace ComputeShader
+{
+  enum
+  {
+    GenerateInstances, CullInstances, NumComputeShaders
+  };
+}
+
+// Compute shader sources
+static const char* csSource[] = {
+// ----------------------------------------------------------------------------
+// Compute shader generating the transformations of the whole instance grid,
+// the data stays resident in the storage buffer until the grid changes
+// ----------------------------------------------------------------------------
+R"(
+#version 430 core
+
+layout (local_size_x = 64) in;
+
+// Must match the structure on the CPU side
+struct InstanceData
+{
+  // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
+  mat3x4 modelToWorld;
+};
+
+// Storage buffer with the generated instances
+layout (std430, binding = 0) writeonly buffer InstanceBuffer
+{
+  InstanceData data[];
+} instanceBuffer;
+
+// Number of instances per grid side
+layout (location = 0) uniform int instancesPerSide;
+
+void main()
+{
+  int index = int(gl_GlobalInvocationID.x);
+  if (index >= instancesPerSide * instancesPerSide * instancesPerSide)
+    return;
+
+  // Same ordering as on the CPU side: x + instancesPerSide * (y + instancesPerSide * z)
+  int x = index % instancesPerSide;
+  int y = (index / instancesPerSide) % instancesPerSide;
+  int z = index / (instancesPerSide * instancesPerSide);
+  vec3 translation = vec3(2 * x - instancesPerSide, 2 * y - instancesPerSide, 2 * z - instancesPerSide);
+
+  // Transposed translation matrix, i.e., rows of the 3x4 affine transformation
+  instanceBuffer.data[index].modelToWorld = mat3x4(vec4(1.0f, 0.0f, 0.0f, translation.x),
+                                                   vec4(0.0f, 1.0f, 0.0f, translation.y),
+                                                   vec4(0.0f, 0.0f, 1.0f, translation.z));
+}
+)",
+// ----------------------------------------------------------------------------
+// Compute shader culling the instances against the view frustum, the visible ones
+// are compacted to the output buffer and counted in the indirect draw command
+// ----------------------------------------------------------------------------
+R"(
+#version 430 core
+
+layout (local_size_x = 64) in;
+
+// Must match the structure on the CPU side
+struct InstanceData
+{
+  // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
+  mat3x4 modelToWorld;
+};
+
+// All instances in the scene
+layout (std430, binding = 0) readonly buffer InstanceBuffer
+{
+  InstanceData data[];
+} instanceBuffer;
+
+// Compacted visible instances
+layout (std430, binding = 1) writeonly buffer VisibleBuffer
+{
+  InstanceData data[];
+} visibleBuffer;
+
+// Indirect draw command, must match DrawElementsIndirectCommand on the CPU side
+layout (std430, binding = 2) buffer DrawCommand
+{
+  uint count;
+  uint instanceCount;
+  uint firstIndex;
+  uint baseVertex;
+  uint baseInstance;
+} drawCommand;
+
+// World space frustum planes with normals pointing inside
+layout (location = 0) uniform vec4 frustumPlanes[6];
+// Number of instances in the instance buffer
+layout (location = 6) uniform int numInstances;
+// Bounding sphere radius of the mesh in the model space
+layout (location = 7) uniform float boundingRadius;
+
+// Visible instances of the work group and their offset in the output buffer
+shared uint groupVisible;
+shared uint groupOffset;
+
+void main()
+{
+  if (gl_LocalInvocationIndex == 0)
+    groupVisible = 0;
+  barrier();
+
+  // Test the bounding sphere against all the planes, everything stays in uniform control flow because of the barriers
+  int index = int(gl_GlobalInvocationID.x);
+  bool visible = index < numInstances;
+  if (visible)
+  {
+    mat3x4 modelToWorld = instanceBuffer.data[index].modelToWorld;
+    vec4 center = vec4(modelToWorld[0].w, modelToWorld[1].w, modelToWorld[2].w, 1.0f);
+    float scale = max(length(modelToWorld[0].xyz), max(length(modelToWorld[1].xyz), length(modelToWorld[2].xyz)));
+    for (int i = 0; i < 6; ++i)
+      visible = visible && dot(frustumPlanes[i], center) >= -boundingRadius * scale;
+  }
+
+  // Reserve the slots locally first so that there's just one global atomic per work group
+  uint localSlot = 0;
+  if (visible)
+    localSlot = atomicAdd(groupVisible, 1u);
+  barrier();
+
+  if (gl_LocalInvocationIndex == 0)
+    groupOffset = atomicAdd(drawCommand.instanceCount, groupVisible);
+  barrier();
+
+  if (visible)
+    visibleBuffer.data[groupOffset + localSlot] = instanceBuffer.data[index];
+}
+)", ""};
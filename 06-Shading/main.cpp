@@ -3,6 +3,7 @@
  * Licensed under the zlib license, see LICENSE.txt in the root directory.
  */
 
+#include <algorithm>
 #include <cstdio>
 #include <vector>
 #include <glad/glad.h>
@@ -13,6 +14,8 @@
 #include <MathSupport.h>
 #include <Camera.h>
 #include <Geometry.h>
+#include <OverdrawCounter.h>
+#include <TextureLoader.h>
 #include <Textures.h>
 
 #include "shaders.h"
@@ -111,6 +114,10 @@ Mesh<Vertex_Pos_Nrm_Tgt_Tex> *quad = nullptr;
 Mesh<Vertex_Pos_Nrm_Tgt_Tex> *cube = nullptr;
 // Textures helper instance
 Textures& textures(Textures::GetInstance());
+// Background loader of the texture files
+TextureLoader textureLoader;
+// Samples shaded by the scene passes
+OverdrawCounter overdrawCounter;
 
 // General use VAO
 GLuint vao = 0;
@@ -129,6 +136,8 @@ bool depthTest = true;
 bool wireframe = false;
 // Tonemapping on?
 bool tonemapping = true;
+// Fill the depth first and shade only the visible surfaces?
+bool depthPrepass = true;
 // Instancing buffer handle
 GLuint instancingBuffer = 0;
 // Transformation matrices uniform buffer object
@@ -250,6 +259,12 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     tonemapping = !tonemapping;
   }
 
+  // Enable/disable the depth prepass
+  if (key == GLFW_KEY_F7 && action == GLFW_PRESS)
+  {
+    depthPrepass = !depthPrepass;
+  }
+
   // Zoom in
   if (key == GLFW_KEY_KP_ADD || key == GLFW_KEY_EQUAL && action == GLFW_PRESS)
   {
@@ -288,10 +303,12 @@ void loadTextures()
   loadedTextures[LoadedTextures::Grey] = Textures::CreateSingleColorTexture(127, 127, 127);
   loadedTextures[LoadedTextures::Blue] = Textures::CreateSingleColorTexture(127, 127, 255);
   loadedTextures[LoadedTextures::CheckerBoard] = Textures::CreateCheckerBoardTexture(256, 16);
-  loadedTextures[LoadedTextures::Diffuse] = Textures::LoadTexture("data/Terracotta_Tiles_002_Base_Color.jpg", true);
-  loadedTextures[LoadedTextures::Normal] = Textures::LoadTexture("data/Terracotta_Tiles_002_Normal.jpg", false);
-  loadedTextures[LoadedTextures::Specular] = Textures::LoadTexture("data/Terracotta_Tiles_002_Roughness.jpg", false);
-  loadedTextures[LoadedTextures::Occlusion] = Textures::LoadTexture("data/Terracotta_Tiles_002_ambientOcclusion.jpg", false);
+  // Decode the texture set in the background, placeholders of similar average color are used in the meantime
+  textureLoader.Init();
+  textureLoader.Load("data/Terracotta_Tiles_002_Base_Color.jpg", true, &loadedTextures[LoadedTextures::Diffuse], 127, 127, 127);
+  textureLoader.Load("data/Terracotta_Tiles_002_Normal.jpg", false, &loadedTextures[LoadedTextures::Normal], 127, 127, 255);
+  textureLoader.Load("data/Terracotta_Tiles_002_Roughness.jpg", false, &loadedTextures[LoadedTextures::Specular], 127, 127, 127);
+  textureLoader.Load("data/Terracotta_Tiles_002_ambientOcclusion.jpg", false, &loadedTextures[LoadedTextures::Occlusion], 255, 255, 255);
 }
 
 // Helper method for creating scene geometry
@@ -564,6 +581,9 @@ void shutDown()
   // Release the instancing buffer
   glDeleteBuffers(1, &instancingBuffer);
 
+  // Release the overdraw queries
+  overdrawCounter.Release();
+
   // Release the framebuffer
   glDeleteTextures(1, &renderTarget);
   glDeleteTextures(1, &depthStencil);
@@ -572,7 +592,8 @@ void shutDown()
   // Release the generic VAO
   glDeleteVertexArrays(1, &vao);
 
-  // Release textures
+  // Release textures, stop the loading first so that it doesn't touch them anymore
+  textureLoader.Release();
   glDeleteTextures(LoadedTextures::NumTextures, loadedTextures);
 
   // Release the window
@@ -725,6 +746,9 @@ void renderScene()
 {
   updateTransformBlock();
 
+  // Read back the overdraw of an older frame
+  overdrawCounter.BeginFrame();
+
   // Bind the framebuffer
   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 
@@ -761,19 +785,49 @@ void renderScene()
   // Light position
   static glm::vec3 lightPosition(-3.0f, 3.0f, 0.0f);
 
+  // Floor transformation matrix - 4 columns, 3 rows, last (0, 0, 0, 1) implicit to save space
+  const glm::mat4x3 floorTransformation = glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
+
+  // Update instances and bind the instancing buffer
+  updateInstanceData();
+
+  // Draw the depth of the scene first:
+  const bool prepass = depthPrepass && depthTest;
+  if (prepass)
+  {
+    glColorMask(false, false, false, false);
+
+    glUseProgram(shaderProgram[ShaderProgram::DepthPass]);
+    glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(floorTransformation));
+    glBindVertexArray(quad->GetVAO());
+    glDrawElements(GL_TRIANGLES, quad->GetIBOSize(), quad->GetIndexType(), reinterpret_cast<void*>(0));
+
+    glUseProgram(shaderProgram[ShaderProgram::InstancingDepthPass]);
+    glBindVertexArray(cube->GetVAO());
+    glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0), numCubes);
+
+    // The depth is final, shade only the visible surfaces and don't write it again
+    glColorMask(true, true, true, true);
+    glDepthFunc(GL_EQUAL);
+    glDepthMask(GL_FALSE);
+  }
+
+  // Count the shaded samples of the scene
+  overdrawCounter.Begin();
+
+  // --------------------------------------------------------------------------
+
   // Draw the scene floor:
   {
     glUseProgram(shaderProgram[ShaderProgram::Default]);
     updateProgramData(shaderProgram[ShaderProgram::Default], lightPosition);
 
-    // Create transformation matrix - 4 columns, 3 rows, last (0, 0, 0, 1) implicit to save space
-    glm::mat4x3 transformation = glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
-    glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(transformation));
+    glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(floorTransformation));
 
     bindTextures(loadedTextures[LoadedTextures::CheckerBoard], loadedTextures[LoadedTextures::Blue], loadedTextures[LoadedTextures::Grey], loadedTextures[LoadedTextures::White]);
 
     glBindVertexArray(quad->GetVAO());
-    glDrawElements(GL_TRIANGLES, quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+    glDrawElements(GL_TRIANGLES, quad->GetIBOSize(), quad->GetIndexType(), reinterpret_cast<void*>(0));
   }
 
   // --------------------------------------------------------------------------
@@ -785,18 +839,26 @@ void renderScene()
     // Update the transformation & projection matrices
     updateProgramData(shaderProgram[ShaderProgram::Instancing], lightPosition);
 
-    // Update instances and bind the instancing buffer
-    updateInstanceData();
-
     bindTextures(loadedTextures[LoadedTextures::Diffuse], loadedTextures[LoadedTextures::Normal], loadedTextures[LoadedTextures::Specular], loadedTextures[LoadedTextures::Occlusion]);
 
     glBindVertexArray(cube->GetVAO());
-    glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), numCubes);
+    glDrawElementsInstanced(GL_TRIANGLES, cube->GetIBOSize(), cube->GetIndexType(), reinterpret_cast<void*>(0), numCubes);
 
     // Unbind the instancing buffer
     glBindBufferBase(GL_UNIFORM_BUFFER, 1, 0);
   }
 
+  // Every sample of the render target is covered by the scene
+  overdrawCounter.End();
+  overdrawCounter.EndFrame((GLint64)mainWindow.width * mainWindow.height * msaaLevel);
+
+  // The light point isn't in the depth prepass
+  if (prepass)
+  {
+    glDepthFunc(GL_LEQUAL);
+    glDepthMask(GL_TRUE);
+  }
+
   // --------------------------------------------------------------------------
 
   // Draw the light:
@@ -881,7 +943,8 @@ void mainLoop()
 
     // Print it to the title bar
     static char title[MAX_TEXT_LENGTH];
-    snprintf(title, MAX_TEXT_LENGTH, "dt = %.2fms, FPS = %.1f", dt * 1000.0f, 1.0f / dt);
+    snprintf(title, MAX_TEXT_LENGTH, "dt = %.2fms, FPS = %.1f, overdraw = %.2f%s", dt * 1000.0f, 1.0f / dt,
+             std::max(overdrawCounter.GetOverdraw(), 0.0), (depthPrepass && depthTest) ? " [Depth prepass]" : "");
     glfwSetWindowTitle(mainWindow.handle, title);
 
     // Poll the events like keyboard, mouse, etc.
@@ -890,6 +953,9 @@ void mainLoop()
     // Process keyboard input
     processInput(dt);
 
+    // Swap in the textures finished in the background
+    textureLoader.Update();
+
     // Render the scene
     renderScene();
 
@@ -919,6 +985,9 @@ int main()
   // Create the scene geometry
   createGeometry();
 
+  // Create the overdraw queries
+  overdrawCounter.Init();
+
   // Load & create texture
   loadTextures();
 
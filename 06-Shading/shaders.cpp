@@ -96,6 +96,26 @@ bool compileShaders()
   uniformBlockBinding(shaderProgram[ShaderProgram::Instancing]);
   uniformBlockBinding(shaderProgram[ShaderProgram::Instancing], "InstanceBuffer", 1);
 
+  // Depth only programs for the depth prepass, no fragment shader needed
+  shaderProgram[ShaderProgram::DepthPass] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::DepthPass], vertexShader[VertexShader::Default]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::DepthPass]))
+  {
+    cleanUp();
+    return false;
+  }
+  uniformBlockBinding(shaderProgram[ShaderProgram::DepthPass]);
+
+  shaderProgram[ShaderProgram::InstancingDepthPass] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::InstancingDepthPass], vertexShader[VertexShader::Instancing]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancingDepthPass]))
+  {
+    cleanUp();
+    return false;
+  }
+  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingDepthPass]);
+  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingDepthPass], "InstanceBuffer", 1);
+
   shaderProgram[ShaderProgram::PointRendering] = glCreateProgram();
   glAttachShader(shaderProgram[ShaderProgram::PointRendering], vertexShader[VertexShader::Point]);
   glAttachShader(shaderProgram[ShaderProgram::PointRendering], fragmentShader[FragmentShader::SingleColor]);
@@ -12,7 +12,7 @@ namespace ShaderProgram
 {
   enum
   {
-    Default, Instancing, PointRendering, Tonemapping, NumShaderPrograms
+    Default, Instancing, DepthPass, InstancingDepthPass, PointRendering, Tonemapping, NumShaderPrograms
   };
 }
 
@@ -74,6 +74,9 @@ out VertexData
   vec4 worldPos;
 } vOut;
 
+// Depth prepass and the shading pass must produce exactly the same depth
+invariant gl_Position;
+
 void main()
 {
   // Pass texture coordinates to the fragment shader
@@ -147,6 +150,9 @@ out VertexData
   vec4 worldPos;
 } vOut;
 
+// Depth prepass and the shading pass must produce exactly the same depth
+invariant gl_Position;
+
 void main()
 {
   // Pass texture coordinates to the fragment shader
@@ -282,13 +288,13 @@ void main()
 
   // Sample textures
   vec3 albedo = texture(Diffuse, vIn.texCoord.st).rgb;
-  vec3 noSample = texture(Normal, vIn.texCoord.st).rgb;
+  vec2 noSample = texture(Normal, vIn.texCoord.st).rg * 2.0f - 1.0f;
   float specSample = texture(Specular, vIn.texCoord.st).r;
   float occlusion = texture(Occlusion, vIn.texCoord.st).r;
 
-  // Calculate world-space normal
+  // Calculate world-space normal, Z is reconstructed so that two channel (BC5) normal maps work as well
   mat3 STN = {vIn.tangent, vIn.bitangent, vIn.normal};
-  vec3 normal = STN * (noSample * 2.0f - 1.0f);
+  vec3 normal = STN * vec3(noSample, sqrt(max(1.0f - dot(noSample, noSample), 0.0f)));
 
   // Calculate the lighting direction and distance
   vec3 lightDir = lightPosWS.xyz - vIn.worldPos.xyz;
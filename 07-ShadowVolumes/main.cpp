@@ -3,7 +3,9 @@
  * Licensed under the zlib license, see LICENSE.txt in the root directory.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -12,6 +14,12 @@
 
 #include <MathSupport.h>
 #include <Camera.h>
+#include <GLState.h>
+#include <GpuMemory.h>
+#include <JobSystem.h>
+#include <Profiler.h>
+#include <Benchmark.h>
+#include <AutoExposure.h>
 
 #include "shaders.h"
 #include "scene.h"
@@ -97,11 +105,15 @@ Camera camera;
 // Scene helper instance
 Scene &scene(Scene::GetInstance());
 // Render modes
-RenderSettings renderMode = {true, false, true, MSAA_SAMPLES};
+RenderSettings renderMode = {true, false, true, MSAA_SAMPLES, true, false, true};
 // Enable/disable light movement
 bool animate = false;
 // Enable/disable Carcmack's reverse
 bool carmackReverse = true;
+// Benchmark mode settings and output
+Benchmark benchmark;
+// Exposure of the tonemapping adapted on the GPU
+AutoExposure autoExposure;
 
 // Our framebuffer object
 GLuint fbo = 0;
@@ -205,6 +217,40 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     carmackReverse = !carmackReverse;
   }
 
+  // Switch between the compute shader and geometry shader extrusion of the shadow volumes
+  if (key == GLFW_KEY_F7 && action == GLFW_PRESS)
+  {
+    renderMode.computeShadowVolumes = !renderMode.computeShadowVolumes;
+    if (!computeShadowVolumes)
+      printf("Compute shader shadow volumes require OpenGL 4.3!\n");
+  }
+
+  // Switch between the shadow cubes and the shadow volumes of the point lights
+  if (key == GLFW_KEY_F8 && action == GLFW_PRESS)
+  {
+    renderMode.pointShadowMaps = !renderMode.pointShadowMaps;
+    if (!pointShadowMaps)
+      printf("Point light shadow cubes require OpenGL 4.0 or ARB_texture_cube_map_array!\n");
+  }
+
+  // Load the shaders from editable files and rebuild them on change, or go back to the built-in ones
+  if (key == GLFW_KEY_F9 && action == GLFW_PRESS)
+  {
+    toggleShaderFiles();
+  }
+
+  // Switch the light passes between the equal and less or equal depth test
+  if (key == GLFW_KEY_F10 && action == GLFW_PRESS)
+  {
+    renderMode.depthEqual = !renderMode.depthEqual;
+  }
+
+  // Print the GPU memory used by each subsystem
+  if (key == GLFW_KEY_F11 && action == GLFW_PRESS)
+  {
+    GpuMemory::GetInstance().Dump();
+  }
+
   // Zoom in
   if (key == GLFW_KEY_KP_ADD || key == GLFW_KEY_EQUAL && action == GLFW_PRESS)
   {
@@ -250,6 +296,10 @@ bool initOpenGL()
 #endif
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+  // Nobody watches the benchmark, we render to our own framebuffer so the window can stay hidden
+  if (benchmark.IsEnabled())
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
   // Create the window
   mainWindow.handle = glfwCreateWindow(Window::DefaultWidth, Window::DefaultHeight, "", nullptr, nullptr);
   if (mainWindow.handle == nullptr)
@@ -324,6 +374,7 @@ void createFramebuffer(int width, int height, GLsizei MSAA)
   // Delete it if necessary
   if (glIsTexture(renderTarget))
   {
+    GpuMemory::GetInstance().UntrackTexture(renderTarget);
     glDeleteTextures(1, &renderTarget);
     renderTarget = 0;
   }
@@ -349,6 +400,7 @@ void createFramebuffer(int width, int height, GLsizei MSAA)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, renderTarget, 0);
   }
+  GpuMemory::GetInstance().TrackTexture(renderTarget, GpuMemory::GetTextureBytes(GL_RGB16F, width, height, 1, 1, MSAA), "Render targets");
 
   // --------------------------------------------------------------------------
   // Depth/stencil buffer texture:
@@ -396,18 +448,23 @@ void createFramebuffer(int width, int height, GLsizei MSAA)
 
   // Bind back the window system provided framebuffer
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  scene.CreateDepthBuffer(width, height, MSAA);
 }
 
 // Helper method for graceful shutdown
 void shutDown()
 {
+  // Stop the worker threads
+  JobSystem::GetInstance().Release();
+
   // Release shader programs
   for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
   {
     glDeleteProgram(shaderProgram[i]);
   }
 
+  // Release the exposure programs and buffers
+  autoExposure.Release();
+
   // Release the framebuffer
   glDeleteTextures(1, &renderTarget);
   glDeleteRenderbuffers(1, &depthStencil);
@@ -474,20 +531,20 @@ void processInput(float dt)
   }
 }
 
-void renderScene()
+void renderScene(float dt)
 {
-  // Bind the framebuffer
-  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-
-  // Draw our scene
-  scene.Draw(camera, renderMode, carmackReverse);
-
-  // Unbind the shader program and other resources
-  glBindVertexArray(0);
-  glUseProgram(0);
+  // Draw our scene, it binds the framebuffer itself after rendering the shadow maps
+  scene.Draw(camera, {fbo, mainWindow.width, mainWindow.height}, renderMode, carmackReverse);
 
+  // Resolve the HDR render target to the screen
+  Profiler::GetInstance().BeginScope("Resolve");
   if (renderMode.tonemapping)
   {
+    // Adapt the exposure to the rendered image
+    Profiler::GetInstance().BeginScope("Exposure");
+    autoExposure.Update(renderTarget, renderMode.msaaLevel > 1, mainWindow.width, mainWindow.height, dt);
+    Profiler::GetInstance().EndScope();
+
     // Unbind the framebuffer and bind the window system provided FBO
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
@@ -507,6 +564,7 @@ void renderScene()
 
     // Send in the required data
     glUniform1f(0, (float)renderMode.msaaLevel);
+    autoExposure.Bind(5);
 
     // Bind the HDR render target as texture
     GLenum target = (renderMode.msaaLevel > 1) ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D;
@@ -530,6 +588,8 @@ void renderScene()
     glDrawBuffer(GL_BACK);
     glBlitFramebuffer(0, 0, mainWindow.width, mainWindow.height, 0, 0, mainWindow.width, mainWindow.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
   }
+
+  Profiler::GetInstance().EndScope();
 }
 
 // Helper method for implementing the application main loop
@@ -543,15 +603,25 @@ void mainLoop()
     float dt = (float)(time - prevTime);
     prevTime = time;
 
-    // Print it to the title bar
+    // Print it to the title bar along with GPU/CPU times of the profiled passes
     static char title[MAX_TEXT_LENGTH];
     static char instacing[] = "[Instancing] ";
-    snprintf(title, MAX_TEXT_LENGTH, "dt = %.2fms, FPS = %.1f", dt * 1000.0f, 1.0f / dt);
+    const GLState &glState = GLState::GetInstance();
+    int length = snprintf(title, MAX_TEXT_LENGTH, "dt = %.2fms, FPS = %.1f, overdraw = %.2f%s, GL state %i/%i skipped | ", dt * 1000.0f, 1.0f / dt,
+                          std::max(scene.GetOverdraw(), 0.0), renderMode.depthEqual ? " [EQUAL]" : "",
+                          glState.GetSkippedCalls(), glState.GetIssuedCalls() + glState.GetSkippedCalls());
+    Profiler::GetInstance().Print(title + length, MAX_TEXT_LENGTH - length);
     glfwSetWindowTitle(mainWindow.handle, title);
 
+    // Start measuring the frame
+    Profiler::GetInstance().BeginFrame();
+
     // Poll the events like keyboard, mouse, etc.
     glfwPollEvents();
 
+    // Pick up the edited shader files
+    updateShaderFiles();
+
     // Process keyboard input
     processInput(dt);
 
@@ -560,15 +630,85 @@ void mainLoop()
       scene.Update(dt);
 
     // Render the scene
-    renderScene();
+    renderScene(dt);
+
+    // Finish measuring the frame
+    Profiler::GetInstance().EndFrame();
 
     // Swap actual buffers on the GPU
     glfwSwapBuffers(mainWindow.handle);
   }
 }
 
-int main()
+// Helper method for running the benchmark, replays the camera path for all requested scene configurations
+void benchmarkLoop()
+{
+  // Fixed time step so that every run animates the scene the same way
+  const float dt = 1.0f / 60.0f;
+  const int numFrames = benchmark.GetTotalFrames();
+
+  for (int numCubes : benchmark.GetSweep("cubes", 5))
+  {
+    for (int numLights : benchmark.GetSweep("lights", 1))
+    {
+      for (int numSpotLights : benchmark.GetSweep("spots", 1))
+      {
+        numCubes = std::min(std::max(numCubes, 1), (int)Scene::MAX_INSTANCES);
+        numLights = std::min(std::max(numLights, 1), (int)Scene::MAX_INSTANCES);
+        numSpotLights = std::min(std::max(numSpotLights, 1), (int)Scene::MAX_SHADOW_CASTERS);
+
+        // Same random scene layout for every run
+        seedRandom(0);
+        scene.Init(numCubes, numLights, numSpotLights);
+        scene.FinishLoading();
+
+        char config[MAX_TEXT_LENGTH];
+        snprintf(config, MAX_TEXT_LENGTH, "cubes=%i lights=%i spots=%i", numCubes, numLights, numSpotLights);
+        benchmark.BeginRun(config);
+        autoExposure.Reset();
+
+        for (int frame = 0; frame < numFrames && !glfwWindowShouldClose(mainWindow.handle); ++frame)
+        {
+          // Start measuring the frame and write out the oldest one read back
+          Profiler::GetInstance().BeginFrame();
+          benchmark.Record();
+
+          // Poll the events so that the window stays responsive
+          glfwPollEvents();
+
+          // Replay the camera path
+          Benchmark::SetCameraOnPath(camera, frame, numFrames, glm::vec3(0.0f, 1.0f, 0.0f), 8.0f, 4.0f);
+
+          {
+            ProfilerScope frameScope("Frame");
+            scene.Update(dt);
+            renderScene(dt);
+          }
+
+          // Finish measuring the frame
+          Profiler::GetInstance().EndFrame();
+
+          // Swap actual buffers on the GPU
+          glfwSwapBuffers(mainWindow.handle);
+        }
+
+        benchmark.EndRun();
+        scene.Release();
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[])
 {
+  // Read the benchmark settings
+  if (!benchmark.ParseCommandLine(argc, argv))
+    return -1;
+
+  // Benchmark must not be limited by the display refresh rate
+  if (benchmark.IsEnabled())
+    renderMode.vsync = false;
+
   // Initialize the OpenGL context and create a window
   if (!initOpenGL())
   {
@@ -585,13 +725,32 @@ int main()
     return -1;
   }
 
-  // Scene initialization
-  int numLights = 1;
-  int numCubes = 5;
-  scene.Init(numCubes, numLights);
+  // Create the exposure buffer and its compute shaders, the exposure just stays 1 if they aren't available
+  if (!autoExposure.Init())
+    printf("Failed to initialize the auto exposure, using a fixed exposure!\n");
 
-  // Enter the application main loop
-  mainLoop();
+  // Create the profiler queries
+  Profiler::GetInstance().Init();
+
+  // Start the worker threads of the parallel scene updates
+  JobSystem::GetInstance().Init();
+
+  if (benchmark.IsEnabled())
+  {
+    // Run all benchmark configurations and quit
+    if (benchmark.Open())
+      benchmarkLoop();
+  }
+  else
+  {
+    // Scene initialization
+    int numLights = 1;
+    int numCubes = 5;
+    scene.Init(numCubes, numLights);
+
+    // Enter the application main loop
+    mainLoop();
+  }
 
   printf(reinterpret_cast<const char*>(glGetString(GL_VERSION)));
   printf("%c", '\n');
@@ -6,13 +6,20 @@
 #include "scene.h"
 #include "shaders.h"
 
+#include <algorithm>
 #include <vector>
 #include <glad/glad.h>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#include <GLState.h>
+#include <GpuMemory.h>
+#include <JobSystem.h>
 #include <MathSupport.h>
+#include <MeshFile.h>
+#include <Profiler.h>
+#include <TransformKernels.h>
 
 #define GLM_ENABLE_EXPERIMENTAL
 
@@ -24,6 +31,17 @@ static const glm::vec3 offset = glm::vec3(0.0f, 3.0f, 0.0f);
 static const glm::vec3 spotlightsAnimationScale = glm::vec3(6.0f, 1.5f, 6.0f);
 static const glm::vec3 spotlightsAnimationOffset = glm::vec3(0.5f, 2.0f, 0.5f);
 
+// Near plane of the shadow cube faces, must match the lighting shader
+static const float cubeShadowNear = 0.05f;
+// Bounding sphere radius of the unit cube
+static const float cubeBoundingRadius = 0.87f;
+// Mesh replacing the cubes if it exists, has to be converted by MeshConverter with -fit to stay within the unit cube
+static const char *modelFile = "data/model.mesh";
+// Number of instances transformed by a single job
+static const int instanceBatchSize = 256;
+// Fixed function state of the shadow map passes
+static const PipelineState shadowMapState = {true, GL_LEQUAL, GL_TRUE, true, true, GL_BACK, false, GL_FUNC_ADD, GL_ONE, GL_ZERO, false, GL_FILL};
+
 // Lissajous curve position calculation based on the parameters
 auto lissajous = [](const glm::vec4 &p, float t) -> glm::vec3
 {
@@ -38,65 +56,243 @@ Scene& Scene::GetInstance()
   return scene;
 }
 
-Scene::Scene() : _textures(Textures::GetInstance())
+Scene::Scene() : _textures(Textures::GetInstance()), _glState(GLState::GetInstance())
 {
 
 }
 
 Scene::~Scene()
+{
+  Release();
+}
+
+void Scene::Release()
 {
   // Delete meshes
-  delete _quad;
-  _quad = nullptr;
-  delete _cube;
-  _cube = nullptr;
+  delete _sceneMeshes;
+  _sceneMeshes = nullptr;
   delete _cubeAdjacency;
   _cubeAdjacency = nullptr;
 
-  // Release the instancing buffer
-  glDeleteBuffers(1, &_instancingBuffer);
+  // Release the instancing and transformation buffers
+  _instanceStream.Release();
+  _instanceOffset = 0;
+  _instanceRangeSize = 0;
+  _lightStream.Release();
+  _lightBlockSize = 0;
+  _overdrawCounter.Release();
+  _shadowBlockSize = 0;
+  glDeleteBuffers(1, &_transformBlockUBO);
+  _transformBlockUBO = 0;
 
   // Release the generic VAO
   glDeleteVertexArrays(1, &_vao);
-
-  // Release textures
+  _vao = 0;
+
+  // Release the shadow atlas
+  glDeleteFramebuffers(1, &_shadowFbo);
+  _shadowFbo = 0;
+  GpuMemory::GetInstance().UntrackTexture(_shadowAtlas);
+  glDeleteTextures(1, &_shadowAtlas);
+  _shadowAtlas = 0;
+
+  // Release the shadow cubes
+  glDeleteFramebuffers(1, &_cubeShadowFbo);
+  _cubeShadowFbo = 0;
+  GpuMemory::GetInstance().UntrackTexture(_cubeShadowMaps);
+  glDeleteTextures(1, &_cubeShadowMaps);
+  _cubeShadowMaps = 0;
+  _numCubeShadows = 0;
+  _cubeShadowStream.Release();
+  _cubeShadowBlockSize = 0;
+
+  // Release the extruded shadow volumes
+  glDeleteVertexArrays(1, &_volumeVao);
+  _volumeVao = 0;
+  GpuMemory::GetInstance().UntrackBuffer(_volumeVertices);
+  GpuMemory::GetInstance().UntrackBuffer(_volumeCommands);
+  glDeleteBuffers(1, &_volumeVertices);
+  _volumeVertices = 0;
+  glDeleteBuffers(1, &_volumeCommands);
+  _volumeCommands = 0;
+  _maxVolumeVertices = 0;
+  _volumeLights.clear();
+  _volumePositions.clear();
+  _volumeAngles.clear();
+
+  // Release textures, stop the loading first so that it doesn't touch them anymore
+  _textureLoader.Release();
   glDeleteTextures(LoadedTextures::NumTextures, _loadedTextures);
+  for (int i = 0; i < LoadedTextures::NumTextures; ++i)
+    _loadedTextures[i] = 0;
+
+  // Forget the scene layout
+  _cubePositions.clear();
+  _cubeAngles.clear();
+  _lights.clear();
+  _spotLights.clear();
+  _lightExtents.clear();
 }
 
-void Scene::Init(int numCubes, int numLights)
+void Scene::Init(int numCubes, int numLights, int numSpotLights)
 {
   // Check if already initialized and return
   if (_vao)
     return;
 
   _numCubes = numCubes;
-  _numSpotLights = 1;
+  _numSpotLights = std::min(std::max(numSpotLights, 1), (int)MAX_SHADOW_CASTERS);
   _numPointLights = numLights;
-  
 
   // Prepare meshes
-  _quad = Geometry::CreateQuadNormalTangentTex();
-  _cube = Geometry::CreateCubeNormalTangentTex();
-  _cubeAdjacency = Geometry::CreateCubeAdjacency();
+  MeshPool<Vertex_Pos_Nrm_Tgt_Tex> meshPool;
+  _quadRange = Geometry::AddQuadNormalTangentTex(meshPool);
+
+  // The model file is mapped and the volumes use its adjacency built offline
+  MeshFile model;
+  if (model.Open(modelFile) && model.HasAdjacency())
+  {
+    _cubeRange = model.AddTo(meshPool);
+    _cubeAdjacency = model.CreateAdjacencyMesh();
+    printf("Using the model %s instead of the cubes\n", modelFile);
+  }
+  else
+  {
+    _cubeRange = Geometry::AddCubeNormalTangentTex(meshPool);
+    _cubeAdjacency = Geometry::CreateCubeAdjacency();
+  }
+  _sceneMeshes = Geometry::CreatePackedMesh(meshPool);
 
   // Create general use VAO
   glGenVertexArrays(1, &_vao);
 
   {
-    // Generate the instancing buffer as Uniform Buffer Object
-    glGenBuffers(1, &_instancingBuffer);
-    glBindBuffer(GL_UNIFORM_BUFFER, _instancingBuffer);
-
-    // Obtain UBO index and size from the instancing shader program
-    GLuint uboIndex = glGetUniformBlockIndex(shaderProgram[ShaderProgram::Instancing], "InstanceBuffer");
+    // Obtain UBO index and size from the instancing shader program, the whole block has to be backed by the bound range
+    GLuint uboIndex = glGetUniformBlockIndex(getSceneProgram(ShaderFeature::Instancing), "InstanceBuffer");
     GLint uboSize = 0;
-    glGetActiveUniformBlockiv(shaderProgram[ShaderProgram::Instancing], uboIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &uboSize);
+    glGetActiveUniformBlockiv(getSceneProgram(ShaderFeature::Instancing), uboIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &uboSize);
+    _instanceRangeSize = uboSize;
 
-    // Describe the buffer data - we're going to change this every frame
-    glBufferData(GL_UNIFORM_BUFFER, uboSize, nullptr, GL_DYNAMIC_DRAW);
+    // Ring buffer for the instance data - we're going to change this every frame
+    _instanceStream.Init(_instanceRangeSize);
+  }
 
-    // Unbind the GL_UNIFORM_BUFFER target for now
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  {
+    // The light block is uploaded for each light pass, at most direct and ambient pass for every light,
+    // the shadow block with the light matrices once per frame
+    const ProgramReflection &reflection = programReflection[ShaderProgram::Scene + ShaderFeature::Instancing];
+    _lightBlockSize = std::max((GLsizeiptr)reflection.GetBlockSize(UniformBlock::LightBlock), (GLsizeiptr)sizeof(LightBlockData));
+    const ProgramReflection &shadowReflection = programReflection[ShaderProgram::InstancedShadowMap];
+    _shadowBlockSize = std::max((GLsizeiptr)shadowReflection.GetBlockSize(UniformBlock::ShadowBlock), (GLsizeiptr)sizeof(ShadowBlockData));
+    const int maxUploads = 2 * (_numPointLights + _numSpotLights);
+    _lightStream.Init(maxUploads * _lightBlockSize + _shadowBlockSize, maxUploads + 1);
+  }
+
+  _overdrawCounter.Init();
+
+  if (computeShadowVolumes)
+  {
+    // Every triangle facing away from the light emits both caps and at most 3 extruded edges, i.e., 24 vertices
+    const int numTriangles = _cubeAdjacency->GetIBOSize() / 6;
+    const int numLights = std::max(_numPointLights, 1);
+    _maxVolumeVertices = _numCubes * numTriangles * 24;
+
+    // Vertex ranges of all point lights, written by the compute shader and read as vertex attributes
+    glGenBuffers(1, &_volumeVertices);
+    glBindBuffer(GL_ARRAY_BUFFER, _volumeVertices);
+    glBufferData(GL_ARRAY_BUFFER, numLights * _maxVolumeVertices * sizeof(glm::vec4), nullptr, GL_DYNAMIC_COPY);
+    GpuMemory::GetInstance().TrackBuffer(_volumeVertices, numLights * _maxVolumeVertices * sizeof(glm::vec4), "Shadow volumes");
+
+    glGenVertexArrays(1, &_volumeVao);
+    glBindVertexArray(_volumeVao);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), reinterpret_cast<void*>(0));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Vertex counts are appended to by the compute shader
+    glGenBuffers(1, &_volumeCommands);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _volumeCommands);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, numLights * sizeof(DrawArraysIndirectCommand), nullptr, GL_DYNAMIC_COPY);
+    GpuMemory::GetInstance().TrackBuffer(_volumeCommands, numLights * sizeof(DrawArraysIndirectCommand), "Shadow volumes");
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  }
+
+  {
+    // Depth texture array holding the shadow maps of all spot lights, one layer each
+    glGenTextures(1, &_shadowAtlas);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _shadowAtlas);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, _numSpotLights, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    // Linear filtering with depth comparison gives us 2x2 PCF for free
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    GpuMemory::GetInstance().TrackTexture(_shadowAtlas, GpuMemory::GetTextureBytes(GL_DEPTH_COMPONENT32, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1, _numSpotLights),
+                                          "Shadow maps");
+
+    // Attach all layers at once, the geometry shader selects the layer via gl_Layer
+    glGenFramebuffers(1, &_shadowFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, _shadowFbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, _shadowAtlas, 0);
+
+    // Depth only, explicitly turn off the color buffer
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+      printf("Failed to create shadow atlas framebuffer: 0x%04X\n", status);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  if (pointShadowMaps)
+  {
+    // Depth cube map array holding the shadow cubes of the first point lights, 6 layers each
+    _numCubeShadows = std::min(_numPointLights, (int)MAX_CUBE_SHADOW_CASTERS);
+    glGenTextures(1, &_cubeShadowMaps);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, _cubeShadowMaps);
+    glTexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_DEPTH_COMPONENT32, CUBE_SHADOW_MAP_SIZE, CUBE_SHADOW_MAP_SIZE, 6 * _numCubeShadows, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    // Linear filtering with depth comparison gives us 2x2 PCF for free
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+    GpuMemory::GetInstance().TrackTexture(_cubeShadowMaps,
+                                          GpuMemory::GetTextureBytes(GL_DEPTH_COMPONENT32, CUBE_SHADOW_MAP_SIZE, CUBE_SHADOW_MAP_SIZE, 1, 6 * _numCubeShadows),
+                                          "Shadow maps");
+    // Filter across the face edges
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    // Attach all faces at once, the geometry shader selects the layer via gl_Layer
+    glGenFramebuffers(1, &_cubeShadowFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, _cubeShadowFbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, _cubeShadowMaps, 0);
+
+    // Depth only, explicitly turn off the color buffer
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+      printf("Failed to create shadow cube framebuffer: 0x%04X\n", status);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // The cube block is uploaded for each batch of the visible instance and face pairs, i.e., usually once per light
+    const ProgramReflection &reflection = programReflection[ShaderProgram::InstancedCubeShadowMap];
+    _cubeShadowBlockSize = std::max((GLsizeiptr)reflection.GetBlockSize(UniformBlock::CubeShadowBlock), (GLsizeiptr)sizeof(CubeShadowBlockData));
+    const int maxUploads = _numCubeShadows * ((6 * _numCubes + MAX_CUBE_SHADOW_INSTANCES - 1) / MAX_CUBE_SHADOW_INSTANCES);
+    _cubeShadowStream.Init(maxUploads * _cubeShadowBlockSize, maxUploads);
   }
 
   {
@@ -108,9 +304,9 @@ void Scene::Init(int numCubes, int numLights)
     // we're gonna bind this UBO for all shader programs and we're making
     // assumption that all of the UBO's used by our shader programs are
     // all the same size
-    GLuint uboIndex = glGetUniformBlockIndex(shaderProgram[ShaderProgram::Default], "TransformBlock");
+    GLuint uboIndex = glGetUniformBlockIndex(getSceneProgram(0), "TransformBlock");
     GLint uboSize = 0;
-    glGetActiveUniformBlockiv(shaderProgram[ShaderProgram::Default], uboIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &uboSize);
+    glGetActiveUniformBlockiv(getSceneProgram(0), uboIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &uboSize);
 
     // Describe the buffer data - we're going to change this every frame
     glBufferData(GL_UNIFORM_BUFFER, uboSize, nullptr, GL_DYNAMIC_DRAW);
@@ -138,15 +334,30 @@ void Scene::Init(int numCubes, int numLights)
     _cubePositions.push_back(glm::vec3(x, y, z));
   }
 
+  // Each cube is rotated around the diagonal by a growing angle
+  _cubeAngles.resize(_numCubes);
+  for (int i = 0; i < _numCubes; ++i)
+    _cubeAngles[i] = glm::radians(i * 20.0f);
+
   // --------------------------------------------------------------------------
 
   // Ambient intensity for the lights
   const float ambientIntensity = 1e-3f / numLights;
 
+  // Calculate radius based on the light intensity
+  auto getLightRadius = [](const glm::vec4 &color) -> float
+  {
+    // The shader fades the light out before the radius, so the cutoff isn't visible
+    const float cutoff = 0.1f;
+    float luminousIntensity = getLuminousIntensity(glm::vec3(color));
+    return sqrt(luminousIntensity / cutoff);
+  };
+
   // Position & color of the first light
   _lights.reserve(_numPointLights);
   glm::vec4 nextPosition = glm::vec4(0.0f, 1.0f, 0.0f, 0.0f);
-  _lights.push_back({glm::vec3(-3.0f, 3.0f, 0.0f), glm::vec4(10.0f, 10.0f, 10.0f, ambientIntensity), nextPosition});
+  glm::vec4 lightColor = glm::vec4(10.0f, 10.0f, 10.0f, ambientIntensity);
+  _lights.push_back({glm::vec3(-3.0f, 3.0f, 0.0f), lightColor, nextPosition, getLightRadius(lightColor)});
 
   // Create Spot Light as the 2nd
   _spotLights.reserve(_numSpotLights);
@@ -159,6 +370,15 @@ void Scene::Init(int numCubes, int numLights)
   _spotLights.push_back({ glm::vec3(-3.0f, 2.0f, 0.0f), glm::vec4(10.0f, 10.0f, 10.0f, ambientIntensity), nextPosition, 
                           spotLightDirection, innerAngle, outerAngle, dropoffDistance});
 
+  // Generate random movement and colors for the rest of the spot lights, they're aimed at the scene center in Update()
+  for (int i = 1; i < _numSpotLights; ++i)
+  {
+    glm::vec4 nextPosition = glm::vec4(getRandom(-1.0f, 1.0f), getRandom(-1.0f, 1.0f), getRandom(-1.0f, 1.0f), getRandom(-1.0f, 1.0f));
+    glm::vec4 color = glm::vec4(getRandom(2.0f, 10.0f), getRandom(2.0f, 10.0f), getRandom(2.0f, 10.0f), ambientIntensity);
+    glm::vec3 position = spotlightsAnimationOffset + lissajous(nextPosition, 0.0f) * spotlightsAnimationScale;
+    _spotLights.push_back({position, color, nextPosition, -position, innerAngle, outerAngle, dropoffDistance});
+  }
+
   // Generate random positions for the rest of the lights
   for (int i = 1; i < _numPointLights; ++i)
   {
@@ -173,8 +393,9 @@ void Scene::Init(int numCubes, int numLights)
     float b = getRandom(0.0f, 5.0f);
     glm::vec4 color = glm::vec4(r, g, b, ambientIntensity);
 
-    _lights.push_back({offset + lissajous(nextPosition, 0.0f) * scale, color, nextPosition});
+    _lights.push_back({offset + lissajous(nextPosition, 0.0f) * scale, color, nextPosition, getLightRadius(color)});
   }
+  _lightExtents.resize(_numPointLights);
 
   // --------------------------------------------------------------------------
 
@@ -186,14 +407,19 @@ void Scene::Init(int numCubes, int numLights)
   _loadedTextures[LoadedTextures::Grey] = Textures::CreateSingleColorTexture(127, 127, 127);
   _loadedTextures[LoadedTextures::Blue] = Textures::CreateSingleColorTexture(127, 127, 255);
   _loadedTextures[LoadedTextures::CheckerBoard] = Textures::CreateCheckerBoardTexture(256, 16);
-  _loadedTextures[LoadedTextures::Diffuse] = Textures::LoadTexture("data/Terracotta_Tiles_002_Base_Color.jpg", true);
-  _loadedTextures[LoadedTextures::Normal] = Textures::LoadTexture("data/Terracotta_Tiles_002_Normal.jpg", false);
-  _loadedTextures[LoadedTextures::Specular] = Textures::LoadTexture("data/Terracotta_Tiles_002_Roughness.jpg", false);
-  _loadedTextures[LoadedTextures::Occlusion] = Textures::LoadTexture("data/Terracotta_Tiles_002_ambientOcclusion.jpg", false);
+  // Decode the texture set in the background, placeholders of similar average color are used in the meantime
+  _textureLoader.Init();
+  _textureLoader.Load("data/Terracotta_Tiles_002_Base_Color.jpg", true, &_loadedTextures[LoadedTextures::Diffuse], 127, 127, 127);
+  _textureLoader.Load("data/Terracotta_Tiles_002_Normal.jpg", false, &_loadedTextures[LoadedTextures::Normal], 127, 127, 255);
+  _textureLoader.Load("data/Terracotta_Tiles_002_Roughness.jpg", false, &_loadedTextures[LoadedTextures::Specular], 127, 127, 127);
+  _textureLoader.Load("data/Terracotta_Tiles_002_ambientOcclusion.jpg", false, &_loadedTextures[LoadedTextures::Occlusion], 255, 255, 255);
 }
 
 void Scene::Update(float dt)
 {
+  // Swap in the textures finished in the background
+  _textureLoader.Update();
+
   // Animation timer
   static float t = 0.0f;
 
@@ -209,6 +435,15 @@ void Scene::Update(float dt)
     _lights[i].position = offset + lissajous(_lights[i].movement, t) * scale;
   }
 
+  // The rest of the spot lights circle around and keep pointing to the scene center, above the ground
+  for (int i = 1; i < _numSpotLights; ++i)
+  {
+    glm::vec3 position = spotlightsAnimationOffset + lissajous(_spotLights[i].movement, t) * spotlightsAnimationScale;
+    position.y = std::max(position.y, 1.0f);
+    _spotLights[i].position = position;
+    _spotLights[i].lightDirection = glm::vec3(0.0f, 0.5f, 0.0f) - position;
+  }
+
   // Update the animation timer
   t += dt;
 }
@@ -238,139 +473,80 @@ void Scene::UpdateInstanceData()
   // Called each frame
   // we prepare the data inside the 
   
-  // Create transformation matrix
-  glm::mat4x4 transformation = glm::mat4x4(1.0f);
-  // Instance data CPU side buffer
-  static std::vector<InstanceData> instanceData(MAX_INSTANCES);
-
-  // Cubes
-  float angle = 20.0f;
-  for (int i = 0; i < _numCubes; ++i)
+  // The extruded shadow volumes of all lights are invalid once the instances change, the mapped transforms are write
+  // only so we compare the positions and the angles they're built from
+  if (_volumePositions != _cubePositions || _volumeAngles != _cubeAngles)
   {
-    // Create unit matrix
-    transformation = glm::translate(_cubePositions[i]);
-    transformation *= glm::rotate(glm::radians(i * angle), glm::vec3(1.0f, 1.0f, 1.0f));
-
-    instanceData[i].transformation = glm::transpose(transformation);
+    _volumePositions = _cubePositions;
+    _volumeAngles = _cubeAngles;
+    _volumeLights.assign(_numPointLights, glm::vec4(0.0f));
   }
 
-  // Bind the instancing buffer to the index 1
-  glBindBufferBase(GL_UNIFORM_BUFFER, 1, _instancingBuffer);
+  // Write the transforms of the cubes for instancing straight to this frame's section of the ring buffer,
+  // the range is bound later by the individual passes
+  InstanceData *instances = static_cast<InstanceData*>(_instanceStream.Map(_numCubes * sizeof(InstanceData), _instanceRangeSize, _instanceOffset));
+  if (!instances)
+    return;
 
-  // Update the buffer data using mapping
-  // e.g. copy the required data (transforms of cubes) for instancing to the UBO (max. size 16kB)
-  void *ptr = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-  memcpy(ptr, &*instanceData.begin(), _numCubes * sizeof(InstanceData));
-  glUnmapBuffer(GL_UNIFORM_BUFFER);
+  // Batches of cubes are transformed in parallel, 4 cubes at once within a batch
+  JobSystem::GetInstance().ParallelFor(_numCubes, instanceBatchSize, [this, instances](int begin, int end)
+  {
+    TransformKernels::TranslateRotate(&_cubePositions[begin], &_cubeAngles[begin], glm::vec3(1.0f, 1.0f, 1.0f), end - begin,
+                                      &instances[begin], sizeof(InstanceData));
+  });
 
-  // Unbind the instancing buffer
-  glBindBufferBase(GL_UNIFORM_BUFFER, 1, 0);
+  _instanceStream.Unmap();
 }
 
-void Scene::UpdateProgramData(GLuint program, RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition,
-    const glm::vec4 &lightColor, const glm::vec3 &lightDirection)
+void Scene::UpdateLightBlock(RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor,
+    const glm::vec3 &lightDirection, float innerAngleCos, float outerAngleCos, float maxLightDistance, int shadowLayer)
 {
+  LightBlockData data;
+
   // Update the light position, use 4th component to pass direct light intensity
-  if ((int)renderPass & ((int)RenderPass::ShadowVolume | (int)RenderPass::LightPass))
-  {
-    GLint lightLoc = glGetUniformLocation(program, "lightPosWS");
-    glUniform4f(lightLoc, lightPosition.x, lightPosition.y, lightPosition.z, ((int)renderPass & (int)RenderPass::DirectLight) ? 1.0f : 0.0f);
-  }
+  data.lightPosWS = glm::vec4(lightPosition, ((int)renderPass & (int)RenderPass::DirectLight) ? 1.0f : 0.0f);
 
-  if ((int)renderPass & ((int)RenderPass::DepthPass))
-  {
-      glm::mat4 lightView = glm::lookAt(lightPosition, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-      glm::mat4 lightMatrix = camera.GetProjection() * lightView;
-      //printf("%f\n  %f\n    %f\n      %f\n", lightMatrix[0].x, lightMatrix[1].y, lightMatrix[2].z, lightMatrix[3].w);
-      GLint lightMatrixLoc = glGetUniformLocation(program, "lightMatrix");
-      glUniformMatrix4fv(lightMatrixLoc, 1, GL_FALSE, &lightMatrix[0][0]);
-  }
+  // Update the view position
+  data.viewPosWS = camera.GetViewToWorld()[3];
 
-  // Update view position and light color
-  if ((int)renderPass & (int)RenderPass::LightPass)
-  {
-    // Update the view position
-    GLint viewPosLoc = glGetUniformLocation(program, "viewPosWS");
-    glm::vec4 viewPos = camera.GetViewToWorld()[3];
-    glUniform4fv(viewPosLoc, 1, glm::value_ptr(viewPos));
+  // Update the light color, 4th component controls ambient light intensity
+  data.lightColor = glm::vec4(glm::vec3(lightColor), ((int)renderPass & (int)RenderPass::AmbientLight) ? lightColor.w : 0.0f);
 
-    // Update the light color, 4th component controls ambient light intensity
-    GLint lightColorLoc = glGetUniformLocation(program, "lightColor");
-    glUniform4f(lightColorLoc, lightColor.x, lightColor.y, lightColor.z, ((int)renderPass & (int)RenderPass::AmbientLight) ? lightColor.w : 0.0f);
-  }
+  // Spot light parameters, unused by the point lights
+  data.lightDirection = lightDirection;
+  data.maxLightDistance = maxLightDistance;
+  data.innerAngleCos = innerAngleCos;
+  data.outerAngleCos = outerAngleCos;
+  data.shadowLayer = shadowLayer;
+
+  // Copy the data to the ring buffer and bind it to the index 2 for all the draws of this pass
+  GLintptr offset = 0;
+  if (_lightStream.Upload(&data, sizeof(LightBlockData), _lightBlockSize, offset))
+    _lightStream.Bind(GL_UNIFORM_BUFFER, 2, offset, _lightBlockSize);
 }
 
-void Scene::UpdateProgramDataSpotlights(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor,
-    const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance)
+void Scene::UpdateShadowBlock()
 {
-    // Update the light position, use 4th component to pass direct light intensity
-    if ((int)renderPass & ((int)RenderPass::ShadowVolume | (int)RenderPass::LightPass))
-    {
-        GLint lightLoc = glGetUniformLocation(program, "lightPosWS");
-        glUniform4f(lightLoc, lightPosition.x, lightPosition.y, lightPosition.z, ((int)renderPass & (int)RenderPass::DirectLight) ? 1.0f : 0.0f);
-    }
-
-    if ((int)renderPass & ((int)RenderPass::DepthPass))
-    {
-        glm::mat4 lightView = glm::lookAt(lightPosition, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-        glm::mat4 lightMatrix = camera.GetProjection() * lightView;
-        //printf("%f\n  %f\n    %f\n      %f\n", lightMatrix[0].x, lightMatrix[1].y, lightMatrix[2].z, lightMatrix[3].w);
-        GLint lightMatrixLoc = glGetUniformLocation(program, "lightMatrix");
-        glUniformMatrix4fv(lightMatrixLoc, 1, GL_FALSE, &lightMatrix[0][0]);
-    }
+  ShadowBlockData data;
 
-    // Update view position and light color
-    if ((int)renderPass & (int)RenderPass::LightPass)
-    {
-        // Update the view position
-        GLint viewPosLoc = glGetUniformLocation(program, "viewPosWS");
-        glm::vec4 viewPos = camera.GetViewToWorld()[3];
-        glUniform4fv(viewPosLoc, 1, glm::value_ptr(viewPos));
-
-        // Update the light color, 4th component controls ambient light intensity
-        GLint lightColorLoc = glGetUniformLocation(program, "lightColor");
-        glUniform4f(lightColorLoc, lightColor.x, lightColor.y, lightColor.z, ((int)renderPass & (int)RenderPass::AmbientLight) ? lightColor.w : 0.0f);
-    }
-    GLint lightDirectionLoc = glGetUniformLocation(program, "lightDirection");
-    GLint innerAngleDegreesLoc = glGetUniformLocation(program, "innerAngleDegrees");
-    GLint outerAngleDegreesLoc = glGetUniformLocation(program, "outerAngleDegrees");
-    GLint maxLightDistanceLoc = glGetUniformLocation(program, "maxLightDistance");
-    glUniform3fv(lightDirectionLoc, 1, glm::value_ptr(lightDirection));
-    glUniform1f(innerAngleDegreesLoc, innerAngleDegrees);
-    glUniform1f(outerAngleDegreesLoc, outerAngleDegrees);
-    glUniform1f(maxLightDistanceLoc, maxLightDistance);
+  for (int i = 0; i < _numSpotLights; ++i)
+  {
+    const SpotLight &light = _spotLights[i];
+    glm::vec3 direction = glm::normalize(light.lightDirection);
 
-}
+    // Pick a different up vector when looking straight up or down
+    glm::vec3 up = (fabsf(direction.y) > 0.99f) ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::mat4x4 lightView = glm::lookAt(light.position, light.position + direction, up);
 
-void Scene::UpdateProgramDataSpotlightsShadow(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor, const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance)
-{
-    // Update the light position, use 4th component to pass direct light intensity
-    if ((int)renderPass & ((int)RenderPass::ShadowVolume | (int)RenderPass::LightPass))
-    {
-        GLint lightLoc = glGetUniformLocation(program, "lightPosWS");
-        glUniform4f(lightLoc, lightPosition.x, lightPosition.y, lightPosition.z, ((int)renderPass & (int)RenderPass::DirectLight) ? 1.0f : 0.0f);
-    }
+    // The frustum has to contain the whole outer cone of the spot light
+    glm::mat4x4 lightProjection = glm::perspective(glm::radians(2.0f * light.outerLightAngleDegrees), 1.0f, 0.1f, 30.0f);
+    data.lightMatrices[i] = lightProjection * lightView;
+  }
 
-    // Update view position and light color
-    if ((int)renderPass & (int)RenderPass::LightPass)
-    {
-        // Update the view position
-        GLint viewPosLoc = glGetUniformLocation(program, "viewPosWS");
-        glm::vec4 viewPos = camera.GetViewToWorld()[3];
-        glUniform4fv(viewPosLoc, 1, glm::value_ptr(viewPos));
-
-        // Update the light color, 4th component controls ambient light intensity
-        GLint lightColorLoc = glGetUniformLocation(program, "lightColor");
-        glUniform4f(lightColorLoc, lightColor.x, lightColor.y, lightColor.z, ((int)renderPass & (int)RenderPass::AmbientLight) ? lightColor.w : 0.0f);
-    }
-    GLint lightDirectionLoc = glGetUniformLocation(program, "lightDirection");
-    GLint innerAngleDegreesLoc = glGetUniformLocation(program, "innerAngleDegrees");
-    GLint outerAngleDegreesLoc = glGetUniformLocation(program, "outerAngleDegrees");
-    GLint maxLightDistanceLoc = glGetUniformLocation(program, "maxLightDistance");
-    glUniform3fv(lightDirectionLoc, 1, glm::value_ptr(lightDirection));
-    glUniform1f(innerAngleDegreesLoc, innerAngleDegrees);
-    glUniform1f(outerAngleDegreesLoc, outerAngleDegrees);
-    glUniform1f(maxLightDistanceLoc, maxLightDistance);
+  // Copy the data to the ring buffer and bind it to the index 3 for the shadow map and spot light passes
+  GLintptr offset = 0;
+  if (_lightStream.Upload(&data, sizeof(ShadowBlockData), _shadowBlockSize, offset))
+    _lightStream.Bind(GL_UNIFORM_BUFFER, 3, offset, _shadowBlockSize);
 }
 
 void Scene::UpdateTransformBlock(const Camera &camera)
@@ -402,12 +578,11 @@ void Scene::UpdateTransformBlock(const Camera &camera)
   glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
-void Scene::DrawBackground(GLuint program, RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
+void Scene::DrawBackground(int features, RenderPass renderPass)
 {
-  // Bind the shader program and update its data
-  glUseProgram(program);
-  glm::vec3 dummyLightDirection = glm::vec3(0.0f);
-  UpdateProgramData(program, renderPass, camera, lightPosition, lightColor, dummyLightDirection);
+  // Bind the shader program, its light data are in the light block, depth pass needs just the positions
+  const bool depthOnly = renderPass == RenderPass::DepthPass;
+  _glState.UseProgram(getSceneProgram(depthOnly ? ShaderFeature::DepthOnly : features));
 
   // Bind textures
   // RenderPass::LightPass will accept DirectLight and AmbientLight
@@ -417,13 +592,13 @@ void Scene::DrawBackground(GLuint program, RenderPass renderPass, const Camera &
   }
 
   // Bind the geometry
-  glBindVertexArray(_quad->GetVAO());
+  _glState.BindVertexArray(depthOnly ? _sceneMeshes->GetPositionVAO() : _sceneMeshes->GetVAO());
 
   // Draw floor:
   glm::mat4x4 transformation = glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
   glm::mat4x3 passMatrix = transformation;
   glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-  glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  DrawMeshRange(*_sceneMeshes, _quadRange);
 
   // Draw Z axis wall
   transformation = glm::translate(glm::vec3(0.0f, 0.0f, 15.0f));
@@ -431,7 +606,7 @@ void Scene::DrawBackground(GLuint program, RenderPass renderPass, const Camera &
   transformation *= glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
   passMatrix = transformation;
   glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-  glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  DrawMeshRange(*_sceneMeshes, _quadRange);
 
   // Draw X axis wall
   transformation = glm::translate(glm::vec3(15.0f, 0.0f, 0.0f));
@@ -439,61 +614,17 @@ void Scene::DrawBackground(GLuint program, RenderPass renderPass, const Camera &
   transformation *= glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
   passMatrix = transformation;
   glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-  glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
-  glBindVertexArray(0);
-}
-
-void Scene::DrawBackgroundSpotlights(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor,
-    const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance)
-{
-    // Bind the shader program and update its data
-    glUseProgram(program);
-    UpdateProgramDataSpotlights(program, renderPass, camera, lightPosition, lightColor, lightDirection, innerAngleDegrees, outerAngleDegrees, maxLightDistance);
-
-    // Bind textures
-    if ((int)renderPass)
-    {
-        BindTextures(_loadedTextures[LoadedTextures::CheckerBoard], _loadedTextures[LoadedTextures::Blue], _loadedTextures[LoadedTextures::Grey], _loadedTextures[LoadedTextures::White]);
-        glActiveTexture(GL_TEXTURE0 + 4);
-        glBindTexture(GL_TEXTURE_2D, depthMapTexture);
-    }
-
-    // Bind the geometry
-    glBindVertexArray(_quad->GetVAO());
-
-    // Draw floor:
-    glm::mat4x4 transformation = glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
-    glm::mat4x3 passMatrix = transformation;
-    glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-    glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
-
-    // Draw Z axis wall
-    transformation = glm::translate(glm::vec3(0.0f, 0.0f, 15.0f));
-    transformation *= glm::rotate(-PI_HALF, glm::vec3(1.0f, 0.0f, 0.0f));
-    transformation *= glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
-    passMatrix = transformation;
-    glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-    glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
-
-    // Draw X axis wall
-    transformation = glm::translate(glm::vec3(15.0f, 0.0f, 0.0f));
-    transformation *= glm::rotate(PI_HALF, glm::vec3(0.0f, 0.0f, 1.0f));
-    transformation *= glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
-    passMatrix = transformation;
-    glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-    glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  DrawMeshRange(*_sceneMeshes, _quadRange);
 }
 
-void Scene::DrawObjects(GLuint program, RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
+void Scene::DrawObjects(int features, RenderPass renderPass, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
 {
-  // Bind the shader program and update its data
-  glUseProgram(program);
-  // Update the transformation & projection matrices
-  glm::vec3 dummyLightDirection = glm::vec3(0.0f);
-  UpdateProgramData(program, renderPass, camera, lightPosition, lightColor, dummyLightDirection);
+  // Bind the shader program, its light data are in the light block, depth pass needs just the positions
+  const bool depthOnly = renderPass == RenderPass::DepthPass;
+  _glState.UseProgram(getSceneProgram(ShaderFeature::Instancing | (depthOnly ? ShaderFeature::DepthOnly : features)));
 
   // Bind the instancing buffer to the index 1
-  glBindBufferBase(GL_UNIFORM_BUFFER, 1, _instancingBuffer);
+  _instanceStream.Bind(GL_UNIFORM_BUFFER, 1, _instanceOffset, _instanceRangeSize);
 
   // Bind textures
   if ((int)renderPass & (int)RenderPass::LightPass)
@@ -502,185 +633,241 @@ void Scene::DrawObjects(GLuint program, RenderPass renderPass, const Camera &cam
   }
 
   // Draw cubes
-    glBindVertexArray(_cube->GetVAO());
-    glDrawElementsInstanced(GL_TRIANGLES, _cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), _numCubes);
-
-  // Unbind the instancing buffer
-  glBindBufferBase(GL_UNIFORM_BUFFER, 1, 0);
+  _glState.BindVertexArray(depthOnly ? _sceneMeshes->GetPositionVAO() : _sceneMeshes->GetVAO());
+  DrawMeshRange(*_sceneMeshes, _cubeRange, _numCubes);
 
   // --------------------------------------------------------------------------
 
   // Draw the light object during the ambient pass
   if ((int)renderPass & (int)RenderPass::AmbientLight)
   {
-    glUseProgram(shaderProgram[ShaderProgram::PointRendering]);
+    _glState.UseProgram(shaderProgram[ShaderProgram::PointRendering]);
+    const ProgramReflection &reflection = programReflection[ShaderProgram::PointRendering];
 
     // Update the light position
-    GLint loc = glGetUniformLocation(shaderProgram[ShaderProgram::PointRendering], "position");
-    glUniform3fv(loc, 1, glm::value_ptr(lightPosition));
+    reflection.Set(Uniform::PointPosition, lightPosition);
 
     // Update the color
-    loc = glGetUniformLocation(shaderProgram[ShaderProgram::PointRendering], "color");
-    glUniform3fv(loc, 1, glm::value_ptr(lightColor * 0.05f));
+    reflection.Set(Uniform::PointColor, glm::vec3(lightColor) * 0.05f);
 
     // Disable blending for lights
-    glDisable(GL_BLEND);
+    _glState.Disable(GL_BLEND);
 
     glPointSize(10.0f);
-    glBindVertexArray(_vao);
+    _glState.BindVertexArray(_vao);
     glDrawArrays(GL_POINTS, 0, 1);
   }
-  glBindVertexArray(0);
 }
 
-void Scene::DrawObjectsSpotlightsShadow(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor,
-    const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance)
+void Scene::UpdateShadowVolumes(int firstLight)
 {
-    // Bind the shader program and update its data
-    glUseProgram(program);
-    UpdateProgramDataSpotlights(program, renderPass, camera, lightPosition, lightColor, lightDirection, innerAngleDegrees, outerAngleDegrees, maxLightDistance);
-
-    // Bind the instancing buffer to the index 1
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, _instancingBuffer);
-
-    // Bind textures
-    if ((int)renderPass & (int)RenderPass::LightPass)
+  // Static lights over static geometry keep the volumes of the previous frames, the skipped lights keep their
+  // last positions so that their volumes get extruded again only if they move
+  std::vector<int> lights;
+  for (int i = firstLight; i < _numPointLights; ++i)
+  {
+    const glm::vec4 light = glm::vec4(_lights[i].position, 1.0f);
+    if (_volumeLights[i] != light)
     {
-        BindTextures(_loadedTextures[LoadedTextures::Diffuse], _loadedTextures[LoadedTextures::Normal], _loadedTextures[LoadedTextures::Specular], _loadedTextures[LoadedTextures::Occlusion]);
-        glActiveTexture(GL_TEXTURE0 + 4);
-        glBindTexture(GL_TEXTURE_2D, depthMapTexture);
+      _volumeLights[i] = light;
+      lights.push_back(i);
     }
+  }
 
-    // Draw cubes
-    glBindVertexArray(_cube->GetVAO());
-    glDrawElementsInstanced(GL_TRIANGLES, _cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), _numCubes);
+  if (lights.empty())
+    return;
 
-    // Unbind the instancing buffer
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, 0);
+  // Empty the ranges of the lights first, the compute shader appends to their vertex counts
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _volumeCommands);
+  for (int light : lights)
+  {
+    DrawArraysIndirectCommand command = {0, 1, (GLuint)(light * _maxVolumeVertices), 0};
+    glBufferSubData(GL_COPY_WRITE_BUFFER, light * sizeof(DrawArraysIndirectCommand), sizeof(DrawArraysIndirectCommand), &command);
+  }
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+  _glState.UseProgram(shaderProgram[ShaderProgram::ShadowVolumeExtrusion]);
+  const ProgramReflection &reflection = programReflection[ShaderProgram::ShadowVolumeExtrusion];
+  const int numTriangles = _cubeAdjacency->GetIBOSize() / 6;
+  reflection.Set(Uniform::NumCubes, _numCubes);
+  reflection.Set(Uniform::NumTriangles, numTriangles);
+
+  // Instances, the mesh w/ adjacency and the outputs
+  _instanceStream.Bind(GL_UNIFORM_BUFFER, 1, _instanceOffset, _instanceRangeSize);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _cubeAdjacency->GetVBO());
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _cubeAdjacency->GetIBO());
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _volumeCommands);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _volumeVertices);
+
+  // One invocation per triangle of each instance
+  for (int light : lights)
+  {
+    reflection.Set(Uniform::ShadowLight, light);
+    reflection.Set(Uniform::LightPosition, _lights[light].position);
+    glDispatchCompute((_numCubes * numTriangles + 63) / 64, 1, 1);
+  }
 
-    // --------------------------------------------------------------------------
+  // The volumes are drawn as vertex arrays through the indirect commands
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
 
-    // Draw the light object during the ambient pass
-    if ((int)renderPass & (int)RenderPass::AmbientLight)
-    {
-        glUseProgram(shaderProgram[ShaderProgram::PointRendering]);
+bool Scene::GetLightExtent(const glm::vec3 &position, float radius, const Camera &camera, const RenderTarget &renderTarget, LightExtent &extent) const
+{
+  // Light center in the view space, the camera looks down the -Z axis
+  const glm::vec3 center = glm::vec3(camera.GetWorldToView() * glm::vec4(position, 1.0f));
+  const glm::mat4x4 &projection = camera.GetProjection();
+  const float nearZ = -camera.GetNearClip();
 
-        // Update the light position
-        GLint loc = glGetUniformLocation(shaderProgram[ShaderProgram::PointRendering], "position");
-        glUniform3fv(loc, 1, glm::value_ptr(lightPosition));
+  // Whole sphere is behind the near plane
+  if (center.z - radius > nearZ)
+    return false;
 
-        // Update the color
-        loc = glGetUniformLocation(shaderProgram[ShaderProgram::PointRendering], "color");
-        glUniform3fv(loc, 1, glm::value_ptr(lightColor * 0.05f));
+  // Window depth of a view space depth, the far plane is clamped
+  auto getDepth = [&projection](float z) -> float
+  {
+    float ndc = (projection[2][2] * z + projection[3][2]) / -z;
+    return glm::clamp(ndc * 0.5f + 0.5f, 0.0f, 1.0f);
+  };
 
-        // Disable blending for lights
-        //glDisable(GL_BLEND);
+  extent.minDepth = getDepth(std::min(center.z + radius, nearZ));
+  extent.maxDepth = getDepth(center.z - radius);
 
-        glPointSize(10.0f);
-        glBindVertexArray(_vao);
-        glDrawArrays(GL_POINTS, 0, 1);
-    }
+  // The sphere intersects the near plane, its projection isn't bounded
+  if (center.z + radius > nearZ)
+  {
+    extent.x = 0;
+    extent.y = 0;
+    extent.width = renderTarget.width;
+    extent.height = renderTarget.height;
+    return true;
+  }
+
+  // Project the corners of the bounding box, it's conservative but cheap
+  glm::vec2 minNdc = glm::vec2(1.0f);
+  glm::vec2 maxNdc = glm::vec2(-1.0f);
+  for (int i = 0; i < 8; ++i)
+  {
+    glm::vec3 corner = center + radius * glm::vec3((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, (i & 4) ? 1.0f : -1.0f);
+    glm::vec4 clip = projection * glm::vec4(corner, 1.0f);
+    glm::vec2 ndc = glm::vec2(clip) / clip.w;
+    minNdc = glm::min(minNdc, ndc);
+    maxNdc = glm::max(maxNdc, ndc);
+  }
+
+  // Off-screen
+  minNdc = glm::max(minNdc, glm::vec2(-1.0f));
+  maxNdc = glm::min(maxNdc, glm::vec2(1.0f));
+  if (minNdc.x >= maxNdc.x || minNdc.y >= maxNdc.y)
+    return false;
+
+  // Round outwards to whole pixels
+  const glm::vec2 size = glm::vec2(renderTarget.width, renderTarget.height);
+  glm::vec2 minPixel = glm::floor((minNdc * 0.5f + 0.5f) * size);
+  glm::vec2 maxPixel = glm::ceil((maxNdc * 0.5f + 0.5f) * size);
+  extent.x = (GLint)minPixel.x;
+  extent.y = (GLint)minPixel.y;
+  extent.width = (GLsizei)(maxPixel.x - minPixel.x);
+  extent.height = (GLsizei)(maxPixel.y - minPixel.y);
+  return true;
+}
+
+void Scene::DrawShadowVolumes(int light, bool computeVolumes, bool carmackReverse)
+{
+  // Only the stencil is updated, both faces of the volumes have to be rasterized
+  _glState.ColorMask(false, false, false, false);
+  _glState.DepthMask(GL_FALSE);
+  _glState.Disable(GL_CULL_FACE);
+  _glState.Enable(GL_STENCIL_TEST);
+  _glState.StencilFunc(GL_ALWAYS, 0, 0xff);
+
+  if (carmackReverse)
+  {
+    // Depth fail: count the volume faces behind the geometry, works with the camera inside a volume as well
+    _glState.StencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+    _glState.StencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+  }
+  else
+  {
+    // Depth pass: count the volume faces in front of the geometry
+    _glState.StencilOpSeparate(GL_FRONT, GL_KEEP, GL_KEEP, GL_INCR_WRAP);
+    _glState.StencilOpSeparate(GL_BACK, GL_KEEP, GL_KEEP, GL_DECR_WRAP);
+  }
+
+  if (computeVolumes)
+  {
+    // Volumes extruded by UpdateShadowVolumes()
+    _glState.UseProgram(shaderProgram[ShaderProgram::ExtrudedShadowVolume]);
+    _glState.BindVertexArray(_volumeVao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _volumeCommands);
+    glDrawArraysIndirect(GL_TRIANGLES, reinterpret_cast<void*>(light * sizeof(DrawArraysIndirectCommand)));
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  }
+  else
+  {
+    // The geometry shader extrudes the silhouettes, the light position comes from the light block
+    _glState.UseProgram(shaderProgram[ShaderProgram::InstancedShadowVolume]);
+    _instanceStream.Bind(GL_UNIFORM_BUFFER, 1, _instanceOffset, _instanceRangeSize);
+    _glState.BindVertexArray(_cubeAdjacency->GetVAO());
+    glDrawElementsInstanced(GL_TRIANGLES_ADJACENCY, _cubeAdjacency->GetIBOSize(), _cubeAdjacency->GetIndexType(), reinterpret_cast<void*>(0), _numCubes);
+  }
+
+  // Light only the pixels outside of all volumes
+  _glState.StencilFunc(GL_EQUAL, 0, 0xff);
+  _glState.StencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+  _glState.Enable(GL_CULL_FACE);
+  _glState.ColorMask(true, true, true, true);
 }
 
-void Scene::Draw(const Camera &camera, const RenderSettings &renderMode, bool carmackReverse)
+void Scene::Draw(const Camera &camera, const RenderTarget &renderTarget, const RenderSettings &renderMode, bool carmackReverse)
 {
+  Profiler &profiler = Profiler::GetInstance();
+
+  // Nothing done since the last frame went through the state cache
+  _glState.BeginFrame();
+
+  // Move to the next section of the instance and light ring buffers
+  _instanceStream.BeginFrame();
+  _lightStream.BeginFrame();
+  _overdrawCounter.BeginFrame();
+
   UpdateTransformBlock(camera);
 
   // --------------------------------------------------------------------------
   // Light pass drawing:
   // --------------------------------------------------------------------------
-  // lambda
-  auto lightPass = [this, &renderMode, &camera](RenderPass renderPass, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
+  // lambda, the light block has to be updated before, features select the scene program permutation
+  auto lightPass = [this](int features, RenderPass renderPass, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
   {
     // Enable additive alpha blending
-    glEnable(GL_BLEND);
-    glBlendEquation(GL_FUNC_ADD);   
-    glBlendFunc(GL_ONE, GL_ONE);
+    _glState.Enable(GL_BLEND);
+    _glState.BlendEquation(GL_FUNC_ADD);
+    _glState.BlendFunc(GL_ONE, GL_ONE);
+
+    // Shadow atlas for the shadowed permutations
+    if (features & ShaderFeature::ShadowMap)
+    {
+      glActiveTexture(GL_TEXTURE0 + 4);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, _shadowAtlas);
+      glBindSampler(4, 0);
+    }
+
+    // Shadow cubes of the point lights
+    if (features & ShaderFeature::CubeShadowMap)
+    {
+      glActiveTexture(GL_TEXTURE0 + 5);
+      glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, _cubeShadowMaps);
+      glBindSampler(5, 0);
+    }
 
     // draws background
-    DrawBackground(shaderProgram[ShaderProgram::Default], renderPass, camera, lightPosition, lightColor);
+    _overdrawCounter.Begin();
+    DrawBackground(features, renderPass);
     // draws the color (material) of objects
-    DrawObjects(shaderProgram[ShaderProgram::Instancing], renderPass, camera, lightPosition, lightColor);
+    DrawObjects(features, renderPass, lightPosition, lightColor);
+    _overdrawCounter.End();
 
     // Disable blending after this pass
-    glDisable(GL_BLEND);
-  };
-
-  // --------------------------------------------------------------------------
-
-  // --------------------------------------------------------------------------
-  // Spot Lights pass drawing:
-  // --------------------------------------------------------------------------
-  auto spotLightPass = [this, &renderMode, &camera](
-      RenderPass renderPass,
-      const glm::vec3& lightPosition,
-      const glm::vec4& lightColor,
-      const glm::vec3& lightDirection,
-      const glm::f32& innerAngleDegrees,
-      const glm::f32& outerAngleDegrees,
-      const glm::f32& maxLightDistance
-      )
-  {
-      // Enable additive alpha blending
-      glEnable(GL_BLEND);
-      glBlendEquation(GL_FUNC_ADD);
-      glBlendFunc(GL_ONE, GL_ONE);
-
-      // draws background
-      float innerAngleCos = glm::cos(glm::radians(innerAngleDegrees));
-      float outerAngleCos = glm::cos(glm::radians(outerAngleDegrees));
-      DrawBackgroundSpotlights(shaderProgram[ShaderProgram::SpotlightDefault], renderPass, camera, lightPosition, lightColor, lightDirection,
-          innerAngleCos, outerAngleCos, maxLightDistance);
-      // draws the color (material) of objects
-      //DrawObjects(shaderProgram[ShaderProgram::Instancing], renderPass, camera, lightPosition, lightColor);
-      DrawObjectsSpotlightsShadow(shaderProgram[ShaderProgram::InstancingSpotlightShadow], renderPass, camera, lightPosition, lightColor, lightDirection,
-          innerAngleCos, outerAngleCos, maxLightDistance);
-
-      // Disable blending after this pass
-      glDisable(GL_BLEND);
-  };
-
-  // --------------------------------------------------------------------------
-  // Shadow Map pass drawing:
-  // --------------------------------------------------------------------------
-  auto shadowMapSpotlightPass = [this, &renderMode, &camera](const glm::vec3& lightPosition, const glm::vec4& lightColor, const glm::vec3& lightDirection)
-  {
-      // Enable additive alpha blending
-      glEnable(GL_BLEND);
-      glBlendEquation(GL_FUNC_ADD);
-      glBlendFunc(GL_ONE, GL_ONE);
-      //DrawObjects(shaderProgram[ShaderProgram::InstancedShadowVolume], camera, lightPosition, lightColor);
-      //DrawObjects(shaderProgram[ShaderProgram::InstancingDepthPass], RenderPass::DepthPass, camera, dummyLightPosition, dummyColor);
-      // Bind the shader program and update its data
-      glUseProgram(shaderProgram[ShaderProgram::InstancingDepthPass]);
-      // Update the transformation & projection matrices
-      Camera cameraAtLightPos = Camera(camera);
-      cameraAtLightPos.SetTransformation(lightPosition, lightDirection, glm::vec3(0.0f, 1.0f, 0.0f));
-      //cameraAtLightPos.SetProjection(glm::radians(90.0f), ((float)screenWidth)/((float)screenHeight), camera.GetNearClip(), camera.GetFarClip());
-      UpdateProgramData(shaderProgram[ShaderProgram::InstancingDepthPass], RenderPass::DepthPass, cameraAtLightPos, lightPosition, lightColor, lightDirection);
-
-      // Bind depth buffer for rendering the depth into it
-      // TODO: the fact that we have to remember the previous FB means that the depth buffer is used in the wrong order. Should be used earlier
-      GLint previousFramebufferId = 0;
-      glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebufferId);
-      glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-      glClearDepth(0.5);
-      glClear(GL_DEPTH_BUFFER_BIT);
-      glClearDepth(1);
-
-      // Bind the instancing buffer to the index 1
-      glBindBufferBase(GL_UNIFORM_BUFFER, 1, _instancingBuffer);
-
-      // Use default cube VAO and GL_TRIANGLES
-      glBindVertexArray(_cube->GetVAO());
-      glDrawElementsInstanced(GL_TRIANGLES, _cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), _numCubes);
-
-      // Unbind the instancing buffer
-      glBindBufferBase(GL_UNIFORM_BUFFER, 1, 0);
-      // Unbind the depth framebuffer
-      glBindFramebuffer(GL_FRAMEBUFFER, previousFramebufferId);
-      // Disable blending after this pass
-      glDisable(GL_BLEND);
+    _glState.Disable(GL_BLEND);
   };
 
   // --------------------------------------------------------------------------
@@ -688,110 +875,262 @@ void Scene::Draw(const Camera &camera, const RenderSettings &renderMode, bool ca
   // Update the scene
   UpdateInstanceData();
 
+  // Neither the shadows nor the light passes are needed for the point lights off-screen
+  for (int i = 0; i < _numPointLights; ++i)
+  {
+    if (!GetLightExtent(_lights[i].position, _lights[i].radius, camera, renderTarget, _lightExtents[i]))
+      _lightExtents[i].width = 0;
+  }
+
+  // The first point lights are shadowed by the cubes if enabled, the rest by the shadow volumes
+  const int numCubeShadows = (_cubeShadowMaps && renderMode.pointShadowMaps) ? _numCubeShadows : 0;
+
+  // Render the shadow maps first so that we don't have to switch the framebuffers mid-frame
+  profiler.BeginScope("Shadow maps");
+  UpdateShadowBlock();
+  DrawShadowMaps(renderTarget);
+  if (numCubeShadows > 0)
+  {
+    _cubeShadowStream.BeginFrame();
+    DrawCubeShadowMaps(renderTarget);
+    _cubeShadowStream.EndFrame();
+  }
+  profiler.EndScope();
+
   // Enable/disable MSAA rendering
   if (renderMode.msaaLevel > 1)
-    glEnable(GL_MULTISAMPLE);
+    _glState.Enable(GL_MULTISAMPLE);
   else
-    glDisable(GL_MULTISAMPLE);
+    _glState.Disable(GL_MULTISAMPLE);
 
-  // Enable backface culling
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_BACK);
+  // Backface culling, depth test, clamp, and write, optionally wireframe
+  const PipelineState depthState = {true, GL_LEQUAL, GL_TRUE, true, true, GL_BACK, false, GL_FUNC_ADD, GL_ONE, GL_ZERO,
+                                    false, renderMode.wireframe ? (GLenum)GL_LINE : (GLenum)GL_FILL};
+  _glState.Apply(depthState);
 
-  // Enable/disable wireframe
-  glPolygonMode(GL_FRONT_AND_BACK, renderMode.wireframe ? GL_LINE : GL_FILL);
-
-  // Enable depth test, clamp, and write
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_DEPTH_CLAMP);
-  glDepthFunc(GL_LEQUAL);
-  // enable write into Depth Buffer
-  glDepthMask(GL_TRUE);
-
-  // Clear the color and depth buffer
+  // Clear the color, depth and stencil buffer
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-  // Note: for depth primed geometry, it would be the best option to also set depth function to GL_EQUAL
- 
+  // Fill the depth buffer first, the shadow volumes are tested against it
+  _glState.ColorMask(false, false, false, false);
+  DrawBackground(0, RenderPass::DepthPass);
+  DrawObjects(0, RenderPass::DepthPass, glm::vec3(0.0f), glm::vec4(0.0f));
+  _glState.ColorMask(true, true, true, true);
 
-  // first depth buffer
-  for (int i = 0; i < _numSpotLights; ++i)
+  // The depth is final now, the light passes only shade the visible surfaces and don't need to write it again,
+  // the scene vertex shader has invariant position so that the depths match exactly
+  if (renderMode.depthEqual)
   {
-      // This should fill the depth buffer (texture)
-      glColorMask(false, false, false, false);
-      shadowMapSpotlightPass(_spotLights[i].position, _spotLights[i].color, _spotLights[i].lightDirection);
+    _glState.DepthFunc(GL_EQUAL);
+    _glState.DepthMask(GL_FALSE);
   }
-  for (int i = 0; i < _numPointLights; ++i)
+
+  // Extrude the shadow volumes of the point lights that moved
+  const bool computeVolumes = computeShadowVolumes && renderMode.computeShadowVolumes;
+  if (computeVolumes)
   {
-      // This should fill the depth buffer (texture)
-      // Waiting until start to implement Point Lights (Omnidirectional Shadow Maps)
-      //shadowMapSpotlightPass(_spotLights[i].position, _spotLights[i].color, _spotLights[i].lightDirection);
+    profiler.BeginScope("Volume extrusion");
+    UpdateShadowVolumes(numCubeShadows);
+    profiler.EndScope();
   }
 
+  // The point light passes are limited to the extent of the light radius
+  const bool depthBounds = GLAD_GL_EXT_depth_bounds_test != 0;
+  _glState.Enable(GL_SCISSOR_TEST);
+  if (depthBounds)
+    _glState.Enable(GL_DEPTH_BOUNDS_TEST_EXT);
+
   // For each light we need to render the scene with its contribution
+  profiler.BeginScope("Lights");
   for (int i = 0; i < _numPointLights; ++i)
   {
-    // Draw direct light, enable color write
-    glColorMask(true, true, true, true);
-    lightPass(RenderPass::DirectLight, _lights[i].position, _lights[i].color);
+    const Light &light = _lights[i];
+    const LightExtent &extent = _lightExtents[i];
+    if (extent.width == 0)
+      continue;
+
+    // Both the stencil clear and the passes are limited by the scissor, the depth bounds reject the pixels
+    // whose geometry is in front of or behind the light sphere
+    glScissor(extent.x, extent.y, extent.width, extent.height);
+    if (depthBounds)
+      glDepthBoundsEXT(extent.minDepth, extent.maxDepth);
+
+    if (i < numCubeShadows)
+    {
+      // Draw direct light, the shadows come from the cube of the light
+      UpdateLightBlock(RenderPass::DirectLight, camera, light.position, light.color, glm::vec3(0.0f), 0.0f, 0.0f, light.radius, i);
+      lightPass(ShaderFeature::CubeShadowMap, RenderPass::DirectLight, light.position, light.color);
+      continue;
+    }
 
-    //lightPass(RenderPass::AmbientLight, _lights[i].position, _lights[i].color);
+    // The light block is shared by the shadow volume and light passes
+    UpdateLightBlock(RenderPass::DirectLight, camera, light.position, light.color, glm::vec3(0.0f), 0.0f, 0.0f, light.radius);
+
+    // Mark the shadows of this light in the stencil, the volumes are tested in front of and behind the scene depth
+    glClear(GL_STENCIL_BUFFER_BIT);
+    _glState.DepthFunc(GL_LEQUAL);
+    DrawShadowVolumes(i, computeVolumes, carmackReverse);
+
+    // Draw direct light outside of the shadows, enable color write, the shadow volumes turned the depth writes off
+    _glState.ColorMask(true, true, true, true);
+    if (renderMode.depthEqual)
+      _glState.DepthFunc(GL_EQUAL);
+    else
+      _glState.DepthMask(GL_TRUE);
+    lightPass(0, RenderPass::DirectLight, light.position, light.color);
+    _glState.Disable(GL_STENCIL_TEST);
   }
 
+  _glState.Disable(GL_SCISSOR_TEST);
+  if (depthBounds)
+    _glState.Disable(GL_DEPTH_BOUNDS_TEST_EXT);
+
   for (int i = 0; i < _numSpotLights; ++i)
   {
-      // Draw direct light, enable color write
-      glColorMask(true, true, true, true);
-      //spotLightPass(RenderPass::DirectLight, _spotLights[i].position, _spotLights[i].color, _spotLights[i].lightDirection, _spotLights[i].innerLightAngleDegrees,
-      //    _spotLights[i].outerLightAngleDegrees, _spotLights[i].lightDistance);
+    const SpotLight &light = _spotLights[i];
+    const float innerAngleCos = glm::cos(glm::radians(light.innerLightAngleDegrees));
+    const float outerAngleCos = glm::cos(glm::radians(light.outerLightAngleDegrees));
 
-      //spotLightPass(RenderPass::AmbientLight, _spotLights[i].position, _spotLights[i].color, _spotLights[i].lightDirection, _spotLights[i].innerLightAngleDegrees,
-      //    _spotLights[i].outerLightAngleDegrees, _spotLights[i].lightDistance);
+    // Draw direct light, enable color write
+    _glState.ColorMask(true, true, true, true);
+    UpdateLightBlock(RenderPass::DirectLight, camera, light.position, light.color, light.lightDirection, innerAngleCos, outerAngleCos, light.lightDistance, i);
+    lightPass(ShaderFeature::SpotLight | ShaderFeature::ShadowMap, RenderPass::DirectLight, light.position, light.color);
   }
 
-  // Don't forget to leave the color write enabled
-  glColorMask(true, true, true, true);
+  profiler.EndScope();
+
+  // Don't forget to leave the color write enabled as well as the depth test and write as expected by the others
+  _glState.ColorMask(true, true, true, true);
+  _glState.DepthFunc(GL_LEQUAL);
+  _glState.DepthMask(GL_TRUE);
+
+  // Every light pass counts the samples of the whole render target
+  _overdrawCounter.EndFrame((GLint64)renderTarget.width * renderTarget.height * std::max(renderMode.msaaLevel, 1));
+
+  // Guard the instance and light data until the GPU is done with this frame
+  _instanceStream.EndFrame();
+  _lightStream.EndFrame();
 }
 
-void Scene::CreateDepthBuffer(int width, int height, int MSAA = 0)
+void Scene::DrawShadowMaps(const RenderTarget &renderTarget)
 {
-    // Depth Buffer
-    if (!depthMapFBO)
-    {
-        printf("creating depth buffer \n");
-        glGenFramebuffers(1, &depthMapFBO);
-    }
+  // Render into all layers of the shadow atlas
+  glBindFramebuffer(GL_FRAMEBUFFER, _shadowFbo);
+  glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
 
-    // prepare depth buffer (texture) for the shadow map
-    glGenTextures(1, &depthMapTexture);
-    glBindTexture(GL_TEXTURE_2D, depthMapTexture);
-    // Allocate storage for the texture data
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    // Set up default filtering modes
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // Set up depth comparison mode
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-    // Set up wrapping modes
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    // Set up done, unbind
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMapTexture, 0);
-
-    // We only need single channel (W) for depth, so we will not use RGB, thererore explicitly turn off color buffer
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-    // Check for completeness
-    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (status != GL_FRAMEBUFFER_COMPLETE)
+  // Depth only pass, no blending and no wireframe
+  _glState.Apply(shadowMapState);
+  glClear(GL_DEPTH_BUFFER_BIT);
+
+  // The light matrices are already bound in the shadow block, the layer is derived from the instance index
+  _glState.UseProgram(shaderProgram[ShaderProgram::InstancedShadowMap]);
+  programReflection[ShaderProgram::InstancedShadowMap].Set(Uniform::NumCubes, _numCubes);
+
+  // Bind the instancing buffer to the index 1
+  _instanceStream.Bind(GL_UNIFORM_BUFFER, 1, _instanceOffset, _instanceRangeSize);
+
+  // Draw the cubes once for every shadow casting light, only the positions are needed
+  _glState.BindVertexArray(_sceneMeshes->GetPositionVAO());
+  DrawMeshRange(*_sceneMeshes, _cubeRange, _numCubes * _numSpotLights);
+
+  // Switch back to the render target, we know its dimensions so we don't need to query the previous state
+  glBindFramebuffer(GL_FRAMEBUFFER, renderTarget.fbo);
+  glViewport(0, 0, renderTarget.width, renderTarget.height);
+}
+
+void Scene::DrawCubeShadowMaps(const RenderTarget &renderTarget)
+{
+  // Looking directions and up vectors of the faces in the +X, -X, +Y, -Y, +Z, -Z order of the cube map layers
+  static const glm::vec3 faceDirections[6] =
+  {
+    glm::vec3( 1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f,  1.0f, 0.0f),
+    glm::vec3( 0.0f,-1.0f, 0.0f), glm::vec3( 0.0f, 0.0f, 1.0f), glm::vec3(0.0f,  0.0f,-1.0f)
+  };
+  static const glm::vec3 faceUps[6] =
+  {
+    glm::vec3( 0.0f,-1.0f, 0.0f), glm::vec3( 0.0f,-1.0f, 0.0f), glm::vec3(0.0f,  0.0f, 1.0f),
+    glm::vec3( 0.0f, 0.0f,-1.0f), glm::vec3( 0.0f,-1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)
+  };
+  // Distance of the bounding sphere center from the 45 degree side planes of a face
+  const float sideDistance = cubeBoundingRadius * sqrtf(2.0f);
+
+  // Render into all faces of the cube map array
+  glBindFramebuffer(GL_FRAMEBUFFER, _cubeShadowFbo);
+  glViewport(0, 0, CUBE_SHADOW_MAP_SIZE, CUBE_SHADOW_MAP_SIZE);
+
+  // Depth only pass, no blending and no wireframe
+  _glState.Apply(shadowMapState);
+  glClear(GL_DEPTH_BUFFER_BIT);
+
+  // The face matrices and the visible instances come from the cube shadow block, the layer from the light index
+  _glState.UseProgram(shaderProgram[ShaderProgram::InstancedCubeShadowMap]);
+  const ProgramReflection &reflection = programReflection[ShaderProgram::InstancedCubeShadowMap];
+
+  // Bind the instancing buffer to the index 1
+  _instanceStream.Bind(GL_UNIFORM_BUFFER, 1, _instanceOffset, _instanceRangeSize);
+  _glState.BindVertexArray(_sceneMeshes->GetPositionVAO());
+
+  // Upload the filled part of the block and draw all of its instance and face pairs at once
+  static CubeShadowBlockData data;
+  auto drawFaces = [&](int light, int count)
+  {
+    GLintptr offset = 0;
+    const GLsizeiptr size = sizeof(data.faceMatrices) + ((count + 3) / 4) * 4 * sizeof(GLuint);
+    if (!_cubeShadowStream.Upload(&data, size, _cubeShadowBlockSize, offset))
+      return;
+
+    _cubeShadowStream.Bind(GL_UNIFORM_BUFFER, 4, offset, _cubeShadowBlockSize);
+    reflection.Set(Uniform::ShadowLight, light);
+    DrawMeshRange(*_sceneMeshes, _cubeRange, count);
+  };
+
+  for (int i = 0; i < _numCubeShadows; ++i)
+  {
+    // Lights off-screen don't light anything
+    if (_lightExtents[i].width == 0)
+      continue;
+
+    // The faces reach to the light radius, the lighting shader reconstructs the depth from it
+    const Light &light = _lights[i];
+    const glm::mat4x4 faceProjection = glm::perspective(PI_HALF, 1.0f, cubeShadowNear, light.radius);
+    for (int face = 0; face < 6; ++face)
+      data.faceMatrices[face] = faceProjection * glm::lookAt(light.position, light.position + faceDirections[face], faceUps[face]);
+
+    // Cull the instance bounding spheres against the faces, most instances end up in a single face
+    int count = 0;
+    for (int instance = 0; instance < _numCubes; ++instance)
     {
-        printf("Failed to create depth framebuffer: 0x%04X\n", status);
+      // Instances beyond the radius shadow only the unlit space
+      const glm::vec3 toInstance = _cubePositions[instance] - light.position;
+      if (glm::length(toInstance) - cubeBoundingRadius > light.radius)
+        continue;
+
+      for (int face = 0; face < 6; ++face)
+      {
+        const int axis = face / 2;
+        const float forward = (face & 1) ? -toInstance[axis] : toInstance[axis];
+        if (forward < -cubeBoundingRadius ||
+            fabsf(toInstance[(axis + 1) % 3]) - forward > sideDistance ||
+            fabsf(toInstance[(axis + 2) % 3]) - forward > sideDistance)
+          continue;
+
+        data.faceInstances[count++] = (GLuint)instance | ((GLuint)face << 16);
+
+        // Too many pairs for a single block, draw what we have so far
+        if (count == MAX_CUBE_SHADOW_INSTANCES)
+        {
+          drawFaces(i, count);
+          count = 0;
+        }
+      }
     }
-    // Set up done, unbind
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-}
\ No newline at end of file
+
+    if (count > 0)
+      drawFaces(i, count);
+  }
+
+  // Switch back to the render target, we know its dimensions so we don't need to query the previous state
+  glBindFramebuffer(GL_FRAMEBUFFER, renderTarget.fbo);
+  glViewport(0, 0, renderTarget.width, renderTarget.height);
+}
@@ -7,6 +7,10 @@
 
 #include <Camera.h>
 #include <Geometry.h>
+#include <GLState.h>
+#include <OverdrawCounter.h>
+#include <StreamingBuffer.h>
+#include <TextureLoader.h>
 #include <Textures.h>
 
 // Textures we'll be using
@@ -29,6 +33,22 @@ struct RenderSettings
   bool tonemapping;
   // Used MSAA samples
   GLsizei msaaLevel;
+  // Extrude the shadow volumes in the compute shader instead of the geometry shader if available?
+  bool computeShadowVolumes;
+  // Shadow the point lights with cube maps instead of the shadow volumes if available?
+  bool pointShadowMaps;
+  // Test the light passes for equal depth with the depth writes off after the depth prepass?
+  bool depthEqual;
+};
+
+// Framebuffer the scene is drawn into
+struct RenderTarget
+{
+  // Framebuffer handle, 0 for the default one
+  GLuint fbo;
+  // Framebuffer dimensions
+  int width;
+  int height;
 };
 
 // Very simple scene abstraction class
@@ -54,20 +74,73 @@ public:
     glm::mat3x4 transformation;
   };
 
+  // Data of a single light pass, std140 layout - must match the LightBlock in the shaders!
+  struct LightBlockData
+  {
+    // Light position, 4th component is the direct light intensity
+    glm::vec4 lightPosWS;
+    // View position in world space coordinates
+    glm::vec4 viewPosWS;
+    // Light color, 4th component is the ambient light intensity
+    glm::vec4 lightColor;
+    // Spot light direction and maximum distance, radius of the point lights
+    glm::vec3 lightDirection;
+    float maxLightDistance;
+    // Cosines of the spot light inner and outer angles
+    float innerAngleCos;
+    float outerAngleCos;
+    // Layer of the shadow atlas, -1 if the light casts no shadow
+    int shadowLayer;
+    // Padding to vec4 size
+    float padding;
+  };
+
+  // Maximum number of spot lights casting shadows - must match the ShadowBlock in the shaders!
+  static const int MAX_SHADOW_CASTERS = 4;
+  // Resolution of a single shadow atlas layer
+  static const int SHADOW_MAP_SIZE = 1024;
+
+  // Light space transformations of all shadow casters, std140 layout - must match the ShadowBlock in the shaders!
+  struct ShadowBlockData
+  {
+    glm::mat4x4 lightMatrices[MAX_SHADOW_CASTERS];
+  };
+
+  // Maximum number of point lights with shadow cubes, the rest uses the shadow volumes
+  static const int MAX_CUBE_SHADOW_CASTERS = 8;
+  // Resolution of a single cube face
+  static const int CUBE_SHADOW_MAP_SIZE = 512;
+  // Maximum number of instance and face pairs drawn at once - must match the CubeShadowBlock in the shaders!
+  static const int MAX_CUBE_SHADOW_INSTANCES = 4000;
+
+  // Cube faces of a single point light, std140 layout - must match the CubeShadowBlock in the shaders!
+  struct CubeShadowBlockData
+  {
+    // World to light clip space transformations of the faces
+    glm::mat4x4 faceMatrices[6];
+    // Instance index | face << 16 of the instances visible in the faces, 4 per element
+    GLuint faceInstances[MAX_CUBE_SHADOW_INSTANCES];
+  };
+
   // Maximum number of allowed instances - must match the instancing vertex shader!
   static const unsigned int MAX_INSTANCES = 1024;
 
   // Get and create instance for this singleton
   static Scene& GetInstance();
-  // Initialize the test scene
-  void Init(int numCubes, int numLights);
+  // Initialize the test scene, the number of spot lights is clamped to MAX_SHADOW_CASTERS
+  void Init(int numCubes, int numLights, int numSpotLights = 1);
   // Updates positions
   void Update(float dt);
-  void CreateDepthBuffer(int width, int height, int MSAA);
-  // Draw the scene
-  void Draw(const Camera &camera, const RenderSettings &renderMode, bool carmackReverse);
+  // Draw the scene into the render target
+  void Draw(const Camera &camera, const RenderTarget &renderTarget, const RenderSettings &renderMode, bool carmackReverse);
+  // Release all scene resources so that it can be initialized again
+  void Release();
+  // Block until all textures are loaded, e.g., so that benchmarks don't measure the placeholders
+  void FinishLoading() { _textureLoader.Finish(); }
   // Return the generic VAO for rendering
   GLuint GetGenericVAO() { return _vao; }
+  // Average number of times each sample was shaded by the light passes, negative if not known yet
+  double GetOverdraw() const { return _overdrawCounter.GetOverdraw(); }
 
 private:
   // Structure describing light
@@ -79,6 +152,25 @@ private:
     glm::vec4 color;
     // Parameters for the light movement
     glm::vec4 movement;
+    // Distance where the light fades out completely
+    float radius;
+  };
+
+  // Screen rectangle and window depth range a light can affect
+  struct LightExtent
+  {
+    GLint x, y;
+    GLsizei width, height;
+    float minDepth, maxDepth;
+  };
+
+  // Must match the DrawCommand in the shadow volume extrusion compute shader!
+  struct DrawArraysIndirectCommand
+  {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
   };
 
   struct SpotLight
@@ -108,32 +200,47 @@ private:
 
   // Helper function for binding the appropriate textures
   void BindTextures(const GLuint &diffuse, const GLuint &normal, const GLuint &specular, const GLuint &occlusion);
-  // Helper function for creating and updating the instance data. Copies array of transforms for the cubes to our _instancingBuffer UBO
+  // Helper function for creating and updating the instance data. Writes the transforms of the cubes to our _instanceStream ring buffer
   void UpdateInstanceData();
-  // Helper function for updating shader program data
-  void UpdateProgramData(GLuint program, RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor, const glm::vec3& lightDirection);
-  void UpdateProgramDataSpotlights(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor, const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance);
-  void UpdateProgramDataSpotlightsShadow(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor,
-      const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance);
+  // Helper function for uploading the per-light data of a single pass to the light uniform block
+  void UpdateLightBlock(RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor,
+      const glm::vec3 &lightDirection = glm::vec3(0.0f), float innerAngleCos = 0.0f, float outerAngleCos = 0.0f, float maxLightDistance = 0.0f,
+      int shadowLayer = -1);
+  // Helper function for uploading the light space transformations of the spot lights to the shadow uniform block
+  void UpdateShadowBlock();
+  // Render the shadow maps of all spot lights into the layers of the shadow atlas in a single draw call
+  void DrawShadowMaps(const RenderTarget &renderTarget);
+  // Render the shadow cubes of the visible point lights, a single draw call per light renders the instances
+  // visible in the individual faces
+  void DrawCubeShadowMaps(const RenderTarget &renderTarget);
+  // Extrude the shadow volumes of the point lights from firstLight on in the compute shader, only the lights
+  // that moved since the last extrusion are updated unless the instances changed
+  void UpdateShadowVolumes(int firstLight);
+  // Calculate the extent of the light sphere in the render target, returns false if it's not visible at all
+  bool GetLightExtent(const glm::vec3 &position, float radius, const Camera &camera, const RenderTarget &renderTarget, LightExtent &extent) const;
+  // Mark the shadowed pixels of the point light in the stencil, the light pass then tests for stencil == 0
+  void DrawShadowVolumes(int light, bool computeVolumes, bool carmackReverse);
   // Helper method to update transformation uniform block
   void UpdateTransformBlock(const Camera &camera);
-  // Draw the backdrop, floor and walls
-  void DrawBackground(GLuint program, RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor);
-  void DrawBackgroundSpotlights(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor,
-      const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance);
-  // Draw cubes
-  void DrawObjects(GLuint program, RenderPass renderPass, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor);
-  void DrawObjectsSpotlightsShadow(GLuint program, RenderPass renderPass, const Camera& camera, const glm::vec3& lightPosition, const glm::vec4& lightColor,
-      const glm::vec3& lightDirection, const glm::f32& innerAngleDegrees, const glm::f32& outerAngleDegrees, const glm::f32& maxLightDistance);
+  // Draw the backdrop, floor and walls with the scene program of the ShaderFeature bits, the depth pass ignores them
+  void DrawBackground(int features, RenderPass renderPass);
+  // Draw cubes with the instanced scene program of the ShaderFeature bits, the depth pass ignores them
+  void DrawObjects(int features, RenderPass renderPass, const glm::vec3 &lightPosition, const glm::vec4 &lightColor);
 
   // Textures helper instance
   Textures &_textures;
+  // Shadowed OpenGL state of the passes
+  GLState &_glState;
   // Loaded textures
   GLuint _loadedTextures[LoadedTextures::NumTextures] = {0};
+  // Background loader of the texture files
+  TextureLoader _textureLoader;
   // Number of cubes in the scene
   int _numCubes = 10;
   // Cube positions
   std::vector<glm::vec3> _cubePositions;
+  // Cube rotations around the diagonal in radians
+  std::vector<float> _cubeAngles;
   // Number of point lights in the scene
   int _numPointLights;
   // Number of spot lights in the scene
@@ -144,19 +251,55 @@ private:
   std::vector<SpotLight> _spotLights;
   // General use VAO
   GLuint _vao = 0;
-  // Quad instance
-  Mesh<Vertex_Pos_Nrm_Tgt_Tex> *_quad = nullptr;
-  // Cube instance
-  Mesh<Vertex_Pos_Nrm_Tgt_Tex> *_cube = nullptr;
+  // Quad and cube suballocated from a single pair of buffers
+  SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *_sceneMeshes = nullptr;
+  // Range of the quad within the scene meshes
+  MeshLod _quadRange = {0, 0, 0};
+  // Range of the cube within the scene meshes
+  MeshLod _cubeRange = {0, 0, 0};
   // Cube instance w/ adjacency information
   Mesh<Vertex_Pos> *_cubeAdjacency = nullptr;
-  // Instancing buffer handle
-  GLuint _instancingBuffer = 0;
+  // Ring buffer streaming the instance data
+  StreamingBuffer _instanceStream;
+  // Offset and size of the current frame instance data in the ring buffer
+  GLintptr _instanceOffset = 0;
+  GLsizeiptr _instanceRangeSize = 0;
+  // Ring buffer streaming the per-light data of each light pass
+  StreamingBuffer _lightStream;
+  // Samples shaded by the light passes
+  OverdrawCounter _overdrawCounter;
+  // Size of the light uniform block
+  GLsizeiptr _lightBlockSize = 0;
   // Transformation matrices uniform buffer object
   GLuint _transformBlockUBO = 0;
-  // Depth maps for lights
-  //std::vector<GLuint> lightDepthTextures;
-  GLuint depthMapTexture;
-  // FBO for depth map (texture)
-  GLuint depthMapFBO = 0;
+  // Size of the shadow uniform block
+  GLsizeiptr _shadowBlockSize = 0;
+  // Depth texture array with a layer for each spot light
+  GLuint _shadowAtlas = 0;
+  // FBO with the whole shadow atlas attached as a layered depth attachment
+  GLuint _shadowFbo = 0;
+  // Number of point lights with shadow cubes, the first ones
+  int _numCubeShadows = 0;
+  // Depth cube map array with a cube for each of the _numCubeShadows point lights
+  GLuint _cubeShadowMaps = 0;
+  // FBO with all faces of the cube map array attached as a layered depth attachment
+  GLuint _cubeShadowFbo = 0;
+  // Ring buffer streaming the cube face data
+  StreamingBuffer _cubeShadowStream;
+  // Size of the cube shadow uniform block
+  GLsizeiptr _cubeShadowBlockSize = 0;
+  // Extents of the point lights in the current frame, 0 width for lights off-screen
+  std::vector<LightExtent> _lightExtents;
+  // Shadow volumes extruded by the compute shader, a range of _maxVolumeVertices for each point light
+  GLuint _volumeVertices = 0;
+  GLsizei _maxVolumeVertices = 0;
+  // Indirect draw of the shadow volumes of each point light
+  GLuint _volumeCommands = 0;
+  // VAO drawing the extruded shadow volumes
+  GLuint _volumeVao = 0;
+  // Light positions the volumes were extruded for, w = 0 if the volumes have to be extruded again
+  std::vector<glm::vec4> _volumeLights;
+  // Positions and angles of the instances the volumes were extruded for
+  std::vector<glm::vec3> _volumePositions;
+  std::vector<float> _volumeAngles;
 };
@@ -5,13 +5,45 @@
 
 #include "shaders.h"
 
+#include <cstdio>
+
+#include <ProgramCache.h>
+#include <ShaderReloader.h>
+
 GLuint shaderProgram[ShaderProgram::NumShaderPrograms] = {0};
+ProgramReflection programReflection[ShaderProgram::NumShaderPrograms];
+bool computeShadowVolumes = false;
+bool pointShadowMaps = false;
 
-bool compileShaders()
+// Names of the Uniform and UniformBlock enum entries as used in the shaders
+static const char *uniformNames[Uniform::NumUniforms] = {"numCubes", "position", "color", "numTriangles", "lightPosition", "shadowLight"};
+static const char *uniformBlockNames[UniformBlock::NumUniformBlocks] = {"TransformBlock", "InstanceBuffer", "LightBlock", "ShadowBlock", "CubeShadowBlock", "ExposureBlock"};
+
+// Defines of the ShaderFeature bits
+static const char *const featureNames[ShaderFeature::NumFeatures] = {"INSTANCING", "SPOT_LIGHT", "SHADOW_MAP", "DEPTH_ONLY", "CUBE_SHADOW_MAP"};
+
+// Program binaries of the previous launch
+static const char programCacheName[] = "07-ShadowVolumes.programs";
+
+// Directory with the editable shader files and their names based on the shader enums
+static const char shaderDirectory[] = "07-ShadowVolumes.shaders";
+static const char *vsNames[VertexShader::NumVertexShaders] = {"Scene", "InstancedShadowVolume", "Point", "ScreenQuad", "InstancedShadowMap",
+  "ExtrudedShadowVolume", "InstancedCubeShadowMap"};
+static const char *fsNames[FragmentShader::NumFragmentShaders] = {"Lighting", "SingleColor", "Null", "Tonemapping"};
+static const char *gsNames[GeometryShader::NumGeometryShaders] = {"ShadowVolume", "ShadowMapLayer"};
+static const char *csNames[ComputeShader::NumComputeShaders] = {"ShadowVolumeExtrusion"};
+
+// Watches the shader files when they're enabled
+static ShaderReloader shaderReloader;
+
+// Compile all shaders and link them into the shader programs
+static bool buildPrograms()
 {
   GLuint vertexShader[VertexShader::NumVertexShaders] = {0};
   GLuint fragmentShader[FragmentShader::NumFragmentShaders] = {0};
-  GLuint geometryShader[FragmentShader::NumFragmentShaders] = {0};
+  GLuint geometryShader[GeometryShader::NumGeometryShaders] = {0};
+  GLuint computeShader[ComputeShader::NumComputeShaders] = {0};
+  ShaderPermutations permutations(featureNames, ShaderFeature::NumFeatures);
 
   // Cleanup lambda
   auto cleanUp = [&]()
@@ -49,20 +81,22 @@ bool compileShaders()
       if (glIsShader(geometryShader[i]))
         glDeleteShader(geometryShader[i]);
     }
-  };
 
-  // UBO explicit binding lambda - call after program linking
-  auto uniformBlockBinding = [](GLuint program, const char* blockName = "TransformBlock", GLint binding = 0)
-  {
-    // Get UBO index from the program
-    GLuint uboIndex = glGetUniformBlockIndex(program, blockName);
-    // Bind it always to slot "binding" - since GLSL 420, it's possible to specify it in the layout block
-    glUniformBlockBinding(program, uboIndex, binding);
+    for (int i = 0; i < ComputeShader::NumComputeShaders; ++i)
+    {
+      if (glIsShader(computeShader[i]))
+        glDeleteShader(computeShader[i]);
+    }
+
+    permutations.Release();
   };
 
-  // Compile all vertex shaders
+  // Compile all vertex shaders, the scene permutations are compiled on demand below
   for (int i = 0; i < VertexShader::NumVertexShaders; ++i)
   {
+    if (i == VertexShader::Scene)
+      continue;
+
     vertexShader[i] = ShaderCompiler::CompileShader(vsSource, i, GL_VERTEX_SHADER);
     if (!vertexShader[i])
     {
@@ -71,9 +105,12 @@ bool compileShaders()
     }
   }
 
-  // Compile all fragment shaders
+  // Compile all fragment shaders, the scene permutations are compiled on demand below
   for (int i = 0; i < FragmentShader::NumFragmentShaders; ++i)
   {
+    if (i == FragmentShader::Lighting)
+      continue;
+
     fragmentShader[i] = ShaderCompiler::CompileShader(fsSource, i, GL_FRAGMENT_SHADER);
     if (!fragmentShader[i])
     {
@@ -93,99 +130,109 @@ bool compileShaders()
     }
   }
 
-  // Shader program for non-instanced geometry w/ color
-  shaderProgram[ShaderProgram::Default] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::Default], vertexShader[VertexShader::Default]);
-  glAttachShader(shaderProgram[ShaderProgram::Default], fragmentShader[FragmentShader::Default]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::Default]))
+  // Compile all compute shaders, they wouldn't compile without OpenGL 4.3
+  for (int i = 0; computeShadowVolumes && i < ComputeShader::NumComputeShaders; ++i)
   {
-    cleanUp();
-    return false;
+    computeShader[i] = ShaderCompiler::CompileShader(csSource, i, GL_COMPUTE_SHADER);
+    if (!computeShader[i])
+    {
+      cleanUp();
+      return false;
+    }
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::Default]);
 
-  // "My" test shader program for spot lights
-  shaderProgram[ShaderProgram::SpotlightDefault] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::SpotlightDefault], vertexShader[VertexShader::Default]);
-  glAttachShader(shaderProgram[ShaderProgram::SpotlightDefault], fragmentShader[FragmentShader::TestDefault]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::SpotlightDefault]))
+  // Scene programs: lit permutations with and without instancing, spot lights optionally with shadows, point lights
+  // optionally with shadow cubes and depth only variants, the vertex stage depends just on the instancing and depth
+  // features, the fragment stage on the lighting ones, so the shared variants are compiled once
+  const int sceneFeatures[] =
   {
-      cleanUp();
-      return false;
+    0, ShaderFeature::SpotLight, ShaderFeature::SpotLight | ShaderFeature::ShadowMap, ShaderFeature::DepthOnly, ShaderFeature::CubeShadowMap
+  };
+  const int lightingFeatures = ShaderFeature::SpotLight | ShaderFeature::ShadowMap | ShaderFeature::CubeShadowMap;
+  for (int instancing = 0; instancing <= ShaderFeature::Instancing; instancing += ShaderFeature::Instancing)
+  {
+    for (int features : sceneFeatures)
+    {
+      // Shadow cubes wouldn't compile without cube map arrays
+      if ((features & ShaderFeature::CubeShadowMap) && !pointShadowMaps)
+        continue;
+
+      features |= instancing;
+      GLuint vs = permutations.GetShader(vsSource, VertexShader::Scene, GL_VERTEX_SHADER, features, ShaderFeature::Instancing | ShaderFeature::DepthOnly);
+      GLuint fs = (features & ShaderFeature::DepthOnly) ? fragmentShader[FragmentShader::Null] :
+        permutations.GetShader(fsSource, FragmentShader::Lighting, GL_FRAGMENT_SHADER, features, lightingFeatures);
+      if (!vs || !fs)
+      {
+        cleanUp();
+        return false;
+      }
+
+      GLuint &program = shaderProgram[ShaderProgram::Scene + features];
+      program = glCreateProgram();
+      glAttachShader(program, vs);
+      glAttachShader(program, fs);
+      if (!ShaderCompiler::LinkProgram(program))
+      {
+        cleanUp();
+        return false;
+      }
+    }
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::SpotlightDefault]);
 
-  // Shader program for non-instanced geometry w/o color
-  shaderProgram[ShaderProgram::DefaultDepthPass] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::DefaultDepthPass], vertexShader[VertexShader::Default]);
-  glAttachShader(shaderProgram[ShaderProgram::DefaultDepthPass], fragmentShader[FragmentShader::Null]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::DefaultDepthPass]))
+  // Shader program for instanced geometry w/ shadow volume extrusion
+  shaderProgram[ShaderProgram::InstancedShadowVolume] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowVolume], vertexShader[VertexShader::InstancedShadowVolume]);
+  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowVolume], geometryShader[GeometryShader::ShadowVolume]);
+  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowVolume], fragmentShader[FragmentShader::Null]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancedShadowVolume]))
   {
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::DefaultDepthPass]);
 
-  // Shader program for instanced geometry w/ color
-  shaderProgram[ShaderProgram::Instancing] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::Instancing], vertexShader[VertexShader::Instancing]);
-  glAttachShader(shaderProgram[ShaderProgram::Instancing], fragmentShader[FragmentShader::Default]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::Instancing]))
+  // Shader program for the shadow volumes extruded by the compute shader
+  shaderProgram[ShaderProgram::ExtrudedShadowVolume] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::ExtrudedShadowVolume], vertexShader[VertexShader::ExtrudedShadowVolume]);
+  glAttachShader(shaderProgram[ShaderProgram::ExtrudedShadowVolume], fragmentShader[FragmentShader::Null]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::ExtrudedShadowVolume]))
   {
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::Instancing]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::Instancing], "InstanceBuffer", 1);
 
-  // "My" shader program for instanced geometry w/ color for spot lights
-  shaderProgram[ShaderProgram::InstancingSpotLights] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::InstancingSpotLights], vertexShader[VertexShader::Instancing]);
-  glAttachShader(shaderProgram[ShaderProgram::InstancingSpotLights], fragmentShader[FragmentShader::TestDefault]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancingSpotLights]))
+  if (computeShadowVolumes)
   {
+    // Shader program extruding the shadow volumes of a single light
+    shaderProgram[ShaderProgram::ShadowVolumeExtrusion] = glCreateProgram();
+    glAttachShader(shaderProgram[ShaderProgram::ShadowVolumeExtrusion], computeShader[ComputeShader::ShadowVolumeExtrusion]);
+    if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::ShadowVolumeExtrusion]))
+    {
       cleanUp();
       return false;
+    }
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingSpotLights]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingSpotLights], "InstanceBuffer", 1);
 
-  // Shader program for instanced geometry w/o color
-  shaderProgram[ShaderProgram::InstancingDepthPass] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::InstancingDepthPass], vertexShader[VertexShader::Instancing]);
-  glAttachShader(shaderProgram[ShaderProgram::InstancingDepthPass], fragmentShader[FragmentShader::Null]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancingDepthPass]))
+  // Shader program for rendering the shadow maps of all spot lights in a single instanced pass
+  shaderProgram[ShaderProgram::InstancedShadowMap] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowMap], vertexShader[VertexShader::InstancedShadowMap]);
+  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowMap], geometryShader[GeometryShader::ShadowMapLayer]);
+  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowMap], fragmentShader[FragmentShader::Null]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancedShadowMap]))
   {
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingDepthPass]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingDepthPass], "InstanceBuffer", 1);
 
-  // Shader program for instanced geometry rendering with spotlights and shadows
-  shaderProgram[ShaderProgram::InstancingSpotlightShadow] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::InstancingSpotlightShadow], vertexShader[VertexShader::VertexShadowSpotlight]);
-  glAttachShader(shaderProgram[ShaderProgram::InstancingSpotlightShadow], fragmentShader[FragmentShader::DefaultShadowSpotlight]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancingSpotlightShadow]))
-  {
-      cleanUp();
-      return false;
-  }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingSpotlightShadow]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancingSpotlightShadow], "InstanceBuffer", 1);
-
-  // Shader program for instanced geometry w/ shadow volume extrusion
-  shaderProgram[ShaderProgram::InstancedShadowVolume] = glCreateProgram();
-  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowVolume], vertexShader[VertexShader::InstancedShadowVolume]);
-  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowVolume], geometryShader[GeometryShader::ShadowVolume]);
-  glAttachShader(shaderProgram[ShaderProgram::InstancedShadowVolume], fragmentShader[FragmentShader::Null]);
-  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancedShadowVolume]))
+  // Shader program for rendering the shadow cube of a point light in a single instanced pass
+  shaderProgram[ShaderProgram::InstancedCubeShadowMap] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::InstancedCubeShadowMap], vertexShader[VertexShader::InstancedCubeShadowMap]);
+  glAttachShader(shaderProgram[ShaderProgram::InstancedCubeShadowMap], geometryShader[GeometryShader::ShadowMapLayer]);
+  glAttachShader(shaderProgram[ShaderProgram::InstancedCubeShadowMap], fragmentShader[FragmentShader::Null]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancedCubeShadowMap]))
   {
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedShadowVolume]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedShadowVolume], "InstanceBuffer", 1);
 
   // Shader program for point rendering w/ constant color
   shaderProgram[ShaderProgram::PointRendering] = glCreateProgram();
@@ -196,7 +243,6 @@ bool compileShaders()
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::PointRendering]);
 
   // Shader program for rendering tonemapping post-process
   shaderProgram[ShaderProgram::Tonemapping] = glCreateProgram();
@@ -211,3 +257,122 @@ bool compileShaders()
   cleanUp();
   return true;
 }
+
+// Set up the state of the linked or restored programs
+static void setUpPrograms()
+{
+  // Cache the uniform locations and block indices once, bind the blocks of all programs using them,
+  // restored program binaries don't keep the bindings set after linking
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    // Skip the unused scene permutations
+    if (!shaderProgram[i])
+      continue;
+
+    programReflection[i].Reflect(shaderProgram[i], uniformNames, Uniform::NumUniforms, uniformBlockNames, UniformBlock::NumUniformBlocks);
+    programReflection[i].BindBlock(UniformBlock::TransformBlock, 0);
+    programReflection[i].BindBlock(UniformBlock::InstanceBuffer, 1);
+    programReflection[i].BindBlock(UniformBlock::LightBlock, 2);
+    programReflection[i].BindBlock(UniformBlock::ShadowBlock, 3);
+    programReflection[i].BindBlock(UniformBlock::CubeShadowBlock, 4);
+    programReflection[i].BindBlock(UniformBlock::ExposureBlock, 5);
+  }
+}
+
+// Rebuild all programs from the current sources, the live programs are kept if it fails
+static bool rebuildPrograms()
+{
+  GLuint livePrograms[ShaderProgram::NumShaderPrograms];
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    livePrograms[i] = shaderProgram[i];
+    shaderProgram[i] = 0;
+  }
+
+  const bool success = buildPrograms();
+
+  // Delete whichever set of programs isn't going to be used
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    if (success)
+    {
+      glDeleteProgram(livePrograms[i]);
+    }
+    else
+    {
+      glDeleteProgram(shaderProgram[i]);
+      shaderProgram[i] = livePrograms[i];
+    }
+  }
+
+  if (!success)
+  {
+    printf("Failed to rebuild the shaders, keeping the previous programs!\n");
+    return false;
+  }
+
+  setUpPrograms();
+  printf("Shaders rebuilt.\n");
+  return true;
+}
+
+bool compileShaders()
+{
+#if _ALLOW_COMPUTE_SHADOW_VOLUMES
+  computeShadowVolumes = GLAD_GL_VERSION_4_3 != 0;
+#else
+  computeShadowVolumes = false;
+#endif
+#if _ALLOW_POINT_SHADOW_MAPS
+  pointShadowMaps = GLAD_GL_VERSION_4_0 || GLAD_GL_ARB_texture_cube_map_array;
+#else
+  pointShadowMaps = false;
+#endif
+
+  // Reuse the programs of the previous launch if neither the sources nor the driver changed
+  ProgramCache programCache;
+  programCache.AddSources(vsSource, VertexShader::NumVertexShaders);
+  programCache.AddSources(fsSource, FragmentShader::NumFragmentShaders);
+  programCache.AddSources(gsSource, GeometryShader::NumGeometryShaders);
+  programCache.AddSources(csSource, ComputeShader::NumComputeShaders);
+  programCache.AddData(&computeShadowVolumes, sizeof(computeShadowVolumes));
+  programCache.AddData(&pointShadowMaps, sizeof(pointShadowMaps));
+
+  if (!programCache.Load(programCacheName, shaderProgram, ShaderProgram::NumShaderPrograms))
+  {
+    if (!buildPrograms())
+      return false;
+
+    programCache.Save(programCacheName, shaderProgram, ShaderProgram::NumShaderPrograms);
+  }
+
+  setUpPrograms();
+  return true;
+}
+
+void toggleShaderFiles()
+{
+  // Register the source tables the first time
+  static bool watching = false;
+  if (!watching)
+  {
+    shaderReloader.Watch(vsSource, vsNames, VertexShader::NumVertexShaders, ".vert");
+    shaderReloader.Watch(fsSource, fsNames, FragmentShader::NumFragmentShaders, ".frag");
+    shaderReloader.Watch(gsSource, gsNames, GeometryShader::NumGeometryShaders, ".geom");
+    shaderReloader.Watch(csSource, csNames, ComputeShader::NumComputeShaders, ".comp");
+    watching = true;
+  }
+
+  if (shaderReloader.IsEnabled())
+    shaderReloader.Disable();
+  else if (!shaderReloader.Enable(shaderDirectory))
+    return;
+
+  rebuildPrograms();
+}
+
+void updateShaderFiles()
+{
+  if (shaderReloader.Update())
+    rebuildPrograms();
+}
@@ -5,23 +5,83 @@
 
 #pragma once
 
+#include <ProgramReflection.h>
 #include <ShaderCompiler.h>
 
+// Extrudes the shadow volumes in a compute shader and caches them instead of the geometry shader, requires OpenGL 4.3 and higher
+#define _ALLOW_COMPUTE_SHADOW_VOLUMES 1
+// Shadows the point lights with cube map arrays as an alternative to the shadow volumes, requires OpenGL 4.0 or ARB_texture_cube_map_array
+#define _ALLOW_POINT_SHADOW_MAPS 1
+
+// Features of the scene shader permutations, each bit enables one #define in the shared sources
+namespace ShaderFeature
+{
+  enum
+  {
+    // Per-instance transformations from the instance buffer
+    Instancing = 0x1,
+    // Spot light cone and distance falloff
+    SpotLight = 0x2,
+    // Shadow atlas lookup, requires SpotLight
+    ShadowMap = 0x4,
+    // Positions only, no lighting
+    DepthOnly = 0x8,
+    // Point light shadow cube map lookup, excludes SpotLight
+    CubeShadowMap = 0x10,
+    NumFeatures = 5,
+    NumPermutations = 0x20
+  };
+}
+
 // Shader programs
 namespace ShaderProgram
 {
   enum
   {
-    Default, SpotlightDefault, DefaultDepthPass, Instancing, InstancingSpotLights, InstancingDepthPass, InstancingSpotlightShadow, InstancedShadowVolume, PointRendering,
-    Tonemapping, NumShaderPrograms
+    // Scene permutations, indexed by the ShaderFeature bits, invalid combinations stay 0
+    Scene,
+    InstancedShadowVolume = Scene + ShaderFeature::NumPermutations, ExtrudedShadowVolume, ShadowVolumeExtrusion, InstancedShadowMap,
+    InstancedCubeShadowMap, PointRendering, Tonemapping, NumShaderPrograms
   };
 }
 
 // Shader programs handle
 extern GLuint shaderProgram[ShaderProgram::NumShaderPrograms];
+// Are the shadow volume extrusion programs available? Set by compileShaders()
+extern bool computeShadowVolumes;
+// Are the point light shadow cube maps available? Set by compileShaders()
+extern bool pointShadowMaps;
+
+// Return the scene program with the ShaderFeature bits
+inline GLuint getSceneProgram(int features) { return shaderProgram[ShaderProgram::Scene + features]; }
+
+// Uniforms set outside of the uniform blocks
+namespace Uniform
+{
+  enum
+  {
+    NumCubes, PointPosition, PointColor, NumTriangles, LightPosition, ShadowLight, NumUniforms
+  };
+}
+
+// Uniform blocks shared by the shader programs
+namespace UniformBlock
+{
+  enum
+  {
+    TransformBlock, InstanceBuffer, LightBlock, ShadowBlock, CubeShadowBlock, ExposureBlock, NumUniformBlocks
+  };
+}
+
+// Cached uniform locations and block indices of the shader programs
+extern ProgramReflection programReflection[ShaderProgram::NumShaderPrograms];
 
 // Helper function for creating and compiling the shaders
 bool compileShaders();
+// Switch between the built-in shader sources and the files in the 07-ShadowVolumes.shaders directory, rebuilds the programs
+void toggleShaderFiles();
+// Rebuild the programs when the shader files change, the live programs are kept if the new ones fail to link
+void updateShaderFiles();
 
 // ============================================================================
 
@@ -30,75 +90,14 @@ namespace VertexShader
 {
   enum
   {
-    Default, Instancing, InstancedShadowVolume, Point, ScreenQuad, VertexShadowSpotlight, NumVertexShaders
+    Scene, InstancedShadowVolume, Point, ScreenQuad, InstancedShadowMap, ExtrudedShadowVolume, InstancedCubeShadowMap, NumVertexShaders
   };
 }
 
 // Vertex shader sources
 static const char* vsSource[] = {
 // ----------------------------------------------------------------------------
-// Default vertex shader
-// ----------------------------------------------------------------------------
-R"(
-#version 330 core
-
-// The following is not not needed since GLSL version #430
-#extension GL_ARB_explicit_uniform_location : require
-
-// The following is not not needed since GLSL version #420
-#extension GL_ARB_shading_language_420pack : require
-
-// Uniform blocks, i.e., constants
-layout (std140, binding = 0) uniform TransformBlock
-{
-  // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
-  mat3x4 worldToView;
-  mat4x4 projection;
-};
-
-// Model to world transformation separately, takes 4 slots!
-layout (location = 0) uniform mat4x3 modelToWorld;
-
-// Vertex attribute block, i.e., input
-layout (location = 0) in vec3 position;
-layout (location = 1) in vec3 normal;
-layout (location = 2) in vec3 tangent;
-layout (location = 3) in vec2 texCoord;
-
-// Vertex output
-out VertexData
-{
-  vec2 texCoord;
-  vec3 tangent;
-  vec3 bitangent;
-  vec3 normal;
-  vec4 worldPos;
-} vOut;
-
-void main()
-{
-  // Pass texture coordinates to the fragment shader
-  vOut.texCoord = texCoord.st;
-
-  // Construct the normal transformation matrix
-  mat3 normalTransform = transpose(inverse(mat3(modelToWorld)));
-
-  // Create the tangent space matrix and pass it to the fragment shader
-  vOut.normal = normalize(normalTransform * normal);
-  vOut.tangent = normalize(mat3(modelToWorld) * tangent);
-  vOut.bitangent = cross(vOut.tangent, vOut.normal);
-
-  // Transform vertex position
-  vOut.worldPos = vec4(modelToWorld * vec4(position.xyz, 1.0f), 1.0f);
-
-  // We must multiply from the left because of transposed worldToView
-  vec4 viewPos = vec4(vOut.worldPos * worldToView, 1.0f);
-
-  gl_Position = projection * viewPos;
-}
-)",
-// ----------------------------------------------------------------------------
-// Instancing vertex shader using instancing buffer via uniform block objects
+// Scene vertex shader, permutations: INSTANCING, DEPTH_ONLY
 // ----------------------------------------------------------------------------
 R"(
 #version 330 core
@@ -117,22 +116,7 @@ layout (std140, binding = 0) uniform TransformBlock
   mat4x4 projection;
 };
 
-// Vertex attribute block, i.e., input
-layout (location = 0) in vec3 position;
-layout (location = 1) in vec3 normal;
-layout (location = 2) in vec3 tangent;
-layout (location = 3) in vec2 texCoord;
-
-// Default value for cases when we don't need it
-layout (location = 11) uniform mat4 lightMatrix = mat4(1.0f, 0.0f, 0.0f, 0.0f, 
-                                                       0.0f, 1.0f, 0.0f, 0.0f,
-                                                       0.0f, 0.0f, 1.0f, 0.0f,
-                                                       0.0f, 0.0f, 0.0f, 1.0f);
-layout (location = 12) uniform mat4 lightProjection = mat4(1.0f, 0.0f, 0.0f, 0.0f, 
-                                                           0.0f, 1.0f, 0.0f, 0.0f,
-                                                           0.0f, 0.0f, 1.0f, 0.0f,
-                                                           0.0f, 0.0f, 0.0f, 1.0f);
-
+#ifdef INSTANCING
 // Must match the structure on the CPU side
 struct InstanceData
 {
@@ -147,7 +131,18 @@ layout (std140, binding = 1) uniform InstanceBuffer
   // being 1024 meaning we could fit another vec4 worth of data
   InstanceData instanceBuffer[1024];
 };
+#else
+// Model to world transformation separately, takes 4 slots!
+layout (location = 0) uniform mat4x3 modelToWorld;
+#endif
 
+// Vertex attribute block, i.e., input
+layout (location = 0) in vec3 position;
+layout (location = 1) in vec3 normal;
+layout (location = 2) in vec3 tangent;
+layout (location = 3) in vec2 texCoord;
+
+#ifndef DEPTH_ONLY
 // Vertex output
 out VertexData
 {
@@ -157,29 +152,38 @@ out VertexData
   vec3 normal;
   vec4 worldPos;
 } vOut;
+#endif
+
+// Depth only and lit permutations have to produce the same depth
+invariant gl_Position;
 
 void main()
 {
+#ifdef INSTANCING
+  // Retrieve the model to world matrix from the instance buffer, undo the transposition for storage
+  mat4x3 modelToWorld = transpose(instanceBuffer[gl_InstanceID].modelToWorld);
+#endif
+
+  // Transform vertex position
+  vec4 worldPos = vec4(modelToWorld * vec4(position.xyz, 1.0f), 1.0f);
+
+#ifndef DEPTH_ONLY
   // Pass texture coordinates to the fragment shader
   vOut.texCoord = texCoord.st;
 
-  // Retrieve the model to world matrix from the instance buffer
-  mat3x4 modelToWorld = instanceBuffer[gl_InstanceID].modelToWorld;
-
   // Construct the normal transformation matrix
   mat3 normalTransform = transpose(inverse(mat3(modelToWorld)));
 
   // Create the tangent space matrix and pass it to the fragment shader
-  // Note: we must multiply from the left because of transposed modelToWorld
-  vOut.normal = normalize(normal * normalTransform);
-  vOut.tangent = normalize(tangent * mat3(modelToWorld));
+  vOut.normal = normalize(normalTransform * normal);
+  vOut.tangent = normalize(mat3(modelToWorld) * tangent);
   vOut.bitangent = cross(vOut.tangent, vOut.normal);
+  vOut.worldPos = worldPos;
+#endif
 
-  // Transform vertex position, note we multiply from the left because of transposed modelToWorld
-  vOut.worldPos = vec4(vec4(position.xyz, 1.0f) * modelToWorld, 1.0f);
-  vec4 viewPos = vec4(vOut.worldPos * worldToView, 1.0f);
+  // We must multiply from the left because of transposed worldToView
+  vec4 viewPos = vec4(worldPos * worldToView, 1.0f);
 
-  //gl_Position = projection * viewPos;
   gl_Position = projection * viewPos;
 }
 )",
@@ -278,13 +282,64 @@ void main()
 }
 )",
 // ----------------------------------------------------------------------------
-// Vertex shader for Shadow Map drawing using depth buffer, for Spotlights
+// Instanced vertex shader rendering all spot light shadow maps at once, instances are
+// ordered by shadow map layer, i.e., the first numCubes instances go to layer 0 etc.
 // ----------------------------------------------------------------------------
 R"(
 #version 330 core
 
-// The following is not not needed since GLSL version #430
-#extension GL_ARB_explicit_uniform_location : require
+// The following is not not needed since GLSL version #420
+#extension GL_ARB_shading_language_420pack : require
+
+// Vertex attribute block, i.e., input
+layout (location = 0) in vec3 position;
+
+// Must match the structure on the CPU side
+struct InstanceData
+{
+  // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
+  mat3x4 modelToWorld;
+};
+
+// Uniform buffer used for instances
+layout (std140, binding = 1) uniform InstanceBuffer
+{
+  // We are limited to 4096 vec4 registers in total, hence the maximum number of instances
+  // being 1024 meaning we could fit another vec4 worth of data
+  InstanceData instanceBuffer[1024];
+};
+
+// World to light clip space transformations of the shadow casting spot lights, must match MAX_SHADOW_CASTERS
+layout (std140, binding = 3) uniform ShadowBlock
+{
+  mat4x4 lightMatrices[4];
+};
+
+// Number of instances rendered to a single layer
+uniform int numCubes;
+
+// Vertex output
+out VertexData
+{
+  flat int layer;
+} vOut;
+
+void main()
+{
+  // Pick the instance and the shadow map layer
+  int instance = gl_InstanceID % numCubes;
+  vOut.layer = gl_InstanceID / numCubes;
+
+  // Transform vertex position, note we multiply from the left because of transposed modelToWorld
+  vec4 worldPos = vec4(vec4(position.xyz, 1.0f) * instanceBuffer[instance].modelToWorld, 1.0f);
+  gl_Position = lightMatrices[vOut.layer] * worldPos;
+}
+)",
+// ----------------------------------------------------------------------------
+// Vertex shader for the shadow volumes extruded by the compute shader
+// ----------------------------------------------------------------------------
+R"(
+#version 330 core
 
 // The following is not not needed since GLSL version #420
 #extension GL_ARB_shading_language_420pack : require
@@ -297,21 +352,28 @@ layout (std140, binding = 0) uniform TransformBlock
   mat4x4 projection;
 };
 
+// World space position, w = 0 for the vertices projected to infinity
+layout (location = 0) in vec4 position;
+
+void main()
+{
+  // We must multiply from the left because of transposed worldToView, w = 0 drops the translation as well
+  vec4 viewPos = vec4(position * worldToView, position.w);
+  gl_Position = projection * viewPos;
+}
+)",
+// ----------------------------------------------------------------------------
+// Instanced vertex shader rendering all 6 faces of a point light shadow cube map at once,
+// each instance is a pair of the scene instance and the cube face it's visible in
+// ----------------------------------------------------------------------------
+R"(
+#version 330 core
+
+// The following is not not needed since GLSL version #420
+#extension GL_ARB_shading_language_420pack : require
+
 // Vertex attribute block, i.e., input
 layout (location = 0) in vec3 position;
-layout (location = 1) in vec3 normal;
-layout (location = 2) in vec3 tangent;
-layout (location = 3) in vec2 texCoord;
-
-// Default value for cases when we don't need it
-layout (location = 11) uniform mat4 lightMatrix = mat4(1.0f, 0.0f, 0.0f, 0.0f, 
-                                                       0.0f, 1.0f, 0.0f, 0.0f,
-                                                       0.0f, 0.0f, 1.0f, 0.0f,
-                                                       0.0f, 0.0f, 0.0f, 1.0f);
-layout (location = 12) uniform mat4 lightProjection = mat4(1.0f, 0.0f, 0.0f, 0.0f, 
-                                                           0.0f, 1.0f, 0.0f, 0.0f,
-                                                           0.0f, 0.0f, 1.0f, 0.0f,
-                                                           0.0f, 0.0f, 0.0f, 1.0f);
 
 // Must match the structure on the CPU side
 struct InstanceData
@@ -328,42 +390,35 @@ layout (std140, binding = 1) uniform InstanceBuffer
   InstanceData instanceBuffer[1024];
 };
 
+// Faces of a single light, must match MAX_CUBE_SHADOW_INSTANCES
+layout (std140, binding = 4) uniform CubeShadowBlock
+{
+  // World to light clip space transformations of the cube faces
+  mat4x4 faceMatrices[6];
+  // Instance index | face << 16 of the instances visible in the faces, 4 per element
+  uvec4 faceInstances[1000];
+};
+
+// Index of the cube in the cube map array
+uniform int shadowLight;
+
 // Vertex output
 out VertexData
 {
-  vec2 texCoord;
-  vec3 tangent;
-  vec3 bitangent;
-  vec3 normal;
-  vec4 worldPos;
-  vec4 fragPosLightSpace;
+  flat int layer;
 } vOut;
 
 void main()
 {
-
-  // Pass texture coordinates to the fragment shader
-  vOut.texCoord = texCoord.st;
-
-  // Retrieve the model to world matrix from the instance buffer
-  mat3x4 modelToWorld = instanceBuffer[gl_InstanceID].modelToWorld;
-
-  // Construct the normal transformation matrix
-  mat3 normalTransform = transpose(inverse(mat3(modelToWorld)));
-
-  // Create the tangent space matrix and pass it to the fragment shader
-  // Note: we must multiply from the left because of transposed modelToWorld
-  vOut.normal = normalize(normal * normalTransform);
-  vOut.tangent = normalize(tangent * mat3(modelToWorld));
-  vOut.bitangent = cross(vOut.tangent, vOut.normal);
+  // Unpack the instance and the cube face
+  uint faceInstance = faceInstances[gl_InstanceID / 4][gl_InstanceID % 4];
+  uint instance = faceInstance & 0xffffu;
+  int face = int(faceInstance >> 16);
+  vOut.layer = 6 * shadowLight + face;
 
   // Transform vertex position, note we multiply from the left because of transposed modelToWorld
-  vOut.worldPos = vec4(vec4(position.xyz, 1.0f) * modelToWorld, 1.0f);
-  vec4 viewPos = vec4(vOut.worldPos * worldToView, 1.0f);
-  vOut.fragPosLightSpace = lightMatrix * vec4(vOut.worldPos.xyz, 1.0); // +
-
-  //gl_Position = projection * viewPos;
-  gl_Position = lightMatrix * projection * viewPos;
+  vec4 worldPos = vec4(vec4(position.xyz, 1.0f) * instanceBuffer[instance].modelToWorld, 1.0f);
+  gl_Position = faceMatrices[face] * worldPos;
 }
 )",
 ""};
@@ -375,14 +430,14 @@ namespace FragmentShader
 {
   enum
   {
-    Default, TestDefault, SingleColor, Null, Tonemapping, DefaultShadowSpotlight, NumFragmentShaders
+    Lighting, SingleColor, Null, Tonemapping, NumFragmentShaders
   };
 }
 
 // Fragment shader sources
 static const char* fsSource[] = {
 // ----------------------------------------------------------------------------
-// Default fragment shader source
+// Scene lighting fragment shader, permutations: SPOT_LIGHT, SHADOW_MAP, CUBE_SHADOW_MAP
 // ----------------------------------------------------------------------------
 R"(
 #version 330 core
@@ -393,21 +448,54 @@ R"(
 // The following is not not needed since GLSL version #420
 #extension GL_ARB_shading_language_420pack : require
 
+#ifdef CUBE_SHADOW_MAP
+// The following is not not needed since GLSL version #400
+#extension GL_ARB_texture_cube_map_array : require
+#endif
+
 // Texture sampler
 layout (binding = 0) uniform sampler2D Diffuse;
 layout (binding = 1) uniform sampler2D Normal;
 layout (binding = 2) uniform sampler2D Specular;
 layout (binding = 3) uniform sampler2D Occlusion;
 
-// Note: explicit location because AMD APU drivers screw up position when linking against
-// the default vertex shader with mat4x3 modelToWorld at location 0 occupying 4 slots
+#ifdef SHADOW_MAP
+layout (binding = 4) uniform sampler2DArrayShadow ShadowAtlas;
+
+// World to light clip space transformations of the shadow casting spot lights, must match MAX_SHADOW_CASTERS
+layout (std140, binding = 3) uniform ShadowBlock
+{
+  mat4x4 lightMatrices[4];
+};
+#endif
+
+#ifdef CUBE_SHADOW_MAP
+layout (binding = 5) uniform samplerCubeArrayShadow CubeShadowMaps;
+
+// Near plane of the cube faces, must match the scene
+const float cubeShadowNear = 0.05f;
+#endif
 
-// Light position/direction
-layout (location = 4) uniform vec4 lightPosWS;
-// View position in world space coordinates
-layout (location = 5) uniform vec4 viewPosWS;
-// Light color
-layout (location = 6) uniform vec4 lightColor;
+// Per-light data, 4th components of the light position and color control the direct and ambient light intensity
+layout (std140, binding = 2) uniform LightBlock
+{
+  // Light position/direction
+  vec4 lightPosWS;
+  // View position in world space coordinates
+  vec4 viewPosWS;
+  // Light color
+  vec4 lightColor;
+  // Direction of the spot light
+  vec3 lightDirection;
+  // Max distance after which the spot light is not calculated, radius of the point light
+  float maxLightDistance;
+  // Inner angle of the spot light where intensity is max and constant
+  float innerAngleDegrees;
+  // Outer angle of the spot light where intensity is with falloff
+  float outerAngleDegrees;
+  // Shadow map layer of the spot light or the shadow cube of the point light, negative if it doesn't cast shadows
+  int shadowLayer;
+};
 
 // Fragment shader inputs
 in VertexData
@@ -422,6 +510,50 @@ in VertexData
 // Fragment shader outputs
 layout (location = 0) out vec4 color;
 
+#ifdef SHADOW_MAP
+float calculateShadow(vec3 worldPos)
+{
+  // Spot light without shadow map
+  if (shadowLayer < 0)
+    return 0.0f;
+
+  // Perspective divide due to perspective projection and transformation to the texture space
+  vec4 lightSpacePos = lightMatrices[shadowLayer] * vec4(worldPos, 1.0f);
+  vec3 projectionCoords = lightSpacePos.xyz / lightSpacePos.w;
+  projectionCoords = projectionCoords * 0.5f + 0.5f;
+
+  // Nothing is shadowed outside of the light frustum
+  if (any(lessThan(projectionCoords, vec3(0.0f))) || any(greaterThan(projectionCoords, vec3(1.0f))))
+    return 0.0f;
+
+  // Hardware depth comparison returns 1 for lit fragments, small bias against shadow acne
+  float lit = texture(ShadowAtlas, vec4(projectionCoords.xy, float(shadowLayer), projectionCoords.z - 0.0005f));
+  return 1.0f - lit;
+}
+#endif
+
+#ifdef CUBE_SHADOW_MAP
+float calculateCubeShadow(vec3 worldPos)
+{
+  // Point light without shadow cube
+  if (shadowLayer < 0)
+    return 0.0f;
+
+  // The face is selected by the major axis, its distance gives the depth of the face projection reaching to
+  // the light radius, pulled a bit towards the light against shadow acne
+  vec3 lightToPos = worldPos - lightPosWS.xyz;
+  vec3 absDir = abs(lightToPos);
+  float z = 0.98f * max(absDir.x, max(absDir.y, absDir.z));
+  float n = cubeShadowNear;
+  float f = maxLightDistance;
+  float depth = ((f + n) / (f - n) - 2.0f * f * n / ((f - n) * z)) * 0.5f + 0.5f;
+
+  // Hardware depth comparison returns 1 for lit fragments
+  float lit = texture(CubeShadowMaps, vec4(lightToPos, float(shadowLayer)), depth);
+  return 1.0f - lit;
+}
+#endif
+
 void main()
 {
   // Shortcut variables for ambient/diffuse light component intensity modulation
@@ -430,13 +562,13 @@ void main()
 
   // Sample textures
   vec3 albedo = texture(Diffuse, vIn.texCoord.st).rgb;
-  vec3 noSample = texture(Normal, vIn.texCoord.st).rgb;
+  vec2 noSample = texture(Normal, vIn.texCoord.st).rg * 2.0f - 1.0f;
   float specSample = texture(Specular, vIn.texCoord.st).r;
   float occlusion = texture(Occlusion, vIn.texCoord.st).r;
 
-  // Calculate world-space normal
+  // Calculate world-space normal, Z is reconstructed so that two channel (BC5) normal maps work as well
   mat3 STN = {vIn.tangent, vIn.bitangent, vIn.normal};
-  vec3 normal = STN * (noSample * 2.0f - 1.0f);
+  vec3 normal = STN * vec3(noSample, sqrt(max(1.0f - dot(noSample, noSample), 0.0f)));
 
   // Calculate the lighting direction and distance
   vec3 lightDir = lightPosWS.xyz - vIn.worldPos.xyz;
@@ -465,113 +597,29 @@ void main()
   vec3 diffuse = directIntensity * horizon * NdotL * lightColor.rgb / lengthSq;
   vec3 specular = directIntensity* horizon * specSample * lightColor.rgb * pow(NdotH, 64.0f) / lengthSq; // Defines shininess
 
-  // Calculate the final color
-  vec3 finalColor = albedo * (ambient + diffuse) + specular;
-  color = vec4(finalColor, 1.0f);
-}
-)",
-// ----------------------------------------------------------------------------
-// Test second Default fragment shader source
-// ----------------------------------------------------------------------------
-R"(
-#version 330 core
-
-// The following is not not needed since GLSL version #430
-#extension GL_ARB_explicit_uniform_location : require
-
-// The following is not not needed since GLSL version #420
-#extension GL_ARB_shading_language_420pack : require
-
-// Texture sampler
-layout (binding = 0) uniform sampler2D Diffuse;
-layout (binding = 1) uniform sampler2D Normal;
-layout (binding = 2) uniform sampler2D Specular;
-layout (binding = 3) uniform sampler2D Occlusion;
-
-// Note: explicit location because AMD APU drivers screw up position when linking against
-// the default vertex shader with mat4x3 modelToWorld at location 0 occupying 4 slots
-
-// Light position/direction
-layout (location = 4) uniform vec4 lightPosWS;
-// View position in world space coordinates
-layout (location = 5) uniform vec4 viewPosWS;
-// Light color
-layout (location = 6) uniform vec4 lightColor;
-// Specific spot light uniforms
-// Direction of the light
-layout (location = 7) uniform vec3 lightDirection;
-// Inner angle of the light where intensity is max and constant
-layout (location = 8) uniform float innerAngleDegrees;
-// Outer angle of the light where intensity is with falloff
-layout (location = 9) uniform float outerAngleDegrees;
-// Max distance after which the light is not calculated
-layout (location = 10) uniform float maxLightDistance;
-
-// Fragment shader inputs
-in VertexData
-{
-  vec2 texCoord;
-  vec3 tangent;
-  vec3 bitangent;
-  vec3 normal;
-  vec4 worldPos;
-} vertexIn;
-
-// Fragment shader outputs
-layout (location = 0) out vec4 color;
-
-void main()
-{
-  // Get values from textures
-  vec3 albedoTextureAtVertex = texture(Diffuse, vertexIn.texCoord.st).rgb;
-  vec3 normalTextureAtVertex = texture(Normal, vertexIn.texCoord.st).rgb;
-  float specularTextureAtVertex = texture(Specular, vertexIn.texCoord.st).r;
-  float occlusionTextureAtVertex = texture(Occlusion, vertexIn.texCoord.st).r;
-
-  vec3 directionToLight = lightPosWS.xyz - vertexIn.worldPos.xyz;
-  float lengthSq = dot(directionToLight, directionToLight);
-  float directionToLightLength = sqrt(lengthSq);
-  directionToLight /= directionToLightLength;
-  
-  // Ambient/diffuse light component intensity modulation
-  const float ambientIntensity = 0.0f; //lightColor.a;
-
-  const float directIntensity = lightPosWS.w;
-
-  // Calculate world-space normal
-  mat3 STN = {vertexIn.tangent, vertexIn.bitangent, vertexIn.normal};
-  vec3 fragmentNormalWS = STN * (normalTextureAtVertex * 2.0f - 1.0f);
-
-  // Calculate the Phong model terms: ambient, diffuse, specular
-  vec3 ambient = albedoTextureAtVertex * ambientIntensity * occlusionTextureAtVertex * lightColor.rgb; // +
-
-  // Calculate diffuse coefficient
-  float NdotL = max(0.0f, dot(fragmentNormalWS, directionToLight));
-
-  vec3 diffuse = albedoTextureAtVertex * directIntensity * NdotL * lightColor.rgb / lengthSq;
-
-  // Calculate specular coefficient
-  // Calculate the view and reflection/halfway direction
-  vec3 viewDir = normalize(viewPosWS.xyz - vertexIn.worldPos.xyz);
-  // Cheaper approximation of reflected direction = reflect(-directionToLight, normal)
-  vec3 halfDir = normalize(viewDir + directionToLight);
-  float NdotH = max(0.0f, dot(fragmentNormalWS, halfDir));
-
-  vec3 specular = directIntensity * specularTextureAtVertex * lightColor.rgb * pow(NdotH, 64.0f) / lengthSq; // Defines shininess
-
-  // spotlight stuff
-  const float noLightAfterMaxDistance = 1 - clamp((directionToLightLength / maxLightDistance), 0, 1);
-  const float theta = dot(directionToLight, normalize(-lightDirection.xyz));
-  const float spotlightIntensityCutoff = clamp((theta - outerAngleDegrees) / (innerAngleDegrees - outerAngleDegrees), 0.0, 1.0);
-
-  diffuse *= spotlightIntensityCutoff;
-  specular *= spotlightIntensityCutoff;
-
-  diffuse *= noLightAfterMaxDistance;
-  specular *= noLightAfterMaxDistance;
+#ifdef SPOT_LIGHT
+  // Fade the light out towards the maximum distance and outside of the cone
+  float distanceFade = 1.0f - clamp(length / maxLightDistance, 0.0f, 1.0f);
+  float theta = dot(lightDir, normalize(-lightDirection));
+  float coneFade = clamp((theta - outerAngleDegrees) / (innerAngleDegrees - outerAngleDegrees), 0.0f, 1.0f);
+  float lightFade = distanceFade * coneFade;
+#ifdef SHADOW_MAP
+  lightFade *= 1.0f - calculateShadow(vIn.worldPos.xyz);
+#endif
+  diffuse *= lightFade;
+  specular *= lightFade;
+#else
+  // Fade the point light out before its radius, its passes are limited to the extent of the radius
+  float lightFade = 1.0f - smoothstep(0.66f * maxLightDistance, 0.9f * maxLightDistance, length);
+#ifdef CUBE_SHADOW_MAP
+  lightFade *= 1.0f - calculateCubeShadow(vIn.worldPos.xyz);
+#endif
+  diffuse *= lightFade;
+  specular *= lightFade;
+#endif
 
   // Calculate the final color
-  vec3 finalColor = ambient + diffuse + specular;
+  vec3 finalColor = albedo * (ambient + diffuse) + specular;
   color = vec4(finalColor, 1.0f);
 }
 )",
@@ -620,6 +668,13 @@ layout (binding = 0) uniform sampler2DMS HDR;
 // Number of used MSAA samples
 layout (location = 0) uniform float MSAA_LEVEL;
 
+// Exposure adapted on the GPU, see AutoExposure
+layout (std140, binding = 5) uniform ExposureBlock
+{
+  float exposure;
+  float averageLuminance;
+};
+
 // Quad UV coordinates
 in vec2 UV;
 
@@ -646,136 +701,12 @@ void main()
   {
      // Fetch a single sample from a single texel (no interpolation)
      vec3 s = texelFetch(HDR, texel, i).rgb;
-     finalColor += ApplyTonemapping(s);
+     finalColor += ApplyTonemapping(s * exposure);
   }
 
   color = vec4(finalColor.rgb / MSAA_LEVEL, 1.0f);
 }
 )",
-// ----------------------------------------------------------------------------
-// Fragment shader for Spot Lights with Shadow Maps
-// ----------------------------------------------------------------------------
-R"(
-#version 330 core
-
-// The following is not not needed since GLSL version #430
-#extension GL_ARB_explicit_uniform_location : require
-
-// The following is not not needed since GLSL version #420
-#extension GL_ARB_shading_language_420pack : require
-
-// Texture sampler
-layout (binding = 0) uniform sampler2D Diffuse;
-layout (binding = 1) uniform sampler2D Normal;
-layout (binding = 2) uniform sampler2D Specular;
-layout (binding = 3) uniform sampler2D Occlusion;
-layout (binding = 4) uniform sampler2D DepthMapShadow;
-
-// Note: explicit location because AMD APU drivers screw up position when linking against
-// the default vertex shader with mat4x3 modelToWorld at location 0 occupying 4 slots
-
-// Light position/direction
-layout (location = 4) uniform vec4 lightPosWS;
-// View position in world space coordinates
-layout (location = 5) uniform vec4 viewPosWS;
-// Light color
-layout (location = 6) uniform vec4 lightColor;
-// Specific spot light uniforms
-// Direction of the light
-layout (location = 7) uniform vec3 lightDirection;
-// Inner angle of the light where intensity is max and constant
-layout (location = 8) uniform float innerAngleDegrees;
-// Outer angle of the light where intensity is with falloff
-layout (location = 9) uniform float outerAngleDegrees;
-// Max distance after which the light is not calculated
-layout (location = 10) uniform float maxLightDistance;
-
-// Fragment shader inputs
-in VertexData
-{
-  vec2 texCoord;
-  vec3 tangent;
-  vec3 bitangent;
-  vec3 normal;
-  vec4 worldPos;
-  vec4 fragPosLightSpace;
-} vertexIn;
-
-// Fragment shader outputs
-layout (location = 0) out vec4 color;
-
-float calculateShadow(vec4 fragPosLightSpace)
-{
-    // perspective divide due to perspective projection
-    vec3 projectionCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
-    projectionCoords = projectionCoords * 0.5 + 0.5;
-    float depthMapAtFrag = texture(DepthMapShadow, projectionCoords.xy).r;
-    float fragDepth = projectionCoords.z;
-    float inShadow = fragDepth > depthMapAtFrag ? 1.0 : 0.0;
-    return inShadow;
-}
-
-void main()
-{
-  // Get values from textures
-  vec3 albedoTextureAtVertex = texture(Diffuse, vertexIn.texCoord.st).rgb;
-  vec3 normalTextureAtVertex = texture(Normal, vertexIn.texCoord.st).rgb;
-  float specularTextureAtVertex = texture(Specular, vertexIn.texCoord.st).r;
-  float occlusionTextureAtVertex = texture(Occlusion, vertexIn.texCoord.st).r;
-
-  vec3 directionToLight = lightPosWS.xyz - vertexIn.worldPos.xyz;
-  float lengthSq = dot(directionToLight, directionToLight);
-  float directionToLightLength = sqrt(lengthSq);
-  directionToLight /= directionToLightLength;
-  
-  // Ambient/diffuse light component intensity modulation
-  const float ambientIntensity = lightColor.a;
-
-  const float directIntensity = lightPosWS.w;
-
-  // Calculate world-space normal
-  mat3 STN = {vertexIn.tangent, vertexIn.bitangent, vertexIn.normal};
-  vec3 fragmentNormalWS = STN * (normalTextureAtVertex * 2.0f - 1.0f);
-
-  // Calculate the Phong model terms: ambient, diffuse, specular
-  vec3 ambient = albedoTextureAtVertex * ambientIntensity * occlusionTextureAtVertex * lightColor.rgb; // +
-  ambient = vec3(0.0f, 0.0f, 0.0f);
-
-  // Calculate diffuse coefficient
-  float NdotL = max(0.0f, dot(fragmentNormalWS, directionToLight));
-
-  vec3 diffuse = albedoTextureAtVertex * directIntensity * NdotL * lightColor.rgb / lengthSq;
-
-  // Calculate specular coefficient
-  // Calculate the view and reflection/halfway direction
-  vec3 viewDir = normalize(viewPosWS.xyz - vertexIn.worldPos.xyz);
-  // Cheaper approximation of reflected direction = reflect(-directionToLight, fragmentNormalWS)
-  vec3 halfDir = normalize(viewDir + directionToLight);
-  float NdotH = max(0.0f, dot(fragmentNormalWS, halfDir));
-
-  vec3 specular = directIntensity * specularTextureAtVertex * lightColor.rgb * pow(NdotH, 64.0f) / lengthSq; // Defines shininess
-
-  // spotlight stuff
-  const float noLightAfterMaxDistance = 1 - clamp((directionToLightLength / maxLightDistance), 0, 1);
-  const float theta = dot(directionToLight, normalize(-lightDirection.xyz));
-  const float spotlightIntensityCutoff = clamp((theta - outerAngleDegrees) / (innerAngleDegrees - outerAngleDegrees), 0.0, 1.0);
-    const float inShadow = calculateShadow(vertexIn.fragPosLightSpace);
-
-  diffuse *= spotlightIntensityCutoff;
-  specular *= spotlightIntensityCutoff;
-
-  diffuse *= noLightAfterMaxDistance;
-  specular *= noLightAfterMaxDistance;
-
-    diffuse *= 1.0 - inShadow;
-    specular *= 1.0 - inShadow;
-
-  // Calculate the final color
-  vec3 finalColor = albedoTextureAtVertex * (ambient + diffuse) + specular;
-  //vec3 finalColor = ambient + diffuse + specular;
-  color = vec4(finalColor, 1.0f);
-}
-)",
 ""};
 
 // ============================================================================
@@ -785,7 +716,7 @@ namespace GeometryShader
 {
 enum
 {
-  ShadowVolume, NumGeometryShaders
+  ShadowVolume, ShadowMapLayer, NumGeometryShaders
 };
 }
 
@@ -817,8 +748,11 @@ layout (std140, binding = 0) uniform TransformBlock
   mat4x4 projection;
 };
 
-// Location 0 is fine, we're linking only against instancing VS
-layout (location = 0) uniform vec4 lightPosWS;
+// Per-light data, only the light position is used here
+layout (std140, binding = 2) uniform LightBlock
+{
+  vec4 lightPosWS;
+};
 
 // Vertex input
 in VertexData
@@ -939,5 +873,195 @@ void main()
   }
 }
 )",
+// ----------------------------------------------------------------------------
+// Pass-through geometry shader routing the triangles to the shadow map layers
+// ----------------------------------------------------------------------------
+R"(
+#version 330 core
+
+// Input layout: triangles
+layout (triangles) in;
+// Output layout: triangle strip
+layout (triangle_strip, max_vertices = 3) out;
+
+// Vertex input
+in VertexData
+{
+  flat int layer;
+} vIn[];
+
+void main()
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    // All vertices of the primitive have to go to the same layer
+    gl_Layer = vIn[0].layer;
+    gl_Position = gl_in[i].gl_Position;
+    EmitVertex();
+  }
+}
+)",
 ""
-};
\ No newline at end of file
+};
+
+// ============================================================================
+
+// Compute shader types
+namespace ComputeShader
+{
+  enum
+  {
+    ShadowVolumeExtrusion, NumComputeShaders
+  };
+}
+
+// Compute shader sources
+static const char* csSource[] = {
+// ----------------------------------------------------------------------------
+// Shadow volume extrusion of all instances for a single light, the same as the
+// shadow volume geometry shader, one invocation per triangle w/ adjacency
+// ----------------------------------------------------------------------------
+R"(
+#version 430 core
+
+layout (local_size_x = 64) in;
+
+// Must match the structure on the CPU side
+struct InstanceData
+{
+  // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
+  mat3x4 modelToWorld;
+};
+
+// Uniform buffer used for instances
+layout (std140, binding = 1) uniform InstanceBuffer
+{
+  // We are limited to 4096 vec4 registers in total, hence the maximum number of instances
+  // being 1024 meaning we could fit another vec4 worth of data
+  InstanceData instanceBuffer[1024];
+};
+
+// Vertex positions of the mesh w/ adjacency, tightly packed vec3s
+layout (std430, binding = 0) readonly buffer AdjacencyVertices
+{
+  float adjacencyVertices[];
+};
+
+// Triangles w/ adjacency, 6 indices each
+layout (std430, binding = 1) readonly buffer AdjacencyIndices
+{
+  uint adjacencyIndices[];
+};
+
+// Must match DrawArraysIndirectCommand on the CPU side
+struct DrawCommand
+{
+  uint count;
+  uint instanceCount;
+  uint first;
+  uint baseInstance;
+};
+
+// Indirect draw of each light, the vertex count is appended to
+layout (std430, binding = 2) buffer VolumeCommands
+{
+  DrawCommand volumeCommands[];
+};
+
+// World space triangles of the extruded volumes, w = 0 for the vertices projected to infinity
+layout (std430, binding = 3) writeonly buffer VolumeVertices
+{
+  vec4 volumeVertices[];
+};
+
+// Number of instances and triangles of a single instance
+uniform int numCubes;
+uniform int numTriangles;
+// Light casting the shadow and its position
+uniform int shadowLight;
+uniform vec3 lightPosition;
+
+// See note in the geometry shader regarding z-fighting and Peter Panning
+const float epsilon = -0.001f;
+
+// Vertex on the original geometry, slightly moved away from light
+vec4 capVertex(vec3 v)
+{
+  return vec4(v + normalize(v - lightPosition) * epsilon, 1.0f);
+}
+
+// Vertex projected to infinity
+vec4 infiniteVertex(vec3 v)
+{
+  return vec4(v - lightPosition, 0.0f);
+}
+
+// Extrudes quad from edge marked by start and end vertices, same winding as the geometry shader strip
+uint extrudeEdge(uint offset, vec3 startVertex, vec3 endVertex)
+{
+  volumeVertices[offset + 0] = capVertex(startVertex);
+  volumeVertices[offset + 1] = infiniteVertex(startVertex);
+  volumeVertices[offset + 2] = capVertex(endVertex);
+  volumeVertices[offset + 3] = capVertex(endVertex);
+  volumeVertices[offset + 4] = infiniteVertex(startVertex);
+  volumeVertices[offset + 5] = infiniteVertex(endVertex);
+  return offset + 6;
+}
+
+void main()
+{
+  int triangle = int(gl_GlobalInvocationID.x) % numTriangles;
+  int instance = int(gl_GlobalInvocationID.x) / numTriangles;
+  if (instance >= numCubes)
+    return;
+
+  // Fetch the triangle w/ adjacency and transform it to the world space
+  mat3x4 modelToWorld = instanceBuffer[instance].modelToWorld;
+  vec3 v[6];
+  for (int i = 0; i < 6; ++i)
+  {
+    uint index = 3 * adjacencyIndices[6 * triangle + i];
+    vec4 position = vec4(adjacencyVertices[index], adjacencyVertices[index + 1], adjacencyVertices[index + 2], 1.0f);
+    // Note we multiply from the left because of transposed modelToWorld
+    v[i] = position * modelToWorld;
+  }
+
+  vec3 e1 = v[2] - v[0];
+  vec3 e2 = v[4] - v[0];
+  vec3 e3 = v[1] - v[0];
+  vec3 e4 = v[3] - v[2];
+  vec3 e5 = v[4] - v[2];
+  vec3 e6 = v[5] - v[0];
+
+  // Handle only light triangles facing away from the light
+  if (dot(cross(e2, e1), lightPosition - v[0]) >= 0)
+    return;
+
+  // Find the silhouette edges
+  bool silhouette1 = dot(cross(e1, e3), lightPosition - v[0]) >= 0;
+  bool silhouette5 = dot(cross(e5, e4), lightPosition - v[2]) >= 0;
+  bool silhouette2 = dot(cross(e6, e2), lightPosition - v[4]) >= 0;
+
+  // Reserve the space for both caps and the extruded edges in the range of the light
+  uint numVertices = 6 + 6 * (uint(silhouette1) + uint(silhouette5) + uint(silhouette2));
+  uint offset = volumeCommands[shadowLight].first + atomicAdd(volumeCommands[shadowLight].count, numVertices);
+
+  if (silhouette1)
+    offset = extrudeEdge(offset, v[0], v[2]);
+  if (silhouette5)
+    offset = extrudeEdge(offset, v[2], v[4]);
+  if (silhouette2)
+    offset = extrudeEdge(offset, v[4], v[0]);
+
+  // Render the front cap
+  volumeVertices[offset + 0] = capVertex(v[0]);
+  volumeVertices[offset + 1] = capVertex(v[2]);
+  volumeVertices[offset + 2] = capVertex(v[4]);
+
+  // Render the back cap
+  volumeVertices[offset + 3] = infiniteVertex(v[0]);
+  volumeVertices[offset + 4] = infiniteVertex(v[4]);
+  volumeVertices[offset + 5] = infiniteVertex(v[2]);
+}
+)",
+""};
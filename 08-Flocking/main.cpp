@@ -3,7 +3,9 @@
  * Licensed under the zlib license, see LICENSE.txt in the root directory.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -12,6 +14,12 @@
 
 #include <MathSupport.h>
 #include <Camera.h>
+#include <GLState.h>
+#include <GpuMemory.h>
+#include <JobSystem.h>
+#include <KernelTuner.h>
+#include <Profiler.h>
+#include <Benchmark.h>
 
 #include "shaders.h"
 #include "scene.h"
@@ -83,17 +91,33 @@ static constexpr float CameraTurboSpeed = 50.0f;
 static const unsigned int MAX_TEXT_LENGTH = 256;
 // MSAA samples
 static const GLsizei MSAA_SAMPLES = 4;
+// Size of the flock simulated interactively
+static const unsigned int FLOCK_SIZE = 16384;
+// Local sizes of the simulation kernels tuned for the GPU
+static const char kernelTuningName[] = "08-Flocking.tuning";
+// Largest tile and the shared memory per cached item of the simulation kernels: the brute force kernel caches both
+// the positions and the velocities, the grid ones the positions to sum them up
+static const int bruteForceMaxTile = 4;
+static const int bruteForceSharedBytes = 2 * sizeof(glm::vec4);
+static const int gridMaxTile = 1;
+static const int gridSharedBytes = sizeof(glm::vec4);
 
 // Camera instance
 Camera camera;
 // Scene helper instance
 Scene &scene(Scene::GetInstance());
 // Render modes
-RenderMode renderMode = {true, false, true, MSAA_SAMPLES};
+RenderMode renderMode = {true, false, true, MSAA_SAMPLES, true};
 // Enable/disable light movement
 bool animate = false;
 // Enable/disable faster flock movement
 bool turbo = false;
+// Neighbor search used by the flocking simulation
+NeighborSearch neighborSearch = NeighborSearch::UniformGrid;
+// Enable/disable triple buffering of the flock state, rendering lags one step behind the simulation
+bool tripleBuffering = false;
+// Benchmark mode settings and output
+Benchmark benchmark;
 
 // Our framebuffer object
 GLuint fbo = 0;
@@ -196,6 +220,51 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     turbo = !turbo;
   }
 
+  // Switch between the brute force and uniform grid neighbor search
+  if (key == GLFW_KEY_F7 && action == GLFW_PRESS)
+  {
+    neighborSearch = (neighborSearch == NeighborSearch::BruteForce) ? NeighborSearch::UniformGrid : NeighborSearch::BruteForce;
+  }
+
+  // Enable/disable triple buffering of the flock state
+  if (key == GLFW_KEY_F8 && action == GLFW_PRESS)
+  {
+    tripleBuffering = !tripleBuffering;
+  }
+
+  // Load the shaders from editable files and rebuild them on change, or go back to the built-in ones
+  if (key == GLFW_KEY_F9 && action == GLFW_PRESS)
+  {
+    toggleShaderFiles();
+  }
+
+  // Switch between the reverse-Z and the traditional depth
+  if (key == GLFW_KEY_F10 && action == GLFW_PRESS)
+  {
+    renderMode.reverseZ = !renderMode.reverseZ;
+    camera.SetReverseZ(renderMode.reverseZ);
+  }
+
+  // Print the GPU memory used by each subsystem
+  if (key == GLFW_KEY_F11 && action == GLFW_PRESS)
+  {
+    GpuMemory::GetInstance().Dump();
+  }
+
+  // Enable/disable the flock statistics, with shift the periodic snapshots of the flock state
+  if (key == GLFW_KEY_F12 && action == GLFW_PRESS)
+  {
+    if (mods & GLFW_MOD_SHIFT)
+    {
+      scene.SetSnapshotsEnabled(!scene.IsSnapshotsEnabled());
+      printf("Flock snapshots %s\n", scene.IsSnapshotsEnabled() ? "enabled" : "disabled");
+    }
+    else
+    {
+      scene.SetStatsEnabled(!scene.IsStatsEnabled());
+    }
+  }
+
   // Zoom in
   if (key == GLFW_KEY_KP_ADD || key == GLFW_KEY_EQUAL && action == GLFW_PRESS)
   {
@@ -241,6 +310,10 @@ bool initOpenGL()
 #endif
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+  // Nobody watches the benchmark, we render to our own framebuffer so the window can stay hidden
+  if (benchmark.IsEnabled())
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
   // Create the window
   mainWindow.handle = glfwCreateWindow(Window::DefaultWidth, Window::DefaultHeight, "", nullptr, nullptr);
   if (mainWindow.handle == nullptr)
@@ -272,8 +345,9 @@ bool initOpenGL()
   else
     glfwSwapInterval(0);
 
-  // Enable depth remapping to [0, 1] interval
+  // Enable depth remapping to [0, 1] interval, required by the reverse-Z projection as well
   glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+  camera.SetReverseZ(renderMode.reverseZ);
 
   // Enable automatic sRGB color conversion
   glEnable(GL_FRAMEBUFFER_SRGB);
@@ -318,6 +392,7 @@ void createFramebuffer(int width, int height, GLsizei MSAA)
   // Delete it if necessary
   if (glIsTexture(renderTarget))
   {
+    GpuMemory::GetInstance().UntrackTexture(renderTarget);
     glDeleteTextures(1, &renderTarget);
     renderTarget = 0;
   }
@@ -343,6 +418,7 @@ void createFramebuffer(int width, int height, GLsizei MSAA)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, renderTarget, 0);
   }
+  GpuMemory::GetInstance().TrackTexture(renderTarget, GpuMemory::GetTextureBytes(GL_RGB16F, width, height, 1, 1, MSAA), "Render targets");
 
   // --------------------------------------------------------------------------
   // Depth/stencil buffer texture:
@@ -361,15 +437,15 @@ void createFramebuffer(int width, int height, GLsizei MSAA)
     glGenRenderbuffers(1, &depthStencil);
   }
 
-  // Bind and recreate the depth-stencil Render Buffer Object
+  // Bind and recreate the depth-stencil Render Buffer Object, float depth for the precision of the reverse-Z depth
   glBindRenderbuffer(GL_RENDERBUFFER, depthStencil);
   if (MSAA > 1)
   {
-    glRenderbufferStorageMultisample(GL_RENDERBUFFER, MSAA, GL_DEPTH24_STENCIL8, width, height);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, MSAA, GL_DEPTH32F_STENCIL8, width, height);
   }
   else
   {
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH32F_STENCIL8, width, height);
   }
   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthStencil);
 
@@ -391,6 +467,9 @@ void createFramebuffer(int width, int height, GLsizei MSAA)
 // Helper method for graceful shutdown
 void shutDown()
 {
+  // Stop the worker threads
+  JobSystem::GetInstance().Release();
+
   // Release shader programs
   for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
   {
@@ -470,10 +549,8 @@ void renderScene()
 
   scene.Draw(camera, renderMode);
 
-  // Unbind the shader program and other resources
-  glBindVertexArray(0);
-  glUseProgram(0);
-
+  // Resolve the HDR render target to the screen
+  Profiler::GetInstance().BeginScope("Resolve");
   if (renderMode.tonemapping)
   {
     // Unbind the framebuffer and bind the window system provided FBO
@@ -518,6 +595,31 @@ void renderScene()
     glDrawBuffer(GL_BACK);
     glBlitFramebuffer(0, 0, mainWindow.width, mainWindow.height, 0, 0, mainWindow.width, mainWindow.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
   }
+
+  Profiler::GetInstance().EndScope();
+}
+
+// Print the latest flock statistics read back from the GPU once per second
+void printFlockStats(double time)
+{
+  static double lastTime = 0.0;
+  static unsigned int lastStep = 0;
+  Scene::FlockStats stats;
+  unsigned int step = 0;
+  if (!scene.IsStatsEnabled() || time - lastTime < 1.0 || !scene.GetStats(stats, step) || step == lastStep)
+    return;
+
+  lastTime = time;
+  lastStep = step;
+  printf("Step %u: center [%.1f, %.1f, %.1f], extent [%.1f, %.1f, %.1f], speed %.2f-%.2f (mean %.2f, sd %.2f), %u colliding\n", step,
+         stats.center.x, stats.center.y, stats.center.z, stats.boundsMax.x - stats.boundsMin.x, stats.boundsMax.y - stats.boundsMin.y,
+         stats.boundsMax.z - stats.boundsMin.z, stats.speed.x, stats.speed.y, stats.speed.z, stats.speed.w, stats.numCollisions);
+
+  char histogram[MAX_TEXT_LENGTH];
+  int length = 0;
+  for (int i = 0; i < Scene::NUM_SPEED_BINS && length < (int)MAX_TEXT_LENGTH; ++i)
+    length += snprintf(histogram + length, MAX_TEXT_LENGTH - length, " %u", stats.speedHistogram[i]);
+  printf("  speed histogram:%s\n", histogram);
 }
 
 // Helper method for implementing the application main loop
@@ -531,31 +633,167 @@ void mainLoop()
     float dt = (float)(time - prevTime);
     prevTime = time;
 
-    // Print it to the title bar
+    // Print it to the title bar along with GPU/CPU times of the profiled passes
     static char title[MAX_TEXT_LENGTH];
     static char instacing[] = "[Instancing] ";
-    snprintf(title, MAX_TEXT_LENGTH, "dt = %.2fms, FPS = %.1f", dt * 1000.0f, 1.0f / dt);
+    const char *search = (neighborSearch == NeighborSearch::UniformGrid) ? "[Grid] " : "[Brute force] ";
+    const char *buffering = tripleBuffering ? "[Triple] " : "[Double] ";
+    const GLState &glState = GLState::GetInstance();
+    int length = snprintf(title, MAX_TEXT_LENGTH, "%s%sdt = %.2fms, FPS = %.1f, GL state %i/%i skipped | ", search, buffering, dt * 1000.0f, 1.0f / dt,
+                          glState.GetSkippedCalls(), glState.GetIssuedCalls() + glState.GetSkippedCalls());
+    Profiler::GetInstance().Print(title + length, MAX_TEXT_LENGTH - length);
     glfwSetWindowTitle(mainWindow.handle, title);
 
+    // Start measuring the frame
+    Profiler::GetInstance().BeginFrame();
+
     // Poll the events like keyboard, mouse, etc.
     glfwPollEvents();
 
+    // Pick up the edited shader files
+    updateShaderFiles();
+
     // Process keyboard input
     processInput(dt);
 
     // Update scene
-    scene.Update(dt, animate, turbo);
+    scene.Update(dt, animate, turbo, neighborSearch, tripleBuffering);
+    printFlockStats(time);
 
     // Render the scene
     renderScene();
 
+    // Finish measuring the frame
+    Profiler::GetInstance().EndFrame();
+
     // Swap actual buffers on the GPU
     glfwSwapBuffers(mainWindow.handle);
   }
 }
 
-int main()
+// Helper method for running the benchmark, replays the camera path for all requested flock configurations
+void benchmarkLoop()
 {
+  // Fixed time step so that every run simulates the flock the same way
+  const float dt = 1.0f / 60.0f;
+  const int numFrames = benchmark.GetTotalFrames();
+
+  for (int flockSize : benchmark.GetSweep("flock", FLOCK_SIZE))
+  {
+    for (int grid : benchmark.GetSweep("grid", 1))
+    {
+      for (int triple : benchmark.GetSweep("triple", 0))
+      {
+        NeighborSearch search = grid ? NeighborSearch::UniformGrid : NeighborSearch::BruteForce;
+
+        // Same initial flock state for every run, the flock is made of whole work groups
+        seedRandom(0);
+        scene.Init((unsigned int)std::max(flockSize, 1));
+
+        char config[MAX_TEXT_LENGTH];
+        snprintf(config, MAX_TEXT_LENGTH, "flock=%u grid=%i triple=%i", scene.GetFlockSize(), grid ? 1 : 0, triple ? 1 : 0);
+        benchmark.BeginRun(config);
+
+        for (int frame = 0; frame < numFrames && !glfwWindowShouldClose(mainWindow.handle); ++frame)
+        {
+          // Start measuring the frame and write out the oldest one read back
+          Profiler::GetInstance().BeginFrame();
+          benchmark.Record();
+
+          // Poll the events so that the window stays responsive
+          glfwPollEvents();
+
+          // Replay the camera path
+          Benchmark::SetCameraOnPath(camera, frame, numFrames, glm::vec3(0.0f, 0.0f, 0.0f), 300.0f, 100.0f);
+
+          {
+            ProfilerScope frameScope("Frame");
+            scene.Update(dt, false, false, search, triple != 0);
+            renderScene();
+          }
+
+          // Finish measuring the frame
+          Profiler::GetInstance().EndFrame();
+
+          // Swap actual buffers on the GPU
+          glfwSwapBuffers(mainWindow.handle);
+        }
+
+        benchmark.EndRun();
+        scene.Release();
+      }
+    }
+  }
+}
+
+// Use the local sizes of the kernels tuned on this GPU and driver before the shaders are compiled, false if there are none
+bool loadKernelConfig()
+{
+  KernelTuner tuner;
+  KernelTuner::Config bruteForce, grid;
+  if (!tuner.Load(kernelTuningName) || !tuner.Get("Flocking", bruteForceMaxTile, bruteForceSharedBytes, bruteForce) ||
+      !tuner.Get("FlockingGrid", gridMaxTile, gridSharedBytes, grid))
+    return false;
+
+  return setKernelConfig(bruteForce, grid);
+}
+
+// Time the simulation steps of the flock with the candidate local sizes of the kernels and keep the fastest ones,
+// the sizes are stored per GPU and driver so that this runs just once, delete the file to tune again
+void tuneKernels()
+{
+  KernelTuner tuner;
+  KernelTuner::Config bruteForce = {256, 1};
+  KernelTuner::Config grid = {256, 1};
+
+  // Fixed time step and the same flock for every candidate
+  const float dt = 1.0f / 60.0f;
+  const int numRuns = 16;
+  NeighborSearch search = NeighborSearch::BruteForce;
+  auto setUp = [&bruteForce, &grid, &search](const KernelTuner::Config &config)
+  {
+    const bool built = (search == NeighborSearch::BruteForce) ? setKernelConfig(config, grid) : setKernelConfig(bruteForce, config);
+    if (!built)
+      return false;
+
+    scene.Release();
+    seedRandom(0);
+    scene.Init(FLOCK_SIZE);
+    return true;
+  };
+  auto run = [&dt, &search]()
+  {
+    scene.Update(dt, false, false, search, false);
+  };
+
+  printf("Tuning the brute force flocking kernel:\n");
+  KernelTuner::Tune(KernelTuner::GetCandidates(64, 1024, bruteForceMaxTile, bruteForceSharedBytes), setUp, run, numRuns, bruteForce);
+
+  printf("Tuning the uniform grid flocking kernels:\n");
+  search = NeighborSearch::UniformGrid;
+  KernelTuner::Tune(KernelTuner::GetCandidates(64, 1024, gridMaxTile, gridSharedBytes), setUp, run, numRuns, grid);
+
+  printf("Using work group size %i with tile %i for the brute force and %i for the uniform grid\n", bruteForce.workGroupSize,
+         bruteForce.tileSize, grid.workGroupSize);
+  scene.Release();
+  if (setKernelConfig(bruteForce, grid))
+  {
+    tuner.Set("Flocking", bruteForce);
+    tuner.Set("FlockingGrid", grid);
+    tuner.Save(kernelTuningName);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  // Read the benchmark settings
+  if (!benchmark.ParseCommandLine(argc, argv))
+    return -1;
+
+  // Benchmark must not be limited by the display refresh rate
+  if (benchmark.IsEnabled())
+    renderMode.vsync = false;
+
   // Initialize the OpenGL context and create a window
   if (!initOpenGL())
   {
@@ -564,7 +802,8 @@ int main()
     return -1;
   }
 
-  // Compile shaders needed to run
+  // Compile shaders needed to run, the simulation kernels with the local sizes tuned for this GPU if there are any
+  const bool kernelsTuned = loadKernelConfig();
   if (!compileShaders())
   {
     printf("Failed to compile shaders!\n");
@@ -572,11 +811,30 @@ int main()
     return -1;
   }
 
-  // Scene initialization
-  scene.Init(256, 64);
+  // Start the worker threads of the parallel scene updates
+  JobSystem::GetInstance().Init();
 
-  // Enter the application main loop
-  mainLoop();
+  // Pick the local sizes of the simulation kernels before the profiler starts measuring the frames
+  if (!kernelsTuned)
+    tuneKernels();
+
+  // Create the profiler queries
+  Profiler::GetInstance().Init();
+
+  if (benchmark.IsEnabled())
+  {
+    // Run all benchmark configurations and quit
+    if (benchmark.Open())
+      benchmarkLoop();
+  }
+  else
+  {
+    // Scene initialization
+    scene.Init(FLOCK_SIZE);
+
+    // Enter the application main loop
+    mainLoop();
+  }
 
   // Release used resources and exit
   shutDown();
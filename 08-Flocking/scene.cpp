@@ -7,21 +7,60 @@
 #include "shaders.h"
 
 #include <vector>
+#include <algorithm>
+#include <cstdio>
 #include <glad/glad.h>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/transform.hpp>
 
+#include <GLState.h>
+#include <GpuMemory.h>
+#include <JobSystem.h>
 #include <MathSupport.h>
+#include <Profiler.h>
 
 // Scaling factor for lights movement curve
 static const glm::vec3 scale = glm::vec3(35.0f, 25.0f, 60.0f);
 
+// Size of the uniform grid cell, mustn't be smaller than the collision avoidance distance
+static const float gridCellSize = 8.0f;
+// Number of boids generated by a single job
+static const int boidBatchSize = 4096;
+
 // Lissajous curve position calculation based on the parameters
 auto lissajous = [](const glm::vec4 &p, float t) -> glm::vec3
 {
   return glm::vec3(sinf(p.x * t), cosf(p.y * t), sinf(p.z * t) * cosf(p.w * t));
 };
 
+// Header of the snapshot files, the positions and the velocities of the flock follow as vec4 arrays
+struct SnapshotHeader
+{
+  char magic[4];
+  unsigned int version;
+  unsigned int flockSize;
+  unsigned int step;
+};
+
+// Write the snapshot with the state read back as the positions followed by the velocities
+static void writeSnapshot(const std::vector<glm::vec4> &state, unsigned int flockSize, unsigned int step)
+{
+  char fileName[64];
+  snprintf(fileName, sizeof(fileName), "08-Flocking.snapshot.%06u.bin", step);
+  FILE *file = fopen(fileName, "wb");
+  if (!file)
+  {
+    printf("Failed to create the snapshot file %s\n", fileName);
+    return;
+  }
+
+  const SnapshotHeader header = {{'F', 'L', 'C', 'K'}, 1, flockSize, step};
+  bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+  success = success && fwrite(state.data(), sizeof(glm::vec4), state.size(), file) == state.size();
+  if (fclose(file) != 0 || !success)
+    printf("Failed to write the snapshot file %s\n", fileName);
+}
+
 // ----------------------------------------------------------------------------
 
 Scene& Scene::GetInstance()
@@ -30,33 +69,78 @@ Scene& Scene::GetInstance()
   return scene;
 }
 
-Scene::Scene()
+Scene::Scene() : _glState(GLState::GetInstance())
 {
 
 }
 
 Scene::~Scene()
 {
+  Release();
+}
+
+void Scene::Release()
+{
+  // Let the snapshot being written finish
+  if (_snapshotWriter.joinable())
+    _snapshotWriter.join();
+
   // Delete meshes
   delete _tetrahedron;
   _tetrahedron = nullptr;
 
-  // Release the instancing buffer
-  glDeleteBuffers(2, _sbo);
+  // Release the flock state buffers
+  for (int i = 0; i < ShaderData::NumBuffers; ++i)
+  {
+    for (int j = 0; j < FlockData::NumFlockStreams; ++j)
+      GpuMemory::GetInstance().UntrackBuffer(_sbo[i][j]);
+  }
+  glDeleteBuffers(ShaderData::NumBuffers * FlockData::NumFlockStreams, &_sbo[0][0]);
+  for (int i = 0; i < ShaderData::NumBuffers; ++i)
+  {
+    for (int j = 0; j < FlockData::NumFlockStreams; ++j)
+      _sbo[i][j] = 0;
+  }
+
+  // Release the uniform grid buffers
+  for (int i = 0; i < GridData::NumGridBuffers; ++i)
+    GpuMemory::GetInstance().UntrackBuffer(_gridBuffers[i]);
+  glDeleteBuffers(GridData::NumGridBuffers, _gridBuffers);
+  for (int i = 0; i < GridData::NumGridBuffers; ++i)
+    _gridBuffers[i] = 0;
+
+  // Release the statistics copies in flight
+  _statsReadback.Release();
+  _snapshotReadback.Release();
+  _statsReadbackSteps.clear();
+  _snapshotReadbackSteps.clear();
+  _statsReduced = false;
+  _hasStats = false;
+  _step = 0;
 
   // Release the generic VAO
   glDeleteVertexArrays(1, &_vao);
+  _vao = 0;
+
+  // Start from the first buffer again
+  _previousFrameData = ShaderData::Flock0;
+  _currentFrameData = ShaderData::Flock0;
+  _renderFrameData = ShaderData::Flock0;
 }
 
-void Scene::Init(unsigned int workGroupSize, unsigned int numWorkGroups)
+void Scene::Init(unsigned int flockSize)
 {
   // Check if already initialized and return
   if (_vao)
     return;
 
-  _workGroupSize = workGroupSize;
-  _numWorkGroups = numWorkGroups;
-  _flockSize = _workGroupSize * _numWorkGroups;
+  // Both local sizes are powers of two, the larger one makes whole work groups of the other as well
+  const unsigned int workGroupSize = getWorkGroupSize(ShaderProgram::Flocking);
+  const unsigned int gridWorkGroupSize = getWorkGroupSize(ShaderProgram::FlockingGrid);
+  const unsigned int granularity = std::max(std::max(workGroupSize, gridWorkGroupSize), 1u);
+  _flockSize = std::min((std::max(flockSize, 1u) + granularity - 1) / granularity, MAX_INSTANCES / granularity) * granularity;
+  _numWorkGroups = _flockSize / std::max(workGroupSize, 1u);
+  _numGridWorkGroups = _flockSize / std::max(gridWorkGroupSize, 1u);
 
   // Prepare meshes
   _tetrahedron = Geometry::CreateTetrahedron();
@@ -66,45 +150,89 @@ void Scene::Init(unsigned int workGroupSize, unsigned int numWorkGroups)
   // Create general use VAO
   glGenVertexArrays(1, &_vao);
 
-  // Generate the instancing buffers
-  glGenBuffers(ShaderData::NumBuffers, _sbo);
+  // Generate the flock state buffers
+  glGenBuffers(ShaderData::NumBuffers * FlockData::NumFlockStreams, &_sbo[0][0]);
 
-  // Create both VAOs for use with flocking simulation
+  // Create both sets of buffers for use with flocking simulation
   for (int i = 0; i < ShaderData::NumBuffers; ++i)
   {
-    // Create the instancing buffer, it will be used for drawing and also updated by the GPU
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _sbo[ShaderData::Flock0 + i]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_INSTANCES * sizeof(InstanceData), nullptr, GL_DYNAMIC_COPY);
+    for (int j = 0; j < FlockData::NumFlockStreams; ++j)
+    {
+      // Create the state buffer, it will be used for drawing and also updated by the GPU
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, _sbo[ShaderData::Flock0 + i][j]);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, _flockSize * sizeof(glm::vec4), nullptr, GL_DYNAMIC_COPY);
+      GpuMemory::GetInstance().TrackBuffer(_sbo[ShaderData::Flock0 + i][j], _flockSize * sizeof(glm::vec4), "Flock");
+    }
   }
 
-  // Initialize data for the first frame
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _sbo[ShaderData::Flock0]);
-  InstanceData* data = reinterpret_cast<InstanceData*>(glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _flockSize * sizeof(InstanceData), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+  // Initialize data for the first frame, both buffers are mapped at once and filled in parallel
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _sbo[ShaderData::Flock0][FlockData::Positions]);
+  glm::vec4* positions = reinterpret_cast<glm::vec4*>(glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _flockSize * sizeof(glm::vec4), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _sbo[ShaderData::Flock0][FlockData::Velocities]);
+  glm::vec4* velocities = reinterpret_cast<glm::vec4*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, _flockSize * sizeof(glm::vec4), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+
+  // Every batch has its own generator seeded from the calling thread's numbers, the flock then stays the same
+  // for the same seed no matter which threads end up generating it
+  const int numBoids = (int)_flockSize;
+  std::vector<uint64_t> batchSeeds((numBoids + boidBatchSize - 1) / boidBatchSize);
+  for (uint64_t &seed : batchSeeds)
+    seed = ((uint64_t)getThreadRandom().Next() << 32) | getThreadRandom().Next();
 
-  for (unsigned int i = 0; i < _flockSize; ++i)
+  if (positions && velocities)
   {
-    // Generate position
-    float x = getRandom(-150.0f, 150.0f);
-    float y = getRandom(-150.0f, 150.0f);
-    float z = getRandom(-150.0f, 150.0f);
-    data[i].transformation[3] = glm::vec4(x, y, z, 1.0f);
-
-    // Generate velocity
-    x = getRandom(-0.5f, 0.5f);
-    y = getRandom(-0.5f, 0.5f);
-    z = getRandom(-0.5f, 0.5f);
-    data[i].velocity = glm::vec4(x, y, z, 1.0f);
-
-    // Set the aside, up, and dir using orthonormalization with scene up
-    glm::vec3 direction = glm::normalize(glm::vec3(x, y, z));
-    data[i].transformation[0] = glm::vec4(glm::normalize(glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), direction)), 0.0f);
-    data[i].transformation[1] = glm::vec4(glm::normalize(glm::cross(direction, glm::vec3(data[i].transformation[0]))), 0.0f);
-    data[i].transformation[2] = glm::vec4(direction, 0.0f);
+    JobSystem::GetInstance().ParallelFor(numBoids, boidBatchSize, [positions, velocities, &batchSeeds](int begin, int end)
+    {
+      RandomGenerator random(batchSeeds[begin / boidBatchSize]);
+      for (int i = begin; i < end; ++i)
+      {
+        // Generate position
+        float x = random.Get(-150.0f, 150.0f);
+        float y = random.Get(-150.0f, 150.0f);
+        float z = random.Get(-150.0f, 150.0f);
+        positions[i] = glm::vec4(x, y, z, 1.0f);
+
+        // Generate velocity
+        x = random.Get(-0.5f, 0.5f);
+        y = random.Get(-0.5f, 0.5f);
+        z = random.Get(-0.5f, 0.5f);
+        velocities[i] = glm::vec4(x, y, z, 0.0f);
+      }
+    });
   }
 
-  // Unmap and unbind the buffer for now
+  // Unmap and unbind the buffers for now
   glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+  glUnmapBuffer(GL_COPY_WRITE_BUFFER);
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+  // --------------------------------------------------------------------------
+
+  // Create buffers for the uniform grid, these are only touched by the GPU. The flock statistics, padded to vec4,
+  // precede the partial sums of the grid statistics
+  const size_t statsSize = (sizeof(FlockStats) + sizeof(glm::vec4) - 1) / sizeof(glm::vec4) * sizeof(glm::vec4);
+  const size_t gridBufferSizes[GridData::NumGridBuffers] =
+  {
+    GRID_CELLS * 2 * sizeof(GLuint),          // Cells
+    _flockSize * sizeof(glm::vec4),           // SortedPositions
+    _flockSize * sizeof(glm::vec4),           // SortedVelocities
+    statsSize + _numGridWorkGroups * sizeof(glm::vec4), // GridStats
+    _flockSize * 2 * sizeof(GLuint)           // MemberCell
+  };
+
+  glGenBuffers(GridData::NumGridBuffers, _gridBuffers);
+  for (int i = 0; i < GridData::NumGridBuffers; ++i)
+  {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _gridBuffers[i]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gridBufferSizes[i], nullptr, GL_DYNAMIC_COPY);
+    GpuMemory::GetInstance().TrackBuffer(_gridBuffers[i], gridBufferSizes[i], "Flock grid");
+  }
+
+  // The simulation counts the collisions in the statistics even if nobody reads them
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _gridBuffers[GridData::GridStats]);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  _statsReadback.Init(sizeof(FlockStats), "Flock telemetry");
 
   // --------------------------------------------------------------------------
 
@@ -116,12 +244,13 @@ void Scene::Init(unsigned int workGroupSize, unsigned int numWorkGroups)
   _light = {lissajous(p, 0.0f) * scale, glm::vec4(100.0f, 100.0f, 100.0f, ambientIntentsity), p};
 }
 
-void Scene::Update(float dt, bool moveLight, bool turbo)
+void Scene::Update(float dt, bool moveLight, bool turbo, NeighborSearch neighborSearch, bool tripleBuffering)
 {
+  // The simulation starts the frame, the state cache only trusts what was set through it since here
+  _glState.BeginFrame();
+
   // Animation timer
   static float t = 0.0f;
-  // Frame index
-  static unsigned int frameIndex = 0;
 
   // Update the light position
   _light.position = lissajous(_light.movement, t) * scale;
@@ -131,71 +260,247 @@ void Scene::Update(float dt, bool moveLight, bool turbo)
 
   // --------------------------------------------------------------------------
 
+  // Measure the whole simulation step
+  ProfilerScope profilerScope("Simulation");
+
+  // Bind input buffers, we will read from these
+  RotateBuffers(tripleBuffering);
+  for (int i = 0; i < FlockData::NumFlockStreams; ++i)
+    _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, i, _sbo[_previousFrameData][i]);
+  // The statistics are used by both simulation kernels, bind them with the grid statistics
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 2 * FlockData::NumFlockStreams + GridData::GridStats, _gridBuffers[GridData::GridStats]);
+
+  // Read back the statistics and the snapshots, reduce the statistics of the input state
+  UpdateTelemetry();
+
+  // Pick the simulation kernel, the uniform grid one needs the grid to be built first
+  int program = ShaderProgram::Flocking;
+  if (neighborSearch == NeighborSearch::UniformGrid)
+  {
+    BuildGrid();
+    program = ShaderProgram::FlockingGrid;
+  }
+
+  // We will put the simulation results to these buffers, bound after the grid build which borrows the indices
+  for (int i = 0; i < FlockData::NumFlockStreams; ++i)
+    _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, FlockData::NumFlockStreams + i, _sbo[_currentFrameData][i]);
+
   // Bind the simulation compute shader and update the goal position
-  glUseProgram(shaderProgram[ShaderProgram::Flocking]);
-  GLint goalLoc = glGetUniformLocation(shaderProgram[ShaderProgram::Flocking], "goal_dt");
-  glUniform4f(goalLoc, _light.position.x, _light.position.y, _light.position.z, turbo ? dt * 10.0f : dt);
-
-  // Bind input/output buffers
-  unsigned int _previousFrameData = frameIndex & 0x01;
-  unsigned int _currentFrameData = _previousFrameData ^ 0x01;
-  // We will read from this buffer
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _sbo[_previousFrameData]);
-  // We will put the simulation results to this buffer
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _sbo[_currentFrameData]);
+  _glState.UseProgram(shaderProgram[program]);
+  programReflection[program].Set(Uniform::GoalDt, glm::vec4(_light.position, turbo ? dt * 10.0f : dt));
+  // Grid parameters are set on every dispatch, the programs may have been rebuilt from the shader files meanwhile
+  programReflection[program].Set(Uniform::CellSize, gridCellSize);
+  programReflection[program].Set(Uniform::NumCells, GRID_CELLS);
 
   // Perform the simulation step in the compute shader
-  glDispatchCompute(_numWorkGroups, 1, 1);
+  glDispatchCompute(program == ShaderProgram::FlockingGrid ? _numGridWorkGroups : _numWorkGroups, 1, 1);
 
-  // Unbind the input/output buffers
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+  // We're rendering the results right away, make them visible to the vertex shader and the next step
+  if (!tripleBuffering)
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-  // Advance frame counter
-  ++frameIndex;
+  ++_step;
 }
 
-void Scene::UpdateProgramData(GLuint program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
+void Scene::UpdateTelemetry()
 {
+  // Pick up the copies the GPU has finished, the newest statistics win
+  while (_statsReadback.Read(&_stats, sizeof(FlockStats)))
+  {
+    _readStatsStep = _statsReadbackSteps.front();
+    _statsReadbackSteps.pop_front();
+    _hasStats = true;
+  }
+
+  // The next snapshot waits in the ring until the previous one is written, the ring then fills up and the
+  // snapshots are skipped rather than stalling anything
+  if (!_snapshotWriting && _snapshotReadback.GetNumPending() > 0)
+  {
+    std::vector<glm::vec4> state(FlockData::NumFlockStreams * _flockSize);
+    if (_snapshotReadback.Read(state.data(), state.size() * sizeof(glm::vec4)))
+    {
+      const unsigned int step = _snapshotReadbackSteps.front();
+      _snapshotReadbackSteps.pop_front();
+
+      if (_snapshotWriter.joinable())
+        _snapshotWriter.join();
+      _snapshotWriting = true;
+      std::atomic<bool> *writing = &_snapshotWriting;
+      const unsigned int flockSize = _flockSize;
+      _snapshotWriter = std::thread([state = std::move(state), flockSize, step, writing]()
+      {
+        writeSnapshot(state, flockSize, step);
+        *writing = false;
+      });
+    }
+  }
+
+  if (!_statsEnabled && !_snapshotsEnabled)
+  {
+    _statsReduced = false;
+    return;
+  }
+
+  ProfilerScope profilerScope("Telemetry");
+
+  // Copies read what the previous step and the statistics pass wrote by the shaders
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  // Statistics of the previous step are complete once its simulation counted the collisions
+  if (_statsReduced && _statsReadback.BeginFrame())
+  {
+    _statsReadback.Copy(_gridBuffers[GridData::GridStats], 0, 0, sizeof(FlockStats));
+    _statsReadback.EndFrame();
+    _statsReadbackSteps.push_back(_statsStep);
+  }
+
+  // Snapshot of the state the step starts from, the ring is created the first time it's needed
+  if (_snapshotsEnabled && _step % SNAPSHOT_INTERVAL == 0)
+  {
+    const GLsizeiptr streamSize = _flockSize * sizeof(glm::vec4);
+    _snapshotReadback.Init(FlockData::NumFlockStreams * streamSize, "Flock telemetry");
+    if (_snapshotReadback.BeginFrame())
+    {
+      for (int i = 0; i < FlockData::NumFlockStreams; ++i)
+        _snapshotReadback.Copy(_sbo[_previousFrameData][i], 0, i * streamSize, streamSize);
+      _snapshotReadback.EndFrame();
+      _snapshotReadbackSteps.push_back(_step);
+    }
+    else
+    {
+      printf("Skipping the snapshot of step %u, the previous ones are still being written\n", _step);
+    }
+  }
+
+  _statsReduced = _statsEnabled;
+  if (!_statsEnabled)
+    return;
+
+  // Reduce the input state in a single work group, the simulation then adds the collisions
+  _glState.UseProgram(shaderProgram[ShaderProgram::FlockStats]);
+  programReflection[ShaderProgram::FlockStats].Set(Uniform::FlockSize, (unsigned int)_flockSize);
+  glDispatchCompute(1, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  _statsStep = _step;
+}
+
+bool Scene::GetStats(FlockStats &stats, unsigned int &step) const
+{
+  if (!_hasStats)
+    return false;
+
+  stats = _stats;
+  step = _readStatsStep;
+  return true;
+}
+
+void Scene::RotateBuffers(bool tripleBuffering)
+{
+  // The latest simulation results are the input for the next step
+  _previousFrameData = _currentFrameData;
+
+  if (tripleBuffering)
+  {
+    // Render the latest results while the next step runs, no dependency between the two.
+    // Write to the buffer nobody reads this frame, i.e., the one rendered two frames ago,
+    // so the dispatch doesn't have to wait for the previous frame to finish drawing
+    unsigned int lastRendered = _renderFrameData;
+    _renderFrameData = _previousFrameData;
+    for (unsigned int i = 0; i < ShaderData::NumBuffers; ++i)
+    {
+      if (i != _previousFrameData && i != lastRendered)
+      {
+        _currentFrameData = i;
+        break;
+      }
+    }
+
+    // Results of the previous step were not made visible yet, both the dispatch and the draw read them
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+  else
+  {
+    // Ping-pong between the first two buffers, render what we've just written,
+    // barrier is issued right after the dispatch
+    _currentFrameData = (_previousFrameData == ShaderData::Flock0) ? ShaderData::Flock1 : ShaderData::Flock0;
+    _renderFrameData = _currentFrameData;
+  }
+}
+
+void Scene::BuildGrid()
+{
+  ProfilerScope profilerScope("Grid");
+
+  // Bind the uniform grid buffers after the input/output buffers, the input ones are expected to be bound already.
+  // None of the grid kernels writes the output, the member cells take the position output index meanwhile
+  for (int i = 0; i < GridData::MemberCell; ++i)
+    _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 2 * FlockData::NumFlockStreams + i, _gridBuffers[i]);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, FlockData::NumFlockStreams + FlockData::Positions, _gridBuffers[GridData::MemberCell]);
+
+  // Reset the cell counters
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _gridBuffers[GridData::Cells]);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT, nullptr);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  // Count the flock members in each cell and sum up their positions
+  // Grid parameters are set on every dispatch as the programs may have been rebuilt from the shader files meanwhile
+  _glState.UseProgram(shaderProgram[ShaderProgram::GridCount]);
+  programReflection[ShaderProgram::GridCount].Set(Uniform::CellSize, gridCellSize);
+  programReflection[ShaderProgram::GridCount].Set(Uniform::NumCells, GRID_CELLS);
+  glDispatchCompute(_numGridWorkGroups, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  // Calculate the cell offsets and the flock center in a single work group
+  _glState.UseProgram(shaderProgram[ShaderProgram::GridPrefixSum]);
+  programReflection[ShaderProgram::GridPrefixSum].Set(Uniform::NumCells, GRID_CELLS);
+  programReflection[ShaderProgram::GridPrefixSum].Set(Uniform::NumPartialSums, (unsigned int)_numGridWorkGroups);
+  programReflection[ShaderProgram::GridPrefixSum].Set(Uniform::FlockSize, (unsigned int)_flockSize);
+  glDispatchCompute(1, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  // Sort the flock members by their cells
+  _glState.UseProgram(shaderProgram[ShaderProgram::GridScatter]);
+  glDispatchCompute(_numGridWorkGroups, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void Scene::UpdateProgramData(int program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
+{
+  const ProgramReflection &reflection = programReflection[program];
+
   // Update the transformation & projection matrices
   glUniformMatrix4fv(0, 1, GL_FALSE, glm::value_ptr(camera.GetWorldToView()));
   glUniformMatrix4fv(1, 1, GL_FALSE, glm::value_ptr(camera.GetProjection()));
 
   // Update the light position
-  GLint lightLoc = glGetUniformLocation(program, "lightPosWS");
-  glUniform4f(lightLoc, lightPosition.x, lightPosition.y, lightPosition.z, 1.0f);
+  reflection.Set(Uniform::LightPosWS, glm::vec4(lightPosition, 1.0f));
 
   // Update the view position
-  GLint viewPosLoc = glGetUniformLocation(program, "viewPosWS");
-  glm::vec4 viewPos = camera.GetViewToWorld()[3];
-  glUniform4fv(viewPosLoc, 1, glm::value_ptr(viewPos));
+  reflection.Set(Uniform::ViewPosWS, camera.GetViewToWorld()[3]);
 
   // Update the light color, 4th component controls ambient light intensity
-  GLint lightColorLoc = glGetUniformLocation(program, "lightColor");
-  glUniform4f(lightColorLoc, lightColor.x, lightColor.y, lightColor.z, lightColor.w);
+  reflection.Set(Uniform::LightColor, lightColor);
 }
 
-void Scene::DrawObjects(GLuint program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
+void Scene::DrawObjects(int program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor)
 {
   // Bind the shader program and update its data
-  glUseProgram(program);
+  _glState.UseProgram(shaderProgram[program]);
   // Update the transformation & projection matrices
   UpdateProgramData(program, camera, lightPosition, lightColor);
 
-  // Bind the instancing buffer to the index 0
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _sbo[_currentFrameData]);
+  // Bind the flock state buffers to the indices 0 and 1
+  for (int i = 0; i < FlockData::NumFlockStreams; ++i)
+    _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, i, _sbo[_renderFrameData][i]);
 
   // Draw the flock
-  glBindVertexArray(_tetrahedron->GetVAO());
-  glDrawElementsInstanced(GL_TRIANGLES, _tetrahedron->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), _flockSize);
-
-  // Unbind the instancing buffer
-  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+  _glState.BindVertexArray(_tetrahedron->GetVAO());
+  glDrawElementsInstanced(GL_TRIANGLES, _tetrahedron->GetIBOSize(), _tetrahedron->GetIndexType(), reinterpret_cast<void*>(0), _flockSize);
 
   // --------------------------------------------------------------------------
 
   // Draw the light object
-  glUseProgram(shaderProgram[ShaderProgram::PointRendering]);
+  _glState.UseProgram(shaderProgram[ShaderProgram::PointRendering]);
 
   // Update the transformation & projection matrices and other data
   glUniformMatrix4fv(0, 1, GL_FALSE, glm::value_ptr(camera.GetWorldToView()));
@@ -203,11 +508,10 @@ void Scene::DrawObjects(GLuint program, const Camera &camera, const glm::vec3 &l
   glUniform3fv(2, 1, glm::value_ptr(lightPosition));
 
   // Update the color
-  GLint colorLoc = glGetUniformLocation(shaderProgram[ShaderProgram::PointRendering], "color");
-  glUniform3fv(colorLoc, 1, glm::value_ptr(lightColor));
+  programReflection[ShaderProgram::PointRendering].Set(Uniform::PointColor, glm::vec3(lightColor));
 
   glPointSize(10.0f);
-  glBindVertexArray(_vao);
+  _glState.BindVertexArray(_vao);
   glDrawArrays(GL_POINTS, 0, 1);
 }
 
@@ -215,26 +519,22 @@ void Scene::Draw(const Camera &camera, const RenderMode &renderMode)
 {
   // Enable/disable MSAA rendering
   if (renderMode.msaaLevel > 1)
-    glEnable(GL_MULTISAMPLE);
+    _glState.Enable(GL_MULTISAMPLE);
   else
-    glDisable(GL_MULTISAMPLE);
-
-  // Enable depth test, clamp, and write
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_DEPTH_CLAMP);
-  glDepthFunc(GL_LEQUAL);
-
-  // Enable backface culling
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_BACK);
+    _glState.Disable(GL_MULTISAMPLE);
 
-  // Enable/disable wireframe
-  glPolygonMode(GL_FRONT_AND_BACK, renderMode.wireframe ? GL_LINE : GL_FILL);
+  // Depth test, clamp, and write with backface culling, the reverse-Z depth decreases with the distance,
+  // wireframe if enabled
+  const PipelineState flockState = {true, camera.IsReverseZ() ? (GLenum)GL_GEQUAL : (GLenum)GL_LEQUAL, GL_TRUE, true, true, GL_BACK,
+                                    false, GL_FUNC_ADD, GL_ONE, GL_ZERO, false, renderMode.wireframe ? (GLenum)GL_LINE : (GLenum)GL_FILL};
+  _glState.Apply(flockState);
 
   // Clear the color and depth buffer
   glClearColor(0.01f, 0.02f, 0.04f, 1.0f);
+  glClearDepth(camera.IsReverseZ() ? 0.0 : 1.0);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   // Draw all scene objects
-  DrawObjects(shaderProgram[ShaderProgram::Instancing], camera, _light.position, _light.color);
+  ProfilerScope profilerScope("Flock");
+  DrawObjects(ShaderProgram::Instancing, camera, _light.position, _light.color);
 }
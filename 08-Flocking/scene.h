@@ -7,8 +7,14 @@
 
 #include <Camera.h>
 #include <Geometry.h>
+#include <GLState.h>
+#include <ReadbackBuffer.h>
 #include <Textures.h>
 
+#include <atomic>
+#include <deque>
+#include <thread>
+
 // Textures we'll be using
 namespace LoadedTextures
 {
@@ -29,40 +35,89 @@ struct RenderMode
   bool tonemapping;
   // Used MSAA samples
   GLsizei msaaLevel;
+  // Reverse-Z depth with infinite far plane?
+  bool reverseZ;
+};
+
+// Neighbor search strategy used by the flocking simulation
+enum class NeighborSearch : int
+{
+  // Every flock member visits all the others, O(N^2)
+  BruteForce,
+  // Flock members are binned into a hashed uniform grid and visit only the neighboring cells
+  UniformGrid,
+  NumModes
 };
 
 // Very simple scene abstraction class
 class Scene
 {
 public:
-  // Data for a single object instance
-  struct InstanceData
+  // Flock state is stored as a structure of arrays, i.e., separate buffers for positions and velocities
+  // (vec4 to include padding), orientation of each flock member is rebuilt from its velocity when rendering
+  enum FlockData
   {
-    // Transformation matrix
-    glm::mat4x4 transformation;
-    // Velocity (vec4 to include padding)
-    glm::vec4 velocity;
+    Positions, Velocities, NumFlockStreams
   };
 
   // Maximum number of allowed instances - SSBO can be up to 128 MB! - it'd be safer to ask driver, though
   static const unsigned int MAX_INSTANCES = 2 << 16;
+  // Number of cells of the hashed uniform grid, must be a power of two
+  static const unsigned int GRID_CELLS = 2 << 17;
+  // Number of bins of the speed histogram over [0, maximum speed], must match the statistics shader
+  static const int NUM_SPEED_BINS = 16;
+  // Number of simulation steps between the snapshots of the flock state
+  static const unsigned int SNAPSHOT_INTERVAL = 60;
+
+  // Flock statistics reduced on the GPU, laid out as the std430 buffer of the statistics shader. They're stored at
+  // the start of the grid statistics buffer to keep the kernels within the 8 guaranteed storage blocks
+  struct FlockStats
+  {
+    glm::vec4 center;
+    glm::vec4 boundsMin;
+    glm::vec4 boundsMax;
+    // Minimum, maximum, mean, and standard deviation of the speed
+    glm::vec4 speed;
+    // Flock members closer to another one than the collision avoidance distance
+    GLuint numCollisions;
+    GLuint speedHistogram[NUM_SPEED_BINS];
+  };
 
   // Get and create instance for this singleton
   static Scene& GetInstance();
-  // Initialize the test scene
-  void Init(unsigned int workGroupSize, unsigned int numWorkGroups);
-  // Updates positions
-  void Update(float dt, bool moveLight, bool turbo);
+  // Initialize the test scene, the flock is rounded up to whole work groups of the simulation kernels
+  void Init(unsigned int flockSize);
+  // Updates positions, with triple buffering the rendered state lags one simulation step behind
+  void Update(float dt, bool moveLight, bool turbo, NeighborSearch neighborSearch, bool tripleBuffering);
   // Draw the scene
   void Draw(const Camera &camera, const RenderMode &renderMode);
+  // Reduce the flock statistics each step and read them back a few frames later
+  void SetStatsEnabled(bool enable) { _statsEnabled = enable; }
+  bool IsStatsEnabled() const { return _statsEnabled; }
+  // Write the flock state to 08-Flocking.snapshot.<step>.bin every SNAPSHOT_INTERVAL steps on a background thread
+  void SetSnapshotsEnabled(bool enable) { _snapshotsEnabled = enable; }
+  bool IsSnapshotsEnabled() const { return _snapshotsEnabled; }
+  // Latest statistics read back and the simulation step they describe, false if there are none yet
+  bool GetStats(FlockStats &stats, unsigned int &step) const;
+  // Release all scene resources so that it can be initialized again
+  void Release();
   // Return the generic VAO for rendering
   GLuint GetGenericVAO() { return _vao; }
+  // Size of the whole flock
+  unsigned int GetFlockSize() const { return _flockSize; }
 
 private:
-  // Shader data indices for double buffering
+  // Shader data indices for double or triple buffering
   enum ShaderData
   {
-    Flock0, Flock1, NumBuffers
+    Flock0, Flock1, Flock2, NumBuffers
+  };
+
+  // Shader data used by the uniform grid neighbor search, bound from index 4 onwards. Only 8 storage buffer
+  // bindings are guaranteed, the member cells are bound to the position output index while the grid is built
+  enum GridData
+  {
+    Cells, SortedPositions, SortedVelocities, GridStats, MemberCell, NumGridBuffers
   };
 
   // Structure describing light
@@ -83,23 +138,57 @@ private:
   Scene(const Scene &);
   Scene & operator = (const Scene &);
 
+  // Picks the buffers for the next simulation step and makes the previous results visible
+  void RotateBuffers(bool tripleBuffering);
+  // Bins the flock members from the previous frame into the uniform grid
+  void BuildGrid();
+  // Reads back the finished copies, copies the statistics and the snapshot of the step about to run and reduces the
+  // statistics of its input state, never waits for the GPU
+  void UpdateTelemetry();
   // Helper function for updating shader program data
-  void UpdateProgramData(GLuint program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor);
+  void UpdateProgramData(int program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor);
   // Draw cubes
-  void DrawObjects(GLuint program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor);
+  void DrawObjects(int program, const Camera &camera, const glm::vec3 &lightPosition, const glm::vec4 &lightColor);
 
-  // Size of the work group
-  unsigned int _workGroupSize;
-  // Size of the compute shader dispatch
+  // Shadowed OpenGL state of the passes
+  GLState &_glState;
+  // Size of the compute shader dispatch of the brute force and the uniform grid kernels, given by the local sizes
+  // the kernels were linked with
   unsigned int _numWorkGroups;
+  unsigned int _numGridWorkGroups;
   // Size of the whole flock
   unsigned int _flockSize;
-  // Single Storage Buffer for all models used for instance data
-  GLuint _sbo[ShaderData::NumBuffers];
+  // Storage buffers for the flock state, used for simulation and instance data
+  GLuint _sbo[ShaderData::NumBuffers][FlockData::NumFlockStreams] = {0};
+  // Storage buffers for the uniform grid neighbor search
+  GLuint _gridBuffers[GridData::NumGridBuffers] = {0};
+  // Number of simulation steps since Init()
+  unsigned int _step = 0;
+
+  // Are the statistics and the snapshots enabled?
+  bool _statsEnabled = false;
+  bool _snapshotsEnabled = false;
+  // Step whose statistics are in the statistics buffer, there are none if it's not reduced by the previous step
+  unsigned int _statsStep = 0;
+  bool _statsReduced = false;
+  // Copies of the statistics and the flock state in flight and the steps they belong to
+  ReadbackBuffer _statsReadback;
+  ReadbackBuffer _snapshotReadback;
+  std::deque<unsigned int> _statsReadbackSteps;
+  std::deque<unsigned int> _snapshotReadbackSteps;
+  // Latest statistics read back
+  FlockStats _stats;
+  unsigned int _readStatsStep = 0;
+  bool _hasStats = false;
+  // Background thread writing the snapshot to the disk, the next one is read back once it's done
+  std::thread _snapshotWriter;
+  std::atomic<bool> _snapshotWriting{false};
   // Index of the SSBO to be read from
-  unsigned int _previousFrameData;
-  // Index of the SSBO to be written to and rendered from
-  unsigned int _currentFrameData;
+  unsigned int _previousFrameData = ShaderData::Flock0;
+  // Index of the SSBO to be written to
+  unsigned int _currentFrameData = ShaderData::Flock0;
+  // Index of the SSBO to be rendered from
+  unsigned int _renderFrameData = ShaderData::Flock0;
   // The single light object
   Light _light;
   // General use VAO
@@ -5,13 +5,61 @@
 
 #include "shaders.h"
 
+#include <cstdio>
+
+#include <ProgramCache.h>
+#include <ShaderReloader.h>
+
 GLuint shaderProgram[ShaderProgram::NumShaderPrograms] = {0};
+ProgramReflection programReflection[ShaderProgram::NumShaderPrograms];
 
-bool compileShaders()
+// Names of the Uniform enum entries as used in the shaders
+static const char *uniformNames[Uniform::NumUniforms] =
+{
+  "lightPosWS", "viewPosWS", "lightColor", "color", "goal_dt", "cellSize", "numCells", "numPartialSums", "flockSize"
+};
+
+// Program binaries of the previous launch
+static const char programCacheName[] = "08-Flocking.programs";
+
+// Directory with the editable shader files and their names based on the shader enums
+static const char shaderDirectory[] = "08-Flocking.shaders";
+static const char *vsNames[VertexShader::NumVertexShaders] = {"Instancing", "Point", "ScreenQuad"};
+static const char *fsNames[FragmentShader::NumFragmentShaders] = {"Default", "SingleColor", "Null", "Tonemapping"};
+static const char *csNames[ComputeShader::NumComputeShaders] = {"Flocking", "FlockingGrid", "GridCount", "GridPrefixSum", "GridScatter", "FlockStats"};
+
+// Watches the shader files when they're enabled
+static ShaderReloader shaderReloader;
+
+// Local sizes of the kernels iterating over the flock, the grid ones share the same size
+static KernelTuner::Config bruteForceConfig = {256, 1};
+static KernelTuner::Config gridConfig = {256, 1};
+
+// Defines injected to the compute shaders, empty for the kernels with fixed sizes
+static void getComputeDefines(int shader, char defines[], size_t size)
+{
+  switch (shader)
+  {
+  case ComputeShader::Flocking:
+    snprintf(defines, size, "#define WORK_GROUP_SIZE %i\n#define TILE_SIZE %i\n", bruteForceConfig.workGroupSize, bruteForceConfig.tileSize);
+    break;
+  case ComputeShader::FlockingGrid:
+  case ComputeShader::GridCount:
+  case ComputeShader::GridScatter:
+    snprintf(defines, size, "#define WORK_GROUP_SIZE %i\n", gridConfig.workGroupSize);
+    break;
+  default:
+    defines[0] = '\0';
+    break;
+  }
+}
+
+// Compile all shaders and link them into the shader programs
+static bool buildPrograms()
 {
   GLuint vertexShader[VertexShader::NumVertexShaders] = {0};
   GLuint fragmentShader[FragmentShader::NumFragmentShaders] = {0};
-  GLuint computeShader[FragmentShader::NumFragmentShaders] = {0};
+  GLuint computeShader[ComputeShader::NumComputeShaders] = {0};
 
   // Cleanup lambda
   auto cleanUp = [&]()
@@ -77,7 +125,9 @@ bool compileShaders()
   // Compile all compute shaders
   for (int i = 0; i < ComputeShader::NumComputeShaders; ++i)
   {
-    computeShader[i] = ShaderCompiler::CompileShader(csSource, i, GL_COMPUTE_SHADER);
+    char defines[128];
+    getComputeDefines(i, defines, sizeof(defines));
+    computeShader[i] = ShaderCompiler::CompileShader(csSource, i, GL_COMPUTE_SHADER, defines);
     if (!computeShader[i])
     {
       cleanUp();
@@ -94,6 +144,51 @@ bool compileShaders()
     return false;
   }
 
+  // Shader program for flocking simulation using the uniform grid
+  shaderProgram[ShaderProgram::FlockingGrid] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::FlockingGrid], computeShader[ComputeShader::FlockingGrid]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::FlockingGrid]))
+  {
+    cleanUp();
+    return false;
+  }
+
+  // Shader program for counting flock members in the grid cells
+  shaderProgram[ShaderProgram::GridCount] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::GridCount], computeShader[ComputeShader::GridCount]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::GridCount]))
+  {
+    cleanUp();
+    return false;
+  }
+
+  // Shader program for the prefix sum over the grid cells
+  shaderProgram[ShaderProgram::GridPrefixSum] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::GridPrefixSum], computeShader[ComputeShader::GridPrefixSum]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::GridPrefixSum]))
+  {
+    cleanUp();
+    return false;
+  }
+
+  // Shader program for sorting flock members by the grid cells
+  shaderProgram[ShaderProgram::GridScatter] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::GridScatter], computeShader[ComputeShader::GridScatter]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::GridScatter]))
+  {
+    cleanUp();
+    return false;
+  }
+
+  // Shader program for the reduction of the flock statistics
+  shaderProgram[ShaderProgram::FlockStats] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::FlockStats], computeShader[ComputeShader::FlockStats]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::FlockStats]))
+  {
+    cleanUp();
+    return false;
+  }
+
   // Shader program for instanced geometry w/ color
   shaderProgram[ShaderProgram::Instancing] = glCreateProgram();
   glAttachShader(shaderProgram[ShaderProgram::Instancing], vertexShader[VertexShader::Instancing]);
@@ -127,3 +222,125 @@ bool compileShaders()
   cleanUp();
   return true;
 }
+
+// Set up the state of the linked or restored programs
+static void setUpPrograms()
+{
+  // Cache the uniform locations once
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+    programReflection[i].Reflect(shaderProgram[i], uniformNames, Uniform::NumUniforms);
+}
+
+// Rebuild all programs from the current sources, the live programs are kept if it fails
+static bool rebuildPrograms()
+{
+  GLuint livePrograms[ShaderProgram::NumShaderPrograms];
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    livePrograms[i] = shaderProgram[i];
+    shaderProgram[i] = 0;
+  }
+
+  const bool success = buildPrograms();
+
+  // Delete whichever set of programs isn't going to be used
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    if (success)
+    {
+      glDeleteProgram(livePrograms[i]);
+    }
+    else
+    {
+      glDeleteProgram(shaderProgram[i]);
+      shaderProgram[i] = livePrograms[i];
+    }
+  }
+
+  if (!success)
+  {
+    printf("Failed to rebuild the shaders, keeping the previous programs!\n");
+    return false;
+  }
+
+  setUpPrograms();
+  return true;
+}
+
+bool compileShaders()
+{
+  // Reuse the programs of the previous launch if neither the sources nor the driver changed
+  ProgramCache programCache;
+  programCache.AddSources(vsSource, VertexShader::NumVertexShaders);
+  programCache.AddSources(fsSource, FragmentShader::NumFragmentShaders);
+  programCache.AddSources(csSource, ComputeShader::NumComputeShaders);
+  programCache.AddData(&bruteForceConfig, sizeof(bruteForceConfig));
+  programCache.AddData(&gridConfig, sizeof(gridConfig));
+
+  if (!programCache.Load(programCacheName, shaderProgram, ShaderProgram::NumShaderPrograms))
+  {
+    if (!buildPrograms())
+      return false;
+
+    programCache.Save(programCacheName, shaderProgram, ShaderProgram::NumShaderPrograms);
+  }
+
+  setUpPrograms();
+  return true;
+}
+
+void toggleShaderFiles()
+{
+  // Register the source tables the first time
+  static bool watching = false;
+  if (!watching)
+  {
+    shaderReloader.Watch(vsSource, vsNames, VertexShader::NumVertexShaders, ".vert");
+    shaderReloader.Watch(fsSource, fsNames, FragmentShader::NumFragmentShaders, ".frag");
+    shaderReloader.Watch(csSource, csNames, ComputeShader::NumComputeShaders, ".comp");
+    watching = true;
+  }
+
+  if (shaderReloader.IsEnabled())
+    shaderReloader.Disable();
+  else if (!shaderReloader.Enable(shaderDirectory))
+    return;
+
+  if (rebuildPrograms())
+    printf("Shaders rebuilt.\n");
+}
+
+void updateShaderFiles()
+{
+  if (shaderReloader.Update() && rebuildPrograms())
+    printf("Shaders rebuilt.\n");
+}
+
+bool setKernelConfig(const KernelTuner::Config &bruteForce, const KernelTuner::Config &grid)
+{
+  const KernelTuner::Config previousBruteForce = bruteForceConfig;
+  const KernelTuner::Config previousGrid = gridConfig;
+  bruteForceConfig = bruteForce;
+  gridConfig = grid;
+
+  // Nothing built yet, compileShaders() picks the sizes up
+  if (!shaderProgram[ShaderProgram::Flocking])
+    return true;
+
+  // The live programs are kept on failure, so are their sizes
+  if (!rebuildPrograms())
+  {
+    bruteForceConfig = previousBruteForce;
+    gridConfig = previousGrid;
+    return false;
+  }
+
+  return true;
+}
+
+unsigned int getWorkGroupSize(int program)
+{
+  GLint size[3] = {0, 0, 0};
+  glGetProgramiv(shaderProgram[program], GL_COMPUTE_WORK_GROUP_SIZE, size);
+  return (unsigned int)size[0];
+}
@@ -5,6 +5,8 @@
 
 #pragma once
 
+#include <KernelTuner.h>
+#include <ProgramReflection.h>
 #include <ShaderCompiler.h>
 
 // Shader programs
@@ -12,15 +14,36 @@ namespace ShaderProgram
 {
   enum
   {
-    Instancing, Flocking, PointRendering, Tonemapping, NumShaderPrograms
+    Instancing, Flocking, FlockingGrid, GridCount, GridPrefixSum, GridScatter, FlockStats, PointRendering, Tonemapping, NumShaderPrograms
   };
 }
 
 // Shader programs handle
 extern GLuint shaderProgram[ShaderProgram::NumShaderPrograms];
 
+// Uniforms looked up by name
+namespace Uniform
+{
+  enum
+  {
+    LightPosWS, ViewPosWS, LightColor, PointColor, GoalDt, CellSize, NumCells, NumPartialSums, FlockSize, NumUniforms
+  };
+}
+
+// Cached uniform locations of the shader programs
+extern ProgramReflection programReflection[ShaderProgram::NumShaderPrograms];
+
 // Helper function for creating and compiling the shaders
 bool compileShaders();
+// Set the work group sizes of the kernels iterating over the flock, the brute force one also fetches tileSize members per
+// invocation to its shared cache, injected as #defines and rebuilds the programs if they're built already
+bool setKernelConfig(const KernelTuner::Config &bruteForce, const KernelTuner::Config &grid);
+// Local size the compute program was linked with
+unsigned int getWorkGroupSize(int program);
+// Switch between the built-in shader sources and the files in the 08-Flocking.shaders directory, rebuilds the programs
+void toggleShaderFiles();
+// Rebuild the programs when the shader files change, the live programs are kept if the new ones fail to link
+void updateShaderFiles();
 
 // ============================================================================
 
@@ -50,21 +73,17 @@ layout (location = 2) uniform mat4 modelToWorld;
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 
-// Structure holding per instance data
-struct InstanceData
+// Flock member positions and velocities using interface block syntax
+layout (std430, binding = 0) readonly buffer PositionBuffer
 {
-  // Model to world transformation
-  mat4 modelToWorld;
-  // Velocity - unused in the vertex shader
-  vec4 velocity;
-};
+  // Only one variable length array allowed inside the storage buffer block
+  vec4 position[];
+} positionBuffer;
 
-// Storage buffer used for instances using interface block syntax
-layout (binding = 0) buffer InstanceBuffer
+layout (std430, binding = 1) readonly buffer VelocityBuffer
 {
-  // Only one variable length array allowed inside the storage buffer block
-  InstanceData data[];
-} instanceBuffer;
+  vec4 velocity[];
+} velocityBuffer;
 
 // Vertex output
 out VertexData
@@ -86,15 +105,19 @@ vec3 generateColor(float f)
 
 void main()
 {
-  // Retrieve the model to world matrix from the instance buffer
-  mat4 modelToWorld = instanceBuffer.data[gl_InstanceID].modelToWorld;
+  // Rebuild the model to world matrix from the velocity: aside, up, direction, position
+  vec3 direction = normalize(velocityBuffer.velocity[gl_InstanceID].xyz);
+  vec3 aside = cross(vec3(0.0f, 1.0f, 0.0f), direction);
+  // Pick another axis when flying straight up or down
+  aside = (dot(aside, aside) > 1e-6f) ? normalize(aside) : vec3(1.0f, 0.0f, 0.0f);
+  vec3 up = cross(direction, aside);
+  mat3 rotation = mat3(aside, up, direction);
 
-  // Construct the normal transformation matrix and transform normal
-  mat3 normalTransform = mat3(transpose(inverse(modelToWorld)));
-  v.Normal = normalize(normalTransform * normal);
+  // The basis is orthonormal, normals can therefore be transformed by the rotation directly
+  v.Normal = rotation * normal;
 
   // Transform vertex position
-  v.WorldPos = modelToWorld * vec4(position.xyz, 1.0f);
+  v.WorldPos = vec4(rotation * position + positionBuffer.position[gl_InstanceID].xyz, 1.0f);
   gl_Position = projection * worldToView * v.WorldPos;
 
   // Generate color based on instance ID
@@ -301,7 +324,7 @@ namespace ComputeShader
 {
 enum
 {
-  Flocking, NumComputeShaders
+  Flocking, FlockingGrid, GridCount, GridPrefixSum, GridScatter, FlockStats, NumComputeShaders
 };
 }
 
@@ -332,8 +355,17 @@ R"(
 //          gl_LocalInvocationID.x;
 // ----------------------------------------------------------------------------
 
-// Local work group size, i.e., how many invocations per work group
-layout (local_size_x = 256) in;
+// Local work group size, i.e., how many invocations per work group, injected by the application
+#ifndef WORK_GROUP_SIZE
+#define WORK_GROUP_SIZE 256
+#endif
+layout (local_size_x = WORK_GROUP_SIZE) in;
+
+// Number of flock members each invocation fetches to the shared cache at once, injected by the application
+#ifndef TILE_SIZE
+#define TILE_SIZE 1
+#endif
+const uint cacheSize = gl_WorkGroupSize.x * uint(TILE_SIZE);
 
 // How close can flock members get together (squared)
 uniform float closestDistanceSq = 50.0;
@@ -344,29 +376,43 @@ uniform vec4 ruleWeights = vec4(0.18f, 0.05f, 0.17f, 0.02f);
 // Goal position which the flock will chase, timestep packed in the last component
 uniform vec4 goal_dt;
 
-// Structured buffer record
-struct FlockMember
+// Input structured buffers - previous frame state, stored as separate arrays
+layout (std430, binding = 0) readonly buffer PositionIn
 {
-  // Model to world transformation matrix
-  mat4 transformation;
-  // Velocity
-  vec4 velocity;
-};
+  vec4 position[];
+} positionIn;
 
-// Input structured buffer - previous frame state
-layout (binding = 0) readonly buffer FlockIn
+layout (std430, binding = 1) readonly buffer VelocityIn
 {
-  FlockMember member[];
-} inputData;
+  vec4 velocity[];
+} velocityIn;
 
-// Output structured buffer - current frame state (will be rendered)
-layout (binding = 1) buffer FlockOut
+// Output structured buffers - current frame state (will be rendered)
+layout (std430, binding = 2) writeonly buffer PositionOut
 {
-  FlockMember member[];
-} outputData;
+  vec4 position[];
+} positionOut;
 
-// Workgroup shared storage (faster access than global memory, e.g., FlockIn buffer)
-shared FlockMember membersCache[gl_WorkGroupSize.x];
+layout (std430, binding = 3) writeonly buffer VelocityOut
+{
+  vec4 velocity[];
+} velocityOut;
+
+// Flock statistics at the start of the grid statistics buffer, we only count the members closer to another one than closestDistance
+layout (std430, binding = 7) buffer FlockStats
+{
+  vec4 center;
+  vec4 boundsMin;
+  vec4 boundsMax;
+  vec4 speed;
+  uint numCollisions;
+} flockStats;
+
+// Workgroup shared storage (faster access than global memory, e.g., PositionIn buffer)
+shared vec3 positionCache[cacheSize];
+shared vec3 velocityCache[cacheSize];
+// Members of the work group too close to another one
+shared uint numCollisions;
 
 // Rule #1: do not collide with others
 vec3 collisionAvoidance(vec3 myPosition, vec3 myVelocity, vec3 otherPosition, vec3 otherVelocity)
@@ -391,39 +437,59 @@ vec3 followOthers(vec3 myPosition, vec3 myVelocity, vec3 otherPosition, vec3 oth
 }
 
 // For each member of the flock, we need to check all others, instead of reading
-// straight from the input buffer, we'll cache the data in WorkGroupSize chunks
-// to a shared local workgroup memory
+// straight from the input buffer, we'll cache the data in WorkGroupSize * TILE_SIZE
+// chunks to a shared local workgroup memory
 void main()
 {
+  uint flockSize = gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+
   // Fetch our data from global memory
-  FlockMember me = inputData.member[gl_GlobalInvocationID.x];
+  vec3 myPosition = positionIn.position[gl_GlobalInvocationID.x].xyz;
+  vec3 myVelocity = velocityIn.velocity[gl_GlobalInvocationID.x].xyz;
 
   // Our acceleration
   vec3 acceleration = vec3(0.0f);
   // Flock center
   vec3 flockCenter = vec3(0.0f);
+  // Are we too close to anyone?
+  bool collision = false;
+  if (gl_LocalInvocationID.x == 0)
+    numCollisions = 0;
 
-  // Iterate over all work groups
-  for (uint groupId = 0; groupId < gl_NumWorkGroups.x; ++groupId)
+  // Iterate over all tiles of the flock, the last one may be partial
+  for (uint tileStart = 0; tileStart < flockSize; tileStart += cacheSize)
   {
-    // Fetch one data member from global memory and put it in shared local cache
-    membersCache[gl_LocalInvocationID.x] = inputData.member[groupId * gl_WorkGroupSize.x + gl_LocalInvocationID.x];
+    // Fetch TILE_SIZE data members from global memory and put them in shared local cache
+    for (uint i = 0; i < TILE_SIZE; ++i)
+    {
+      uint cacheId = i * gl_WorkGroupSize.x + gl_LocalInvocationID.x;
+      uint otherId = tileStart + cacheId;
+      if (otherId < flockSize)
+      {
+        positionCache[cacheId] = positionIn.position[otherId].xyz;
+        velocityCache[cacheId] = velocityIn.velocity[otherId].xyz;
+      }
+    }
 
     // Wait until the whole work group fetched the data
     memoryBarrierShared();
     barrier();
 
     // Iterate over the local cache to apply first two flocking rules
-    for (uint localId = 0; localId < gl_WorkGroupSize.x; ++localId)
+    uint tileCount = min(cacheSize, flockSize - tileStart);
+    for (uint localId = 0; localId < tileCount; ++localId)
     {
-      FlockMember other = membersCache[localId];
-      flockCenter += other.transformation[3].xyz;
+      vec3 otherPosition = positionCache[localId];
+      vec3 otherVelocity = velocityCache[localId];
+      flockCenter += otherPosition;
 
       // Make sure we discard ourselves
-      if (groupId * gl_WorkGroupSize.x + localId != gl_GlobalInvocationID.x)
+      if (tileStart + localId != gl_GlobalInvocationID.x)
       {
-        acceleration += collisionAvoidance(me.transformation[3].xyz, me.velocity.xyz, other.transformation[3].xyz, other.velocity.xyz) * ruleWeights.x;
-        acceleration += followOthers(me.transformation[3].xyz, me.velocity.xyz, other.transformation[3].xyz, other.velocity.xyz) * ruleWeights.y;
+        vec3 d = myPosition - otherPosition;
+        collision = collision || (dot(d, d) < closestDistanceSq);
+        acceleration += collisionAvoidance(myPosition, myVelocity, otherPosition, otherVelocity) * ruleWeights.x;
+        acceleration += followOthers(myPosition, myVelocity, otherPosition, otherVelocity) * ruleWeights.y;
       }
     }
 
@@ -431,34 +497,572 @@ void main()
     barrier();
   }
 
+  // Count the collisions of the work group, the shared counter is cleared before the barriers in the loop
+  if (collision)
+    atomicAdd(numCollisions, 1u);
+  memoryBarrierShared();
+  barrier();
+  if (gl_LocalInvocationID.x == 0 && numCollisions > 0)
+    atomicAdd(flockStats.numCollisions, numCollisions);
+
+  // Finish the update: Rule #3: follow common goal, Rule #4: try to reach flock center
+  flockCenter /= float(flockSize);
+  acceleration += normalize(goal_dt.xyz - myPosition) * ruleWeights.z;
+  acceleration += normalize(flockCenter - myPosition) * ruleWeights.w;
+
+  // Update the new position and velocity
+  vec3 position = myPosition + myVelocity * goal_dt.w;
+  vec3 velocity = myVelocity + acceleration * goal_dt.w;
+  float speed = length(velocity);
+  if (speed > maxSpeed)
+  {
+    velocity *= maxSpeed / speed;
+  }
+
+  // Write out to the output buffers, orientation is rebuilt from the velocity when rendering
+  positionOut.position[gl_GlobalInvocationID.x] = vec4(position, 1.0f);
+  velocityOut.velocity[gl_GlobalInvocationID.x] = vec4(velocity, 0.0f);
+}
+)",
+// ----------------------------------------------------------------------------
+// Uniform grid flocking compute shader source
+// ----------------------------------------------------------------------------
+R"(
+#version 460 core
+
+// Local work group size, i.e., how many invocations per work group, injected by the application
+#ifndef WORK_GROUP_SIZE
+#define WORK_GROUP_SIZE 256
+#endif
+layout (local_size_x = WORK_GROUP_SIZE) in;
+
+// How close can flock members get together (squared)
+uniform float closestDistanceSq = 50.0;
+// Maximum allowed speed
+uniform float maxSpeed = 10.0f;
+// Weight rules
+uniform vec4 ruleWeights = vec4(0.18f, 0.05f, 0.17f, 0.02f);
+// Goal position which the flock will chase, timestep packed in the last component
+uniform vec4 goal_dt;
+// Size of a single grid cell, i.e., the radius of the neighborhood
+uniform float cellSize;
+// Number of cells of the hashed grid, power of two
+uniform uint numCells;
+
+// Input structured buffers - previous frame state, stored as separate arrays
+layout (std430, binding = 0) readonly buffer PositionIn
+{
+  vec4 position[];
+} positionIn;
+
+layout (std430, binding = 1) readonly buffer VelocityIn
+{
+  vec4 velocity[];
+} velocityIn;
+
+// Output structured buffers - current frame state (will be rendered)
+layout (std430, binding = 2) writeonly buffer PositionOut
+{
+  vec4 position[];
+} positionOut;
+
+layout (std430, binding = 3) writeonly buffer VelocityOut
+{
+  vec4 velocity[];
+} velocityOut;
+
+// Number of flock members in each cell and index of the first one in the sorted buffers
+layout (std430, binding = 4) readonly buffer Cells
+{
+  uvec2 countStart[];
+} cells;
+
+// Previous frame state sorted by cells
+layout (std430, binding = 5) readonly buffer SortedPositions
+{
+  vec4 position[];
+} sortedPositions;
+
+layout (std430, binding = 6) readonly buffer SortedVelocities
+{
+  vec4 velocity[];
+} sortedVelocities;
+
+// Flock statistics, we only count the members closer to another one than closestDistance and read the flock center
+// reduced by the grid prefix sum
+layout (std430, binding = 7) buffer FlockStats
+{
+  vec4 center;
+  vec4 boundsMin;
+  vec4 boundsMax;
+  vec4 speed;
+  uint numCollisions;
+} flockStats;
+
+// Members of the work group too close to another one
+shared uint numCollisions;
+
+// Maps cell coordinates to the hashed grid
+uint cellHash(ivec3 cell)
+{
+  uint h = (uint(cell.x) * 73856093u) ^ (uint(cell.y) * 19349663u) ^ (uint(cell.z) * 83492791u);
+  return h & (numCells - 1u);
+}
+
+// Rule #1: do not collide with others
+vec3 collisionAvoidance(vec3 myPosition, vec3 myVelocity, vec3 otherPosition, vec3 otherVelocity)
+{
+  // Pull away when too close
+  vec3 d = myPosition - otherPosition;
+  if (dot(d, d) < closestDistanceSq)
+    return d;
+
+  return vec3(0.0f);
+}
+
+// Rule #2: fly in the general direction as others
+vec3 followOthers(vec3 myPosition, vec3 myVelocity, vec3 otherPosition, vec3 otherVelocity)
+{
+  const float epsilonSq = 10.0f;
+  vec3 d = otherPosition - myPosition;
+  vec3 dv = otherVelocity - myVelocity;
+
+  // Take acceleration as velocity difference modulated by distance, prevent it from getting too large
+  return dv / (dot(d, d) + epsilonSq);
+}
+
+// Same rules as the brute force kernel, but the first two are only applied to
+// the flock members from the 27 neighboring cells that lie within cellSize
+void main()
+{
+  // Fetch our data from global memory
+  vec3 myPosition = positionIn.position[gl_GlobalInvocationID.x].xyz;
+  vec3 myVelocity = velocityIn.velocity[gl_GlobalInvocationID.x].xyz;
+  ivec3 myCell = ivec3(floor(myPosition / cellSize));
+  float neighborhoodSq = cellSize * cellSize;
+
+  // Our acceleration
+  vec3 acceleration = vec3(0.0f);
+  // Are we too close to anyone? We can't tell ourselves from a member at the very same position
+  bool collision = false;
+  if (gl_LocalInvocationID.x == 0)
+    numCollisions = 0;
+  memoryBarrierShared();
+  barrier();
+
+  // Hashed cells we've already visited, different cells may share the same hash
+  uint visited[27];
+  uint numVisited = 0;
+
+  for (int z = -1; z <= 1; ++z)
+  for (int y = -1; y <= 1; ++y)
+  for (int x = -1; x <= 1; ++x)
+  {
+    uint cell = cellHash(myCell + ivec3(x, y, z));
+
+    // Skip hash collisions within the neighborhood
+    bool duplicate = false;
+    for (uint i = 0; i < numVisited; ++i)
+      duplicate = duplicate || (visited[i] == cell);
+    if (duplicate)
+      continue;
+    visited[numVisited++] = cell;
+
+    // Iterate over all the flock members in the cell, note that we don't need to discard
+    // ourselves as both rules yield zero acceleration for the same position and velocity
+    uvec2 countStart = cells.countStart[cell];
+    for (uint i = countStart.y; i < countStart.y + countStart.x; ++i)
+    {
+      vec3 otherPosition = sortedPositions.position[i].xyz;
+      vec3 d = otherPosition - myPosition;
+      float distanceSq = dot(d, d);
+      collision = collision || (distanceSq > 0.0f && distanceSq < closestDistanceSq);
+      if (distanceSq < neighborhoodSq)
+      {
+        vec3 otherVelocity = sortedVelocities.velocity[i].xyz;
+        acceleration += collisionAvoidance(myPosition, myVelocity, otherPosition, otherVelocity) * ruleWeights.x;
+        acceleration += followOthers(myPosition, myVelocity, otherPosition, otherVelocity) * ruleWeights.y;
+      }
+    }
+  }
+
+  // Count the collisions of the work group
+  if (collision)
+    atomicAdd(numCollisions, 1u);
+  memoryBarrierShared();
+  barrier();
+  if (gl_LocalInvocationID.x == 0 && numCollisions > 0)
+    atomicAdd(flockStats.numCollisions, numCollisions);
+
   // Finish the update: Rule #3: follow common goal, Rule #4: try to reach flock center
-  flockCenter /= float(gl_NumWorkGroups.x * gl_WorkGroupSize.x);
-  acceleration += normalize(goal_dt.xyz - me.transformation[3].xyz) * ruleWeights.z;
-  acceleration += normalize(flockCenter - me.transformation[3].xyz) * ruleWeights.w;
+  acceleration += normalize(goal_dt.xyz - myPosition) * ruleWeights.z;
+  acceleration += normalize(flockStats.center.xyz - myPosition) * ruleWeights.w;
 
   // Update the new position and velocity
-  vec3 position = me.transformation[3].xyz + me.velocity.xyz * goal_dt.w;
-  vec3 velocity = me.velocity.xyz + acceleration * goal_dt.w;
+  vec3 position = myPosition + myVelocity * goal_dt.w;
+  vec3 velocity = myVelocity + acceleration * goal_dt.w;
   float speed = length(velocity);
-  vec3 direction = velocity / speed;
   if (speed > maxSpeed)
   {
-    velocity = direction * maxSpeed;
+    velocity *= maxSpeed / speed;
+  }
+
+  // Write out to the output buffers, orientation is rebuilt from the velocity when rendering
+  positionOut.position[gl_GlobalInvocationID.x] = vec4(position, 1.0f);
+  velocityOut.velocity[gl_GlobalInvocationID.x] = vec4(velocity, 0.0f);
+}
+)",
+// ----------------------------------------------------------------------------
+// Grid cell count compute shader source
+// ----------------------------------------------------------------------------
+R"(
+#version 460 core
+
+// Local work group size, i.e., how many invocations per work group, injected by the application
+#ifndef WORK_GROUP_SIZE
+#define WORK_GROUP_SIZE 256
+#endif
+layout (local_size_x = WORK_GROUP_SIZE) in;
+
+// Number of bins of the speed histogram, part of the statistics
+#define NUM_SPEED_BINS 16
+
+// Size of a single grid cell, i.e., the radius of the neighborhood
+uniform float cellSize;
+// Number of cells of the hashed grid, power of two
+uniform uint numCells;
+
+// Input structured buffer - previous frame positions
+layout (std430, binding = 0) readonly buffer PositionIn
+{
+  vec4 position[];
+} positionIn;
+
+// Number of flock members in each cell, cleared before the dispatch
+layout (std430, binding = 4) buffer Cells
+{
+  uvec2 countStart[];
+} cells;
+
+// Cell of each flock member and its offset within the cell, borrows the position output index
+layout (std430, binding = 2) writeonly buffer MemberCell
+{
+  uvec2 cell[];
+} memberCell;
+
+// Flock statistics followed by the partial sums of the positions, see the statistics shader
+layout (std430, binding = 7) writeonly buffer FlockStats
+{
+  vec4 center;
+  vec4 boundsMin;
+  vec4 boundsMax;
+  vec4 speed;
+  uint numCollisions;
+  uint speedHistogram[NUM_SPEED_BINS];
+  vec4 partialSum[];
+} flockStats;
+
+// Workgroup shared storage for the reduction of the positions
+shared vec3 positionCache[gl_WorkGroupSize.x];
+
+// Maps cell coordinates to the hashed grid
+uint cellHash(ivec3 cell)
+{
+  uint h = (uint(cell.x) * 73856093u) ^ (uint(cell.y) * 19349663u) ^ (uint(cell.z) * 83492791u);
+  return h & (numCells - 1u);
+}
+
+void main()
+{
+  vec3 position = positionIn.position[gl_GlobalInvocationID.x].xyz;
+
+  // Insert ourselves to the cell, the returned counter value is our offset within the cell
+  uint cell = cellHash(ivec3(floor(position / cellSize)));
+  uint offset = atomicAdd(cells.countStart[cell].x, 1u);
+  memberCell.cell[gl_GlobalInvocationID.x] = uvec2(cell, offset);
+
+  // Sum the positions within the work group for the flock center
+  positionCache[gl_LocalInvocationID.x] = position;
+  memoryBarrierShared();
+  barrier();
+
+  for (uint stride = gl_WorkGroupSize.x / 2; stride > 0; stride >>= 1)
+  {
+    if (gl_LocalInvocationID.x < stride)
+      positionCache[gl_LocalInvocationID.x] += positionCache[gl_LocalInvocationID.x + stride];
+
+    memoryBarrierShared();
+    barrier();
+  }
+
+  if (gl_LocalInvocationID.x == 0)
+    flockStats.partialSum[gl_WorkGroupID.x] = vec4(positionCache[0], 0.0f);
+}
+)",
+// ----------------------------------------------------------------------------
+// Grid prefix sum compute shader source, dispatched as a single work group
+// ----------------------------------------------------------------------------
+R"(
+#version 460 core
+
+// Local work group size, i.e., how many invocations per work group
+layout (local_size_x = 1024) in;
+
+// Number of bins of the speed histogram, part of the statistics
+#define NUM_SPEED_BINS 16
+
+// Number of cells of the hashed grid, power of two
+uniform uint numCells;
+// Number of partial sums written by the cell count pass
+uniform uint numPartialSums;
+// Size of the whole flock
+uniform uint flockSize;
+
+// Number of flock members in each cell, we fill in the index of the first one
+layout (std430, binding = 4) buffer Cells
+{
+  uvec2 countStart[];
+} cells;
+
+// Flock statistics followed by the partial sums of the positions, see the statistics shader
+layout (std430, binding = 7) buffer FlockStats
+{
+  vec4 center;
+  vec4 boundsMin;
+  vec4 boundsMax;
+  vec4 speed;
+  uint numCollisions;
+  uint speedHistogram[NUM_SPEED_BINS];
+  vec4 partialSum[];
+} flockStats;
+
+// Workgroup shared storage for the scan and the reduction
+shared uint scanCache[gl_WorkGroupSize.x];
+shared vec3 centerCache[gl_WorkGroupSize.x];
+
+void main()
+{
+  // Each invocation scans a contiguous chunk of cells
+  uint chunk = (numCells + gl_WorkGroupSize.x - 1) / gl_WorkGroupSize.x;
+  uint first = min(gl_LocalInvocationID.x * chunk, numCells);
+  uint last = min(first + chunk, numCells);
+
+  uint sum = 0;
+  for (uint i = first; i < last; ++i)
+    sum += cells.countStart[i].x;
+  scanCache[gl_LocalInvocationID.x] = sum;
+
+  // Gather the partial sums of the positions
+  vec3 center = vec3(0.0f);
+  for (uint i = gl_LocalInvocationID.x; i < numPartialSums; i += gl_WorkGroupSize.x)
+    center += flockStats.partialSum[i].xyz;
+  centerCache[gl_LocalInvocationID.x] = center;
+
+  memoryBarrierShared();
+  barrier();
+
+  // Inclusive scan of the chunk sums over the work group
+  for (uint offset = 1; offset < gl_WorkGroupSize.x; offset <<= 1)
+  {
+    uint value = (gl_LocalInvocationID.x >= offset) ? scanCache[gl_LocalInvocationID.x - offset] : 0u;
+    memoryBarrierShared();
+    barrier();
+
+    scanCache[gl_LocalInvocationID.x] += value;
+    memoryBarrierShared();
+    barrier();
+  }
+
+  // Write out the exclusive prefix sum for our chunk
+  uint start = scanCache[gl_LocalInvocationID.x] - sum;
+  for (uint i = first; i < last; ++i)
+  {
+    cells.countStart[i].y = start;
+    start += cells.countStart[i].x;
+  }
+
+  // Reduce the positions to the flock center
+  for (uint stride = gl_WorkGroupSize.x / 2; stride > 0; stride >>= 1)
+  {
+    if (gl_LocalInvocationID.x < stride)
+      centerCache[gl_LocalInvocationID.x] += centerCache[gl_LocalInvocationID.x + stride];
+
+    memoryBarrierShared();
+    barrier();
+  }
+
+  if (gl_LocalInvocationID.x == 0)
+    flockStats.center = vec4(centerCache[0] / float(flockSize), 1.0f);
+}
+)",
+// ----------------------------------------------------------------------------
+// Grid scatter compute shader source
+// ----------------------------------------------------------------------------
+R"(
+#version 460 core
+
+// Local work group size, i.e., how many invocations per work group, injected by the application
+#ifndef WORK_GROUP_SIZE
+#define WORK_GROUP_SIZE 256
+#endif
+layout (local_size_x = WORK_GROUP_SIZE) in;
+
+// Input structured buffers - previous frame state
+layout (std430, binding = 0) readonly buffer PositionIn
+{
+  vec4 position[];
+} positionIn;
+
+layout (std430, binding = 1) readonly buffer VelocityIn
+{
+  vec4 velocity[];
+} velocityIn;
+
+// Number of flock members in each cell and index of the first one in the sorted buffers
+layout (std430, binding = 4) readonly buffer Cells
+{
+  uvec2 countStart[];
+} cells;
+
+// Cell of each flock member and its offset within the cell, borrows the position output index
+layout (std430, binding = 2) readonly buffer MemberCell
+{
+  uvec2 cell[];
+} memberCell;
+
+// Previous frame state sorted by cells
+layout (std430, binding = 5) writeonly buffer SortedPositions
+{
+  vec4 position[];
+} sortedPositions;
+
+layout (std430, binding = 6) writeonly buffer SortedVelocities
+{
+  vec4 velocity[];
+} sortedVelocities;
+
+void main()
+{
+  // Copy ourselves to our slot within the cell so that neighbors are read coherently
+  uvec2 cell = memberCell.cell[gl_GlobalInvocationID.x];
+  uint index = cells.countStart[cell.x].y + cell.y;
+  sortedPositions.position[index] = positionIn.position[gl_GlobalInvocationID.x];
+  sortedVelocities.velocity[index] = velocityIn.velocity[gl_GlobalInvocationID.x];
+}
+)",
+// ----------------------------------------------------------------------------
+// Flock statistics compute shader source, dispatched as a single work group
+// ----------------------------------------------------------------------------
+R"(
+#version 460 core
+
+// Local work group size, i.e., how many invocations per work group
+layout (local_size_x = 256) in;
+
+// Number of bins of the speed histogram
+#define NUM_SPEED_BINS 16
+
+// Maximum allowed speed, the histogram covers [0, maxSpeed]
+uniform float maxSpeed = 10.0f;
+// Size of the whole flock
+uniform uint flockSize;
+
+// Input structured buffers - state the simulation step starts from
+layout (std430, binding = 0) readonly buffer PositionIn
+{
+  vec4 position[];
+} positionIn;
+
+layout (std430, binding = 1) readonly buffer VelocityIn
+{
+  vec4 velocity[];
+} velocityIn;
+
+// Flock statistics at the start of the grid statistics buffer, the collisions are counted by the simulation step
+// that follows
+layout (std430, binding = 7) writeonly buffer FlockStats
+{
+  vec4 center;
+  vec4 boundsMin;
+  vec4 boundsMax;
+  // Minimum, maximum, mean, and standard deviation of the speed
+  vec4 speed;
+  uint numCollisions;
+  uint speedHistogram[NUM_SPEED_BINS];
+} flockStats;
+
+// Workgroup shared storage for the reduction
+shared vec3 sumCache[gl_WorkGroupSize.x];
+shared vec3 minCache[gl_WorkGroupSize.x];
+shared vec3 maxCache[gl_WorkGroupSize.x];
+// Minimum, maximum, sum, and sum of squares of the speed
+shared vec4 speedCache[gl_WorkGroupSize.x];
+shared uint histogram[NUM_SPEED_BINS];
+
+void main()
+{
+  if (gl_LocalInvocationID.x < NUM_SPEED_BINS)
+    histogram[gl_LocalInvocationID.x] = 0u;
+  memoryBarrierShared();
+  barrier();
+
+  // Each invocation goes through every WorkGroupSize-th member of the flock
+  vec3 sum = vec3(0.0f);
+  vec3 minPosition = vec3(1e30f);
+  vec3 maxPosition = vec3(-1e30f);
+  vec4 speedSum = vec4(1e30f, 0.0f, 0.0f, 0.0f);
+  for (uint i = gl_LocalInvocationID.x; i < flockSize; i += gl_WorkGroupSize.x)
+  {
+    vec3 position = positionIn.position[i].xyz;
+    sum += position;
+    minPosition = min(minPosition, position);
+    maxPosition = max(maxPosition, position);
+
+    float speed = length(velocityIn.velocity[i].xyz);
+    speedSum = vec4(min(speedSum.x, speed), max(speedSum.y, speed), speedSum.z + speed, speedSum.w + speed * speed);
+    uint bin = min(uint(speed / maxSpeed * NUM_SPEED_BINS), NUM_SPEED_BINS - 1u);
+    atomicAdd(histogram[bin], 1u);
   }
 
-  // Prepare the output data
-  FlockMember newMe;
-  newMe.velocity = vec4(velocity, 1.0f);
+  sumCache[gl_LocalInvocationID.x] = sum;
+  minCache[gl_LocalInvocationID.x] = minPosition;
+  maxCache[gl_LocalInvocationID.x] = maxPosition;
+  speedCache[gl_LocalInvocationID.x] = speedSum;
+  memoryBarrierShared();
+  barrier();
+
+  for (uint stride = gl_WorkGroupSize.x / 2; stride > 0; stride >>= 1)
+  {
+    if (gl_LocalInvocationID.x < stride)
+    {
+      uint other = gl_LocalInvocationID.x + stride;
+      sumCache[gl_LocalInvocationID.x] += sumCache[other];
+      minCache[gl_LocalInvocationID.x] = min(minCache[gl_LocalInvocationID.x], minCache[other]);
+      maxCache[gl_LocalInvocationID.x] = max(maxCache[gl_LocalInvocationID.x], maxCache[other]);
+      vec4 a = speedCache[gl_LocalInvocationID.x];
+      vec4 b = speedCache[other];
+      speedCache[gl_LocalInvocationID.x] = vec4(min(a.x, b.x), max(a.y, b.y), a.zw + b.zw);
+    }
+
+    memoryBarrierShared();
+    barrier();
+  }
 
-  // Update the transformation matrix (aside, up, direction, position)
-  newMe.transformation[0] = vec4(normalize(cross(me.transformation[1].xyz, direction)), 0.0f);
-  newMe.transformation[1] = vec4(normalize(cross(direction, newMe.transformation[0].xyz)), 0.0f);
-  newMe.transformation[2] = vec4(direction, 0.0f);
-  newMe.transformation[3] = vec4(position, 1.0f);
+  if (gl_LocalInvocationID.x < NUM_SPEED_BINS)
+    flockStats.speedHistogram[gl_LocalInvocationID.x] = histogram[gl_LocalInvocationID.x];
 
-  // Write out to the output buffer
-  outputData.member[gl_GlobalInvocationID.x] = newMe;
+  if (gl_LocalInvocationID.x == 0)
+  {
+    float n = float(flockSize);
+    vec4 speed = speedCache[0];
+    float mean = speed.z / n;
+    flockStats.center = vec4(sumCache[0] / n, 1.0f);
+    flockStats.boundsMin = vec4(minCache[0], 1.0f);
+    flockStats.boundsMax = vec4(maxCache[0], 1.0f);
+    flockStats.speed = vec4(speed.x, speed.y, mean, sqrt(max(speed.w / n - mean * mean, 0.0f)));
+    flockStats.numCollisions = 0u;
+  }
 }
 )",
 ""
-};
\ No newline at end of file
+};
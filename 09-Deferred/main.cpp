@@ -3,7 +3,9 @@
  * Licensed under the zlib license, see LICENSE.txt in the root directory.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -12,6 +14,14 @@
 
 #include <MathSupport.h>
 #include <Camera.h>
+#include <DynamicResolution.h>
+#include <FrameGraph.h>
+#include <GLState.h>
+#include <GpuMemory.h>
+#include <JobSystem.h>
+#include <Profiler.h>
+#include <Benchmark.h>
+#include <AutoExposure.h>
 
 #include "shaders.h"
 #include "scene.h"
@@ -95,16 +105,24 @@ Camera camera;
 // Scene helper instance
 Scene &scene(Scene::GetInstance());
 // Render modes
-RenderMode renderMode = {true, DisplayMode::Default};
+#if _ALLOW_TILED_LIGHTING
+RenderMode renderMode = {true, DisplayMode::Default, LightingMode::Tiled};
+#else
+RenderMode renderMode = {true, DisplayMode::Default, LightingMode::Volumes};
+#endif
 // Enable/disable light movement
 bool animate = false;
-// All render targets that will be used
+// Animate and classify the lights on the GPU when it's supported
+bool gpuLights = true;
+// Passes of the frame and their render targets
+FrameGraph frameGraph;
 RenderTargets renderTargets;
-
-// ----------------------------------------------------------------------------
-
-// Forward declaration for the framebuffer creation
-void createFramebuffer(int width, int height);
+// Benchmark mode settings and output
+Benchmark benchmark;
+// Exposure of the tonemapping adapted on the GPU
+AutoExposure autoExposure;
+// Scale of the rendered image keeping the GPU frame time at the target
+DynamicResolution dynamicResolution;
 
 // Callback for handling GLFW errors
 void errorCallback(int error, const char* description)
@@ -127,8 +145,6 @@ void resizeCallback(GLFWwindow* window, int width, int height)
   mainWindow.height = height;
   glViewport(0, 0, width, height);
   camera.SetProjection(fov, (float)width / (float)height, nearClipPlane, farClipPlane);
-
-  createFramebuffer(width, height);
 }
 
 // Callback for handling mouse movement over the window - called when mouse movement is detected
@@ -139,6 +155,14 @@ void mouseMoveCallback(GLFWwindow* window, double x, double y)
   mouseStatus.y = y;
 }
 
+// Remap the depth to [0, 1] for the reverse-Z projection or to the traditional [-1, 1] otherwise
+void applyDepthMapping()
+{
+  if (GLAD_GL_VERSION_4_5 || GLAD_GL_ARB_clip_control)
+    glClipControl(GL_LOWER_LEFT, reverseDepth ? GL_ZERO_TO_ONE : GL_NEGATIVE_ONE_TO_ONE);
+  camera.SetReverseZ(reverseDepth);
+}
+
 // Keyboard callback for handling system switches
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
@@ -162,6 +186,14 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     animate = !animate;
   }
 
+#if _ALLOW_TILED_LIGHTING
+  // Switch between light volumes and the tiled light pass
+  if (key == GLFW_KEY_F3 && action == GLFW_PRESS)
+  {
+    renderMode.lightingMode = (renderMode.lightingMode + 1) % LightingMode::NumLightingModes;
+  }
+#endif
+
   // GBuffer visualization modes
   if (key == GLFW_KEY_1 && action == GLFW_PRESS)
   {
@@ -193,6 +225,61 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     renderMode.displayMode = DisplayMode::Occlusion; // Material occlusion
   }
 
+  if (key == GLFW_KEY_7 && action == GLFW_PRESS)
+  {
+    renderMode.displayMode = DisplayMode::NormalError; // Normal difference against the other GBuffer layout
+  }
+
+  if (key == GLFW_KEY_8 && action == GLFW_PRESS)
+  {
+    renderMode.displayMode = DisplayMode::Edges; // Pixels shaded per sample
+  }
+
+  // Switch between the default and compact GBuffer layout
+  if (key == GLFW_KEY_F4 && action == GLFW_PRESS)
+  {
+    toggleCompactGBuffer();
+  }
+
+  // Enable/disable MSAA of the GBuffer and the light passes
+  if (key == GLFW_KEY_F5 && action == GLFW_PRESS)
+  {
+    toggleMsaaGBuffer();
+  }
+
+  // Switch between the reverse-Z and the traditional depth
+  if (key == GLFW_KEY_F6 && action == GLFW_PRESS)
+  {
+    if (toggleReverseDepth())
+      applyDepthMapping();
+  }
+
+#if _ALLOW_GPU_LIGHTS
+  // Switch between the lights animated on the CPU and the GPU
+  if (key == GLFW_KEY_F7 && action == GLFW_PRESS)
+  {
+    gpuLights = scene.SetGpuLights(!gpuLights);
+  }
+#endif
+
+  // Enable/disable the dynamic resolution
+  if (key == GLFW_KEY_F8 && action == GLFW_PRESS)
+  {
+    dynamicResolution.SetEnabled(!dynamicResolution.IsEnabled());
+  }
+
+  // Load the shaders from editable files and rebuild them on change, or go back to the built-in ones
+  if (key == GLFW_KEY_F9 && action == GLFW_PRESS)
+  {
+    toggleShaderFiles();
+  }
+
+  // Print the GPU memory used by each subsystem
+  if (key == GLFW_KEY_F11 && action == GLFW_PRESS)
+  {
+    GpuMemory::GetInstance().Dump();
+  }
+
   // Zoom in
   if (key == GLFW_KEY_KP_ADD || key == GLFW_KEY_EQUAL && action == GLFW_PRESS)
   {
@@ -229,15 +316,24 @@ bool initOpenGL()
   // Initialize the GLFW library
   if (!glfwInit()) return false;
 
-  // Request OpenGL 3.3 core profile upon window creation
+  // Request OpenGL 3.3 core profile upon window creation, tiled lighting and storage buffers need 4.3
+#if _ALLOW_TILED_LIGHTING || _ALLOW_SSBO_STORAGE
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+#else
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  glfwWindowHint(GLFW_SAMPLES, 0); // Disable MSAA, we can't use it here
+#endif
+  glfwWindowHint(GLFW_SAMPLES, 0); // Disable MSAA, we'll handle it ourselves in the GBuffer
 #if _ENABLE_OPENGL_DEBUG
   glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
 #endif
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+  // Nobody watches the benchmark, we render to our own framebuffer so the window can stay hidden
+  if (benchmark.IsEnabled())
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
   // Create the window
   mainWindow.handle = glfwCreateWindow(Window::DefaultWidth, Window::DefaultHeight, "", nullptr, nullptr);
   if (mainWindow.handle == nullptr)
@@ -290,211 +386,23 @@ bool initOpenGL()
   return true;
 }
 
-// Helper function for creating the HDR framebuffer
-void createFramebuffer(int width, int height)
-{
-  // Bind the default framebuffer
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-  // Generate the HDR FBO if necessary
-  if (!renderTargets.hdrFbo)
-  {
-    glGenFramebuffers(1, &renderTargets.hdrFbo);
-  }
-
-  // Bind it and recreate textures
-  glBindFramebuffer(GL_FRAMEBUFFER, renderTargets.hdrFbo);
-
-  // --------------------------------------------------------------------------
-  // Depth/stencil buffer texture (shared between both framebuffers):
-  // --------------------------------------------------------------------------
-
-  // Delete it if necessary
-  if (glIsTexture(renderTargets.depthStencil))
-  {
-    glDeleteTextures(1, &renderTargets.depthStencil);
-    renderTargets.depthStencil = 0;
-  }
-
-  // Create the depth-stencil name
-  if (renderTargets.depthStencil == 0)
-  {
-    glGenTextures(1, &renderTargets.depthStencil);
-  }
-
-  // Internal format, determines precision, possible choices (depth only)
-  // GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT16, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT32, GL_DEPTH_COMPONENT32F
-  GLint format = GL_DEPTH_COMPONENT32F;
-  glBindTexture(GL_TEXTURE_2D, renderTargets.depthStencil);
-  glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, renderTargets.depthStencil, 0);
-
-  // --------------------------------------------------------------------------
-  // Render target texture:
-  // --------------------------------------------------------------------------
-
-  // Delete it if necessary
-  if (glIsTexture(renderTargets.hdrRT))
-  {
-    glDeleteTextures(1, &renderTargets.hdrRT);
-    renderTargets.hdrRT = 0;
-  }
-
-  // Create the texture name
-  if (renderTargets.hdrRT == 0)
-  {
-    glGenTextures(1, &renderTargets.hdrRT);
-  }
-
-  // Bind and recreate the render target texture
-  glBindTexture(GL_TEXTURE_2D, renderTargets.hdrRT);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, nullptr);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, renderTargets.hdrRT, 0);
-
-  // --------------------------------------------------------------------------
-
-  {
-    // Set the list of draw buffers.
-    GLenum drawBuffers[] = {GL_COLOR_ATTACHMENT0};
-    glDrawBuffers(1, drawBuffers);
-
-    // Check for completeness
-    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (status != GL_FRAMEBUFFER_COMPLETE)
-    {
-      printf("Failed to create framebuffer: 0x%04X\n", status);
-      glBindFramebuffer(GL_FRAMEBUFFER, 0);
-      return;
-    }
-  }
-
-  // Bind back the window system provided framebuffer
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-  // Generate the GBuffer FBO if necessary
-  if (!renderTargets.gBufferFbo)
-  {
-    glGenFramebuffers(1, &renderTargets.gBufferFbo);
-  }
-
-  // Bind it and recreate textures
-  glBindFramebuffer(GL_FRAMEBUFFER, renderTargets.gBufferFbo);
-
-  // Bind the depth/stencil texture to it as well
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, renderTargets.depthStencil, 0);
-
-  // --------------------------------------------------------------------------
-  // Color buffer texture:
-  // --------------------------------------------------------------------------
-
-  // Delete it if necessary
-  if (glIsTexture(renderTargets.colorRT))
-  {
-    glDeleteTextures(1, &renderTargets.colorRT);
-    renderTargets.colorRT = 0;
-  }
-
-  // Create the texture name
-  if (renderTargets.colorRT == 0)
-  {
-    glGenTextures(1, &renderTargets.colorRT);
-  }
-
-  // Bind and recreate the render target texture
-  glBindTexture(GL_TEXTURE_2D, renderTargets.colorRT);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_BYTE, nullptr);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, renderTargets.colorRT, 0);
-
-  // --------------------------------------------------------------------------
-  // Normals buffer texture:
-  // --------------------------------------------------------------------------
-
-  // Delete it if necessary
-  if (glIsTexture(renderTargets.normalRT))
-  {
-    glDeleteTextures(1, &renderTargets.normalRT);
-    renderTargets.normalRT = 0;
-  }
-
-  // Create the texture name
-  if (renderTargets.normalRT == 0)
-  {
-    glGenTextures(1, &renderTargets.normalRT);
-  }
-
-  // Bind and recreate the render target texture
-  glBindTexture(GL_TEXTURE_2D, renderTargets.normalRT);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, width, height, 0, GL_RG, GL_FLOAT, nullptr);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, renderTargets.normalRT, 0);
-
-  // --------------------------------------------------------------------------
-  // Material buffer texture:
-  // --------------------------------------------------------------------------
-
-  // Delete it if necessary
-  if (glIsTexture(renderTargets.materialRT))
-  {
-    glDeleteTextures(1, &renderTargets.materialRT);
-    renderTargets.materialRT = 0;
-  }
-
-  // Create the texture name
-  if (renderTargets.materialRT == 0)
-  {
-    glGenTextures(1, &renderTargets.materialRT);
-  }
-
-  // Bind and recreate the render target texture
-  glBindTexture(GL_TEXTURE_2D, renderTargets.materialRT);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8UI, width, height, 0, GL_RGB_INTEGER, GL_BYTE, nullptr);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, renderTargets.materialRT, 0);
-
-  // --------------------------------------------------------------------------
-
-  {
-    // Set the list of draw buffers.
-    GLenum drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
-    glDrawBuffers(3, drawBuffers);
-
-    // Check for completeness
-    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (status != GL_FRAMEBUFFER_COMPLETE)
-    {
-      printf("Failed to create framebuffer: 0x%04X\n", status);
-    }
-  }
-
-  // Bind back the window system provided framebuffer
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-}
-
 // Helper method for graceful shutdown
 void shutDown()
 {
+  // Stop the worker threads
+  JobSystem::GetInstance().Release();
+
   // Release shader programs
   for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
   {
     glDeleteProgram(shaderProgram[i]);
   }
 
-  // Release the framebuffer
-  glDeleteTextures(1, &renderTargets.hdrRT);
-  glDeleteTextures(1, &renderTargets.depthStencil);
-  glDeleteTextures(1, &renderTargets.colorRT);
-  glDeleteTextures(1, &renderTargets.normalRT);
-  glDeleteTextures(1, &renderTargets.materialRT);
-  glDeleteFramebuffers(1, &renderTargets.hdrFbo);
-  glDeleteFramebuffers(1, &renderTargets.gBufferFbo);
+  // Release the exposure programs and buffers
+  autoExposure.Release();
+
+  // Release the render targets
+  frameGraph.Release();
 
   // Release the window
   glfwDestroyWindow(mainWindow.handle);
@@ -557,59 +465,100 @@ void processInput(float dt)
   }
 }
 
-void renderScene()
+void renderScene(float dt)
 {
-  // Draw our scene
-  scene.Draw(camera, renderTargets);
-
-  // Unbind the shader program and other resources
-  glBindVertexArray(0);
-  glUseProgram(0);
-
-  // Bind the window system provided FBO
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-  // Solid fill always
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-
-  // Disable depth test
-  glDisable(GL_DEPTH_TEST);
-
-  // Clear the color
-  glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-  glClear(GL_COLOR_BUFFER_BIT);
-
-  // Tonemapping
-  glUseProgram(shaderProgram[ShaderProgram::Tonemapping]);
-
-  // Send in the required data
-  glm::vec3 data = glm::vec3(nearClipPlane, farClipPlane, renderMode.displayMode);
-  glUniform3fv(0, 1, glm::value_ptr(data));
-
-  // Bind the GBuffer textures
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.depthStencil);
-  glBindSampler(0, 0);
-  glActiveTexture(GL_TEXTURE1);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.colorRT);
-  glBindSampler(1, 0);
-  glActiveTexture(GL_TEXTURE2);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.normalRT);
-  glBindSampler(2, 0);
-  glActiveTexture(GL_TEXTURE3);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.materialRT);
-  glBindSampler(3, 0);
-  glActiveTexture(GL_TEXTURE4);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.hdrRT);
-  glBindSampler(4, 0);
-
-  // Draw fullscreen quad
-  glBindVertexArray(scene.GetGenericVAO());
-  glDrawArrays(GL_TRIANGLES, 0, 6);
-
-  // Unbind the shader program and other resources
-  glBindVertexArray(0);
-  glUseProgram(0);
+  // The render targets follow the window and the GBuffer settings, the frame graph recreates them on change, with
+  // the dynamic resolution they only grow to the largest window size so far and the scaled image is rendered to
+  // their lower left part
+  dynamicResolution.Update();
+  if (dynamicResolution.IsEnabled())
+  {
+    renderTargets.width = std::max(renderTargets.width, mainWindow.width);
+    renderTargets.height = std::max(renderTargets.height, mainWindow.height);
+  }
+  else
+  {
+    renderTargets.width = mainWindow.width;
+    renderTargets.height = mainWindow.height;
+  }
+  dynamicResolution.GetScaledSize(mainWindow.width, mainWindow.height, renderTargets.renderWidth, renderTargets.renderHeight);
+  renderTargets.samples = gBufferSamples;
+  renderTargets.compact = compactGBuffer;
+
+  // Declare the passes of our scene
+  frameGraph.Reset();
+  scene.AddPasses(frameGraph, camera, renderTargets, renderMode.lightingMode);
+  const FrameResource backbuffer = frameGraph.ImportBackbuffer("Backbuffer", mainWindow.width, mainWindow.height);
+  // AutoExposure synchronizes its buffer itself, the resource just orders the passes
+  const FrameResource exposure = frameGraph.ImportBuffer("Exposure", 0);
+
+  // Adapt the exposure to the lit image, the other display modes don't use it and skip the light passes as well
+  const bool lit = renderMode.displayMode == DisplayMode::Default;
+  int pass = -1;
+  if (lit)
+  {
+    pass = frameGraph.AddPass("Exposure", [dt](const FrameGraph &frameGraph)
+    {
+      autoExposure.Update(frameGraph.GetTexture(renderTargets.hdr), renderTargets.samples > 1, renderTargets.renderWidth, renderTargets.renderHeight, dt);
+
+      // The exposure programs and buffers are bound behind the state cache
+      GLState::GetInstance().Invalidate();
+    });
+    frameGraph.Read(pass, renderTargets.hdr, ResourceAccess::Texture);
+    frameGraph.Write(pass, exposure, ResourceAccess::Uniform);
+  }
+
+  // Tonemapping to the window system provided framebuffer
+  pass = frameGraph.AddPass("Tonemapping", [](const FrameGraph &frameGraph)
+  {
+    // Solid fill always, no depth test and no blending
+    GLState &glState = GLState::GetInstance();
+    const PipelineState tonemappingState = {false, GL_LEQUAL, GL_TRUE, false, false, GL_BACK, false, GL_FUNC_ADD, GL_ONE, GL_ZERO, false, GL_FILL};
+    glState.Apply(tonemappingState);
+
+    // Clear the color
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glState.UseProgram(shaderProgram[ShaderProgram::Tonemapping]);
+
+    // Send in the required data
+    glm::vec3 data = glm::vec3(nearClipPlane, farClipPlane, renderMode.displayMode);
+    glUniform3fv(0, 1, glm::value_ptr(data));
+    // Upscale the rendered part of the render targets to the window
+    glUniform4f(1, (float)renderTargets.renderWidth / std::max(mainWindow.width, 1), (float)renderTargets.renderHeight / std::max(mainWindow.height, 1),
+                (float)renderTargets.renderWidth, (float)renderTargets.renderHeight);
+    autoExposure.Bind(4);
+
+    // Bind the GBuffer and HDR textures, the ones not needed by the display mode aren't rendered at all
+    frameGraph.BindTexture(0, renderTargets.depthStencil);
+    frameGraph.BindTexture(1, renderTargets.color);
+    frameGraph.BindTexture(2, renderTargets.normal);
+    frameGraph.BindTexture(3, renderTargets.material);
+    frameGraph.BindTexture(4, renderTargets.hdr);
+
+    // Draw fullscreen quad
+    glState.BindVertexArray(scene.GetGenericVAO());
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+  });
+  if (lit)
+  {
+    frameGraph.Read(pass, renderTargets.hdr, ResourceAccess::Texture);
+    frameGraph.Read(pass, exposure, ResourceAccess::Uniform);
+  }
+  else
+  {
+    frameGraph.Read(pass, renderTargets.depthStencil, ResourceAccess::Texture);
+    frameGraph.Read(pass, renderTargets.color, ResourceAccess::Texture);
+    frameGraph.Read(pass, renderTargets.normal, ResourceAccess::Texture);
+    frameGraph.Read(pass, renderTargets.material, ResourceAccess::Texture);
+  }
+  frameGraph.Write(pass, backbuffer, ResourceAccess::Attachment);
+
+  // Order the passes, drop the unused ones, and run them
+  if (frameGraph.Compile())
+    frameGraph.Execute();
+  scene.EndFrame();
 }
 
 // Helper method for implementing the application main loop
@@ -623,15 +572,30 @@ void mainLoop()
     float dt = (float)(time - prevTime);
     prevTime = time;
 
-    // Print it to the title bar
+    // Print it to the title bar along with GPU/CPU times of the profiled passes
     static char title[MAX_TEXT_LENGTH];
     static char instacing[] = "[Instancing] ";
-    snprintf(title, MAX_TEXT_LENGTH, "dt = %.2fms, FPS = %.1f", dt * 1000.0f, 1.0f / dt);
+    const char *lighting = (renderMode.lightingMode == LightingMode::Tiled) ? "[Tiled] " : "[Volumes] ";
+    const char *animation = scene.GetGpuLights() ? "[GPU lights] " : "";
+    const GLState &glState = GLState::GetInstance();
+    char resolution[MAX_TEXT_LENGTH] = "";
+    if (dynamicResolution.IsEnabled())
+      snprintf(resolution, MAX_TEXT_LENGTH, "[Resolution %.0f%% of %.1fms] ", dynamicResolution.GetScale() * 100.0f, dynamicResolution.GetTarget());
+    int length = snprintf(title, MAX_TEXT_LENGTH, "%s%s%sdt = %.2fms, FPS = %.1f, GL state %i/%i skipped, passes %i/%i, targets %.1fMB | ",
+                          lighting, animation, resolution, dt * 1000.0f, 1.0f / dt, glState.GetSkippedCalls(), glState.GetIssuedCalls() + glState.GetSkippedCalls(),
+                          frameGraph.GetNumExecutedPasses(), frameGraph.GetNumPasses(), frameGraph.GetAllocatedBytes() / (1024.0 * 1024.0));
+    Profiler::GetInstance().Print(title + length, MAX_TEXT_LENGTH - length);
     glfwSetWindowTitle(mainWindow.handle, title);
 
+    // Start measuring the frame
+    Profiler::GetInstance().BeginFrame();
+
     // Poll the events like keyboard, mouse, etc.
     glfwPollEvents();
 
+    // Pick up the edited shader files
+    updateShaderFiles();
+
     // Process keyboard input
     processInput(dt);
 
@@ -639,15 +603,94 @@ void mainLoop()
     scene.Update(animate ? dt : 0.0f, camera);
 
     // Render the scene
-    renderScene();
+    renderScene(dt);
+
+    // Finish measuring the frame
+    Profiler::GetInstance().EndFrame();
 
     // Swap actual buffers on the GPU
     glfwSwapBuffers(mainWindow.handle);
   }
 }
 
-int main()
+// Helper method for running the benchmark, replays the camera path for all requested scene configurations
+void benchmarkLoop()
+{
+  // Fixed time step so that every run animates the scene the same way
+  const float dt = 1.0f / 60.0f;
+  const int numFrames = benchmark.GetTotalFrames();
+
+  for (int numCubes : benchmark.GetSweep("cubes", 10))
+  {
+    for (int numLights : benchmark.GetSweep("lights", 5))
+    {
+      numCubes = std::min(std::max(numCubes, 1), (int)scene.GetMaxInstances());
+      numLights = std::min(std::max(numLights, 1), (int)scene.GetMaxInstances());
+
+      // Same random scene layout for every run
+      seedRandom(0);
+      scene.Init(numCubes, numLights);
+      scene.SetGpuLights(gpuLights);
+      scene.FinishLoading();
+
+      // Compare both lighting approaches on the same scene
+      for (int tiled : benchmark.GetSweep("tiled", renderMode.lightingMode))
+      {
+#if _ALLOW_TILED_LIGHTING
+        renderMode.lightingMode = tiled ? LightingMode::Tiled : LightingMode::Volumes;
+#else
+        tiled = 0;
+#endif
+
+        char config[MAX_TEXT_LENGTH];
+        snprintf(config, MAX_TEXT_LENGTH, "cubes=%i lights=%i tiled=%i msaa=%i gpulights=%i", numCubes, numLights, tiled ? 1 : 0,
+                 (int)gBufferSamples, scene.GetGpuLights() ? 1 : 0);
+        benchmark.BeginRun(config);
+        autoExposure.Reset();
+
+        for (int frame = 0; frame < numFrames && !glfwWindowShouldClose(mainWindow.handle); ++frame)
+        {
+          // Start measuring the frame and write out the oldest one read back
+          Profiler::GetInstance().BeginFrame();
+          benchmark.Record();
+
+          // Poll the events so that the window stays responsive
+          glfwPollEvents();
+
+          // Replay the camera path
+          Benchmark::SetCameraOnPath(camera, frame, numFrames, glm::vec3(0.0f, 1.0f, 0.0f), 8.0f, 4.0f);
+
+          {
+            ProfilerScope frameScope("Frame");
+            scene.Update(dt, camera);
+            renderScene(dt);
+          }
+
+          // Finish measuring the frame
+          Profiler::GetInstance().EndFrame();
+
+          // Swap actual buffers on the GPU
+          glfwSwapBuffers(mainWindow.handle);
+        }
+
+        benchmark.EndRun();
+      }
+
+      scene.Release();
+    }
+  }
+}
+
+int main(int argc, char *argv[])
 {
+  // Read the benchmark settings
+  if (!benchmark.ParseCommandLine(argc, argv))
+    return -1;
+
+  // Benchmark must not be limited by the display refresh rate
+  if (benchmark.IsEnabled())
+    renderMode.vsync = false;
+
   // Initialize the OpenGL context and create a window
   if (!initOpenGL())
   {
@@ -664,11 +707,34 @@ int main()
     return -1;
   }
 
-  // Scene initialization
-  scene.Init(10, 5);
+  // Match the depth mapping the programs were built for
+  applyDepthMapping();
+
+  // Create the exposure buffer and its compute shaders, the exposure just stays 1 if they aren't available
+  if (!autoExposure.Init())
+    printf("Failed to initialize the auto exposure, using a fixed exposure!\n");
+
+  // Create the profiler queries
+  Profiler::GetInstance().Init();
+
+  // Start the worker threads of the parallel scene updates
+  JobSystem::GetInstance().Init();
+
+  if (benchmark.IsEnabled())
+  {
+    // Run all benchmark configurations and quit
+    if (benchmark.Open())
+      benchmarkLoop();
+  }
+  else
+  {
+    // Scene initialization
+    scene.Init(10, 5);
+    gpuLights = scene.SetGpuLights(gpuLights);
 
-  // Enter the application main loop
-  mainLoop();
+    // Enter the application main loop
+    mainLoop();
+  }
 
   // Release used resources and exit
   shutDown();
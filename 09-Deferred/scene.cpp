@@ -6,18 +6,67 @@
 #include "scene.h"
 #include "shaders.h"
 
+#include <algorithm>
+#include <cstdio>
 #include <functional>
 #include <vector>
 #include <glad/glad.h>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/transform.hpp>
 
+#include <GLState.h>
+#include <GpuMemory.h>
+#include <JobSystem.h>
 #include <MathSupport.h>
+#include <TransformKernels.h>
 
 // Scaling factor for lights movement curve
 static const glm::vec3 scale = glm::vec3(13.0f, 2.0f, 13.0f);
 // Offset for lights movement curve
 static const glm::vec3 offset = glm::vec3(0.0f, 3.0f, 0.0f);
+// Offset of the unscaled movement curve of the first light
+static const glm::vec3 firstLightOffset = glm::vec3(-3.0f, 2.0f, 0.0f);
+// Global ambient light intensity
+static const float ambientLightIntensity = 0.01f;
+
+#if _ALLOW_SSBO_STORAGE
+// Buffer target used for the instance and light data
+static const GLenum dataBufferTarget = GL_SHADER_STORAGE_BUFFER;
+#else
+static const GLenum dataBufferTarget = GL_UNIFORM_BUFFER;
+#endif
+
+// Number of instances transformed by a single job
+static const int instanceBatchSize = 256;
+
+// Maximum number of instance and light data uploads within a frame: objects, inside, outside and visualized lights
+static const int maxInstanceUploads = 4;
+static const int maxLightUploads = 3;
+
+// Textures of each material: diffuse, normal, specular and occlusion
+static const int materialTextureSets[Material::NumMaterials][4] =
+{
+  {LoadedTextures::CheckerBoard, LoadedTextures::Blue, LoadedTextures::Grey, LoadedTextures::White},
+  {LoadedTextures::Diffuse, LoadedTextures::Normal, LoadedTextures::Specular, LoadedTextures::Occlusion}
+};
+
+// Projected light volume radius relative to the screen half height below which the next coarser level of detail is used
+static const float lightLodScreenSize[] = {0.5f, 0.1f};
+
+// Work group size of the light animation - must match the light animation compute shader!
+static const int lightAnimationGroupSize = 64;
+
+// Size of the bound data range, storage buffers only need to fit the data while uniform blocks need the whole block
+static GLsizeiptr getDataRangeSize(GLsizeiptr dataSize, GLsizeiptr blockSize)
+{
+#if _ALLOW_SSBO_STORAGE
+  (void)blockSize;
+  return dataSize;
+#else
+  (void)dataSize;
+  return blockSize;
+#endif
+}
 
 // Lissajous curve position calculation based on the parameters
 auto lissajous = [](const glm::vec4 &p, float t) -> glm::vec3
@@ -33,32 +82,86 @@ Scene& Scene::GetInstance()
   return scene;
 }
 
-Scene::Scene() : _textures(Textures::GetInstance())
+Scene::Scene() : _textures(Textures::GetInstance()), _glState(GLState::GetInstance())
 {
 
 }
 
 Scene::~Scene()
 {
-  // Delete meshes
-  delete _quad;
-  _quad = nullptr;
-  delete _cube;
-  _cube = nullptr;
-  delete _icosahedron;
-  _icosahedron = nullptr;
-
-  // Release the instancing buffer
-  glDeleteBuffers(1, &_instancingBuffer);
+  Release();
+}
 
-  // Release the light buffer
-  glDeleteBuffers(1, &_lightBuffer);
+void Scene::Release()
+{
+  // Delete meshes
+  delete _sceneMeshes;
+  _sceneMeshes = nullptr;
+  delete _icosphere;
+  _icosphere = nullptr;
+
+  // Release the instance and light ring buffer and the transformation buffer
+  _dataStream.Release();
+  _instanceBlockSize = 0;
+  _lightBlockSize = 0;
+  glDeleteBuffers(1, &_transformBlockUBO);
+  _transformBlockUBO = 0;
+  glDeleteBuffers(1, &_materialUBO);
+  _materialUBO = 0;
+
+  // Release the buffers of the GPU lights
+  for (GLuint buffer : {_gpuLightParams, _gpuLightInstances, _gpuLightData, _gpuAllLights, _gpuLightCommands, _gpuLightCommandsReset})
+    GpuMemory::GetInstance().UntrackBuffer(buffer);
+  glDeleteBuffers(1, &_gpuLightParams);
+  _gpuLightParams = 0;
+  glDeleteBuffers(1, &_gpuLightInstances);
+  _gpuLightInstances = 0;
+  glDeleteBuffers(1, &_gpuLightData);
+  _gpuLightData = 0;
+  glDeleteBuffers(1, &_gpuAllLights);
+  _gpuAllLights = 0;
+  glDeleteBuffers(1, &_gpuLightCommands);
+  _gpuLightCommands = 0;
+  glDeleteBuffers(1, &_gpuLightCommandsReset);
+  _gpuLightCommandsReset = 0;
 
   // Release the generic VAO
   glDeleteVertexArrays(1, &_vao);
+  _vao = 0;
 
-  // Release textures
+  // Release textures, stop the loading first so that it doesn't touch them anymore
+  _textureLoader.Release();
   glDeleteTextures(LoadedTextures::NumTextures, _loadedTextures);
+  for (int i = 0; i < LoadedTextures::NumTextures; ++i)
+    _loadedTextures[i] = 0;
+
+  // Handles die with their textures
+  for (int i = 0; i < Material::NumMaterials; ++i)
+  {
+    for (int j = 0; j < 4; ++j)
+      _materialTextures[i][j] = 0;
+  }
+
+  // Forget the scene layout
+  _cubePositions.clear();
+  _cubeAngles.clear();
+  _lights.clear();
+  _insideLights.clear();
+  _outsideLights.clear();
+  _instanceData.clear();
+  _lightData.clear();
+}
+
+unsigned int Scene::GetMaxInstances() const
+{
+#if _ALLOW_SSBO_STORAGE
+  // Storage buffers are limited by the maximum buffer block size, at least 128 MB
+  GLint maxSize = 0;
+  glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxSize);
+  return (unsigned int)(maxSize / sizeof(InstanceData));
+#else
+  return MAX_INSTANCES;
+#endif
 }
 
 void Scene::Init(int numCubes, int numLights)
@@ -67,50 +170,50 @@ void Scene::Init(int numCubes, int numLights)
   if (_vao)
     return;
 
-  _numCubes = numCubes;
-  _numLights = numLights;
+  // Don't overflow the instance and light buffers
+  const int maxInstances = (int)GetMaxInstances();
+  if (numCubes > maxInstances || numLights > maxInstances)
+    printf("Number of cubes and lights limited to %i!\n", maxInstances);
+
+  _numCubes = std::min(numCubes, maxInstances);
+  _numLights = std::min(numLights, maxInstances);
 
   // Prepare meshes
-  _quad = Geometry::CreateQuadNormalTangentTex();
-  _cube = Geometry::CreateCubeNormalTangentTex();
-  _icosahedron = Geometry::CreateIcosahedron();
+  MeshPool<Vertex_Pos_Nrm_Tgt_Tex> meshPool;
+  _quadRange = Geometry::AddQuadNormalTangentTex(meshPool);
+  _cubeRange = Geometry::AddCubeNormalTangentTex(meshPool);
+  _sceneMeshes = Geometry::CreatePackedMesh(meshPool);
+  _icosphere = Geometry::CreateIcosphere(NUM_LIGHT_LODS);
 
   // Create general use VAO
   glGenVertexArrays(1, &_vao);
 
-  {
-    // Generate the instancing buffer as Uniform Buffer Object
-    glGenBuffers(1, &_instancingBuffer);
-    glBindBuffer(GL_UNIFORM_BUFFER, _instancingBuffer);
+  // The instancing buffer is shared by cubes and light volumes
+  const int numInstances = std::max(_numCubes, _numLights);
+  _instanceData.resize(numInstances);
+  _lightData.resize(_numLights);
 
-    // Obtain UBO index and size from the instancing shader program
+#if _ALLOW_SSBO_STORAGE
+  // Storage buffers just need to fit all the instances and lights
+  _instanceBlockSize = numInstances * sizeof(InstanceData);
+  _lightBlockSize = _numLights * sizeof(LightData);
+#else
+  {
+    // Obtain UBO indices and sizes from the instancing and light pass shader programs
     GLuint uboIndex = glGetUniformBlockIndex(shaderProgram[ShaderProgram::InstancedGBuffer], "InstanceBuffer");
     GLint uboSize = 0;
     glGetActiveUniformBlockiv(shaderProgram[ShaderProgram::InstancedGBuffer], uboIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &uboSize);
+    _instanceBlockSize = uboSize;
 
-    // Describe the buffer data - we're going to change this every frame
-    glBufferData(GL_UNIFORM_BUFFER, uboSize, nullptr, GL_DYNAMIC_DRAW);
-
-    // Unbind the GL_UNIFORM_BUFFER target for now
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-  }
-
-  {
-    // Generate the light buffer as Uniform Buffer Object
-    glGenBuffers(1, &_lightBuffer);
-    glBindBuffer(GL_UNIFORM_BUFFER, _lightBuffer);
-
-    // Obtain UBO index and size from the
-    GLuint uboIndex = glGetUniformBlockIndex(shaderProgram[ShaderProgram::InstancedLightPass], "LightBuffer");
-    GLint uboSize = 0;
+    uboIndex = glGetUniformBlockIndex(shaderProgram[ShaderProgram::InstancedLightPass], "LightBuffer");
     glGetActiveUniformBlockiv(shaderProgram[ShaderProgram::InstancedLightPass], uboIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &uboSize);
-
-    // Describe the buffer data - we're going to change this every frame
-    glBufferData(GL_UNIFORM_BUFFER, uboSize, nullptr, GL_DYNAMIC_DRAW);
-
-    // Unbind the GL_UNIFORM_BUFFER target for now
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    _lightBlockSize = uboSize;
   }
+#endif
+
+  // Ring buffer for all the instance and light data - we're going to change this every frame,
+  // the tiled light pass uploads all lights once more at most
+  _dataStream.Init(maxInstanceUploads * _instanceBlockSize + (maxLightUploads + 1) * _lightBlockSize, maxInstanceUploads + maxLightUploads + 1);
 
   {
     // Generate the transform UBO handle
@@ -151,6 +254,11 @@ void Scene::Init(int numCubes, int numLights)
     _cubePositions.push_back(glm::vec3(x, y, z));
   }
 
+  // Each cube is rotated around the diagonal by a growing angle
+  _cubeAngles.resize(_numCubes);
+  for (int i = 0; i < _numCubes; ++i)
+    _cubeAngles[i] = glm::radians(i * 20.0f);
+
   // --------------------------------------------------------------------------
 
   // Ambient intensity for the lights
@@ -207,17 +315,55 @@ void Scene::Init(int numCubes, int numLights)
   _loadedTextures[LoadedTextures::Grey] = Textures::CreateSingleColorTexture(127, 127, 127);
   _loadedTextures[LoadedTextures::Blue] = Textures::CreateSingleColorTexture(127, 127, 255);
   _loadedTextures[LoadedTextures::CheckerBoard] = Textures::CreateCheckerBoardTexture(256, 16);
-  _loadedTextures[LoadedTextures::Diffuse] = Textures::LoadTexture("data/Terracotta_Tiles_002_Base_Color.jpg", true);
-  _loadedTextures[LoadedTextures::Normal] = Textures::LoadTexture("data/Terracotta_Tiles_002_Normal.jpg", false);
-  _loadedTextures[LoadedTextures::Specular] = Textures::LoadTexture("data/Terracotta_Tiles_002_Roughness.jpg", false);
-  _loadedTextures[LoadedTextures::Occlusion] = Textures::LoadTexture("data/Terracotta_Tiles_002_ambientOcclusion.jpg", false);
+  // Decode the texture set in the background, placeholders of similar average color are used in the meantime
+  _textureLoader.Init();
+  _textureLoader.Load("data/Terracotta_Tiles_002_Base_Color.jpg", true, &_loadedTextures[LoadedTextures::Diffuse], 127, 127, 127);
+  _textureLoader.Load("data/Terracotta_Tiles_002_Normal.jpg", false, &_loadedTextures[LoadedTextures::Normal], 127, 127, 255);
+  _textureLoader.Load("data/Terracotta_Tiles_002_Roughness.jpg", false, &_loadedTextures[LoadedTextures::Specular], 127, 127, 127);
+  _textureLoader.Load("data/Terracotta_Tiles_002_ambientOcclusion.jpg", false, &_loadedTextures[LoadedTextures::Occlusion], 255, 255, 255);
+
+  if (bindlessMaterials)
+  {
+    // Material handles are stored in a uniform buffer bound for the whole lifetime of the scene
+    glGenBuffers(1, &_materialUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, _materialUBO);
+    glBufferData(GL_UNIFORM_BUFFER, MAX_MATERIALS * sizeof(MaterialData), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 3, _materialUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    // Create handles for the placeholders
+    UpdateMaterials();
+  }
+
+#if _ALLOW_GPU_LIGHTS
+  InitGpuLights();
+#endif
+}
+
+bool Scene::SetGpuLights(bool enable)
+{
+  // Needs both the buffers and the compute shader
+  _gpuLights = enable && _gpuLightCommands != 0 && shaderProgram[ShaderProgram::LightAnimation] != 0;
+  return _gpuLights;
 }
 
 void Scene::Update(float dt, const Camera &camera)
 {
+  // Swap in the textures finished in the background and point the materials to them
+  _textureLoader.Update();
+  UpdateMaterials();
+
   // Animation timer
   static float t = 0.0f;
 
+  // The compute shader does the rest, just pass it the time
+  if (_gpuLights)
+  {
+    _lightTime = t;
+    t += dt;
+    return;
+  }
+
   glm::vec3 cameraPos = camera.GetViewToWorld()[3];
 
   _insideLights.clear();
@@ -240,7 +386,7 @@ void Scene::Update(float dt, const Camera &camera)
   };
 
   // Treat the first light as a special case with offset
-  _lights[0].position = glm::vec3(-3.0f, 2.0f, 0.0f) + lissajous(_lights[0].movement, t);
+  _lights[0].position = firstLightOffset + lissajous(_lights[0].movement, t);
   assignLightSet(cameraPos, 0);
 
   // Update the rest of the lights
@@ -274,45 +420,93 @@ void Scene::BindTextures(const GLuint &diffuse, const GLuint &normal, const GLui
   glBindSampler(3, _textures.GetSampler(Sampler::Anisotropic));
 }
 
-void Scene::UpdateInstanceData()
+void Scene::BindMaterial(int material)
 {
-  // Create transformation matrix
-  glm::mat4x4 transformation = glm::mat4x4(1.0f);
-  // Instance data CPU side buffer
-  static std::vector<InstanceData> instanceData(MAX_INSTANCES);
+  // Bindless materials are fetched from the material buffer using the instance material index
+  if (bindlessMaterials)
+    return;
 
-  // Cubes
-  float angle = 20.0f;
-  for (int i = 0; i < _numCubes; ++i)
-  {
-    // Fill the transformation matrix
-    transformation = glm::translate(_cubePositions[i]);
-    transformation *= glm::rotate(glm::radians(i * angle), glm::vec3(1.0f, 1.0f, 1.0f));
+  const int *textures = materialTextureSets[material];
+  BindTextures(_loadedTextures[textures[0]], _loadedTextures[textures[1]], _loadedTextures[textures[2]], _loadedTextures[textures[3]]);
+}
 
-    instanceData[i].transformation = glm::transpose(transformation);
-  }
+void Scene::UpdateMaterials()
+{
+  if (!bindlessMaterials)
+    return;
 
-  // Start working with instancing buffer
-  glBindBuffer(GL_UNIFORM_BUFFER, _instancingBuffer);
+  bool changed = false;
+  for (int i = 0; i < Material::NumMaterials; ++i)
+  {
+    for (int j = 0; j < 4; ++j)
+    {
+      GLuint texture = _loadedTextures[materialTextureSets[i][j]];
+      if (texture == _materialTextures[i][j])
+        continue;
+
+      // Handle of the texture and sampler pair, the same pair always gives the same handle,
+      // textures shared by several materials are already resident then
+      GLuint64 handle = glGetTextureSamplerHandleARB(texture, _textures.GetSampler(Sampler::Anisotropic));
+      if (!glIsTextureHandleResidentARB(handle))
+        glMakeTextureHandleResidentARB(handle);
+
+      _materialTextures[i][j] = texture;
+      _materialData[i].handles[j] = handle;
+      changed = true;
+    }
+  }
 
-  // Bind the instancing buffer to the index 1
-  glBindBufferBase(GL_UNIFORM_BUFFER, 1, _instancingBuffer);
+  // Upload the handles of all materials, this happens only a few times while the textures are loading
+  if (changed)
+  {
+    glBindBuffer(GL_UNIFORM_BUFFER, _materialUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(_materialData), _materialData);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+}
 
-  // Update the buffer data using mapping
-  void *ptr = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-  memcpy(ptr, &*instanceData.begin(), _numCubes * sizeof(InstanceData));
-  glUnmapBuffer(GL_UNIFORM_BUFFER);
+void Scene::UpdateInstanceData()
+{
+  // Write the instances straight to this frame's section of the ring buffer
+  GLintptr offset = 0;
+  GLsizeiptr rangeSize = getDataRangeSize(_numCubes * sizeof(InstanceData), _instanceBlockSize);
+  InstanceData *instances = static_cast<InstanceData*>(_dataStream.Map(_numCubes * sizeof(InstanceData), rangeSize, offset));
+  if (!instances)
+    return;
 
-  // Unbind the uniform buffer target
-  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  // Batches of cubes are transformed in parallel, 4 cubes at once within a batch
+  JobSystem::GetInstance().ParallelFor(_numCubes, instanceBatchSize, [this, instances](int begin, int end)
+  {
+    TransformKernels::TranslateRotate(&_cubePositions[begin], &_cubeAngles[begin], glm::vec3(1.0f, 1.0f, 1.0f), end - begin,
+                                      &instances[begin].transformation, sizeof(InstanceData));
+    for (int i = begin; i < end; ++i)
+      instances[i].material = Material::Terracotta;
+  });
+
+  // Bind it to the index 1
+  _dataStream.Unmap();
+  _dataStream.Bind(dataBufferTarget, 1, offset, rangeSize);
 }
 
-int Scene::UpdateLightData(LightSet lightSet, bool visualization)
+int Scene::SelectLightLod(const glm::vec3 &position, float radius, const Camera &camera) const
 {
-  // Instance and light data CPU side buffer
-  static std::vector<InstanceData> instanceData(MAX_INSTANCES);
-  static std::vector<LightData> lightData(MAX_INSTANCES);
+  // Camera inside or touching the volume, always use the finest level
+  glm::vec3 d = position - glm::vec3(camera.GetViewToWorld()[3]);
+  float distance = glm::length(d);
+  if (distance <= radius)
+    return 0;
+
+  // Projected radius as a fraction of the screen half height, the projection scales by cot(fov / 2)
+  float screenSize = radius / distance * camera.GetProjection()[1][1];
+
+  int lod = 0;
+  while (lod < NUM_LIGHT_LODS - 1 && screenSize < lightLodScreenSize[lod])
+    ++lod;
+  return lod;
+}
 
+int Scene::UpdateLightData(LightSet lightSet, bool visualization, const Camera &camera, int lodOffsets[NUM_LIGHT_LODS + 1])
+{
   // Based on the selected light pass let as pick light using the appropriate way, i.e.,
   // I'm doing here some lambda expressions magic because I'm lazy and lamdas are cool :)
   int numLights = 0;
@@ -351,6 +545,24 @@ int Scene::UpdateLightData(LightSet lightSet, bool visualization)
   // Transformation matrix of the light volume
   glm::mat4x4 transformation = glm::mat4x4(1.0f);
 
+  // Count the lights per level of detail of their volume
+  int lodCounts[NUM_LIGHT_LODS] = {0};
+  _lightLods.resize(numLights);
+  for (int i = 0; i < numLights; ++i)
+  {
+    const Light &light = getLight(i);
+    _lightLods[i] = SelectLightLod(light.position, visualization ? 0.1f : light.radius, camera);
+    ++lodCounts[_lightLods[i]];
+  }
+
+  // Each level gets a contiguous range of the buffers so that it can be drawn with a single instanced draw
+  lodOffsets[0] = 0;
+  for (int lod = 0; lod < NUM_LIGHT_LODS; ++lod)
+  {
+    lodOffsets[lod + 1] = lodOffsets[lod] + lodCounts[lod];
+    lodCounts[lod] = lodOffsets[lod];
+  }
+
   // For all lights in this light set
   for (int i = 0; i < numLights; ++i)
   {
@@ -371,43 +583,29 @@ int Scene::UpdateLightData(LightSet lightSet, bool visualization)
     transformation = glm::translate(light.position);
     transformation *= glm::scale(glm::vec3(scale));
 
-    instanceData[i].transformation = glm::transpose(transformation);
-
-    lightData[i].position = glm::vec4(light.position, light.radius);
-    lightData[i].color = glm::vec4(light.color * attenuation);
-  }
-
-  {
-    // Start working with instancing buffer
-    glBindBuffer(GL_UNIFORM_BUFFER, _instancingBuffer);
-
-    // Update the buffer data using mapping
-    void *ptr = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-    memcpy(ptr, &*instanceData.begin(), (numLights) * sizeof(InstanceData));
-    glUnmapBuffer(GL_UNIFORM_BUFFER);
-
-    // Bind the instancing buffer to the index 1
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, _instancingBuffer);
+    // Next free slot of the light's level of detail
+    int slot = lodCounts[_lightLods[i]]++;
+    _instanceData[slot].transformation = glm::transpose(transformation);
 
-    // Unbind the uniform buffer target
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    _lightData[slot].position = glm::vec4(light.position, light.radius);
+    _lightData[slot].color = glm::vec4(light.color * attenuation);
   }
 
-  {
-    // Start working with the light buffer
-    glBindBuffer(GL_UNIFORM_BUFFER, _lightBuffer);
+  // Nothing to upload
+  if (numLights == 0)
+    return 0;
 
-    // Update the buffer data using mapping
-    void *ptr = glMapBuffer(GL_UNIFORM_BUFFER, GL_WRITE_ONLY);
-    memcpy(ptr, &*lightData.begin(), (numLights) * sizeof(LightData));
-    glUnmapBuffer(GL_UNIFORM_BUFFER);
+  GLintptr offset = 0;
 
-    // Bind the light buffer to the index 2
-    glBindBufferBase(GL_UNIFORM_BUFFER, 2, _lightBuffer);
+  // Copy the instance data to the ring buffer and bind it to the index 1
+  GLsizeiptr rangeSize = getDataRangeSize(numLights * sizeof(InstanceData), _instanceBlockSize);
+  if (_dataStream.Upload(&*_instanceData.begin(), numLights * sizeof(InstanceData), rangeSize, offset))
+    _dataStream.Bind(dataBufferTarget, 1, offset, rangeSize);
 
-    // Unbind the uniform buffer target
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-  }
+  // Copy the light data to the ring buffer and bind it to the index 2
+  rangeSize = getDataRangeSize(numLights * sizeof(LightData), _lightBlockSize);
+  if (_dataStream.Upload(&*_lightData.begin(), numLights * sizeof(LightData), rangeSize, offset))
+    _dataStream.Bind(dataBufferTarget, 2, offset, rangeSize);
 
   return numLights;
 }
@@ -439,19 +637,20 @@ void Scene::DrawBackground()
   GLuint program = shaderProgram[ShaderProgram::DefaultGBuffer];
 
   // Bind the shader program and update its data
-  glUseProgram(program);
+  _glState.UseProgram(program);
 
-  // Bind textures
-  BindTextures(_loadedTextures[LoadedTextures::CheckerBoard], _loadedTextures[LoadedTextures::Blue], _loadedTextures[LoadedTextures::Grey], _loadedTextures[LoadedTextures::White]);
+  // Bind the material, i.e., the textures or just its index for the bindless handles
+  BindMaterial(Material::Background);
+  glUniform1ui(4, Material::Background);
 
   // Bind the geometry
-  glBindVertexArray(_quad->GetVAO());
+  _glState.BindVertexArray(_sceneMeshes->GetVAO());
 
   // Draw floor:
   glm::mat4x4 transformation = glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
   glm::mat4x3 passMatrix = transformation;
   glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-  glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  DrawMeshRange(*_sceneMeshes, _quadRange);
 
   // Draw Z axis wall
   transformation = glm::translate(glm::vec3(0.0f, 0.0f, 15.0f));
@@ -459,7 +658,7 @@ void Scene::DrawBackground()
   transformation *= glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
   passMatrix = transformation;
   glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-  glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  DrawMeshRange(*_sceneMeshes, _quadRange);
 
   // Draw X axis wall
   transformation = glm::translate(glm::vec3(15.0f, 0.0f, 0.0f));
@@ -467,7 +666,7 @@ void Scene::DrawBackground()
   transformation *= glm::scale(glm::vec3(30.0f, 1.0f, 30.0f));
   passMatrix = transformation;
   glUniformMatrix4x3fv(0, 1, GL_FALSE, glm::value_ptr(passMatrix));
-  glDrawElements(GL_TRIANGLES, _quad->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0));
+  DrawMeshRange(*_sceneMeshes, _quadRange);
 }
 
 void Scene::DrawObjects()
@@ -478,145 +677,490 @@ void Scene::DrawObjects()
   GLuint program = shaderProgram[ShaderProgram::InstancedGBuffer];
 
   // Bind the shader program and update its data
-  glUseProgram(program);
+  _glState.UseProgram(program);
 
-  // Bind textures
-  BindTextures(_loadedTextures[LoadedTextures::Diffuse], _loadedTextures[LoadedTextures::Normal], _loadedTextures[LoadedTextures::Specular], _loadedTextures[LoadedTextures::Occlusion]);
+  // Bind textures, the instances carry their material index for the bindless handles
+  BindMaterial(Material::Terracotta);
 
   // Draw cubes
-  glBindVertexArray(_cube->GetVAO());
-  glDrawElementsInstanced(GL_TRIANGLES, _cube->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), _numCubes);
+  _glState.BindVertexArray(_sceneMeshes->GetVAO());
+  DrawMeshRange(*_sceneMeshes, _cubeRange, _numCubes);
 }
 
-void Scene::DrawLights(const Camera &camera)
+void Scene::ClassifyEdges()
 {
-  auto lightPass = [this](LightSet lightSet, bool visualize)
+  // Only the edge pixels pass the shader, all their samples get the stencil reference
+  _glState.UseProgram(shaderProgram[ShaderProgram::EdgeClassification]);
+  _glState.ColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  _glState.Disable(GL_DEPTH_TEST);
+  _glState.Enable(GL_STENCIL_TEST);
+  _glState.StencilFunc(GL_ALWAYS, 1, 0x01);
+  _glState.StencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+
+  // Draw fullscreen quad - textures already bound outside the scope
+  _glState.BindVertexArray(_vao);
+  glDrawArrays(GL_TRIANGLES, 0, 6);
+
+  // Light passes just test the stencil
+  _glState.StencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+  _glState.Disable(GL_STENCIL_TEST);
+  _glState.Enable(GL_DEPTH_TEST);
+  _glState.ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+void Scene::DrawLights(const Camera &camera, bool classifiedEdges)
+{
+  // Shader programs for instanced light passes, the second one shades the edge samples
+  const GLuint programs[2] = {shaderProgram[ShaderProgram::InstancedLightPass], shaderProgram[ShaderProgram::InstancedLightPassPerSample]};
+  const int numPasses = classifiedEdges ? 2 : 1;
+
+  auto lightPass = [this, &camera, &programs, numPasses](LightSet lightSet, bool visualize)
   {
-    // Update the instancing and light buffer
-    int numLights = UpdateLightData(lightSet, visualize);
+    // Update the instancing and light buffer, the GPU lights are already there
+    int lodOffsets[NUM_LIGHT_LODS + 1];
+    int numLights = _gpuLights ? _numLights : UpdateLightData(lightSet, visualize, camera, lodOffsets);
 
     if (numLights > 0)
     {
-      glDrawElementsInstanced(GL_TRIANGLES, _icosahedron->GetIBOSize(), GL_UNSIGNED_INT, reinterpret_cast<void*>(0), numLights);
+      // Pixels with matching samples first, then the edge samples, stencil tells them apart
+      for (int pass = 0; pass < numPasses; ++pass)
+      {
+        if (numPasses > 1)
+          _glState.StencilFunc(GL_EQUAL, pass, 0x01);
+
+        _glState.UseProgram(programs[pass]);
+        if (_gpuLights)
+          DrawGpuLightVolumes(programs[pass], lightSet);
+        else
+          DrawLightVolumes(programs[pass], lodOffsets);
+      }
     }
   };
 
-  // We'll be drawing icosahedra for both light pass and light visualization
-  glBindVertexArray(_icosahedron->GetVAO());
+  // We'll be drawing icospheres for both light pass and light visualization
+  _glState.BindVertexArray(_icosphere->GetVAO());
 
-  // Bind the shader program for instanced light passes
-  GLuint program = shaderProgram[ShaderProgram::InstancedLightPass];
-  glUseProgram(program);
+  for (int pass = 0; pass < numPasses; ++pass)
+  {
+    _glState.UseProgram(programs[pass]);
 
-  // Update the camera world space position
-  GLint loc = glGetUniformLocation(program, "cameraPosWS");
-  const glm::vec4 &cameraPos = camera.GetViewToWorld()[3];
-  glUniform4fv(loc, 1, glm::value_ptr(cameraPos));
+    // Update the camera world space position
+    GLint loc = glGetUniformLocation(programs[pass], "cameraPosWS");
+    const glm::vec4 &cameraPos = camera.GetViewToWorld()[3];
+    glUniform4fv(loc, 1, glm::value_ptr(cameraPos));
 
-  // Update the camera clip planes
-  loc = glGetUniformLocation(program, "NEAR_FAR");
-  glUniform2f(loc, camera.GetNearClip(), camera.GetFarClip());
+    // Update the camera clip planes
+    loc = glGetUniformLocation(programs[pass], "NEAR_FAR");
+    glUniform2f(loc, camera.GetNearClip(), camera.GetFarClip());
+  }
+
+  if (classifiedEdges)
+    _glState.Enable(GL_STENCIL_TEST);
 
   // Draw light volumes where camera is inside as back faces w/o depth test
-  glCullFace(GL_FRONT);
-  glDisable(GL_DEPTH_TEST);
+  _glState.CullFace(GL_FRONT);
+  _glState.Disable(GL_DEPTH_TEST);
   lightPass(LightSet::Inside, false);
 
   // Draw light volumes where camera is outside as back faces w/ depth test
-  glCullFace(GL_BACK);
-  glEnable(GL_DEPTH_TEST);
+  _glState.CullFace(GL_BACK);
+  _glState.Enable(GL_DEPTH_TEST);
   lightPass(LightSet::Outside, false);
 
-  // --------------------------------------------------------------------------
-  // Draw light points
+  _glState.Disable(GL_STENCIL_TEST);
+}
+
+void Scene::DrawLightVolumes(GLuint program, const int lodOffsets[NUM_LIGHT_LODS + 1])
+{
+  // The instances of each level start at its offset in the buffers, gl_InstanceID starts from 0 for every draw
+  GLint loc = glGetUniformLocation(program, "instanceOffset");
+  for (int lod = 0; lod < NUM_LIGHT_LODS; ++lod)
+  {
+    int numInstances = lodOffsets[lod + 1] - lodOffsets[lod];
+    if (numInstances == 0)
+      continue;
 
+    const MeshLod &range = _icosphere->GetLod(lod);
+    glUniform1i(loc, lodOffsets[lod]);
+    DrawMeshRange(*_icosphere, range, numInstances);
+  }
+}
+
+void Scene::DrawLightPoints(const Camera &camera)
+{
   // Bind the shader program for light point visualization
-  glUseProgram(shaderProgram[ShaderProgram::InstancedLightVis]);
+  GLuint program = shaderProgram[ShaderProgram::InstancedLightVis];
+  _glState.UseProgram(program);
 
-  // Draw light volumes as small points for visualization purposes
-  lightPass(LightSet::All, true);
+  // Draw light volumes as small points for visualization purposes, these mostly end up with the coarsest level
+  _glState.BindVertexArray(_icosphere->GetVAO());
+  if (_gpuLights)
+  {
+    DrawGpuLightVolumes(program, LightSet::All);
+    return;
+  }
+
+  int lodOffsets[NUM_LIGHT_LODS + 1];
+  int numLights = UpdateLightData(LightSet::All, true, camera, lodOffsets);
+  if (numLights > 0)
+    DrawLightVolumes(program, lodOffsets);
 }
 
-void Scene::DrawAmbientPass()
+void Scene::InitGpuLights()
 {
-  GLuint program = shaderProgram[ShaderProgram::AmbientLightPass];
+  // Each draw gets a range for all the lights as any of them may end up in it
+  const GLsizeiptr numSlots = NUM_GPU_LIGHT_SETS * NUM_LIGHT_LODS * _numLights;
+  GLint maxSize = 0;
+  glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxSize);
+  if (numSlots * (GLsizeiptr)sizeof(InstanceData) > (GLsizeiptr)maxSize)
+  {
+    printf("Too many lights for the GPU light buffers, animating them on the CPU!\n");
+    _gpuLights = false;
+    return;
+  }
 
-  // Bind the shader program and update its data
-  glUseProgram(program);
+  // Static light parameters, the first light moves along an unscaled curve of its own
+  std::vector<GpuLightParams> params(_numLights);
+  for (int i = 0; i < _numLights; ++i)
+  {
+    const Light &light = _lights[i];
+    const glm::vec3 curveOffset = (i == 0) ? firstLightOffset : offset;
+    const glm::vec3 curveScale = (i == 0) ? glm::vec3(1.0f) : scale;
+    params[i] = {light.movement, light.color, glm::vec4(curveOffset, light.radius), glm::vec4(curveScale, 0.0f)};
+  }
 
-  // Set the global ambient light
-  const float lightIntensity = 0.01f;
-  glUniform3f(0, lightIntensity, lightIntensity, lightIntensity);
+  glGenBuffers(1, &_gpuLightParams);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _gpuLightParams);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, _numLights * sizeof(GpuLightParams), params.data(), GL_STATIC_DRAW);
+
+  // Instance and light data written and read by the GPU only
+  glGenBuffers(1, &_gpuLightInstances);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _gpuLightInstances);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, numSlots * sizeof(InstanceData), nullptr, GL_DYNAMIC_COPY);
+  glGenBuffers(1, &_gpuLightData);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _gpuLightData);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, numSlots * sizeof(LightData), nullptr, GL_DYNAMIC_COPY);
+  glGenBuffers(1, &_gpuAllLights);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _gpuAllLights);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, _numLights * sizeof(LightData), nullptr, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  // Draws of all the sets and levels with no instances, the compute shader appends them
+  DrawElementsIndirectCommand commands[NUM_GPU_LIGHT_SETS * NUM_LIGHT_LODS];
+  for (int set = 0; set < NUM_GPU_LIGHT_SETS; ++set)
+  {
+    for (int lod = 0; lod < NUM_LIGHT_LODS; ++lod)
+    {
+      const MeshLod &range = _icosphere->GetLod(lod);
+      commands[set * NUM_LIGHT_LODS + lod] = {(GLuint)range.indexCount, 0, range.firstIndex, range.baseVertex, 0};
+    }
+  }
 
-  // Draw fullscreen quad - textures already bound outside the scope
-  glBindVertexArray(_vao);
-  glDrawArrays(GL_TRIANGLES, 0, 6);
+  glGenBuffers(1, &_gpuLightCommandsReset);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _gpuLightCommandsReset);
+  glBufferData(GL_COPY_WRITE_BUFFER, sizeof(commands), commands, GL_STATIC_COPY);
+  glGenBuffers(1, &_gpuLightCommands);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _gpuLightCommands);
+  glBufferData(GL_COPY_WRITE_BUFFER, sizeof(commands), nullptr, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+  GpuMemory &memory = GpuMemory::GetInstance();
+  memory.TrackBuffer(_gpuLightParams, _numLights * sizeof(GpuLightParams), "Lights");
+  memory.TrackBuffer(_gpuLightInstances, numSlots * sizeof(InstanceData), "Lights");
+  memory.TrackBuffer(_gpuLightData, numSlots * sizeof(LightData), "Lights");
+  memory.TrackBuffer(_gpuAllLights, _numLights * sizeof(LightData), "Lights");
+  memory.TrackBuffer(_gpuLightCommandsReset, sizeof(commands), "Lights");
+  memory.TrackBuffer(_gpuLightCommands, sizeof(commands), "Lights");
 }
 
-void Scene::Draw(const Camera &camera, const RenderTargets &renderTargets)
+void Scene::UpdateGpuLights(const Camera &camera)
 {
-  UpdateTransformBlock(camera);
+  // Reset the instance counts of all the draws, the copy never leaves the GPU
+  glBindBuffer(GL_COPY_READ_BUFFER, _gpuLightCommandsReset);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _gpuLightCommands);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, NUM_GPU_LIGHT_SETS * NUM_LIGHT_LODS * sizeof(DrawElementsIndirectCommand));
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+  GLuint program = shaderProgram[ShaderProgram::LightAnimation];
+  _glState.UseProgram(program);
 
-  // Enable depth test, clamp, and write
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_DEPTH_CLAMP);
-  glDepthFunc(GL_LEQUAL);
-  glDepthMask(GL_TRUE);
+  // Send in the required data, the light parameters are already on the GPU
+  const glm::vec4 &cameraPos = camera.GetViewToWorld()[3];
+  glUniform1i(0, _numLights);
+  glUniform1f(1, _lightTime);
+  glUniform3f(2, cameraPos.x, cameraPos.y, cameraPos.z);
+  glUniform1f(3, camera.GetProjection()[1][1]);
+  glUniform1fv(4, NUM_LIGHT_LODS - 1, lightLodScreenSize);
+
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _gpuLightParams);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _gpuLightInstances);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _gpuLightData);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _gpuAllLights);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _gpuLightCommands);
+  glDispatchCompute((_numLights + lightAnimationGroupSize - 1) / lightAnimationGroupSize, 1, 1);
+}
 
-  // Enable backface culling
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_BACK);
+void Scene::DrawGpuLightVolumes(GLuint program, LightSet lightSet)
+{
+  // Sets follow each other in the command buffer in the order of the compute shader
+  const int set = (lightSet == LightSet::Inside) ? 0 : (lightSet == LightSet::Outside) ? 1 : 2;
 
-  // --------------------------------------------------------------------------
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _gpuLightInstances);
+  _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _gpuLightData);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _gpuLightCommands);
 
-  // Bind the GBuffer
-  glBindFramebuffer(GL_FRAMEBUFFER, renderTargets.gBufferFbo);
+  // Every draw has the range for all the lights, the number of instances comes from the GPU
+  GLint loc = glGetUniformLocation(program, "instanceOffset");
+  for (int lod = 0; lod < NUM_LIGHT_LODS; ++lod)
+  {
+    int draw = set * NUM_LIGHT_LODS + lod;
+    glUniform1i(loc, draw * _numLights);
+    glDrawElementsIndirect(GL_TRIANGLES, _icosphere->GetIndexType(), reinterpret_cast<void*>(draw * sizeof(DrawElementsIndirectCommand)));
+  }
+
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
 
-  // Clear the color and depth buffers
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void Scene::UpdateTiledLightData()
+{
+  // The light animation already wrote all the lights
+  if (_gpuLights)
+  {
+    _glState.BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _gpuAllLights);
+    return;
+  }
+
+  // Nothing to upload
+  if (_numLights == 0)
+    return;
+
+  for (int i = 0; i < _numLights; ++i)
+  {
+    _lightData[i].position = glm::vec4(_lights[i].position, _lights[i].radius);
+    _lightData[i].color = _lights[i].color;
+  }
+
+  // Copy the data to the ring buffer and bind it to the storage buffer index 0
+  GLintptr offset = 0;
+  GLsizeiptr dataSize = _numLights * sizeof(LightData);
+  if (_dataStream.Upload(&*_lightData.begin(), dataSize, dataSize, offset))
+    _dataStream.Bind(GL_SHADER_STORAGE_BUFFER, 0, offset, dataSize);
+}
+
+void Scene::DrawTiledLights(const Camera &camera, GLuint hdrTexture, int width, int height)
+{
+  // Update the light storage buffer
+  UpdateTiledLightData();
+
+  GLuint program = shaderProgram[ShaderProgram::TiledLightPass];
+  _glState.UseProgram(program);
+
+  // Send in the required data, GBuffer textures are already bound by the pass
+  glUniform1i(0, _numLights);
+  glUniform2f(1, camera.GetNearClip(), camera.GetFarClip());
+  glUniform3f(2, ambientLightIntensity, ambientLightIntensity, ambientLightIntensity);
+  glUniform2i(3, width, height);
+
+  // Each work group shades a single tile writing directly to the HDR render target
+  glBindImageTexture(0, hdrTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+  glDispatchCompute((width + TILE_SIZE - 1) / TILE_SIZE, (height + TILE_SIZE - 1) / TILE_SIZE, 1);
+}
+
+void Scene::DrawAmbientPass(bool classifiedEdges)
+{
+  // Shader programs for the ambient pass, the second one shades the edge samples
+  const GLuint programs[2] = {shaderProgram[ShaderProgram::AmbientLightPass], shaderProgram[ShaderProgram::AmbientLightPassPerSample]};
+  const int numPasses = classifiedEdges ? 2 : 1;
+
+  if (classifiedEdges)
+    _glState.Enable(GL_STENCIL_TEST);
+
+  _glState.BindVertexArray(_vao);
+  for (int pass = 0; pass < numPasses; ++pass)
+  {
+    if (classifiedEdges)
+      _glState.StencilFunc(GL_EQUAL, pass, 0x01);
+
+    // Bind the shader program and update its data
+    _glState.UseProgram(programs[pass]);
+
+    // Set the global ambient light
+    glUniform3f(0, ambientLightIntensity, ambientLightIntensity, ambientLightIntensity);
+
+    // Draw fullscreen quad - textures already bound outside the scope
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+  }
+
+  _glState.Disable(GL_STENCIL_TEST);
+}
+
+void Scene::AddPasses(FrameGraph &frameGraph, const Camera &camera, RenderTargets &renderTargets, int lightingMode)
+{
+  // The state cache only trusts what was set through it since here
+  _glState.BeginFrame();
+
+  // Move to the next section of the instance and light ring buffer
+  _dataStream.BeginFrame();
+
+  UpdateTransformBlock(camera);
+
+  // GBuffer and HDR targets, the compact layout keeps the occlusion in the color alpha and has no material buffer,
+  // RGBA HDR as there are no 3 component image formats for the tiled light pass
+  const int width = renderTargets.width;
+  const int height = renderTargets.height;
+  const GLsizei samples = renderTargets.samples;
+  const bool compact = renderTargets.compact;
+  renderTargets.depthStencil = frameGraph.CreateTexture("Depth", {GL_DEPTH32F_STENCIL8, GL_DEPTH_STENCIL, GL_FLOAT_32_UNSIGNED_INT_24_8_REV, GL_NEAREST, width, height, samples});
+  renderTargets.color = compact ? frameGraph.CreateTexture("Color", {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_LINEAR, width, height, samples})
+                                : frameGraph.CreateTexture("Color", {GL_RGB8, GL_RGB, GL_BYTE, GL_LINEAR, width, height, samples});
+  renderTargets.normal = compact ? frameGraph.CreateTexture("Normal", {GL_RGB10_A2, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, GL_LINEAR, width, height, samples})
+                                 : frameGraph.CreateTexture("Normal", {GL_RG16F, GL_RG, GL_FLOAT, GL_LINEAR, width, height, samples});
+  renderTargets.material = compact ? -1 : frameGraph.CreateTexture("Material", {GL_RGB8UI, GL_RGB_INTEGER, GL_BYTE, GL_LINEAR, width, height, samples});
+  renderTargets.hdr = frameGraph.CreateTexture("HDR", {GL_RGBA16F, GL_RGBA, GL_FLOAT, GL_LINEAR, width, height, samples});
+  const RenderTargets targets = renderTargets;
+  const int renderWidth = targets.renderWidth > 0 ? targets.renderWidth : width;
+  const int renderHeight = targets.renderHeight > 0 ? targets.renderHeight : height;
+  const FrameResource gBuffer[] = {targets.depthStencil, targets.color, targets.normal, targets.material};
+
+  // Lights and indirect draws written by the light animation, the CPU lights are uploaded by the passes themselves
+  const FrameResource gpuLights = _gpuLights ? frameGraph.ImportBuffer("GPU lights", _gpuLightData) : -1;
+  const FrameResource lightCommands = _gpuLights ? frameGraph.ImportBuffer("Light commands", _gpuLightCommands) : -1;
+  // Every light regardless of the visibility sets, read by the tiled lighting
+  const FrameResource allLights = _gpuLights ? frameGraph.ImportBuffer("All lights", _gpuAllLights) : -1;
+
+  // Depth test, clamp, and write with backface culling, the reverse-Z depth decreases with the distance, the light volumes
+  // are tested the same way
+  const GLenum depthFunc = camera.IsReverseZ() ? GL_GEQUAL : GL_LEQUAL;
+  const PipelineState gBufferState = {true, depthFunc, GL_TRUE, true, true, GL_BACK, false, GL_FUNC_ADD, GL_ONE, GL_ONE, false, GL_FILL};
+  // We primed the depth buffer in the GBuffer pass, no need to write to it anymore, lights are blended additively
+  const PipelineState lightState = {true, depthFunc, GL_FALSE, true, true, GL_BACK, true, GL_FUNC_ADD, GL_ONE, GL_ONE, false, GL_FILL};
+  const bool multisampled = samples > 1;
+
+  // --------------------------------------------------------------------------
+
+  // Animate and classify the lights before anything reads them
+  int pass = -1;
+  if (_gpuLights)
+  {
+    pass = frameGraph.AddPass("Light animation", [this, &camera](const FrameGraph &) { UpdateGpuLights(camera); });
+    frameGraph.Write(pass, gpuLights, ResourceAccess::Storage);
+    frameGraph.Write(pass, lightCommands, ResourceAccess::Storage);
+    frameGraph.Write(pass, allLights, ResourceAccess::Storage);
+  }
 
   // Render the scene into the GBuffer only
-  DrawBackground();
-  DrawObjects();
+  pass = frameGraph.AddPass("GBuffer", [this, &camera, gBufferState](const FrameGraph &)
+  {
+    _glState.Apply(gBufferState);
+
+    // Clear the color, depth and stencil buffers
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClearStencil(0);
+    glClearDepth(camera.IsReverseZ() ? 0.0 : 1.0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-  // We primed the depth buffer, no need to write to it anymore
-  glDepthMask(GL_FALSE);
+    DrawBackground();
+    DrawObjects();
+  });
+  frameGraph.SetViewport(pass, renderWidth, renderHeight);
+  for (FrameResource resource : gBuffer)
+    frameGraph.Write(pass, resource, ResourceAccess::Attachment);
 
   // --------------------------------------------------------------------------
 
-  // Bind the HDR framebuffer
-  glBindFramebuffer(GL_FRAMEBUFFER, renderTargets.hdrFbo);
-
-  // Clear the color buffer
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-  glClear(GL_COLOR_BUFFER_BIT);
-
-  // Enable additive alpha blending
-  glEnable(GL_BLEND);
-  glBlendEquation(GL_FUNC_ADD);
-  glBlendFunc(GL_ONE, GL_ONE);
-
-  // Bind the GBuffer textures
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.depthStencil);
-  glBindSampler(0, 0);
-  glActiveTexture(GL_TEXTURE1);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.colorRT);
-  glBindSampler(1, 0);
-  glActiveTexture(GL_TEXTURE2);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.normalRT);
-  glBindSampler(2, 0);
-  glActiveTexture(GL_TEXTURE3);
-  glBindTexture(GL_TEXTURE_2D, renderTargets.materialRT);
-  glBindSampler(3, 0);
-
-  // Combine the GBuffer into the HDR buffer using ambient light
-  DrawAmbientPass();
-
-  // Draw all the lights in the scene using the GBuffer as input outputting to the HDR buffer
-  DrawLights(camera);
-
-  // Disable blending
-  glDisable(GL_BLEND);
+#if _ALLOW_TILED_LIGHTING
+  if (lightingMode == LightingMode::Tiled)
+  {
+    // Ambient and all the lights in the scene in a single pass over the GBuffer
+    pass = frameGraph.AddPass("Tiled lights", [this, &camera, targets, lightState, renderWidth, renderHeight](const FrameGraph &frameGraph)
+    {
+      _glState.Apply(lightState);
+      BindGBuffer(frameGraph, targets);
+      DrawTiledLights(camera, frameGraph.GetTexture(targets.hdr), renderWidth, renderHeight);
+    });
+    for (FrameResource resource : gBuffer)
+      frameGraph.Read(pass, resource, ResourceAccess::Texture);
+    frameGraph.Read(pass, allLights, ResourceAccess::Storage);
+    frameGraph.Write(pass, targets.hdr, ResourceAccess::Image);
+  }
+  else
+#endif
+  {
+    // Mark the pixels whose samples differ, only those are shaded per sample
+    if (multisampled)
+    {
+      pass = frameGraph.AddPass("Edges", [this, targets, lightState](const FrameGraph &frameGraph)
+      {
+        _glState.Apply(lightState);
+        BindGBuffer(frameGraph, targets);
+        ClassifyEdges();
+      });
+      frameGraph.SetViewport(pass, renderWidth, renderHeight);
+      for (FrameResource resource : gBuffer)
+        frameGraph.Read(pass, resource, ResourceAccess::Texture);
+      frameGraph.Write(pass, targets.depthStencil, ResourceAccess::Attachment);
+    }
+
+    // Combine the GBuffer into the HDR buffer using ambient light
+    pass = frameGraph.AddPass("Ambient", [this, targets, lightState, multisampled](const FrameGraph &frameGraph)
+    {
+      _glState.Apply(lightState);
+
+      // Clear the color buffer
+      glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+      glClear(GL_COLOR_BUFFER_BIT);
+
+      BindGBuffer(frameGraph, targets);
+      DrawAmbientPass(multisampled);
+    });
+    frameGraph.SetViewport(pass, renderWidth, renderHeight);
+    for (FrameResource resource : gBuffer)
+      frameGraph.Read(pass, resource, ResourceAccess::Texture);
+    frameGraph.Read(pass, targets.depthStencil, ResourceAccess::Attachment);
+    frameGraph.Write(pass, targets.hdr, ResourceAccess::Attachment);
+
+    // Draw all the lights in the scene using the GBuffer as input outputting to the HDR buffer
+    pass = frameGraph.AddPass("Lights", [this, &camera, targets, lightState, multisampled](const FrameGraph &frameGraph)
+    {
+      _glState.Apply(lightState);
+      BindGBuffer(frameGraph, targets);
+      DrawLights(camera, multisampled);
+    });
+    frameGraph.SetViewport(pass, renderWidth, renderHeight);
+    for (FrameResource resource : gBuffer)
+      frameGraph.Read(pass, resource, ResourceAccess::Texture);
+    frameGraph.Read(pass, targets.depthStencil, ResourceAccess::Attachment);
+    frameGraph.Read(pass, gpuLights, ResourceAccess::Storage);
+    frameGraph.Read(pass, lightCommands, ResourceAccess::Indirect);
+    frameGraph.Read(pass, targets.hdr, ResourceAccess::Attachment);
+    frameGraph.Write(pass, targets.hdr, ResourceAccess::Attachment);
+  }
+
+  // Draw light points blended over the lit image
+  pass = frameGraph.AddPass("Light points", [this, &camera, lightState](const FrameGraph &)
+  {
+    _glState.Apply(lightState);
+    DrawLightPoints(camera);
+  });
+  frameGraph.SetViewport(pass, renderWidth, renderHeight);
+  frameGraph.Read(pass, targets.depthStencil, ResourceAccess::Attachment);
+  frameGraph.Read(pass, gpuLights, ResourceAccess::Storage);
+  frameGraph.Read(pass, lightCommands, ResourceAccess::Indirect);
+  frameGraph.Read(pass, targets.hdr, ResourceAccess::Attachment);
+  frameGraph.Write(pass, targets.hdr, ResourceAccess::Attachment);
+}
+
+void Scene::EndFrame()
+{
+  // Guard the instance and light data until the GPU is done with this frame
+  _dataStream.EndFrame();
+}
+
+void Scene::BindGBuffer(const FrameGraph &frameGraph, const RenderTargets &renderTargets) const
+{
+  frameGraph.BindTexture(0, renderTargets.depthStencil);
+  frameGraph.BindTexture(1, renderTargets.color);
+  frameGraph.BindTexture(2, renderTargets.normal);
+  frameGraph.BindTexture(3, renderTargets.material);
 }
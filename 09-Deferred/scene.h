@@ -6,7 +6,11 @@
 #pragma once
 
 #include <Camera.h>
+#include <FrameGraph.h>
 #include <Geometry.h>
+#include <GLState.h>
+#include <StreamingBuffer.h>
+#include <TextureLoader.h>
 #include <Textures.h>
 
 // Textures we'll be using
@@ -18,11 +22,28 @@ namespace LoadedTextures
   };
 }
 
+// Materials of the scene objects, each is a set of the loaded textures
+namespace Material
+{
+  enum
+  {
+    Background, Terracotta, NumMaterials
+  };
+}
+
 namespace DisplayMode
 {
   enum
   {
-    Default, Color, Depth, Normals, Specular, Occlusion
+    Default, Color, Depth, Normals, Specular, Occlusion, NormalError, Edges
+  };
+}
+
+namespace LightingMode
+{
+  enum
+  {
+    Volumes, Tiled, NumLightingModes
   };
 }
 
@@ -33,31 +54,40 @@ struct RenderMode
   bool vsync;
   // Display mode for presentation
   int displayMode;
+  // Light volumes or tiled light pass
+  int lightingMode;
 };
 
+// Render targets of a frame, transient textures of the frame graph declared by Scene::AddPasses()
 struct RenderTargets
 {
-  // Framebuffer object for HDR rendering
-  GLuint hdrFbo = 0;
-  // Framebuffer object for GBuffer rendering
-  GLuint gBufferFbo = 0;
   // Render target for HDR rendering
-  GLuint hdrRT = 0;
-  // Depth stencil target
-  GLuint depthStencil = 0;
-  // Diffuse color buffer
-  GLuint colorRT = 0;
-  // Normals buffer
-  GLuint normalRT = 0;
-  // Material buffer
-  GLuint materialRT = 0;
+  FrameResource hdr = -1;
+  // Depth stencil target, the stencil marks the edge pixels of the multisampled GBuffer
+  FrameResource depthStencil = -1;
+  // Diffuse color buffer, occlusion in alpha in the compact layout
+  FrameResource color = -1;
+  // Normals buffer, specularity in blue in the compact layout
+  FrameResource normal = -1;
+  // Material buffer, invalid in the compact layout
+  FrameResource material = -1;
+  // Size of the render targets
+  int width = 0;
+  int height = 0;
+  // Rendered part of the render targets starting at their origin, smaller than their size with dynamic resolution
+  int renderWidth = 0;
+  int renderHeight = 0;
+  // Number of samples of all the render targets, 1 if they aren't multisampled
+  GLsizei samples = 1;
+  // Compact GBuffer layout?
+  bool compact = false;
 };
 
 // Very simple scene abstraction class
 class Scene
 {
 public:
-  // Maximum number of allowed instances - must match the instancing vertex shader!
+  // Maximum number of allowed instances in uniform buffers - must match the instancing vertex shader!
   static const unsigned int MAX_INSTANCES = 1024;
 
   // Get and create instance for this singleton
@@ -66,17 +96,48 @@ public:
   void Init(int numCubes, int numLights);
   // Updates positions
   void Update(float dt, const Camera &camera);
-  // Draw the scene
-  void Draw(const Camera &camera, const RenderTargets &renderTargets);
+  // Declare the render targets of the given size and the passes drawing the scene into them, fills in the resources
+  void AddPasses(FrameGraph &frameGraph, const Camera &camera, RenderTargets &renderTargets, int lightingMode);
+  // Call after the passes were executed
+  void EndFrame();
+  // Release all scene resources so that it can be initialized again
+  void Release();
+  // Block until all textures are loaded, e.g., so that benchmarks don't measure the placeholders
+  void FinishLoading() { _textureLoader.Finish(); }
+  // Maximum number of cubes and lights allowed by the instance and light buffers, requires valid OpenGL context
+  unsigned int GetMaxInstances() const;
   // Return the generic VAO for rendering
   GLuint GetGenericVAO() { return _vao; }
+  // Animate and classify the lights on the GPU instead of the CPU, returns whether the GPU lights are used
+  bool SetGpuLights(bool enable);
+  // Are the lights animated on the GPU?
+  bool GetGpuLights() const { return _gpuLights; }
 
 private:
+  // Tile size of the tiled light pass in pixels - must match the tiled light pass compute shader!
+  static const int TILE_SIZE = 16;
+  // Maximum number of materials - must match the MaterialBlock in the GBuffer shaders!
+  static const int MAX_MATERIALS = 16;
+  // Number of levels of detail of the light volumes - must match the light animation compute shader!
+  static const int NUM_LIGHT_LODS = 3;
+  // Light sets appended to by the light animation compute shader: inside, outside and visualization
+  static const int NUM_GPU_LIGHT_SETS = 3;
+
   // GPU data for a single object instance
   struct InstanceData
   {
-    // In this simple example just a transformation matrix, transposed for efficient storage
+    // Transformation matrix, transposed for efficient storage
     glm::mat3x4 transformation;
+    // Material of the instance, padded to vec4
+    GLuint material;
+    GLuint padding[3];
+  };
+
+  // Bindless texture handles of a single material, std140 layout - must match the MaterialBlock in the shaders!
+  struct MaterialData
+  {
+    // Diffuse, normal, specular and occlusion texture handles
+    GLuint64 handles[4];
   };
 
   // GPU data for a single light instance
@@ -88,6 +149,29 @@ private:
     glm::vec4 color;
   };
 
+  // Static parameters of a light animated on the GPU, std430 layout - must match the light animation compute shader!
+  struct GpuLightParams
+  {
+    // Parameters for the light movement
+    glm::vec4 movement;
+    // Color and ambient intensity of the light
+    glm::vec4 color;
+    // Offset of the movement curve, radius of the light in w
+    glm::vec4 offset;
+    // Scale of the movement curve
+    glm::vec4 scale;
+  };
+
+  // Indirect draw command of glDrawElementsIndirect()
+  struct DrawElementsIndirectCommand
+  {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+  };
+
   // Structure describing light
   struct Light
   {
@@ -116,29 +200,61 @@ private:
 
   // Helper function for binding the appropriate textures
   void BindTextures(const GLuint &diffuse, const GLuint &normal, const GLuint &specular, const GLuint &occlusion);
+  // Bind the textures of the material, nothing to do when the materials are bindless
+  void BindMaterial(int material);
+  // Refresh the bindless handles of the materials whose textures changed, e.g., when the loader replaced a placeholder
+  void UpdateMaterials();
   // Helper function for creating and updating the instance data
   void UpdateInstanceData();
-  // Helper function for creating and updating light data
-  int UpdateLightData(LightSet lightSet, bool visualization);
+  // Helper function for creating and updating light data, the lights are sorted by the level of detail of their volume,
+  // lodOffsets receive the first light of each level and the total number of lights at the end
+  int UpdateLightData(LightSet lightSet, bool visualization, const Camera &camera, int lodOffsets[NUM_LIGHT_LODS + 1]);
+  // Pick the level of detail of the light volume based on its size on the screen
+  int SelectLightLod(const glm::vec3 &position, float radius, const Camera &camera) const;
   // Helper method to update transformation uniform block
   void UpdateTransformBlock(const Camera &camera);
+  // Bind the GBuffer textures to the units 0-3
+  void BindGBuffer(const FrameGraph &frameGraph, const RenderTargets &renderTargets) const;
   // Draw the backdrop, floor and walls
   void DrawBackground();
   // Draw cubes
   void DrawObjects();
-  // Draw lights
-  void DrawLights(const Camera &camera);
-  // Draw the ambient light fullscreen pass
-  void DrawAmbientPass();
+  // Mark the edge pixels of the multisampled GBuffer in the stencil
+  void ClassifyEdges();
+  // Draw lights, with classified edges the edge pixels are drawn again per sample
+  void DrawLights(const Camera &camera, bool classifiedEdges);
+  // Draw the light volumes of the uploaded lights using one instanced draw per level of detail
+  void DrawLightVolumes(GLuint program, const int lodOffsets[NUM_LIGHT_LODS + 1]);
+  // Draw light positions as small points
+  void DrawLightPoints(const Camera &camera);
+  // Create the buffers of the GPU lights, their parameters are uploaded just once
+  void InitGpuLights();
+  // Animate the lights and append them to the indirect draws of their light set and level of detail on the GPU
+  void UpdateGpuLights(const Camera &camera);
+  // Draw the light volumes of a light set appended on the GPU using one indirect draw per level of detail,
+  // LightSet::All draws the visualized points
+  void DrawGpuLightVolumes(GLuint program, LightSet lightSet);
+  // Copy all lights to the storage buffer of the tiled light pass
+  void UpdateTiledLightData();
+  // Draw ambient and all the lights using a single compute pass over screen tiles
+  void DrawTiledLights(const Camera &camera, GLuint hdrTexture, int width, int height);
+  // Draw the ambient light fullscreen pass, with classified edges the edge pixels are drawn again per sample
+  void DrawAmbientPass(bool classifiedEdges);
 
   // Textures helper instance
   Textures &_textures;
+  // Shadowed OpenGL state of the passes
+  GLState &_glState;
   // Loaded textures
   GLuint _loadedTextures[LoadedTextures::NumTextures] = {0};
+  // Background loader of the texture files
+  TextureLoader _textureLoader;
   // Number of cubes in the scene
   int _numCubes = 10;
   // Cube positions
   std::vector<glm::vec3> _cubePositions;
+  // Cube rotations around the diagonal in radians
+  std::vector<float> _cubeAngles;
   // Number of lights in the scene
   int _numLights;
   // All lights lights data
@@ -147,18 +263,45 @@ private:
   std::vector<int> _insideLights;
   // Indices of lights well outside the camera
   std::vector<int> _outsideLights;
+  // Instance data CPU side buffer
+  std::vector<InstanceData> _instanceData;
+  // Light data CPU side buffer
+  std::vector<LightData> _lightData;
+  // Level of detail of the lights being uploaded
+  std::vector<int> _lightLods;
   // General use VAO
   GLuint _vao = 0;
-  // Quad instance
-  Mesh<Vertex_Pos_Nrm_Tgt_Tex> *_quad = nullptr;
-  // Cube instance
-  Mesh<Vertex_Pos_Nrm_Tgt_Tex> *_cube = nullptr;
-  // Icosahedron instance for light rendering
-  Mesh<Vertex_Pos> *_icosahedron = nullptr;
-  // Instancing buffer handle
-  GLuint _instancingBuffer = 0;
-  // Light buffer handle
-  GLuint _lightBuffer = 0;
+  // Quad and cube suballocated from a single pair of buffers
+  SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *_sceneMeshes = nullptr;
+  // Range of the quad within the scene meshes
+  MeshLod _quadRange = {0, 0, 0};
+  // Range of the cube within the scene meshes
+  MeshLod _cubeRange = {0, 0, 0};
+  // Icosphere with levels of detail for light rendering
+  Mesh<Vertex_Pos> *_icosphere = nullptr;
+  // Ring buffer streaming the instance and light data of all passes
+  StreamingBuffer _dataStream;
+  // Size of the instance and light buffer blocks, uniform blocks have to be backed by the whole declared size
+  GLsizeiptr _instanceBlockSize = 0;
+  GLsizeiptr _lightBlockSize = 0;
   // Transformation matrices uniform buffer object
   GLuint _transformBlockUBO = 0;
+  // Textures the material handles were created for, detects the textures swapped by the loader
+  GLuint _materialTextures[Material::NumMaterials][4] = {{0}};
+  // Bindless handles of all materials
+  MaterialData _materialData[Material::NumMaterials] = {};
+  // Material uniform buffer object, only used with bindless materials
+  GLuint _materialUBO = 0;
+  // Are the lights animated and classified on the GPU?
+  bool _gpuLights = false;
+  // Animation time of the lights sent to the GPU
+  float _lightTime = 0.0f;
+  // Static light parameters, instance and light data of all draws, all the lights for the tiled pass
+  GLuint _gpuLightParams = 0;
+  GLuint _gpuLightInstances = 0;
+  GLuint _gpuLightData = 0;
+  GLuint _gpuAllLights = 0;
+  // Indirect draws of the light sets and the initial commands with no instances copied over them every frame
+  GLuint _gpuLightCommands = 0;
+  GLuint _gpuLightCommandsReset = 0;
 };
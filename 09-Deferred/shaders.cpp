@@ -5,12 +5,42 @@
 
 #include "shaders.h"
 
+#include <cstdio>
+#include <cstring>
+
+#include <ProgramCache.h>
+#include <ShaderReloader.h>
+
 GLuint shaderProgram[ShaderProgram::NumShaderPrograms] = {0};
+bool bindlessMaterials = false;
+bool compactGBuffer = false;
+GLsizei gBufferSamples = MSAA_SAMPLES;
+bool reverseDepth = true;
 
-bool compileShaders()
+// Uniform blocks of all programs, each is bound to the binding point of its index in the table,
+// storage buffers and blocks not used by a program are skipped
+static const char *uniformBlockNames[] = {"TransformBlock", "InstanceBuffer", "LightBuffer", "MaterialBlock", "ExposureBlock"};
+
+// Program binaries of the previous launch
+static const char programCacheName[] = "09-Deferred.programs";
+
+// Directory with the editable shader files and their names based on the shader enums
+static const char shaderDirectory[] = "09-Deferred.shaders";
+static const char *vsNames[VertexShader::NumVertexShaders] = {"Default", "Instancing", "Light", "ScreenQuad"};
+static const char *fsNames[FragmentShader::NumFragmentShaders] = {"GBuffer", "GBufferBindless", "EdgeClassification", "AmbientPass", "LightPass", "LightColor", "Tonemapping"};
+static const char *csNames[ComputeShader::NumComputeShaders] = {"TiledLightPass", "LightAnimation"};
+
+// Watches the shader files when they're enabled
+static ShaderReloader shaderReloader;
+
+// Compile all shaders and link them into the shader programs
+static bool buildPrograms()
 {
   GLuint vertexShader[VertexShader::NumVertexShaders] = {0};
   GLuint fragmentShader[FragmentShader::NumFragmentShaders] = {0};
+  GLuint computeShader[ComputeShader::NumComputeShaders] = {0};
+  // Variants of the ambient and light pass shading each sample of the edge pixels
+  GLuint perSampleShader[2] = {0};
 
   // Cleanup lambda
   auto cleanUp = [&]()
@@ -41,15 +71,18 @@ bool compileShaders()
       if (glIsShader(fragmentShader[i]))
         glDeleteShader(fragmentShader[i]);
     }
-  };
 
-  // UBO explicit binding lambda - call after program linking
-  auto uniformBlockBinding = [](GLuint program, const char* blockName = "TransformBlock", GLint binding = 0)
-  {
-    // Get UBO index from the program
-    GLuint uboIndex = glGetUniformBlockIndex(program, blockName);
-    // Bind it always to slot "binding" - since GLSL 420, it's possible to specify it in the layout block
-    glUniformBlockBinding(program, uboIndex, binding);
+    for (int i = 0; i < ComputeShader::NumComputeShaders; ++i)
+    {
+      if (glIsShader(computeShader[i]))
+        glDeleteShader(computeShader[i]);
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+      if (glIsShader(perSampleShader[i]))
+        glDeleteShader(perSampleShader[i]);
+    }
   };
 
   // Compile all vertex shaders
@@ -63,10 +96,28 @@ bool compileShaders()
     }
   }
 
+  // Shaders accessing the GBuffer select the layout, the number of samples, and the depth mapping by the defines,
+  // they're ignored by the rest
+  const bool multisampled = gBufferSamples > 1;
+  char gBufferDefines[128];
+  char perSampleDefines[160];
+  snprintf(gBufferDefines, sizeof(gBufferDefines), "%s%s", compactGBuffer ? "#define COMPACT_GBUFFER 1\n" : "", reverseDepth ? "#define REVERSE_Z 1\n" : "");
+  if (multisampled)
+    snprintf(gBufferDefines + strlen(gBufferDefines), sizeof(gBufferDefines) - strlen(gBufferDefines), "#define MSAA_SAMPLES %d\n", gBufferSamples);
+  snprintf(perSampleDefines, sizeof(perSampleDefines), "%s#define PER_SAMPLE 1\n", gBufferDefines);
+
   // Compile all fragment shaders
   for (int i = 0; i < FragmentShader::NumFragmentShaders; ++i)
   {
-    fragmentShader[i] = ShaderCompiler::CompileShader(fsSource, i, GL_FRAGMENT_SHADER);
+    // Bindless variant wouldn't compile without the extension
+    if (i == FragmentShader::GBufferBindless && !bindlessMaterials)
+      continue;
+
+    // Edges are classified only in the multisampled GBuffer
+    if (i == FragmentShader::EdgeClassification && !multisampled)
+      continue;
+
+    fragmentShader[i] = ShaderCompiler::CompileShader(fsSource, i, GL_FRAGMENT_SHADER, gBufferDefines);
     if (!fragmentShader[i])
     {
       cleanUp();
@@ -74,28 +125,89 @@ bool compileShaders()
     }
   }
 
+  // Per sample variants of the ambient and light pass
+  if (multisampled)
+  {
+    const int perSampleSources[2] = {FragmentShader::AmbientPass, FragmentShader::LightPass};
+    for (int i = 0; i < 2; ++i)
+    {
+      perSampleShader[i] = ShaderCompiler::CompileShader(fsSource, perSampleSources[i], GL_FRAGMENT_SHADER, perSampleDefines);
+      if (!perSampleShader[i])
+      {
+        cleanUp();
+        return false;
+      }
+    }
+  }
+
+#if _ALLOW_TILED_LIGHTING || _ALLOW_GPU_LIGHTS
+  // Compile all compute shaders
+  for (int i = 0; i < ComputeShader::NumComputeShaders; ++i)
+  {
+    computeShader[i] = ShaderCompiler::CompileShader(csSource, i, GL_COMPUTE_SHADER, gBufferDefines);
+    if (!computeShader[i])
+    {
+      cleanUp();
+      return false;
+    }
+  }
+#endif
+
+  // Material textures are either bound to the texture units or fetched through bindless handles
+  const GLuint gBufferShader = fragmentShader[bindlessMaterials ? FragmentShader::GBufferBindless : FragmentShader::GBuffer];
+
   // Shader program for non-instanced geometry writing into the GBuffer
   shaderProgram[ShaderProgram::DefaultGBuffer] = glCreateProgram();
   glAttachShader(shaderProgram[ShaderProgram::DefaultGBuffer], vertexShader[VertexShader::Default]);
-  glAttachShader(shaderProgram[ShaderProgram::DefaultGBuffer], fragmentShader[FragmentShader::GBuffer]);
+  glAttachShader(shaderProgram[ShaderProgram::DefaultGBuffer], gBufferShader);
   if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::DefaultGBuffer]))
   {
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::DefaultGBuffer]);
 
   // Shader program for instanced geometry writing into the GBuffer
   shaderProgram[ShaderProgram::InstancedGBuffer] = glCreateProgram();
   glAttachShader(shaderProgram[ShaderProgram::InstancedGBuffer], vertexShader[VertexShader::Instancing]);
-  glAttachShader(shaderProgram[ShaderProgram::InstancedGBuffer], fragmentShader[FragmentShader::GBuffer]);
+  glAttachShader(shaderProgram[ShaderProgram::InstancedGBuffer], gBufferShader);
   if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancedGBuffer]))
   {
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedGBuffer]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedGBuffer], "InstanceBuffer", 1);
+
+  if (multisampled)
+  {
+    // Shader program for the fullscreen edge classification
+    shaderProgram[ShaderProgram::EdgeClassification] = glCreateProgram();
+    glAttachShader(shaderProgram[ShaderProgram::EdgeClassification], vertexShader[VertexShader::ScreenQuad]);
+    glAttachShader(shaderProgram[ShaderProgram::EdgeClassification], fragmentShader[FragmentShader::EdgeClassification]);
+    if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::EdgeClassification]))
+    {
+      cleanUp();
+      return false;
+    }
+
+    // Shader program for ambient fullscreen light pass of the edge samples
+    shaderProgram[ShaderProgram::AmbientLightPassPerSample] = glCreateProgram();
+    glAttachShader(shaderProgram[ShaderProgram::AmbientLightPassPerSample], vertexShader[VertexShader::ScreenQuad]);
+    glAttachShader(shaderProgram[ShaderProgram::AmbientLightPassPerSample], perSampleShader[0]);
+    if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::AmbientLightPassPerSample]))
+    {
+      cleanUp();
+      return false;
+    }
+
+    // Shader program for light pass of the edge samples
+    shaderProgram[ShaderProgram::InstancedLightPassPerSample] = glCreateProgram();
+    glAttachShader(shaderProgram[ShaderProgram::InstancedLightPassPerSample], vertexShader[VertexShader::Light]);
+    glAttachShader(shaderProgram[ShaderProgram::InstancedLightPassPerSample], perSampleShader[1]);
+    if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::InstancedLightPassPerSample]))
+    {
+      cleanUp();
+      return false;
+    }
+  }
 
   // Shader program for ambient fullscreen light pass
   shaderProgram[ShaderProgram::AmbientLightPass] = glCreateProgram();
@@ -116,9 +228,6 @@ bool compileShaders()
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedLightPass]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedLightPass], "InstanceBuffer", 1);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedLightPass], "LightBuffer", 2);
 
   // Shader program for light point visualization
   shaderProgram[ShaderProgram::InstancedLightVis] = glCreateProgram();
@@ -129,9 +238,28 @@ bool compileShaders()
     cleanUp();
     return false;
   }
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedLightVis]);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedLightVis], "InstanceBuffer", 1);
-  uniformBlockBinding(shaderProgram[ShaderProgram::InstancedLightVis], "LightBuffer", 2);
+
+#if _ALLOW_TILED_LIGHTING
+  // Shader program for tiled light pass
+  shaderProgram[ShaderProgram::TiledLightPass] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::TiledLightPass], computeShader[ComputeShader::TiledLightPass]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::TiledLightPass]))
+  {
+    cleanUp();
+    return false;
+  }
+#endif
+
+#if _ALLOW_GPU_LIGHTS
+  // Shader program for the light animation and classification
+  shaderProgram[ShaderProgram::LightAnimation] = glCreateProgram();
+  glAttachShader(shaderProgram[ShaderProgram::LightAnimation], computeShader[ComputeShader::LightAnimation]);
+  if (!ShaderCompiler::LinkProgram(shaderProgram[ShaderProgram::LightAnimation]))
+  {
+    cleanUp();
+    return false;
+  }
+#endif
 
   // Shader program for rendering tonemapping post-process
   shaderProgram[ShaderProgram::Tonemapping] = glCreateProgram();
@@ -146,3 +274,181 @@ bool compileShaders()
   cleanUp();
   return true;
 }
+
+// Set up the state of the linked or restored programs
+static void setUpPrograms()
+{
+  // UBO explicit binding - since GLSL 420, it's possible to specify it in the layout block, but restored
+  // program binaries don't keep the bindings set after linking either way
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    if (!shaderProgram[i])
+      continue;
+
+    for (GLuint binding = 0; binding < sizeof(uniformBlockNames) / sizeof(uniformBlockNames[0]); ++binding)
+    {
+      GLuint uboIndex = glGetUniformBlockIndex(shaderProgram[i], uniformBlockNames[binding]);
+      if (uboIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(shaderProgram[i], uboIndex, binding);
+    }
+  }
+}
+
+// Rebuild all programs from the current sources, the live programs are kept if it fails
+static bool rebuildPrograms()
+{
+  GLuint livePrograms[ShaderProgram::NumShaderPrograms];
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    livePrograms[i] = shaderProgram[i];
+    shaderProgram[i] = 0;
+  }
+
+  const bool success = buildPrograms();
+
+  // Delete whichever set of programs isn't going to be used
+  for (int i = 0; i < ShaderProgram::NumShaderPrograms; ++i)
+  {
+    if (success)
+    {
+      glDeleteProgram(livePrograms[i]);
+    }
+    else
+    {
+      glDeleteProgram(shaderProgram[i]);
+      shaderProgram[i] = livePrograms[i];
+    }
+  }
+
+  if (!success)
+  {
+    printf("Failed to rebuild the shaders, keeping the previous programs!\n");
+    return false;
+  }
+
+  setUpPrograms();
+  printf("Shaders rebuilt.\n");
+  return true;
+}
+
+bool compileShaders()
+{
+#if _ALLOW_BINDLESS_MATERIALS
+  bindlessMaterials = GLAD_GL_ARB_bindless_texture != 0;
+#else
+  bindlessMaterials = false;
+#endif
+
+  // Edges of the multisampled GBuffer are shaded per sample through gl_SampleID
+  if (gBufferSamples > 1 && !GLAD_GL_VERSION_4_0 && !GLAD_GL_ARB_sample_shading)
+  {
+    printf("Sample shading not supported, GBuffer MSAA disabled!\n");
+    gBufferSamples = 1;
+  }
+
+  // The reverse-Z depth is useless without mapping it to [0, 1]
+  if (reverseDepth && !GLAD_GL_VERSION_4_5 && !GLAD_GL_ARB_clip_control)
+  {
+    printf("Clip control not supported, reverse-Z depth disabled!\n");
+    reverseDepth = false;
+  }
+
+  // Reuse the programs of the previous launch if neither the sources nor the driver changed
+  ProgramCache programCache;
+  programCache.AddSources(vsSource, VertexShader::NumVertexShaders);
+  programCache.AddSources(fsSource, FragmentShader::NumFragmentShaders);
+  programCache.AddSources(csSource, ComputeShader::NumComputeShaders);
+  programCache.AddData(&bindlessMaterials, sizeof(bindlessMaterials));
+  programCache.AddData(&compactGBuffer, sizeof(compactGBuffer));
+  programCache.AddData(&gBufferSamples, sizeof(gBufferSamples));
+  programCache.AddData(&reverseDepth, sizeof(reverseDepth));
+
+  if (!programCache.Load(programCacheName, shaderProgram, ShaderProgram::NumShaderPrograms))
+  {
+    if (!buildPrograms())
+      return false;
+
+    programCache.Save(programCacheName, shaderProgram, ShaderProgram::NumShaderPrograms);
+  }
+
+  setUpPrograms();
+  return true;
+}
+
+void toggleShaderFiles()
+{
+  // Register the source tables the first time
+  static bool watching = false;
+  if (!watching)
+  {
+    shaderReloader.Watch(vsSource, vsNames, VertexShader::NumVertexShaders, ".vert");
+    shaderReloader.Watch(fsSource, fsNames, FragmentShader::NumFragmentShaders, ".frag");
+    shaderReloader.Watch(csSource, csNames, ComputeShader::NumComputeShaders, ".comp");
+    watching = true;
+  }
+
+  if (shaderReloader.IsEnabled())
+    shaderReloader.Disable();
+  else if (!shaderReloader.Enable(shaderDirectory))
+    return;
+
+  rebuildPrograms();
+}
+
+void updateShaderFiles()
+{
+  if (shaderReloader.Update())
+    rebuildPrograms();
+}
+
+bool toggleCompactGBuffer()
+{
+  compactGBuffer = !compactGBuffer;
+  if (!rebuildPrograms())
+  {
+    compactGBuffer = !compactGBuffer;
+    return false;
+  }
+
+  printf("%s GBuffer layout.\n", compactGBuffer ? "Compact" : "Default");
+  return true;
+}
+
+bool toggleMsaaGBuffer()
+{
+  if (gBufferSamples == 1 && !GLAD_GL_VERSION_4_0 && !GLAD_GL_ARB_sample_shading)
+  {
+    printf("Sample shading not supported, GBuffer MSAA stays disabled!\n");
+    return false;
+  }
+
+  const GLsizei previousSamples = gBufferSamples;
+  gBufferSamples = gBufferSamples > 1 ? 1 : MSAA_SAMPLES;
+  if (!rebuildPrograms())
+  {
+    gBufferSamples = previousSamples;
+    return false;
+  }
+
+  printf("GBuffer MSAA %s.\n", gBufferSamples > 1 ? "enabled" : "disabled");
+  return true;
+}
+
+bool toggleReverseDepth()
+{
+  if (!reverseDepth && !GLAD_GL_VERSION_4_5 && !GLAD_GL_ARB_clip_control)
+  {
+    printf("Clip control not supported, reverse-Z depth stays disabled!\n");
+    return false;
+  }
+
+  reverseDepth = !reverseDepth;
+  if (!rebuildPrograms())
+  {
+    reverseDepth = !reverseDepth;
+    return false;
+  }
+
+  printf("%s depth.\n", reverseDepth ? "Reverse-Z" : "Traditional");
+  return true;
+}
@@ -7,20 +7,266 @@
 
 #include <ShaderCompiler.h>
 
+// Uses compute shader based tiled lighting, requires OpenGL 4.3 and higher
+#define _ALLOW_TILED_LIGHTING 1
+// Stores instance and light data in storage buffers instead of uniform buffers, requires OpenGL 4.3 and higher
+#define _ALLOW_SSBO_STORAGE 1
+// Fetches the material textures through bindless handles if ARB_bindless_texture is available
+#define _ALLOW_BINDLESS_MATERIALS 1
+// Animates and classifies the lights by a compute shader feeding indirect draws, requires OpenGL 4.3 and storage buffers
+#define _ALLOW_GPU_LIGHTS 1
+
+#if !_ALLOW_SSBO_STORAGE
+#undef _ALLOW_GPU_LIGHTS
+#define _ALLOW_GPU_LIGHTS 0
+#endif
+
 // Shader programs
 namespace ShaderProgram
 {
   enum
   {
-    DefaultGBuffer, InstancedGBuffer, AmbientLightPass, InstancedLightPass, InstancedLightVis, Tonemapping, NumShaderPrograms
+    DefaultGBuffer, InstancedGBuffer, EdgeClassification, AmbientLightPass, AmbientLightPassPerSample,
+    InstancedLightPass, InstancedLightPassPerSample, InstancedLightVis, TiledLightPass, LightAnimation, Tonemapping,
+    NumShaderPrograms
   };
 }
 
 // Shader programs handle
 extern GLuint shaderProgram[ShaderProgram::NumShaderPrograms];
+// Do the GBuffer programs sample the materials through bindless handles? Set by compileShaders()
+extern bool bindlessMaterials;
+// Do the programs use the compact GBuffer layout? Switched by toggleCompactGBuffer()
+extern bool compactGBuffer;
+// Number of samples of the multisampled GBuffer
+static const GLsizei MSAA_SAMPLES = 4;
+// Number of GBuffer samples the programs are built for, 1 without MSAA. Switched by toggleMsaaGBuffer(),
+// compileShaders() falls back to 1 if the edges can't be shaded per sample
+extern GLsizei gBufferSamples;
+// Do the programs linearize the reverse-Z depth? Switched by toggleReverseDepth(), compileShaders() turns it off without
+// glClipControl()
+extern bool reverseDepth;
 
 // Helper function for creating and compiling the shaders
 bool compileShaders();
+// Switch between the built-in shader sources and the files in the 09-Deferred.shaders directory, rebuilds the programs
+void toggleShaderFiles();
+// Rebuild the programs when the shader files change, the live programs are kept if the new ones fail to link
+void updateShaderFiles();
+// Switch between the default and compact GBuffer layout and rebuild the programs, the GBuffer has to be recreated
+// afterwards, returns false if the layout stays the same
+bool toggleCompactGBuffer();
+// Switch the MSAA of the GBuffer on and off and rebuild the programs, the GBuffer has to be recreated afterwards,
+// returns false if the number of samples stays the same
+bool toggleMsaaGBuffer();
+// Switch between the reverse-Z and the traditional depth and rebuild the programs, the camera and the clip control have
+// to follow afterwards, returns false if the depth mapping stays the same
+bool toggleReverseDepth();
+
+// ============================================================================
+
+// Instance and light data are stored either in storage buffers or in uniform buffers,
+// the declarations are spliced into the shader sources below
+#if _ALLOW_SSBO_STORAGE
+#define DATA_BUFFER_VERSION "#version 430 core\n"
+
+// Storage buffer used for instances, the size is limited just by the available memory
+#define INSTANCE_BUFFER_BLOCK \
+"layout (std430, binding = 1) readonly buffer InstanceBuffer\n" \
+"{\n" \
+"  InstanceData instanceBuffer[];\n" \
+"};\n"
+
+// Storage buffer used for lights, the size is limited just by the available memory
+#define LIGHT_BUFFER_BLOCK \
+"layout (std430, binding = 2) readonly buffer LightBuffer\n" \
+"{\n" \
+"  LightData lightBuffer[];\n" \
+"};\n"
+#else
+#define DATA_BUFFER_VERSION "#version 330 core\n"
+
+// Uniform buffer used for instances, binding is set after linking
+#define INSTANCE_BUFFER_BLOCK \
+"layout (std140) uniform InstanceBuffer\n" \
+"{\n" \
+"  // We are limited to 4096 vec4 registers in total, hence the maximum number of instances\n" \
+"  // being 1024 with the transformation and the material index taking 4 vec4 each\n" \
+"  InstanceData instanceBuffer[1024];\n" \
+"};\n"
+
+// Uniform buffer used for lights, binding is set after linking
+#define LIGHT_BUFFER_BLOCK \
+"layout (std140) uniform LightBuffer\n" \
+"{\n" \
+"  // 1024 lights should be enough for everybody, must not exceed 4096 vec4 registers\n" \
+"  LightData lightBuffer[1024];\n" \
+"};\n"
+#endif
+
+// GBuffer layouts, the shaders reading or writing the GBuffer are compiled with COMPACT_GBUFFER defined for the compact one:
+// - default: RGB8 albedo, RG16F normal.xz, RGB8UI specularity, occlusion and the sign of normal.y
+// - compact: RGBA8 albedo and occlusion, RGB10_A2 octahedral normal and specularity
+#define GBUFFER_OCTAHEDRAL \
+"// Octahedral mapping of a unit vector to [-1, 1]^2 and back\n" \
+"vec2 signNotZero(vec2 v)\n" \
+"{\n" \
+"  return vec2(v.x >= 0.0f ? 1.0f : -1.0f, v.y >= 0.0f ? 1.0f : -1.0f);\n" \
+"}\n" \
+"\n" \
+"vec2 encodeOctahedral(vec3 n)\n" \
+"{\n" \
+"  n /= abs(n.x) + abs(n.y) + abs(n.z);\n" \
+"  return n.z >= 0.0f ? n.xy : (1.0f - abs(n.yx)) * signNotZero(n.xy);\n" \
+"}\n" \
+"\n" \
+"vec3 decodeOctahedral(vec2 e)\n" \
+"{\n" \
+"  vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));\n" \
+"  if (n.z < 0.0f)\n" \
+"    n.xy = (1.0f - abs(n.yx)) * signNotZero(n.xy);\n" \
+"  return normalize(n);\n" \
+"}\n" \
+"\n" \
+"// Default layout stores just X and Z, Y is reconstructed from its sign\n" \
+"vec3 decodeDefault(vec2 n, bool negativeY)\n" \
+"{\n" \
+"  float y = (negativeY ? -1.0f : 1.0f) * sqrt(max(1e-5, 1.0f - dot(n, n)));\n" \
+"  return vec3(n.x, y, n.y);\n" \
+"}\n"
+
+// GBuffer outputs of the geometry pass, writeGBuffer() writes all of them
+#define GBUFFER_OUTPUT GBUFFER_OCTAHEDRAL \
+"\n" \
+"#ifdef COMPACT_GBUFFER\n" \
+"layout (location = 0) out vec4 oColor;\n" \
+"layout (location = 1) out vec4 oNormal;\n" \
+"\n" \
+"void writeGBuffer(vec3 albedo, vec3 normal, float specularity, float occlusion)\n" \
+"{\n" \
+"  oColor = vec4(albedo, occlusion);\n" \
+"  oNormal = vec4(encodeOctahedral(normal) * 0.5f + 0.5f, specularity, 0.0f);\n" \
+"}\n" \
+"#else\n" \
+"layout (location = 0) out vec3 oColor;\n" \
+"layout (location = 1) out vec2 oNormal;\n" \
+"layout (location = 2) out uvec3 oMaterial;\n" \
+"\n" \
+"void writeGBuffer(vec3 albedo, vec3 normal, float specularity, float occlusion)\n" \
+"{\n" \
+"  oColor = albedo;\n" \
+"  oNormal = normal.xz;\n" \
+"\n" \
+"  // Pass information about normal orientation, just a single bit, 7 others free to use\n" \
+"  uint bitFlags = normal.y < 0.0f ? 1u : 0u;\n" \
+"  oMaterial = uvec3(specularity * 255.0f, occlusion * 255.0f, bitFlags);\n" \
+"}\n" \
+"#endif\n"
+
+// GBuffer input textures of the light passes, the shaders are compiled with MSAA_SAMPLES defined for the multisampled
+// GBuffer, the Material one isn't used by the compact layout
+#define GBUFFER_SAMPLERS \
+"#ifdef MSAA_SAMPLES\n" \
+"layout (binding = 0) uniform sampler2DMS Depth;\n" \
+"layout (binding = 1) uniform sampler2DMS Color;\n" \
+"layout (binding = 2) uniform sampler2DMS Normals;\n" \
+"layout (binding = 3) uniform usampler2DMS Material;\n" \
+"#else\n" \
+"layout (binding = 0) uniform sampler2D Depth;\n" \
+"layout (binding = 1) uniform sampler2D Color;\n" \
+"layout (binding = 2) uniform sampler2D Normals;\n" \
+"layout (binding = 3) uniform usampler2D Material;\n" \
+"#endif\n"
+
+// GBuffer decoding of the light passes, requires the GBUFFER_SAMPLERS to be declared before. The sample index is
+// the last texelFetch() argument for multisampled textures and the mip level otherwise, so it must be 0 without MSAA
+#define GBUFFER_INPUT GBUFFER_OCTAHEDRAL \
+"\n" \
+"float fetchDepth(ivec2 texel, int s)\n" \
+"{\n" \
+"  return texelFetch(Depth, texel, s).r;\n" \
+"}\n" \
+"\n" \
+"// View depth of the window depth, the reverse-Z projection maps the near plane to 1 and the infinite far plane to 0\n" \
+"float linearizeDepth(float d, float near, float far)\n" \
+"{\n" \
+"#ifdef REVERSE_Z\n" \
+"  return near / max(d, 1e-30f);\n" \
+"#else\n" \
+"  return (near * far) / (far + d * (near - far));\n" \
+"#endif\n" \
+"}\n" \
+"\n" \
+"// Is the window depth the cleared background?\n" \
+"bool isBackground(float d)\n" \
+"{\n" \
+"#ifdef REVERSE_Z\n" \
+"  return d <= 0.0f;\n" \
+"#else\n" \
+"  return d >= 1.0f;\n" \
+"#endif\n" \
+"}\n" \
+"\n" \
+"vec3 fetchAlbedo(ivec2 texel, int s)\n" \
+"{\n" \
+"  return texelFetch(Color, texel, s).rgb;\n" \
+"}\n" \
+"\n" \
+"#ifdef COMPACT_GBUFFER\n" \
+"vec3 fetchNormal(ivec2 texel, int s)\n" \
+"{\n" \
+"  return decodeOctahedral(texelFetch(Normals, texel, s).rg * 2.0f - 1.0f);\n" \
+"}\n" \
+"\n" \
+"float fetchSpecularity(ivec2 texel, int s)\n" \
+"{\n" \
+"  return texelFetch(Normals, texel, s).b;\n" \
+"}\n" \
+"\n" \
+"float fetchOcclusion(ivec2 texel, int s)\n" \
+"{\n" \
+"  return texelFetch(Color, texel, s).a;\n" \
+"}\n" \
+"#else\n" \
+"vec3 fetchNormal(ivec2 texel, int s)\n" \
+"{\n" \
+"  return decodeDefault(texelFetch(Normals, texel, s).rg, texelFetch(Material, texel, s).b == 1u);\n" \
+"}\n" \
+"\n" \
+"float fetchSpecularity(ivec2 texel, int s)\n" \
+"{\n" \
+"  return texelFetch(Material, texel, s).r / 255.0f;\n" \
+"}\n" \
+"\n" \
+"float fetchOcclusion(ivec2 texel, int s)\n" \
+"{\n" \
+"  return texelFetch(Material, texel, s).g / 255.0f;\n" \
+"}\n" \
+"#endif\n" \
+"\n" \
+"#ifdef MSAA_SAMPLES\n" \
+"// Do the samples of the pixel see different surfaces? Samples of a single triangle share all the GBuffer values\n" \
+"// but the depth, which may differ by its slope across the pixel, so only larger relative differences count\n" \
+"bool isEdgePixel(ivec2 texel)\n" \
+"{\n" \
+"  float depth = fetchDepth(texel, 0);\n" \
+"  vec3 normal = fetchNormal(texel, 0);\n" \
+"  for (int s = 1; s < MSAA_SAMPLES; ++s)\n" \
+"  {\n" \
+"    float d = fetchDepth(texel, s);\n" \
+"#ifdef REVERSE_Z\n" \
+"    // Window depth is near / z, so it scales a relative view depth difference itself\n" \
+"    float scale = max(d, depth);\n" \
+"#else\n" \
+"    // Window depth is roughly 1 - near / z, 1 - depth thus scales a relative view depth difference\n" \
+"    float scale = 1.0f - min(d, depth);\n" \
+"#endif\n" \
+"    if (abs(d - depth) > 0.01f * scale || dot(fetchNormal(texel, s), normal) < 0.98f)\n" \
+"      return true;\n" \
+"  }\n" \
+"  return false;\n" \
+"}\n" \
+"#endif\n"
 
 // ============================================================================
 
@@ -57,6 +303,8 @@ layout (std140, binding = 0) uniform TransformBlock
 
 // Model to world transformation separately
 layout (location = 0) uniform mat4x3 modelToWorld;
+// Index of the material, mat4x3 above takes locations 0 - 3
+layout (location = 4) uniform uint materialIndex;
 
 // Vertex attribute block, i.e., input
 layout (location = 0) in vec3 position;
@@ -72,12 +320,14 @@ out VertexData
   vec3 bitangent;
   vec3 normal;
   vec4 worldPos;
+  flat uint material;
 } vOut;
 
 void main()
 {
-  // Pass texture coordinates to the fragment shader
+  // Pass texture coordinates and the material to the fragment shader
   vOut.texCoord = texCoord.st;
+  vOut.material = materialIndex;
 
   // Construct the normal transformation matrix
   mat3 normalTransform = transpose(inverse(mat3(modelToWorld)));
@@ -97,10 +347,9 @@ void main()
 }
 )",
 // ----------------------------------------------------------------------------
-// Instancing vertex shader using instancing buffer via uniform block objects
+// Instancing vertex shader using instancing buffer via storage or uniform block objects
 // ----------------------------------------------------------------------------
-R"(
-#version 330 core
+"\n" DATA_BUFFER_VERSION R"(
 
 // The following is not not needed since GLSL version #430
 #extension GL_ARB_explicit_uniform_location : require
@@ -127,16 +376,10 @@ struct InstanceData
 {
   // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
   mat3x4 modelToWorld;
+  // Index of the material used by the instance, padded to vec4
+  uint material;
 };
-
-// Uniform buffer used for instances
-layout (std140, binding = 1) uniform InstanceBuffer
-{
-  // We are limited to 4096 vec4 registers in total, hence the maximum number of instances
-  // being 1024 meaning we could fit another vec4 worth of data
-  InstanceData instanceBuffer[1024];
-};
-
+)" INSTANCE_BUFFER_BLOCK R"(
 // Vertex output
 out VertexData
 {
@@ -145,6 +388,7 @@ out VertexData
   vec3 bitangent;
   vec3 normal;
   vec4 worldPos;
+  flat uint material;
 } vOut;
 
 void main()
@@ -152,8 +396,9 @@ void main()
   // Pass texture coordinates to the fragment shader
   vOut.texCoord = texCoord.st;
 
-  // Retrieve the model to world matrix from the instance buffer
+  // Retrieve the model to world matrix and the material from the instance buffer
   mat3x4 modelToWorld = instanceBuffer[gl_InstanceID].modelToWorld;
+  vOut.material = instanceBuffer[gl_InstanceID].material;
 
   // Construct the normal transformation matrix
   mat3 normalTransform = transpose(inverse(mat3(modelToWorld)));
@@ -172,10 +417,9 @@ void main()
 }
 )",
 // ----------------------------------------------------------------------------
-// Instancing vertex shader for lights using instancing buffer via uniform block objects
+// Instancing vertex shader for lights using instancing buffer via storage or uniform block objects
 // ----------------------------------------------------------------------------
-R"(
-#version 330 core
+"\n" DATA_BUFFER_VERSION R"(
 
 // The following is not not needed since GLSL version #430
 #extension GL_ARB_explicit_uniform_location : require
@@ -199,20 +443,16 @@ struct InstanceData
 {
   // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
   mat3x4 modelToWorld;
+  // Index of the material used by the instance, padded to vec4
+  uint material;
 };
-
-// Uniform buffer used for instances
-layout (std140, binding = 1) uniform InstanceBuffer
-{
-  // We are limited to 4096 vec4 registers in total, hence the maximum number of instances
-  // being 1024 meaning we could fit another vec4 worth of data
-  InstanceData instanceBuffer[1024];
-};
-
+)" INSTANCE_BUFFER_BLOCK R"(
 // Camera position in world space coordinates
 uniform vec4 cameraPosWS;
 // Near/far clip planes for depth reconstruction
 uniform vec2 NEAR_FAR;
+// Index of the first instance of the draw, the instances are grouped by their level of detail
+uniform int instanceOffset;
 
 // Vertex output
 out VertexData
@@ -226,10 +466,11 @@ out VertexData
 void main()
 {
   // Pass in the instance ID to FS
-  vOut.lightID = gl_InstanceID;
+  int instanceID = instanceOffset + gl_InstanceID;
+  vOut.lightID = instanceID;
 
   // Retrieve the model to world matrix from the instance buffer
-  mat3x4 modelToWorld = instanceBuffer[gl_InstanceID].modelToWorld;
+  mat3x4 modelToWorld = instanceBuffer[instanceID].modelToWorld;
 
   // Transform vertex position, note we multiply from the left because of transposed modelToWorld
   vec4 worldPos = vec4(vec4(position.xyz, 1.0f) * modelToWorld, 1.0f);
@@ -282,7 +523,7 @@ namespace FragmentShader
 {
   enum
   {
-    GBuffer, AmbientPass, LightPass, LightColor, Tonemapping, NumFragmentShaders
+    GBuffer, GBufferBindless, EdgeClassification, AmbientPass, LightPass, LightColor, Tonemapping, NumFragmentShaders
   };
 }
 
@@ -311,33 +552,105 @@ in VertexData
   vec3 bitangent;
   vec3 normal;
   vec4 worldPos;
+  flat uint material;
 } vIn;
 
-// Fragment shader outputs
-layout (location = 0) out vec3 oColor;
-layout (location = 1) out vec2 oNormal;
-layout (location = 2) out uvec3 oMaterial;
-
+// Fragment shader outputs and the GBuffer encoding
+)" GBUFFER_OUTPUT R"(
 void main()
 {
   // Sample textures
   vec3 albedo = texture(Diffuse, vIn.texCoord.st).rgb;
-  vec3 noSample = texture(Normal, vIn.texCoord.st).rgb;
+  vec2 noSample = texture(Normal, vIn.texCoord.st).rg * 2.0f - 1.0f;
   float specSample = texture(Specular, vIn.texCoord.st).r;
   float occlusion = texture(Occlusion, vIn.texCoord.st).r;
 
-  // Calculate world-space normal
+  // Calculate world-space normal, Z is reconstructed so that two channel (BC5) normal maps work as well
+  mat3 STN = {vIn.tangent, vIn.bitangent, vIn.normal};
+  vec3 normal = STN * vec3(noSample, sqrt(max(1.0f - dot(noSample, noSample), 0.0f)));
+
+  // Just output the material properties into the GBuffer:
+  // everything that we'll need to calculate lighting later on
+  writeGBuffer(albedo, normal, specSample, occlusion);
+}
+)",
+// ----------------------------------------------------------------------------
+// Fragment shader for GBuffer rendering sampling the material textures through bindless handles
+// ----------------------------------------------------------------------------
+R"(
+#version 400 core
+
+// The following is not not needed since GLSL version #420
+#extension GL_ARB_shading_language_420pack : require
+
+// Texture handles are plain 64-bit values that can live in any buffer
+#extension GL_ARB_bindless_texture : require
+
+// Must match the structure on the CPU side
+struct MaterialData
+{
+  // Handles of the textures with the anisotropic sampler, sampler2D constructors take them as uvec2
+  uvec2 diffuse;
+  uvec2 normal;
+  uvec2 specular;
+  uvec2 occlusion;
+};
+
+// All materials of the scene, the size must match Scene::MAX_MATERIALS
+layout (std140, binding = 3) uniform MaterialBlock
+{
+  MaterialData materials[16];
+};
+
+// Fragment shader inputs
+in VertexData
+{
+  vec2 texCoord;
+  vec3 tangent;
+  vec3 bitangent;
+  vec3 normal;
+  vec4 worldPos;
+  flat uint material;
+} vIn;
+
+// Fragment shader outputs and the GBuffer encoding
+)" GBUFFER_OUTPUT R"(
+void main()
+{
+  // Sample textures of the material, instances of a single draw may use different materials
+  MaterialData material = materials[vIn.material];
+  vec3 albedo = texture(sampler2D(material.diffuse), vIn.texCoord.st).rgb;
+  vec2 noSample = texture(sampler2D(material.normal), vIn.texCoord.st).rg * 2.0f - 1.0f;
+  float specSample = texture(sampler2D(material.specular), vIn.texCoord.st).r;
+  float occlusion = texture(sampler2D(material.occlusion), vIn.texCoord.st).r;
+
+  // Calculate world-space normal, Z is reconstructed so that two channel (BC5) normal maps work as well
   mat3 STN = {vIn.tangent, vIn.bitangent, vIn.normal};
-  vec3 normal = STN * (noSample * 2.0f - 1.0f);
+  vec3 normal = STN * vec3(noSample, sqrt(max(1.0f - dot(noSample, noSample), 0.0f)));
 
   // Just output the material properties into the GBuffer:
   // everything that we'll need to calculate lighting later on
-  oColor = albedo;
-  oNormal = normal.xz;
+  writeGBuffer(albedo, normal, specSample, occlusion);
+}
+)",
+// ----------------------------------------------------------------------------
+// Edge classification pixel shader, only the edge pixels of the multisampled GBuffer pass to mark the stencil
+// ----------------------------------------------------------------------------
+R"(
+#version 330 core
 
-  // Pass information about normal orientation, just a single bit, 7 others free to use
-  uint bitFlags = normal.y < 0.0f ? 1u : 0u;
-  oMaterial = uvec3(specSample * 255.0f, occlusion * 255.0f, bitFlags);
+// The following is not not needed since GLSL version #420
+#extension GL_ARB_shading_language_420pack : require
+
+// GBuffer input textures
+)" GBUFFER_SAMPLERS R"(
+// GBuffer decoding
+)" GBUFFER_INPUT R"(
+void main()
+{
+  // Pixels with matching samples are shaded just once
+  if (!isEdgePixel(ivec2(gl_FragCoord.xy)))
+    discard;
 }
 )",
 // ----------------------------------------------------------------------------
@@ -352,12 +665,15 @@ R"(
 // The following is not not needed since GLSL version #420
 #extension GL_ARB_shading_language_420pack : require
 
-// GBuffer input textures
-layout (binding = 0) uniform sampler2D Depth;
-layout (binding = 1) uniform sampler2D Color;
-layout (binding = 2) uniform sampler2D Normals;
-layout (binding = 3) uniform usampler2D Material;
+// The variant shading the edge pixels runs for each sample
+#ifdef PER_SAMPLE
+#extension GL_ARB_sample_shading : enable
+#endif
 
+// GBuffer input textures
+)" GBUFFER_SAMPLERS R"(
+// GBuffer decoding
+)" GBUFFER_INPUT R"(
 // Output color
 out vec4 oColor;
 
@@ -366,12 +682,17 @@ layout (location = 0) uniform vec3 ambientLight;
 
 void main()
 {
-  // Get the fragment position
+  // Get the fragment position and the shaded sample, the first one represents the whole pixel
   ivec2 texel = ivec2(gl_FragCoord.xy);
+#ifdef PER_SAMPLE
+  int s = gl_SampleID;
+#else
+  int s = 0;
+#endif
 
   // Fetch the required GBuffer data
-  vec3 albedo = texelFetch(Color, texel, 0).rgb;
-  float occlusion = texelFetch(Material, texel, 0).g / 255.0f;
+  vec3 albedo = fetchAlbedo(texel, s);
+  float occlusion = fetchOcclusion(texel, s);
 
   // We're calculating here just the ambient light contribution to the scene,
   // but we could calculate directional light here as well
@@ -382,8 +703,7 @@ void main()
 // ----------------------------------------------------------------------------
 // Light pass pixel shader
 // ----------------------------------------------------------------------------
-R"(
-#version 330 core
+"\n" DATA_BUFFER_VERSION R"(
 
 // The following is not not needed since GLSL version #420
 #extension GL_ARB_shading_language_420pack : require
@@ -391,12 +711,15 @@ R"(
 // The following is not not needed since GLSL version #420
 #extension GL_ARB_shading_language_420pack : require
 
-// All textures that can be sampled and displayed
-layout (binding = 0) uniform sampler2D Depth;
-layout (binding = 1) uniform sampler2D Color;
-layout (binding = 2) uniform sampler2D Normals;
-layout (binding = 3) uniform usampler2D Material;
+// The variant shading the edge pixels runs for each sample
+#ifdef PER_SAMPLE
+#extension GL_ARB_sample_shading : enable
+#endif
 
+// All textures that can be sampled and displayed
+)" GBUFFER_SAMPLERS R"(
+// GBuffer decoding
+)" GBUFFER_INPUT R"(
 // Must match the structure on the CPU side
 struct LightData
 {
@@ -405,14 +728,7 @@ struct LightData
   // Light color and intensity
   vec4 color;
 };
-
-// Uniform buffer used for lights
-layout (std140, binding = 2) uniform LightBuffer
-{
-  // 1024 lights should be enough for everybody, must not exceed 4096 vec4 registers
-  LightData lightBuffer[1024];
-};
-
+)" LIGHT_BUFFER_BLOCK R"(
 // Vertex inputs
 in VertexData
 {
@@ -430,13 +746,18 @@ out vec4 oColor;
 
 void main()
 {
+  // Get the fragment position and the shaded sample, the first one represents the whole pixel
   ivec2 texel = ivec2(gl_FragCoord.xy);
+#ifdef PER_SAMPLE
+  int s = gl_SampleID;
+#else
+  int s = 0;
+#endif
 
   // Reconstruct the world space position using linearized sampled depth value
   const float near = NEAR_FAR.x;
   const float far = NEAR_FAR.y;
-  float d = texelFetch(Depth, texel, 0).r;
-  float z = (near * far) / (far + d * (near - far));
+  float z = linearizeDepth(fetchDepth(texel, s), near, far);
   // vIn.viewRayWS is at far plane, so just scale it down to the Z value
   vec3 posWS = cameraPosWS.xyz + vIn.viewRayWS * (z / far);
 
@@ -444,14 +765,11 @@ void main()
   vec3 viewDirWS = -normalize(vIn.viewRayWS);
 
   // Reconstruct the world space normal
-  vec2 n = texelFetch(Normals, texel, 0).rg;
-  uint bitFlags = texelFetch(Material, texel, 0).b;
-  float y = (bitFlags == 1u ? -1.0f : 1.0f) * sqrt(max(1e-5, 1.0f - dot(n, n)));
-  vec3 normalWS = vec3(n.r, y, n.g);
+  vec3 normalWS = fetchNormal(texel, s);
 
   // Fetch albedo and specularity
-  vec3 albedo = texelFetch(Color, texel, 0).rgb;
-  float specularity = texelFetch(Material, texel, 0).r / 255.0f;
+  vec3 albedo = fetchAlbedo(texel, s);
+  float specularity = fetchSpecularity(texel, s);
 
   // Calculate the lighting direction and distance
   vec3 lightDirWS = lightBuffer[vIn.lightID].positionWS.xyz - posWS;
@@ -484,8 +802,7 @@ void main()
 // ----------------------------------------------------------------------------
 // Light color pixel shader - for light visualization
 // ----------------------------------------------------------------------------
-R"(
-#version 330 core
+"\n" DATA_BUFFER_VERSION R"(
 
 // Must match the structure on the CPU side
 struct LightData
@@ -495,14 +812,7 @@ struct LightData
   // Light color and intensity
   vec4 color;
 };
-
-// Uniform buffer used for lights
-layout (std140) uniform LightBuffer
-{
-  // 1024 lights should be enough for everybody, must not exceed 4096 vec4 registers
-  LightData lightBuffer[1024];
-};
-
+)" LIGHT_BUFFER_BLOCK R"(
 // Vertex inputs
 in VertexData
 {
@@ -532,14 +842,34 @@ R"(
 #extension GL_ARB_shading_language_420pack : require
 
 // All textures that can be sampled and displayed
-layout (binding = 0) uniform sampler2D Depth;
-layout (binding = 1) uniform sampler2D Color;
-layout (binding = 2) uniform sampler2D Normals;
-layout (binding = 3) uniform usampler2D Material;
+)" GBUFFER_SAMPLERS R"(
+#ifdef MSAA_SAMPLES
+layout (binding = 4) uniform sampler2DMS HDR;
+#else
 layout (binding = 4) uniform sampler2D HDR;
+#endif
 
-// Number of used MSAA samples
+// GBuffer decoding
+)" GBUFFER_INPUT R"(
+// Near/far clip planes and the display mode
 layout (location = 0) uniform vec3 NEAR_FAR_MODE;
+// Ratio of the rendered and the window size in xy and the rendered size in pixels in zw, 1 and the window size without
+// dynamic resolution
+layout (location = 1) uniform vec4 renderScale;
+
+// Exposure adapted on the GPU, see AutoExposure
+layout (std140, binding = 4) uniform ExposureBlock
+{
+  float exposure;
+  float averageLuminance;
+};
+
+// Round to the half float precision
+vec2 quantizeHalf(vec2 v)
+{
+  vec2 e = exp2(floor(log2(max(abs(v), vec2(1e-5)))));
+  return round(v / e * 1024.0f) / 1024.0f * e;
+}
 
 // Output
 out vec4 color;
@@ -554,21 +884,29 @@ vec3 ApplyTonemapping(vec3 hdr)
 
 void main()
 {
-  // Get the fragment position
-  ivec2 texel = ivec2(gl_FragCoord.xy);
+  // Get the fragment position within the rendered part of the render targets
+  vec2 renderPos = clamp(gl_FragCoord.xy * renderScale.xy, vec2(0.5f), renderScale.zw - 0.5f);
+  ivec2 texel = ivec2(renderPos);
 
   int MODE = int(NEAR_FAR_MODE.z);
   vec3 finalColor = vec3(0.0f);
   if (MODE == 0)
   {
-     // Fetch an HDR texel and tonemap it
-     vec3 hdr = texelFetch(HDR, texel, 0).rgb;
-     finalColor += ApplyTonemapping(hdr);
+#ifdef MSAA_SAMPLES
+     // Tonemap all the samples before resolving them so that bright samples don't dominate the edges
+     for (int i = 0; i < MSAA_SAMPLES; ++i)
+       finalColor += ApplyTonemapping(texelFetch(HDR, texel, i).rgb * exposure);
+     finalColor /= float(MSAA_SAMPLES);
+#else
+     // Fetch an HDR texel and tonemap it, the bilinear filter upscales the lower resolution, texel centers stay exact
+     vec3 hdr = texture(HDR, renderPos / vec2(textureSize(HDR, 0))).rgb;
+     finalColor += ApplyTonemapping(hdr * exposure);
+#endif
   }
   else if (MODE == 1)
   {
     // Fetch the color and store it directly
-    finalColor = texelFetch(Color, texel, 0).rgb;
+    finalColor = fetchAlbedo(texel, 0);
   }
   else if (MODE == 2)
   {
@@ -576,32 +914,50 @@ void main()
     const float far = NEAR_FAR_MODE.y;
 
     // Fetch depth and linearize it by reverting the projection matrix transformation
-    float d = texelFetch(Depth, texel, 0).r;
-    float z = (near * far) / (far + d * (near - far));
+    float z = linearizeDepth(fetchDepth(texel, 0), near, far);
 
-    // Remap it to [0, 1] range for display
-    z = z / (far - near);
+    // Remap it to [0, 1] range for display, the reverse-Z depth goes beyond the far plane
+    z = min(z / (far - near), 1.0f);
 
     finalColor = z.xxx;
   }
   else if (MODE == 3)
   {
     // Reconstruct world space normal and display it
-    vec2 n = texelFetch(Normals, texel, 0).rg;
-    uint bitFlags = texelFetch(Material, texel, 0).b;
-    float y = (bitFlags == 1u ? -1.0f : 1.0f) * sqrt(max(1e-5, 1.0f - dot(n, n)));
-    vec3 normal = vec3(n.r, y, n.g);
+    vec3 normal = fetchNormal(texel, 0);
     finalColor = normal * 0.5f + 0.5f;
   }
   else if (MODE == 4)
   {
     // Fetch the material specularity value and display it
-    finalColor = texelFetch(Material, texel, 0).rrr / 255.0f;
+    finalColor = fetchSpecularity(texel, 0).xxx;
   }
   else if (MODE == 5)
   {
     // Fetch the material occlusion value and display it
-    finalColor = texelFetch(Material, texel, 0).ggg / 255.0f;
+    finalColor = fetchOcclusion(texel, 0).xxx;
+  }
+  else if (MODE == 6)
+  {
+    // Round trip the stored normal through the other layout, white is 1 degree of difference or more
+    vec3 normal = fetchNormal(texel, 0);
+#ifdef COMPACT_GBUFFER
+    vec3 other = decodeDefault(quantizeHalf(normal.xz), normal.y < 0.0f);
+#else
+    vec2 e = round((encodeOctahedral(normal) * 0.5f + 0.5f) * 1023.0f) / 1023.0f;
+    vec3 other = decodeOctahedral(e * 2.0f - 1.0f);
+#endif
+    float angle = degrees(acos(clamp(dot(normal, other), -1.0f, 1.0f)));
+    finalColor = vec3(clamp(angle, 0.0f, 1.0f));
+  }
+  else if (MODE == 7)
+  {
+    // Edge pixels shaded per sample in white over the dimmed albedo
+#ifdef MSAA_SAMPLES
+    finalColor = isEdgePixel(texel) ? vec3(1.0f) : 0.25f * fetchAlbedo(texel, 0);
+#else
+    finalColor = 0.25f * fetchAlbedo(texel, 0);
+#endif
   }
   else
   {
@@ -613,3 +969,374 @@ void main()
 }
 )",
 ""};
+
+// ============================================================================
+
+// Compute shader types
+namespace ComputeShader
+{
+  enum
+  {
+    TiledLightPass, LightAnimation, NumComputeShaders
+  };
+}
+
+// Compute shader sources
+static const char* csSource[] = {
+// ----------------------------------------------------------------------------
+// Tiled light pass compute shader, culls lights per screen tile and shades
+// ambient and all the tile lights with a single GBuffer fetch
+// ----------------------------------------------------------------------------
+R"(
+#version 430 core
+
+// Tile size in pixels, must match Scene::TILE_SIZE
+#define TILE_SIZE 16
+// Maximum number of lights affecting a single tile, the rest is ignored
+#define MAX_TILE_LIGHTS 1024
+
+layout (local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+// Uniform blocks, i.e., constants
+layout (std140, binding = 0) uniform TransformBlock
+{
+  // Transposed worldToView matrix - stored compactly as an array of 3 x vec4
+  mat3x4 worldToView;
+  mat4x4 projection;
+};
+
+// GBuffer input textures
+)" GBUFFER_SAMPLERS R"(
+// GBuffer decoding
+)" GBUFFER_INPUT R"(
+// HDR output, every sample is written exactly once
+#ifdef MSAA_SAMPLES
+#define NUM_SAMPLES MSAA_SAMPLES
+layout (binding = 0, rgba16f) uniform writeonly image2DMS HDR;
+#define storeHDR(texel, s, color) imageStore(HDR, texel, s, color)
+#else
+#define NUM_SAMPLES 1
+layout (binding = 0, rgba16f) uniform writeonly image2D HDR;
+#define storeHDR(texel, s, color) imageStore(HDR, texel, color)
+#endif
+
+// Must match the structure on the CPU side
+struct LightData
+{
+  // Light position in world space, w is the light radius
+  vec4 positionWS;
+  // Light color and intensity
+  vec4 color;
+};
+
+// Storage buffer with all the lights in the scene
+layout (std430, binding = 0) readonly buffer LightBuffer
+{
+  LightData lightBuffer[];
+};
+
+// Number of lights in the light buffer
+layout (location = 0) uniform int numLights;
+// Near/far clip planes for depth reconstruction
+layout (location = 1) uniform vec2 NEAR_FAR;
+// Global ambient light intensity and color
+layout (location = 2) uniform vec3 ambientLight;
+// Rendered part of the HDR buffer, may be smaller than the buffer with dynamic resolution
+layout (location = 3) uniform ivec2 renderSize;
+
+// Linear depth range of the tile, positive floats keep their order when compared as uints
+shared uint tileMinZ;
+shared uint tileMaxZ;
+// Lights affecting the tile
+shared uint tileNumLights;
+shared uint tileLights[MAX_TILE_LIGHTS];
+
+// Shade a single sample of the texel with ambient and all the tile lights
+vec3 shadeSample(ivec2 texel, int s, vec2 size)
+{
+  // Fetch the GBuffer data just once for all the lights
+  vec3 albedo = fetchAlbedo(texel, s);
+  float specularity = fetchSpecularity(texel, s);
+  float occlusion = fetchOcclusion(texel, s);
+
+  // Ambient light contribution
+  vec3 finalColor = albedo * occlusion * ambientLight.rgb;
+
+  // Cleared background gets just the ambient
+  float d = fetchDepth(texel, s);
+  if (isBackground(d))
+    return finalColor;
+
+  // Reconstruct the view space position from the linear depth
+  float z = linearizeDepth(d, NEAR_FAR.x, NEAR_FAR.y);
+  vec2 ndc = (vec2(texel) + 0.5f) / size * 2.0f - 1.0f;
+  vec3 posVS = vec3(ndc.x * z / projection[0][0], ndc.y * z / projection[1][1], -z);
+
+  // View space viewing direction
+  vec3 viewDirVS = -normalize(posVS);
+
+  // Reconstruct the world space normal and move it to the view space, shading is the same
+  vec3 normalVS = vec4(fetchNormal(texel, s), 0.0f) * worldToView;
+
+  uint count = min(tileNumLights, uint(MAX_TILE_LIGHTS));
+  for (uint i = 0; i < count; ++i)
+  {
+    LightData light = lightBuffer[tileLights[i]];
+
+    // Calculate the lighting direction and distance
+    vec3 lightDirVS = (vec4(light.positionWS.xyz, 1.0f) * worldToView) - posVS;
+    float distSq = dot(lightDirVS, lightDirVS);
+    float dist = sqrt(distSq);
+    lightDirVS /= dist;
+
+    // Need to make sure that distance function gets to 0 before leaving light volume
+    float radius = light.positionWS.w;
+    float attenuation = 1.0f - smoothstep(0.66f * radius, 0.9f * radius, dist);
+
+    // Calculate the halfway direction vector
+    vec3 halfDirVS = normalize(viewDirVS + lightDirVS);
+
+    // Calculate diffuse and specular coefficients
+    float NdotL = max(0.0f, dot(normalVS, lightDirVS));
+    float NdotH = max(0.0f, dot(normalVS, halfDirVS));
+
+    // Calculate the Blinn-Phong model diffuse and specular terms
+    vec3 diffuse = attenuation * NdotL * light.color.rgb / distSq;
+    vec3 specular = attenuation * specularity * light.color.rgb * pow(NdotH, 64.0f) / distSq;
+
+    finalColor += albedo * diffuse + specular;
+  }
+
+  return finalColor;
+}
+
+void main()
+{
+  ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+  ivec2 size = renderSize;
+  bool valid = all(lessThan(texel, size));
+
+  if (gl_LocalInvocationIndex == 0)
+  {
+    tileMinZ = 0x7f7fffffu;
+    tileMaxZ = 0u;
+    tileNumLights = 0u;
+  }
+  barrier();
+
+  // Linearize the sampled depth values, cleared background is left out of the depth range
+  for (int s = 0; s < NUM_SAMPLES && valid; ++s)
+  {
+    float d = fetchDepth(texel, s);
+    float z = linearizeDepth(d, NEAR_FAR.x, NEAR_FAR.y);
+    if (!isBackground(d))
+    {
+      atomicMin(tileMinZ, floatBitsToUint(z));
+      atomicMax(tileMaxZ, floatBitsToUint(z));
+    }
+  }
+  barrier();
+
+  float minZ = uintBitsToFloat(tileMinZ);
+  float maxZ = uintBitsToFloat(tileMaxZ);
+
+  // Side planes of the tile frustum in view space, all of them pass through the camera
+  vec2 tileMin = vec2(gl_WorkGroupID.xy * TILE_SIZE) / vec2(size) * 2.0f - 1.0f;
+  vec2 tileMax = vec2((gl_WorkGroupID.xy + 1) * TILE_SIZE) / vec2(size) * 2.0f - 1.0f;
+  vec3 planes[4] = vec3[4](normalize(vec3( projection[0][0], 0.0f,  tileMin.x)),
+                           normalize(vec3(-projection[0][0], 0.0f, -tileMax.x)),
+                           normalize(vec3(0.0f,  projection[1][1],  tileMin.y)),
+                           normalize(vec3(0.0f, -projection[1][1], -tileMax.y)));
+
+  // Cull the light spheres against the tile frustum, each thread tests a part of the lights
+  for (uint i = gl_LocalInvocationIndex; i < uint(numLights) && minZ <= maxZ; i += TILE_SIZE * TILE_SIZE)
+  {
+    vec4 light = lightBuffer[i].positionWS;
+    vec3 centerVS = vec4(light.xyz, 1.0f) * worldToView;
+    float radius = light.w;
+
+    bool inside = (-centerVS.z + radius >= minZ) && (-centerVS.z - radius <= maxZ);
+    for (int p = 0; p < 4; ++p)
+      inside = inside && dot(planes[p], centerVS) >= -radius;
+
+    if (inside)
+    {
+      uint index = atomicAdd(tileNumLights, 1u);
+      if (index < MAX_TILE_LIGHTS)
+        tileLights[index] = i;
+    }
+  }
+  barrier();
+
+  if (!valid)
+    return;
+
+#ifdef MSAA_SAMPLES
+  // Samples seeing different surfaces are shaded separately
+  if (isEdgePixel(texel))
+  {
+    for (int s = 0; s < NUM_SAMPLES; ++s)
+      storeHDR(texel, s, vec4(shadeSample(texel, s, vec2(size)), 1.0f));
+    return;
+  }
+#endif
+
+  // Shade the first sample for the whole pixel
+  vec4 finalColor = vec4(shadeSample(texel, 0, vec2(size)), 1.0f);
+  for (int s = 0; s < NUM_SAMPLES; ++s)
+    storeHDR(texel, s, finalColor);
+}
+)",
+// ----------------------------------------------------------------------------
+// Light animation compute shader, moves the lights along their curves and
+// appends them to the indirect draws of their light set and level of detail
+// ----------------------------------------------------------------------------
+R"(
+#version 430 core
+
+// Number of levels of detail of the light volumes, must match Scene::NUM_LIGHT_LODS
+#define NUM_LIGHT_LODS 3
+// Light sets being appended to: camera inside, camera outside and the visualized points
+#define SET_INSIDE 0
+#define SET_OUTSIDE 1
+#define SET_VISUALIZATION 2
+
+layout (local_size_x = 64) in;
+
+// Must match the structure on the CPU side
+struct LightParams
+{
+  // Parameters for the light movement
+  vec4 movement;
+  // Light color and intensity
+  vec4 color;
+  // Offset of the movement curve, w is the light radius
+  vec4 offset;
+  // Scale of the movement curve
+  vec4 scale;
+};
+
+// Must match the structure on the CPU side
+struct InstanceData
+{
+  // Transposed modelToWorld matrix - stored compactly as an array of 3 x vec4
+  mat3x4 modelToWorld;
+  // Index of the material used by the instance, padded to vec4
+  uint material;
+};
+
+// Must match the structure on the CPU side
+struct LightData
+{
+  // Light position in world space, w is the light radius
+  vec4 positionWS;
+  // Light color and intensity
+  vec4 color;
+};
+
+// Must match the structure on the CPU side
+struct DrawElementsIndirectCommand
+{
+  uint count;
+  uint instanceCount;
+  uint firstIndex;
+  int baseVertex;
+  uint baseInstance;
+};
+
+// Static parameters of all the lights
+layout (std430, binding = 0) readonly buffer LightParamsBuffer
+{
+  LightParams lightParams[];
+};
+
+// Instances and lights of each draw, the draw of a set and level starts at (set * NUM_LIGHT_LODS + lod) * numLights
+layout (std430, binding = 1) writeonly buffer InstanceBuffer
+{
+  InstanceData instanceBuffer[];
+};
+
+layout (std430, binding = 2) writeonly buffer LightBuffer
+{
+  LightData lightBuffer[];
+};
+
+// All the lights in the original order for the tiled light pass
+layout (std430, binding = 3) writeonly buffer AllLightBuffer
+{
+  LightData allLightBuffer[];
+};
+
+// Indirect draw of each set and level, instance counts are reset to 0 before the dispatch
+layout (std430, binding = 4) buffer CommandBuffer
+{
+  DrawElementsIndirectCommand commands[];
+};
+
+// Number of lights in the scene
+layout (location = 0) uniform int numLights;
+// Animation time
+layout (location = 1) uniform float time;
+// Camera position in world space
+layout (location = 2) uniform vec3 cameraPosWS;
+// Projection scale of the screen height, i.e., cot(fov / 2)
+layout (location = 3) uniform float lodScale;
+// Projected radius relative to the screen half height below which the next coarser level is used
+layout (location = 4) uniform float lodScreenSize[NUM_LIGHT_LODS - 1];
+
+// Pick the level of detail of the light volume based on its size on the screen
+int selectLod(vec3 position, float radius)
+{
+  // Camera inside or touching the volume, always use the finest level
+  float distance = length(position - cameraPosWS);
+  if (distance <= radius)
+    return 0;
+
+  float screenSize = radius / distance * lodScale;
+  int lod = 0;
+  while (lod < NUM_LIGHT_LODS - 1 && screenSize < lodScreenSize[lod])
+    ++lod;
+  return lod;
+}
+
+// Append the light volume scaled to the given size to the draw of the set and its level of detail
+void appendLight(int set, vec3 position, float size, LightData light)
+{
+  int draw = set * NUM_LIGHT_LODS + selectLod(position, size);
+  uint slot = uint(draw * numLights) + atomicAdd(commands[draw].instanceCount, 1u);
+
+  instanceBuffer[slot].modelToWorld = mat3x4(vec4(size, 0.0f, 0.0f, position.x),
+                                             vec4(0.0f, size, 0.0f, position.y),
+                                             vec4(0.0f, 0.0f, size, position.z));
+  instanceBuffer[slot].material = 0u;
+  lightBuffer[slot] = light;
+}
+
+void main()
+{
+  int i = int(gl_GlobalInvocationID.x);
+  if (i >= numLights)
+    return;
+
+  // Lissajous curve position calculation based on the parameters
+  LightParams params = lightParams[i];
+  vec4 p = params.movement;
+  vec3 curve = vec3(sin(p.x * time), cos(p.y * time), sin(p.z * time) * cos(p.w * time));
+  vec3 position = params.offset.xyz + curve * params.scale.xyz;
+  float radius = params.offset.w;
+
+  LightData light;
+  light.positionWS = vec4(position, radius);
+  light.color = params.color;
+  allLightBuffer[i] = light;
+
+  // Assign the light set based on camera position, i.e., camera inside light volume or outside
+  vec3 d = position - cameraPosWS;
+  appendLight((dot(d, d) < radius * radius) ? SET_INSIDE : SET_OUTSIDE, position, radius, light);
+
+  // Small points attenuated for visualization purposes
+  light.color *= 0.05f;
+  appendLight(SET_VISUALIZATION, position, 0.1f, light);
+}
+)",
+""};
@@ -0,0 +1,61 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+// Exposure adaptation kept entirely on the GPU: a compute shader builds a luminance histogram of the HDR image in shared
+// memory, a second one reduces it to the average luminance of a percentile range and adapts the exposure towards it
+// over time. The exposure stays in a buffer read by the tonemapping shaders as a uniform block, nothing is read back.
+// Requires OpenGL 4.3, the exposure stays 1 otherwise.
+class AutoExposure
+{
+public:
+  // Number of histogram bins - must match the compute shaders!
+  static const int NUM_BINS = 256;
+
+  // Exposure buffer, std140 layout - must match the ExposureBlock in the tonemapping shaders!
+  struct ExposureData
+  {
+    // Scale of the HDR values before the tonemapping operator
+    float exposure;
+    // Adapted average luminance, negative until the first update
+    float luminance;
+    // Padding to vec4 size
+    float padding[2];
+  };
+
+  AutoExposure() = default;
+  ~AutoExposure();
+
+  // Create the buffers and compile the compute shaders, requires valid OpenGL context
+  bool Init();
+  // Release all resources
+  void Release();
+  // Is the exposure adapting, i.e., are the compute shaders available?
+  bool IsSupported() const { return _averageProgram != 0; }
+  // Build the histogram of the width x height part of the HDR texture and adapt the exposure, the first sample is used
+  // for multisampled textures, dt is the time since the last update
+  void Update(GLuint hdrTexture, bool multisampled, int width, int height, float dt);
+  // Forget the adapted luminance, the next update starts from its target right away
+  void Reset();
+  // Bind the exposure to the indexed uniform buffer binding point of the tonemapping shaders
+  void Bind(GLuint index) const;
+
+private:
+  // No copies allowed
+  AutoExposure(const AutoExposure &);
+  AutoExposure & operator = (const AutoExposure &);
+
+  // Histogram programs for single and multisampled HDR textures
+  GLuint _histogramPrograms[2] = {0};
+  // Program reducing the histogram and adapting the exposure
+  GLuint _averageProgram = 0;
+  // Storage buffer with the bins, cleared by the reduction for the next update
+  GLuint _histogram = 0;
+  // Buffer with the ExposureData
+  GLuint _exposure = 0;
+};
@@ -0,0 +1,77 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include <Camera.h>
+
+// Non-interactive benchmark mode replaying a scripted camera path and writing profiler results to CSV.
+// Command line: --benchmark [--frames N] [--warmup N] [--csv file] [--<parameter> a,b,c ...]
+class Benchmark
+{
+public:
+  Benchmark() = default;
+  ~Benchmark();
+
+  // Parse the command line, returns false on invalid arguments
+  bool ParseCommandLine(int argc, char *argv[]);
+  // Was the benchmark mode requested?
+  bool IsEnabled() const { return _enabled; }
+  // Number of measured frames of a single run
+  int GetNumFrames() const { return _numFrames; }
+  // Number of all frames of a single run including the warmup ones
+  int GetTotalFrames() const { return _numWarmupFrames + _numFrames; }
+  // Values of a swept parameter given as "--name a,b,c", returns the default value if not given
+  std::vector<int> GetSweep(const char *name, int defaultValue) const;
+
+  // Open the CSV output, requires ParseCommandLine() to be called first
+  bool Open();
+  // Start a new run with the given configuration, the string may not contain commas
+  void BeginRun(const char *config);
+  // Write the results of the newest frame read back by the profiler, call right after Profiler::BeginFrame()
+  void Record();
+  // Wait for the GPU and write the frames still in flight
+  void EndRun();
+  // Close the CSV output
+  void Close();
+
+  // Place the camera on a circular path around the center, frame goes from 0 to numFrames over the full circle
+  static void SetCameraOnPath(Camera &camera, int frame, int numFrames, const glm::vec3 &center, float radius, float height);
+
+private:
+  // No copies allowed
+  Benchmark(const Benchmark &);
+  Benchmark & operator = (const Benchmark &);
+
+  // Benchmark mode on?
+  bool _enabled = false;
+  // Number of measured frames
+  int _numFrames = 1000;
+  // Number of frames skipped at the beginning of each run
+  int _numWarmupFrames = 100;
+  // Name of the output file
+  std::string _fileName = "benchmark.csv";
+  // Swept parameters and their values
+  std::vector<std::pair<std::string, std::vector<int>>> _sweeps;
+  // Output file
+  FILE *_file = nullptr;
+  // Configuration of the current run
+  std::string _config;
+  // Profiler frame index of the first frame of the current run
+  int _firstFrame = 0;
+  // Profiler frame index of the last written frame
+  int _lastFrame = -1;
+  // Sums of the top level scope times of the current run
+  double _gpuTotal = 0.0;
+  double _cpuTotal = 0.0;
+  // Number of the frames written in the current run
+  int _numRecorded = 0;
+};
@@ -37,12 +37,21 @@ public:
   const glm::mat4x4& GetViewToWorld() const { return _viewToWorld; }
   // Sets camera projection using field of view and aspect ratio
   void SetProjection(float fov, float aspect, float nearClip, float farClip);
+  // Switches to the reverse-Z projection with the far plane at infinity mapping the near plane to depth 1 and infinity
+  // to 0, the depth must be remapped to [0, 1] by glClipControl(), cleared to 0 and tested by GL_GREATER (or GL_GEQUAL).
+  // Best used with a float depth buffer, the far clip plane is then used only for the frustum culling.
+  void SetReverseZ(bool reverseZ);
+  // Returns true for the reverse-Z projection
+  bool IsReverseZ() const { return _reverseZ; }
   // Returns the camera projection matrix
   const glm::mat4x4& GetProjection() const { return _projection; }
   // Returns the camera near clip plane
   const float GetNearClip() const { return _nearClip; }
   // Returns the camera far clip plane
   const float GetFarClip() const { return _farClip; }
+  // Fills the world space frustum planes (left, right, bottom, top, near, far) with normals pointing inside,
+  // a point p is inside the plane when dot(plane, vec4(p, 1)) >= 0
+  void GetFrustumPlanes(glm::vec4 planes[6]) const;
   // Moves camera along designated directions and orients it using mouse
   void Move(MovementDirections direction, const glm::vec2& mouseMove, float dt);
 
@@ -61,4 +70,10 @@ protected:
   float _nearClip;
   // Camera far clip plane
   float _farClip;
+  // Camera field of view in degrees
+  float _fov;
+  // Camera aspect ratio
+  float _aspect;
+  // Reverse-Z projection with infinite far plane?
+  bool _reverseZ;
 };
@@ -0,0 +1,66 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+// Resolution scale keeping the GPU frame time at the target: the GPU times of the frames read back by the Profiler
+// are averaged over a few frames and the scale is changed so that the shaded pixel count matches the budget. Frames
+// rendered before the last change of the scale are ignored as the Profiler reads them back several frames late.
+class DynamicResolution
+{
+public:
+  // Number of frames averaged before the scale is changed
+  static const int NUM_SAMPLES = 4;
+  // Scale is never raised by less than this to avoid flickering between two close resolutions
+  static constexpr float MIN_CHANGE = 0.02f;
+  // Largest relative change of the scale at once, going up is slower so that we don't overshoot the budget
+  static constexpr float MAX_DECREASE = 0.75f;
+  static constexpr float MAX_INCREASE = 1.1f;
+
+  DynamicResolution() = default;
+  ~DynamicResolution() = default;
+
+  // Target GPU frame time in milliseconds and the allowed range of the scale of each axis
+  void SetTarget(float targetMs) { _target = targetMs; }
+  void SetScaleRange(float minScale, float maxScale);
+  float GetTarget() const { return _target; }
+  // Enable or disable the scaling, disabled scaling stays at the maximum scale
+  void SetEnabled(bool enable);
+  bool IsEnabled() const { return _enabled; }
+  // Go back to the maximum scale and forget the measured frames
+  void Reset();
+
+  // Take the GPU time of the frame read back by the Profiler and adapt the scale, call once per frame after
+  // Profiler::BeginFrame()
+  void Update();
+  // Current scale of each axis of the rendered image
+  float GetScale() const { return _enabled ? _scale : _maxScale; }
+  // Scaled size of the image, at least a single pixel
+  void GetScaledSize(int width, int height, int &scaledWidth, int &scaledHeight) const;
+  // Average GPU time of the last measured frames in milliseconds, 0 if nothing was measured yet
+  float GetAverageTime() const { return _averageTime; }
+
+private:
+  // No copies allowed
+  DynamicResolution(const DynamicResolution &);
+  DynamicResolution & operator = (const DynamicResolution &);
+
+  // Target GPU frame time in milliseconds, i.e., 120 Hz
+  float _target = 8.3f;
+  // Allowed scale of each axis
+  float _minScale = 0.5f;
+  float _maxScale = 1.0f;
+  // Current scale of each axis
+  float _scale = 1.0f;
+  bool _enabled = false;
+
+  // GPU times of the frames rendered since the last change of the scale
+  float _samples[NUM_SAMPLES] = {0.0f};
+  int _numSamples = 0;
+  float _averageTime = 0.0f;
+  // First Profiler frame rendered with the current scale and the last frame taken
+  int _scaleFrame = 0;
+  int _lastFrame = -1;
+};
@@ -0,0 +1,212 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <glad/glad.h>
+
+// Handle of a resource within the frame graph, negative if invalid
+typedef int FrameResource;
+
+// How a pass accesses a resource
+enum class ResourceAccess
+{
+  // Framebuffer attachment, depth formats go to the depth attachment and the rest to the color ones in the declared order
+  Attachment,
+  // Sampled texture
+  Texture,
+  // Image load and store
+  Image,
+  // Shader storage buffer
+  Storage,
+  // Uniform buffer
+  Uniform,
+  // Indirect draw or dispatch commands
+  Indirect
+};
+
+// Description of a transient render target texture
+struct FrameTextureDesc
+{
+  // Formats as for glTexImage2D()
+  GLint internalFormat;
+  GLenum format;
+  GLenum type;
+  // Minification and magnification filter, multisampled textures have none
+  GLint filter;
+  // Size and samples, 1 sample creates a regular 2D texture
+  int width;
+  int height;
+  GLsizei samples;
+
+  bool operator == (const FrameTextureDesc &other) const
+  {
+    return internalFormat == other.internalFormat && format == other.format && type == other.type && filter == other.filter &&
+           width == other.width && height == other.height && samples == other.samples;
+  }
+};
+
+// Declarative frame graph: passes are added every frame along with the resources they read and write, Compile() then
+// orders them by their dependencies, removes the passes whose results nobody reads, allocates the transient textures,
+// and Execute() runs them with the framebuffers bound and the memory barriers issued. Transient textures whose
+// lifetimes don't overlap share the same texture, passes must not expect any content they didn't write themselves.
+// Writes to the imported resources marked as the output of the frame are always kept.
+class FrameGraph
+{
+public:
+  // Callback running the pass, the framebuffer of its attachments is already bound
+  typedef std::function<void(const FrameGraph &frameGraph)> PassJob;
+
+  // Number of frames an unused texture or framebuffer survives before it gets deleted
+  static const int MAX_UNUSED_FRAMES = 3;
+
+  FrameGraph() = default;
+  ~FrameGraph();
+
+  // Delete all textures and framebuffers
+  void Release();
+  // Forget the passes and resources of the previous frame, the textures are kept for reuse
+  void Reset();
+
+  // Declare a transient texture living within this frame only
+  FrameResource CreateTexture(const char *name, const FrameTextureDesc &desc);
+  // Import an existing texture, the description tells how to attach and bind it
+  FrameResource ImportTexture(const char *name, GLuint texture, const FrameTextureDesc &desc);
+  // Import the window system provided framebuffer, it's always the output of the frame
+  FrameResource ImportBackbuffer(const char *name, int width, int height);
+  // Import an existing buffer, 0 is fine for resources that only order the passes
+  FrameResource ImportBuffer(const char *name, GLuint buffer);
+  // Keep the passes writing the imported resource
+  void MarkOutput(FrameResource resource);
+
+  // Add a pass, the name is used for the profiler scope and must outlive the graph
+  int AddPass(const char *name, const PassJob &job);
+  // Declare the access of the pass to the resource, invalid resources are ignored
+  void Read(int pass, FrameResource resource, ResourceAccess access);
+  void Write(int pass, FrameResource resource, ResourceAccess access);
+  // Render to the lower left width x height part of the attachments only, e.g., for dynamic resolution
+  void SetViewport(int pass, int width, int height);
+
+  // Order the passes, remove the unused ones, and allocate the transient resources, returns false on cyclic dependencies
+  bool Compile();
+  // Run the compiled passes
+  void Execute();
+
+  // Texture or buffer behind the resource, valid during the execution of the compiled passes only
+  GLuint GetTexture(FrameResource resource) const;
+  GLuint GetBuffer(FrameResource resource) const { return GetTexture(resource); }
+  // Bind the texture to the texture unit using the target matching its samples
+  void BindTexture(GLuint unit, FrameResource resource) const;
+
+  // Number of passes added and actually executed in the last compiled frame
+  int GetNumPasses() const { return (int)_passes.size(); }
+  int GetNumExecutedPasses() const { return (int)_order.size(); }
+  // Bytes of the transient textures used by the last compiled frame and of the textures actually allocated
+  size_t GetTransientBytes() const { return _transientBytes; }
+  size_t GetAllocatedBytes() const { return _allocatedBytes; }
+
+private:
+  // Declared access of a pass
+  struct Access
+  {
+    FrameResource resource;
+    ResourceAccess access;
+    bool write;
+  };
+
+  // Declared pass
+  struct Pass
+  {
+    const char *name;
+    PassJob job;
+    std::vector<Access> accesses;
+    // Framebuffer of the attachments, 0 if the pass has none or renders to the backbuffer
+    GLuint fbo;
+    bool hasAttachments;
+    // Viewport of the attachments
+    int width;
+    int height;
+    // Requested viewport, 0 for the whole attachments
+    int viewportWidth;
+    int viewportHeight;
+    // Barrier bits needed before the pass runs
+    GLbitfield barriers;
+  };
+
+  // Declared resource
+  struct Resource
+  {
+    const char *name;
+    FrameTextureDesc desc;
+    // Texture or buffer name, assigned by Compile() for the transient ones
+    GLuint object;
+    bool transient;
+    bool backbuffer;
+    bool output;
+    // First and last position in the execution order, -1 if unused
+    int first;
+    int last;
+    // Index of the allocated texture of the transient ones
+    int texture;
+  };
+
+  // Allocated transient texture
+  struct Texture
+  {
+    FrameTextureDesc desc;
+    GLuint texture;
+    // Last position in the execution order of the resource currently occupying the texture
+    int busyUntil;
+    int unusedFrames;
+  };
+
+  // Cached framebuffer of a set of attachments
+  struct Framebuffer
+  {
+    std::vector<GLuint> attachments;
+    GLuint fbo;
+    int unusedFrames;
+  };
+
+  // No copies allowed
+  FrameGraph(const FrameGraph &);
+  FrameGraph & operator = (const FrameGraph &);
+
+  // Sort the passes so that every pass runs after the writers of the resources it reads, returns false on a cycle
+  bool SortPasses();
+  // Remove the passes that don't contribute to the output
+  void CullPasses();
+  // Assign the transient textures to the resources, alias those whose lifetimes don't overlap
+  void AllocateTextures();
+  // Get the framebuffers of the passes
+  void CreateFramebuffers();
+  // Find the barriers of the passes reading or writing what the previous passes wrote by shaders
+  void ComputeBarriers();
+  // Delete the textures and framebuffers unused for too long
+  void CollectGarbage();
+
+  // Is the format depth or depth stencil, 0 if neither, GL_DEPTH_STENCIL_ATTACHMENT or GL_DEPTH_ATTACHMENT otherwise
+  static GLenum GetDepthAttachment(GLint internalFormat);
+  // Size of the texture in bytes, rough guess of what the driver allocates
+  static size_t GetTextureBytes(const FrameTextureDesc &desc);
+
+  // Passes and resources of the current frame
+  std::vector<Pass> _passes;
+  std::vector<Resource> _resources;
+  // Compiled execution order of the passes
+  std::vector<int> _order;
+  // Textures and framebuffers kept among frames
+  std::vector<Texture> _textures;
+  std::vector<Framebuffer> _framebuffers;
+  // Memory statistics of the last compiled frame
+  size_t _transientBytes = 0;
+  size_t _allocatedBytes = 0;
+  // Passes reordered and resources read without any writer in the last compiled frame, the warnings are printed
+  // only when they change
+  int _reordered = 0;
+  int _unwritten = 0;
+};
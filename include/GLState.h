@@ -0,0 +1,162 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+// Fixed function state of a render pass, applied at once by GLState::Apply()
+struct PipelineState
+{
+  // Depth test, function and writes
+  bool depthTest;
+  GLenum depthFunc;
+  GLboolean depthMask;
+  // Depth clamping instead of the near and far plane clipping
+  bool depthClamp;
+  // Face culling and the culled faces
+  bool cullFace;
+  GLenum cullMode;
+  // Blending, its equation and factors
+  bool blend;
+  GLenum blendEquation;
+  GLenum blendSrc;
+  GLenum blendDst;
+  // Stencil test, the function and operations are set separately
+  bool stencilTest;
+  // Polygon rasterization of both faces
+  GLenum polygonMode;
+};
+
+// Shadows the OpenGL state of the render passes and skips the calls that wouldn't change anything, so that the passes
+// may set everything they need without caring about what the previous ones left behind and nothing has to be unbound
+// after use. Only the calls going through the cache are tracked, the cache is invalidated in BeginFrame() as
+// the code outside the passes, e.g., recreated programs and buffers, doesn't go through it.
+class GLState
+{
+public:
+  // Number of indexed uniform and storage buffer binding points tracked, the rest is passed through
+  static const int MAX_BUFFER_BINDINGS = 16;
+
+  // Get and create instance for this singleton
+  static GLState& GetInstance();
+  // Forget everything and start counting the calls of a new frame
+  void BeginFrame();
+  // Forget the shadowed state, call after changing it behind the cache
+  void Invalidate();
+
+  // Set the whole fixed function state of a pass
+  void Apply(const PipelineState &state);
+
+  // Cached counterparts of the OpenGL calls, capabilities that aren't tracked are passed through
+  void Enable(GLenum cap) { Set(cap, true); }
+  void Disable(GLenum cap) { Set(cap, false); }
+  void Set(GLenum cap, bool enabled);
+  void DepthFunc(GLenum func);
+  void DepthMask(GLboolean mask);
+  void CullFace(GLenum mode);
+  void BlendEquation(GLenum mode);
+  void BlendFunc(GLenum src, GLenum dst);
+  void PolygonMode(GLenum mode);
+  void ColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a);
+  void StencilFunc(GLenum func, GLint ref, GLuint mask) { StencilFuncSeparate(GL_FRONT_AND_BACK, func, ref, mask); }
+  void StencilFuncSeparate(GLenum face, GLenum func, GLint ref, GLuint mask);
+  void StencilOp(GLenum sfail, GLenum dpfail, GLenum dppass) { StencilOpSeparate(GL_FRONT_AND_BACK, sfail, dpfail, dppass); }
+  void StencilOpSeparate(GLenum face, GLenum sfail, GLenum dpfail, GLenum dppass);
+  void UseProgram(GLuint program);
+  void BindVertexArray(GLuint vao);
+  // Indexed binds don't guarantee the generic binding point, bind it explicitly before updating the buffer through it
+  void BindBufferBase(GLenum target, GLuint index, GLuint buffer) { BindBufferRange(target, index, buffer, 0, 0); }
+  // Size 0 binds the whole buffer
+  void BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+  // Calls issued and skipped in the last finished frame
+  int GetIssuedCalls() const { return _lastIssued; }
+  int GetSkippedCalls() const { return _lastSkipped; }
+
+private:
+  // Number of tracked capabilities, listed in GLState.cpp
+  static const int NumCapabilities = 9;
+
+  // Shadowed value, invalid until the first call sets it
+  template <typename T>
+  struct Cached
+  {
+    T value;
+    bool valid;
+
+    // Remember the new value, returns false if the call can be skipped
+    bool Update(const T &newValue)
+    {
+      if (valid && value == newValue)
+        return false;
+
+      value = newValue;
+      valid = true;
+      return true;
+    }
+  };
+
+  // Stencil function of a face
+  struct StencilFuncState
+  {
+    GLenum func;
+    GLint ref;
+    GLuint mask;
+    bool operator == (const StencilFuncState &other) const { return func == other.func && ref == other.ref && mask == other.mask; }
+  };
+
+  // Stencil operations of a face
+  struct StencilOpState
+  {
+    GLenum sfail;
+    GLenum dpfail;
+    GLenum dppass;
+    bool operator == (const StencilOpState &other) const { return sfail == other.sfail && dpfail == other.dpfail && dppass == other.dppass; }
+  };
+
+  // Buffer bound to an indexed binding point
+  struct BufferBinding
+  {
+    GLuint buffer;
+    GLintptr offset;
+    GLsizeiptr size;
+    bool operator == (const BufferBinding &other) const { return buffer == other.buffer && offset == other.offset && size == other.size; }
+  };
+
+  // All is private, instance is created in GetInstance()
+  GLState() { Invalidate(); }
+  // No copies allowed
+  GLState(const GLState &);
+  GLState & operator = (const GLState &);
+
+  // Count the call, returns whether it should be issued
+  bool Count(bool changed);
+  // Index of the tracked capability, NumCapabilities if it isn't tracked
+  static int GetCapability(GLenum cap);
+
+  Cached<bool> _capabilities[NumCapabilities];
+  Cached<GLenum> _depthFunc;
+  Cached<GLboolean> _depthMask;
+  Cached<GLenum> _cullMode;
+  Cached<GLenum> _blendEquation;
+  Cached<GLuint> _blendFunc;
+  Cached<GLenum> _polygonMode;
+  Cached<GLuint> _colorMask;
+  // Front and back face stencil
+  Cached<StencilFuncState> _stencilFunc[2];
+  Cached<StencilOpState> _stencilOp[2];
+  Cached<GLuint> _program;
+  Cached<GLuint> _vao;
+  // Uniform and storage buffer bindings
+  Cached<BufferBinding> _uniformBuffers[MAX_BUFFER_BINDINGS];
+  Cached<BufferBinding> _storageBuffers[MAX_BUFFER_BINDINGS];
+
+  // Calls issued and skipped in the current and last frame
+  int _issued = 0;
+  int _skipped = 0;
+  int _lastIssued = 0;
+  int _lastSkipped = 0;
+};
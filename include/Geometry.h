@@ -6,6 +6,7 @@
 #pragma once
 
 #include "Mesh.h"
+#include "MeshPool.h"
 #include "Vertex.h"
 
 // Geometry utilities class
@@ -18,6 +19,10 @@ public:
   static Mesh<Vertex_Pos_Tex> *CreateQuadTex();
   // Create simple quad with normals, tangents and texture coordinates
   static Mesh<Vertex_Pos_Nrm_Tgt_Tex> *CreateQuadNormalTangentTex();
+  // Create simple quad with a separate position stream and packed normals, tangents and texture coordinates
+  static SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *CreateQuadNormalTangentTexPacked();
+  // Add simple quad with normals, tangents and texture coordinates to the pool, returns its range
+  static MeshLod AddQuadNormalTangentTex(MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool);
   // Creates simple cube with colors
   static Mesh<Vertex_Pos_Col> *CreateCubeColor();
   // Creates simple cube with colors and shared vertices
@@ -28,10 +33,18 @@ public:
   static Mesh<Vertex_Pos_Tex> *CreateCubeTex();
   // Create simple cube with normals, tangents and texture coordinates
   static Mesh<Vertex_Pos_Nrm_Tgt_Tex> *CreateCubeNormalTangentTex();
+  // Create simple cube with a separate position stream and packed normals, tangents and texture coordinates
+  static SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *CreateCubeNormalTangentTexPacked();
+  // Add simple cube with normals, tangents and texture coordinates to the pool, returns its range
+  static MeshLod AddCubeNormalTangentTex(MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool);
+  // Create a single mesh with a separate position stream and packed attributes from all meshes in the pool
+  static SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *CreatePackedMesh(const MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool);
   // Create tethrahedron composed from vertices with normals
   static Mesh<Vertex_Pos_Nrm> *CreateTetrahedron();
   // Create regular icosahedron with just positions
   static Mesh<Vertex_Pos> *CreateIcosahedron();
+  // Create unit icosphere with numLods levels of detail, the finest first, the coarsest being the icosahedron
+  static Mesh<Vertex_Pos> *CreateIcosphere(int numLods);
 
 private:
   Geometry();
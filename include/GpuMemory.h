@@ -0,0 +1,62 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+#include <cstddef>
+#include <map>
+
+// Bookkeeping of the buffers and textures the samples allocate, each recorded with its size and the subsystem it
+// belongs to. Objects deleted without untracking are dropped by Prune() as their names are no longer valid, the dump
+// adds the video memory reported by the driver via GL_NVX_gpu_memory_info or GL_ATI_meminfo where supported.
+class GpuMemory
+{
+public:
+  // Get and create instance for this singleton
+  static GpuMemory& GetInstance();
+
+  // Record the buffer or texture, replaces the previous record of the same name, subsystem must be a string literal
+  void TrackBuffer(GLuint buffer, size_t bytes, const char *subsystem);
+  void TrackTexture(GLuint texture, size_t bytes, const char *subsystem);
+  // Forget the buffer or texture about to be deleted
+  void UntrackBuffer(GLuint buffer) { _buffers.erase(buffer); }
+  void UntrackTexture(GLuint texture) { _textures.erase(texture); }
+  // Forget the objects deleted behind our back
+  void Prune();
+
+  // Bytes of all tracked buffers and textures
+  size_t GetTrackedBytes() const;
+  // Total and currently available video memory in kB as reported by the driver, false if there's no way to tell
+  static bool QueryVideoMemory(GLint &totalKB, GLint &availableKB);
+  // Print the bytes of each subsystem and the video memory reported by the driver
+  void Dump();
+
+  // Bits of a single texel of the internal format, compressed formats are averaged over their blocks
+  static int GetTexelBits(GLenum internalFormat);
+  // Bytes of the texture with all its mip levels, layers (i.e., array layers or cube faces), and samples
+  static size_t GetTextureBytes(GLenum internalFormat, GLsizei width, GLsizei height, GLsizei numLevels = 1, GLsizei numLayers = 1,
+                                GLsizei numSamples = 1);
+
+private:
+  // Single tracked object
+  struct Allocation
+  {
+    size_t bytes;
+    const char *subsystem;
+  };
+
+  // All is private, instance is created in GetInstance()
+  GpuMemory() = default;
+  ~GpuMemory() = default;
+  // No copies allowed
+  GpuMemory(const GpuMemory &);
+  GpuMemory & operator = (const GpuMemory &);
+
+  // Tracked objects by their names
+  std::map<GLuint, Allocation> _buffers;
+  std::map<GLuint, Allocation> _textures;
+};
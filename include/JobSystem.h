@@ -0,0 +1,82 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small work stealing job system for data parallel loops: a loop is split into batches dealt to the queues of
+// the worker threads and of the calling thread, each thread works on its own queue first and steals the batches
+// of the others once it runs dry. Jobs must not touch OpenGL, they only fill the CPU side or mapped memory.
+class JobSystem
+{
+public:
+  // Job processing the [begin, end) range of the loop
+  typedef std::function<void(int begin, int end)> RangeJob;
+
+  // Get and create instance for this singleton
+  static JobSystem& GetInstance();
+  // Start the worker threads, 0 uses all hardware threads but one as the calling thread works as well
+  bool Init(int numThreads = 0);
+  // Stop the worker threads, the loops run just on the calling thread afterwards
+  void Release();
+  // Run the job over count items in batches of batchSize items, returns once all batches are done,
+  // call from the main thread only, small loops run right away without waking the workers
+  void ParallelFor(int count, int batchSize, const RangeJob &job);
+  // Number of threads running the loops including the calling thread
+  int GetNumThreads() const { return (int)_threads.size() + 1; }
+
+private:
+  // Part of a loop
+  struct Batch
+  {
+    // Job of the loop
+    const RangeJob *job;
+    // Range of the items
+    int begin;
+    int end;
+    // Batches of the loop not finished yet
+    std::atomic<int> *remaining;
+  };
+
+  // Batches of a single thread, the owner takes them from the back while the thieves from the front
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Batch> batches;
+  };
+
+  // All is private, instance is created in GetInstance()
+  JobSystem() = default;
+  ~JobSystem();
+  // No copies allowed
+  JobSystem(const JobSystem &);
+  JobSystem & operator = (const JobSystem &);
+
+  // Worker thread loop, index is the queue of the thread
+  void WorkerLoop(int index);
+  // Take a batch from the own queue or steal one and run it, returns false if there was nothing to do
+  bool RunBatch(int index);
+
+  // Worker threads, the calling thread owns the queue 0
+  std::vector<std::thread> _threads;
+  // Queues of all the threads
+  std::unique_ptr<Queue[]> _queues;
+  int _numQueues = 0;
+  // Number of batches waiting in all the queues
+  std::atomic<int> _numQueued{0};
+  // Guards the sleeping of the workers and the exit flag
+  std::mutex _mutex;
+  // Signaled when there are new batches or when the workers should exit
+  std::condition_variable _workReady;
+  bool _exit = false;
+};
@@ -0,0 +1,62 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// Picks the fastest local size of compute kernels by timing them on the GPU. The tuned configurations are stored
+// by name to a text file along with the driver identification, the file is ignored on a different GPU or driver.
+class KernelTuner
+{
+public:
+  // Local size of a kernel and the number of items each invocation fetches to the shared memory at once
+  struct Config
+  {
+    int workGroupSize;
+    int tileSize;
+  };
+
+  // Sets up the candidate, e.g., rebuilds the kernel, returns false if it can't be used
+  typedef std::function<bool(const Config &config)> SetUpFunc;
+  // Runs the timed work once
+  typedef std::function<void()> RunFunc;
+
+  KernelTuner() = default;
+  ~KernelTuner() = default;
+
+  // Power of two work group sizes in [minSize, maxSize] combined with the power of two tile sizes up to maxTile whose
+  // shared memory of sharedBytesPerItem bytes per cached item fits the limits of the GPU, requires OpenGL 4.3
+  static std::vector<Config> GetCandidates(int minSize, int maxSize, int maxTile, int sharedBytesPerItem);
+  // Time numRuns runs of each candidate after a warm up, waits for the GPU, returns false if no candidate could be set up
+  static bool Tune(const std::vector<Config> &candidates, const SetUpFunc &setUp, const RunFunc &run, int numRuns, Config &fastest);
+
+  // Read the configurations tuned on this GPU, fails if the file is missing or from a different GPU or driver
+  bool Load(const char fileName[]);
+  // Store all configurations along with the driver identification
+  bool Save(const char fileName[]) const;
+  // Get or set the configuration of the kernel, names mustn't contain whitespace. Get fails if the configuration isn't
+  // one of the candidates of GetCandidates() with the same maxTile and sharedBytesPerItem of the kernel, requires OpenGL 4.3
+  bool Get(const char name[], int maxTile, int sharedBytesPerItem, Config &config) const;
+  void Set(const char name[], const Config &config) { _configs[name] = config; }
+
+private:
+  // No copies allowed
+  KernelTuner(const KernelTuner &);
+  KernelTuner & operator = (const KernelTuner &);
+
+  // Are both sizes powers of two within the limits of the kernel and does the work group fit the limits of the GPU?
+  static bool IsValid(const Config &config, int maxTile, int sharedBytesPerItem);
+  // Vendor, renderer, and version of the driver joined to a single line
+  static std::string GetDriverId();
+
+  // Tuned configurations by the kernel names
+  std::map<std::string, Config> _configs;
+};
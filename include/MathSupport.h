@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -22,10 +23,59 @@ inline glm::mat4x4 fastMatrixInverse(const glm::mat4x4& matrix)
                      glm::vec4(-inv * glm::vec3(matrix[3]), 1.0f));
 }
 
-// Gets random number from the [min, max] range
+// Small and fast PCG32 random number generator, unlike rand() every instance has its own state
+class RandomGenerator
+{
+public:
+  explicit RandomGenerator(uint64_t seed = 0) { Seed(seed); }
+
+  // Restart the sequence, the same seed always gives the same numbers
+  void Seed(uint64_t seed)
+  {
+    _state = 0;
+    Next();
+    _state += seed;
+    Next();
+  }
+
+  // Next 32 random bits
+  uint32_t Next()
+  {
+    uint64_t state = _state;
+    _state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t xorShifted = static_cast<uint32_t>(((state >> 18u) ^ state) >> 27u);
+    uint32_t rotation = static_cast<uint32_t>(state >> 59u);
+    return (xorShifted >> rotation) | (xorShifted << ((32u - rotation) & 31u));
+  }
+
+  // Random number from the [min, max) range
+  float Get(float min, float max)
+  {
+    // The upper 24 bits fit the float mantissa exactly
+    return min + (Next() >> 8) * (1.0f / 16777216.0f) * (max - min);
+  }
+
+private:
+  uint64_t _state;
+};
+
+// Generator used by getRandom(), each thread has its own so it's safe to call from multiple threads
+inline RandomGenerator &getThreadRandom()
+{
+  static thread_local RandomGenerator generator;
+  return generator;
+}
+
+// Restart the random numbers of the calling thread, e.g., so that benchmarks get the same scene every run
+inline void seedRandom(uint64_t seed)
+{
+  getThreadRandom().Seed(seed);
+}
+
+// Gets random number from the [min, max) range
 inline float getRandom(float min, float max)
 {
-  return min + static_cast<float>(rand()) / (static_cast <float>(RAND_MAX / (max - min)));
+  return getThreadRandom().Get(min, max);
 }
 
 // C++ type safe signum function
@@ -5,29 +5,89 @@
 
 #pragma once
 
+#include "GpuMemory.h"
+#include "Vertex.h"
+
+#include <algorithm>
 #include <glad/glad.h>
 #include <vector>
 
+// Create a buffer with static data, uses immutable storage and DSA if available (GL 4.5 or ARB_direct_state_access),
+// the buffer is tracked by GpuMemory under the given subsystem
+inline GLuint CreateStaticBuffer(GLsizeiptr size, const void *data, const char *subsystem = "Meshes")
+{
+  GLuint buffer = 0;
+  if (GLAD_GL_VERSION_4_5 || GLAD_GL_ARB_direct_state_access)
+  {
+    // The size is final and the content won't change
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, size, data, 0);
+  }
+  else
+  {
+    // Use the copy target so that we don't mess up the bindings of the current VAO
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, size, data, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+  GpuMemory::GetInstance().TrackBuffer(buffer, (size_t)size, subsystem);
+  return buffer;
+}
+
+// Index range of a single level of detail or of a pooled mesh within the mesh buffers
+struct MeshLod
+{
+  // Offset of the first index in the index buffer
+  GLuint firstIndex;
+  // Number of indices
+  GLsizei indexCount;
+  // Value added to the indices, i.e., offset of the first vertex in the vertex buffer
+  GLint baseVertex;
+};
+
 // Class for mesh representation
 template <class VertexType>
 class Mesh
 {
 public:
-  Mesh() : _vao(0), _vbo(0), _vboSize(0), _ibo(0), _iboSize(0) {}
+  Mesh() : _vao(0), _positionVao(0), _vbo(0), _vboSize(0), _ibo(0), _iboSize(0), _indexType(GL_UNSIGNED_INT) {}
   ~Mesh();
 
-  // Initialize the mesh with data
-  void Init(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib);
+  // Initialize the mesh with data, the whole index buffer is the only level of detail, the indices are stored in 16 bits
+  // if they all fit unless shortIndices is false (e.g., when shaders read the index buffer as uints)
+  void Init(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib, bool shortIndices = true);
+  // Initialize the mesh with data containing multiple levels of detail, the first one being the finest, or multiple pooled meshes
+  void Init(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib, const std::vector<MeshLod> &lods, bool shortIndices = true);
+  // Initialize the mesh straight from the memory, e.g., mapped from a file, indexType is GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+  void Init(const VertexType *vertices, GLsizei numVertices, const void *indices, GLsizei numIndices, GLenum indexType,
+            const std::vector<MeshLod> &lods);
   // Return the associated VAO for rendering
   GLuint GetVAO() { return _vao; }
+  // Return the VAO with just the positions for depth only passes, the full one if the mesh has no separate position stream
+  GLuint GetPositionVAO() { return _positionVao ? _positionVao : _vao; }
+  // Get the vertex buffer, e.g., to read it in a compute shader
+  GLuint GetVBO() { return _vbo; }
+  // Get the index buffer
+  GLuint GetIBO() { return _ibo; }
   // Get the size of the vertex buffer
   GLsizei GetVBOSize() { return _vboSize; }
   // Get the size of the index buffer
   GLsizei GetIBOSize() { return _iboSize; }
+  // Get the type of the indices for the draw calls, GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+  GLenum GetIndexType() const { return _indexType; }
+  // Get the size of a single index in bytes, e.g., to turn the first index into the offset of the draw
+  GLsizei GetIndexSize() const { return _indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint); }
+  // Get the number of levels of detail
+  int GetNumLods() const { return (int)_lods.size(); }
+  // Get the index range of the level of detail
+  const MeshLod &GetLod(int lod) const { return _lods[lod]; }
 
 protected:
   // Vertex array object used to draw this mesh
   GLuint _vao;
+  // Vertex array object with just the position stream, 0 if there's none
+  GLuint _positionVao;
   // Vertex buffer
   GLuint _vbo;
   // Vertex buffer size in # of vertices
@@ -36,6 +96,10 @@ protected:
   GLuint _ibo;
   // Index buffer size
   GLsizei _iboSize;
+  // Type of the indices in the index buffer
+  GLenum _indexType;
+  // Index ranges of the levels of detail
+  std::vector<MeshLod> _lods;
 
 private:
   // No copies allowed
@@ -48,42 +112,138 @@ Mesh<VertexType>::~Mesh()
 {
   // Release resources used by the driver
   glDeleteVertexArrays(1, &_vao);
+  glDeleteVertexArrays(1, &_positionVao);
+  GpuMemory::GetInstance().UntrackBuffer(_vbo);
+  GpuMemory::GetInstance().UntrackBuffer(_ibo);
   glDeleteBuffers(1, &_vbo);
   glDeleteBuffers(1, &_ibo);
 }
 
 template<class VertexType>
-void Mesh<VertexType>::Init(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib)
+void Mesh<VertexType>::Init(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib, bool shortIndices)
+{
+  Init(vb, ib, std::vector<MeshLod>(1, {0, (GLsizei)ib.size(), 0}), shortIndices);
+}
+
+template<class VertexType>
+void Mesh<VertexType>::Init(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib, const std::vector<MeshLod> &lods, bool shortIndices)
+{
+  // Indices are relative to the base vertex of their range, halve the index fetch if they all fit in 16 bits
+  if (shortIndices && !ib.empty() && *std::max_element(ib.begin(), ib.end()) <= 0xffff)
+  {
+    std::vector<GLushort> shortIb;
+    shortIb.reserve(ib.size());
+    for (GLuint index : ib)
+      shortIb.push_back((GLushort)index);
+    Init(vb.data(), (GLsizei)vb.size(), shortIb.data(), (GLsizei)shortIb.size(), GL_UNSIGNED_SHORT, lods);
+  }
+  else
+    Init(vb.data(), (GLsizei)vb.size(), ib.data(), (GLsizei)ib.size(), GL_UNSIGNED_INT, lods);
+}
+
+template<class VertexType>
+void Mesh<VertexType>::Init(const VertexType *vertices, GLsizei numVertices, const void *indices, GLsizei numIndices, GLenum indexType,
+                            const std::vector<MeshLod> &lods)
 {
   // Do nothing if we're already initialized
   if (_vao)
     return;
 
-  _vboSize = (GLsizei)vb.size();
-  _iboSize = (GLsizei)ib.size();
+  _vboSize = numVertices;
+  _iboSize = numIndices;
+  _indexType = indexType;
+  _lods = lods;
+
+  // Generate the vertex and index buffers and fill them with data
+  _vbo = CreateStaticBuffer(sizeof(VertexType) * _vboSize, static_cast<const void *>(vertices));
+  _ibo = CreateStaticBuffer(GetIndexSize() * _iboSize, indices);
 
   // Create and bind the Vertex Array Object
   glGenVertexArrays(1, &_vao);
   glBindVertexArray(_vao);
 
-  // Generate the vertex buffer fill it with data
-  glGenBuffers(1, &_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, _vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(VertexType) * _vboSize, static_cast<const void *>(&*vb.begin()), GL_STATIC_DRAW);
-
   // Describe and enable vertex attributes
+  glBindBuffer(GL_ARRAY_BUFFER, _vbo);
   VertexType::BindVertexAttributes();
 
   // Unbind the array buffer to prevent accidental changes
   glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-  // Generate the index buffer and fill it with data
-  glGenBuffers(1, &_ibo);
+  // Store the index buffer in the VAO
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * _iboSize, static_cast<const void *>(&*ib.begin()), GL_STATIC_DRAW);
 
   // Note: can't unbind the IBO while the VAO is active unlike VBO which got stored trough glVertexAttribPointer call, it would break things
 
   // Unbind the VAO
   glBindVertexArray(0);
 }
+
+// Mesh with the positions and the rest of the vertex attributes in separate streams so that depth only passes
+// fetch just the positions, AttributeType describes the second stream starting at the attribute location 1
+template <class AttributeType>
+class SplitMesh : public Mesh<AttributeType>
+{
+public:
+  SplitMesh() : _positionVbo(0) {}
+  ~SplitMesh();
+
+  // Initialize the mesh with the streams of the same size, the whole index buffer is the only level of detail
+  void Init(const std::vector<Vertex_Pos> &positions, const std::vector<AttributeType> &attributes, const std::vector<GLuint> &ib,
+            bool shortIndices = true);
+  // Initialize the mesh with the streams of the same size containing multiple index ranges
+  void Init(const std::vector<Vertex_Pos> &positions, const std::vector<AttributeType> &attributes, const std::vector<GLuint> &ib,
+            const std::vector<MeshLod> &lods, bool shortIndices = true);
+
+protected:
+  // Vertex buffer with the positions
+  GLuint _positionVbo;
+
+private:
+  // No copies allowed
+  SplitMesh(const SplitMesh &);
+  SplitMesh & operator = (const SplitMesh &);
+};
+
+template <class AttributeType>
+SplitMesh<AttributeType>::~SplitMesh()
+{
+  GpuMemory::GetInstance().UntrackBuffer(_positionVbo);
+  glDeleteBuffers(1, &_positionVbo);
+}
+
+template<class AttributeType>
+void SplitMesh<AttributeType>::Init(const std::vector<Vertex_Pos> &positions, const std::vector<AttributeType> &attributes, const std::vector<GLuint> &ib,
+                                    bool shortIndices)
+{
+  Init(positions, attributes, ib, std::vector<MeshLod>(1, {0, (GLsizei)ib.size(), 0}), shortIndices);
+}
+
+template<class AttributeType>
+void SplitMesh<AttributeType>::Init(const std::vector<Vertex_Pos> &positions, const std::vector<AttributeType> &attributes, const std::vector<GLuint> &ib,
+                                    const std::vector<MeshLod> &lods, bool shortIndices)
+{
+  // Do nothing if we're already initialized
+  if (this->_vao)
+    return;
+
+  // Creates the VAO with the attribute stream and the index buffer
+  Mesh<AttributeType>::Init(attributes, ib, lods, shortIndices);
+
+  // Generate the position buffer and fill it with data
+  _positionVbo = CreateStaticBuffer(sizeof(Vertex_Pos) * positions.size(), static_cast<const void *>(&*positions.begin()));
+
+  // Add the position stream to the full VAO
+  glBindVertexArray(this->_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, _positionVbo);
+  Vertex_Pos::BindVertexAttributes();
+
+  // Position only VAO sharing the index buffer
+  glGenVertexArrays(1, &this->_positionVao);
+  glBindVertexArray(this->_positionVao);
+  Vertex_Pos::BindVertexAttributes();
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->_ibo);
+
+  // Unbind the VAO first so that the element array binding stays in it
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
@@ -0,0 +1,33 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include "Vertex.h"
+
+#include <glad/glad.h>
+#include <vector>
+
+// Offline conversion of the source meshes to the MeshFile format: the triangles are optimized by MeshOptimizer, missing
+// normals and tangents are generated, and the indices with adjacency are built over the welded positions
+class MeshConverter
+{
+public:
+  // Convert Wavefront OBJ file, polygons are triangulated as fans, fitUnitCube centers and scales the mesh to [-0.5, 0.5]^3
+  static bool ConvertObj(const char *objName, const char *meshName, bool fitUnitCube = false);
+  // Write the triangle list to the mesh file along with its adjacency
+  static bool Convert(std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, std::vector<GLuint> &ib, const char *meshName);
+
+  // Merge the vertices of the same position, weldedIb gets the indices of ib translated to the welded vertices
+  static void WeldPositions(const std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, const std::vector<GLuint> &ib,
+                            std::vector<Vertex_Pos> &positions, std::vector<GLuint> &weldedIb);
+  // Build GL_TRIANGLES_ADJACENCY indices of the triangle list, edges without a neighbour get the opposite vertex of
+  // their own triangle so they are never silhouettes, the mesh should be closed for the shadow volumes to be correct
+  static void BuildAdjacency(const std::vector<GLuint> &ib, std::vector<GLuint> &adjacencyIb);
+
+private:
+  MeshConverter();
+  ~MeshConverter();
+};
@@ -0,0 +1,87 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include "Mesh.h"
+#include "MeshPool.h"
+#include "Vertex.h"
+
+#include <glad/glad.h>
+#include <vector>
+
+// Binary mesh file created offline by tools/MeshConverter, its blocks are laid out exactly as the buffers expect them
+// so that the file is just memory mapped and the blocks go straight to the buffers. The file holds the levels of detail,
+// the vertices, and the indices of the render mesh and optionally the welded positions and the indices with adjacency
+// of the same mesh for the shadow volume extrusion.
+class MeshFile
+{
+public:
+  // Identification of the files, bump the version when the layout changes
+  static const char MAGIC[4];
+  static const unsigned int VERSION = 1;
+
+  MeshFile() = default;
+  ~MeshFile();
+
+  // Map the file and validate its content, fails if it's missing or corrupted
+  bool Open(const char *fileName);
+  // Unmap the file, the meshes created from it stay valid
+  void Close();
+
+  // Write the mesh file, the render mesh indices are stored in 16 bits if they all fit, adjacency may be empty
+  static bool Write(const char *fileName, const std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, const std::vector<GLuint> &ib,
+                    const std::vector<MeshLod> &lods, const std::vector<Vertex_Pos> &adjacencyVb, const std::vector<GLuint> &adjacencyIb);
+
+  // Create the render mesh uploading the mapped blocks
+  Mesh<Vertex_Pos_Nrm_Tgt_Tex> *CreateMesh() const;
+  // Create the mesh with adjacency, nullptr if the file has none, indices stay 32 bit for the extrusion compute shader
+  Mesh<Vertex_Pos> *CreateAdjacencyMesh() const;
+  // Add the finest level of detail to the pool, returns its range
+  MeshLod AddTo(MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool) const;
+
+  // Is the file mapped?
+  bool IsOpen() const { return _data != nullptr; }
+  // Does the file contain the mesh with adjacency?
+  bool HasAdjacency() const { return _header && _header->numAdjacencyIndices > 0; }
+
+private:
+  // Header at the start of the file, the blocks follow in the order of the counts below, each aligned to 4 bytes
+  struct Header
+  {
+    char magic[4];
+    unsigned int version;
+    unsigned int numLods;
+    unsigned int numVertices;
+    unsigned int numIndices;
+    // Size of the render mesh indices, 2 or 4
+    unsigned int indexSize;
+    unsigned int numAdjacencyVertices;
+    unsigned int numAdjacencyIndices;
+  };
+
+  // No copies allowed
+  MeshFile(const MeshFile &);
+  MeshFile & operator = (const MeshFile &);
+
+  // Size of the block rounded up so that the next one stays aligned
+  static size_t GetBlockSize(size_t size) { return (size + 3) & ~(size_t)3; }
+
+  // Mapped file
+  const unsigned char *_data = nullptr;
+  size_t _size = 0;
+#ifdef _WIN32
+  void *_fileHandle = nullptr;
+  void *_mappingHandle = nullptr;
+#endif
+
+  // Blocks within the mapped file
+  const Header *_header = nullptr;
+  const MeshLod *_lods = nullptr;
+  const Vertex_Pos_Nrm_Tgt_Tex *_vertices = nullptr;
+  const void *_indices = nullptr;
+  const Vertex_Pos *_adjacencyVertices = nullptr;
+  const GLuint *_adjacencyIndices = nullptr;
+};
@@ -0,0 +1,53 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include "Mesh.h"
+
+#include <cstddef>
+#include <vector>
+#include <glad/glad.h>
+
+// Post-processing of triangle meshes before they are uploaded: the triangles are reordered for the post-transform
+// vertex cache (Forsyth, "Linear-Speed Vertex Cache Optimisation"), then clusters of them for overdraw (Sander et al.,
+// "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw") so that the outer facing parts go first, and
+// finally the vertices are renumbered in the order of their first use for the vertex fetch locality
+class MeshOptimizer
+{
+public:
+  // Size of the simulated post-transform vertex cache
+  static const int CACHE_SIZE = 32;
+  // Clusters may have this many times more cache misses than the cache optimized order for the sake of overdraw
+  static constexpr float OVERDRAW_THRESHOLD = 1.05f;
+
+  // Optimize the triangle lists of all index ranges, positions are 3 floats from the start of each vertex stride bytes
+  // apart, the indices are relative to the base vertex of each range. remap receives the new index of every vertex,
+  // the ranges get their new base vertices, the vertex streams have to be reordered using RemapVertices() afterwards.
+  static void Optimize(std::vector<GLuint> &indices, std::vector<MeshLod> &ranges, const float *positions, size_t stride, size_t numVertices,
+                       std::vector<GLuint> &remap);
+  // Reorder the triangles for the vertex cache
+  static void OptimizeVertexCache(GLuint *indices, size_t numIndices, size_t numVertices);
+  // Reorder the clusters of the cache optimized triangles from the outer facing ones to the inner facing ones
+  static void OptimizeOverdraw(GLuint *indices, size_t numIndices, const float *positions, size_t stride, size_t numVertices,
+                               float threshold = OVERDRAW_THRESHOLD);
+  // Renumber the vertices in the order of their first use, the vertices unused by the ranges go last
+  static void OptimizeVertexFetch(std::vector<GLuint> &indices, std::vector<MeshLod> &ranges, size_t numVertices, std::vector<GLuint> &remap);
+  // Average number of cache misses per triangle of the index list, 0.5 is the best possible for regular meshes
+  static float GetACMR(const GLuint *indices, size_t numIndices, size_t numVertices, int cacheSize = CACHE_SIZE);
+
+  // Move the vertices to their new indices
+  template <class VertexType>
+  static void RemapVertices(std::vector<VertexType> &vertices, const std::vector<GLuint> &remap);
+};
+
+template <class VertexType>
+void MeshOptimizer::RemapVertices(std::vector<VertexType> &vertices, const std::vector<GLuint> &remap)
+{
+  std::vector<VertexType> remapped(vertices.size());
+  for (size_t i = 0; i < vertices.size(); ++i)
+    remapped[remap[i]] = vertices[i];
+  vertices.swap(remapped);
+}
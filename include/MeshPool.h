@@ -0,0 +1,64 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include "Mesh.h"
+
+#include <glad/glad.h>
+#include <vector>
+
+// Gathers the data of several meshes of the same vertex type so that they can be suballocated from a single VBO/IBO pair,
+// each mesh is then addressed by its index range and base vertex and the whole pool is drawn using a single VAO
+template <class VertexType>
+class MeshPool
+{
+public:
+  // Append the mesh data to the pool, returns the range of the mesh within the pool
+  MeshLod Add(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib);
+  // Get the vertices of all meshes
+  const std::vector<VertexType> &GetVertices() const { return _vertices; }
+  // Get the indices of all meshes, relative to the base vertex of each range
+  const std::vector<GLuint> &GetIndices() const { return _indices; }
+  // Get the ranges of all meshes in the order they were added
+  const std::vector<MeshLod> &GetRanges() const { return _ranges; }
+  // Create the mesh holding the whole pool, the ranges are accessible as its levels of detail
+  Mesh<VertexType> *CreateMesh() const;
+
+private:
+  // Concatenated vertex buffers
+  std::vector<VertexType> _vertices;
+  // Concatenated index buffers
+  std::vector<GLuint> _indices;
+  // Range of each added mesh
+  std::vector<MeshLod> _ranges;
+};
+
+template <class VertexType>
+MeshLod MeshPool<VertexType>::Add(const std::vector<VertexType> &vb, const std::vector<GLuint> &ib)
+{
+  // Indices stay as they are, the base vertex moves them to the right place
+  MeshLod range = {(GLuint)_indices.size(), (GLsizei)ib.size(), (GLint)_vertices.size()};
+  _vertices.insert(_vertices.end(), vb.begin(), vb.end());
+  _indices.insert(_indices.end(), ib.begin(), ib.end());
+  _ranges.push_back(range);
+  return range;
+}
+
+template <class VertexType>
+Mesh<VertexType> *MeshPool<VertexType>::CreateMesh() const
+{
+  Mesh<VertexType> *mesh = new Mesh<VertexType>();
+  mesh->Init(_vertices, _indices, _ranges);
+  return mesh;
+}
+
+// Draw the range of the mesh, its VAO has to be bound
+template <class VertexType>
+inline void DrawMeshRange(const Mesh<VertexType> &mesh, const MeshLod &range, GLsizei instanceCount = 1)
+{
+  glDrawElementsInstancedBaseVertex(GL_TRIANGLES, range.indexCount, mesh.GetIndexType(), reinterpret_cast<void*>((size_t)range.firstIndex * mesh.GetIndexSize()),
+                                    instanceCount, range.baseVertex);
+}
@@ -0,0 +1,74 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+// Counts the samples passing the depth and stencil tests in the marked parts of a frame using occlusion queries,
+// relating them to the samples of the render target gives the average number of times each sample was shaded
+class OverdrawCounter
+{
+public:
+  // Number of frames kept in flight before reading the queries back, so that we never stall
+  static const int NUM_FRAMES = 4;
+  // Maximum number of counted ranges within a single frame
+  static const int MAX_QUERIES = 256;
+
+  OverdrawCounter() = default;
+  ~OverdrawCounter();
+
+  // Create the query objects, requires valid OpenGL context
+  void Init();
+  // Release the query objects
+  void Release();
+  // Start a new frame, reads back the oldest frame if the GPU is already done with it
+  void BeginFrame();
+  // Finish the current frame, targetSamples is the number of pixels times the MSAA samples of the render target
+  void EndFrame(GLint64 targetSamples);
+  // Start counting the following draw calls, ranges must not be nested
+  void Begin();
+  // Stop counting the draw calls
+  void End();
+  // Samples that passed in the last frame read back
+  GLuint64 GetSamples() const { return _samples; }
+  // Average number of passed samples per render target sample in the last frame read back, negative if not known
+  double GetOverdraw() const { return _overdraw; }
+
+private:
+  // Ranges counted within a single frame
+  struct Frame
+  {
+    // Samples passed query for each range
+    GLuint queries[MAX_QUERIES];
+    // Number of the render target samples
+    GLint64 targetSamples;
+    // Number of the issued queries
+    int numQueries;
+    // Were there more ranges than queries? The frame isn't reported then
+    bool overflow;
+    // Waiting for the GPU?
+    bool pending;
+  };
+
+  // No copies allowed
+  OverdrawCounter(const OverdrawCounter &);
+  OverdrawCounter & operator = (const OverdrawCounter &);
+
+  // Read back the frame if the GPU finished it
+  void ReadBack(Frame &frame);
+
+  // Ring of frames in flight
+  Frame _frames[NUM_FRAMES] = {};
+  // Frame currently being recorded
+  int _frameIndex = 0;
+  // Is a query running?
+  bool _counting = false;
+  // Results of the last frame read back
+  GLuint64 _samples = 0;
+  double _overdraw = -1.0;
+  // Were query objects created?
+  bool _initialized = false;
+};
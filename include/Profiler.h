@@ -0,0 +1,113 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+// Simple CPU & GPU profiler measuring named scopes using timestamp queries
+class Profiler
+{
+public:
+  // Number of frames kept in flight before reading the queries back, so that we never stall
+  static const int NUM_FRAMES = 4;
+  // Maximum number of scopes measured within a single frame
+  static const int MAX_SCOPES = 32;
+
+  // Measured times of a single scope
+  struct ScopeTiming
+  {
+    // Name of the scope, must be a string literal or otherwise outlive the profiler
+    const char *name;
+    // Nesting level of the scope
+    int depth;
+    // GPU time in milliseconds
+    double gpuTime;
+    // CPU time in milliseconds
+    double cpuTime;
+  };
+
+  // Get and create instance for this singleton
+  static Profiler& GetInstance();
+  // Create the query objects, requires valid OpenGL context
+  void Init();
+  // Start a new frame, reads back the oldest frame if the GPU is already done with it
+  void BeginFrame();
+  // Finish the current frame
+  void EndFrame();
+  // Start a named scope, scopes may be nested
+  void BeginScope(const char *name);
+  // Finish the last started scope
+  void EndScope();
+  // Number of scopes measured in the last frame read back
+  int GetNumResults() const { return _numResults; }
+  // Times measured in the last frame read back
+  const ScopeTiming &GetResult(int i) const { return _results[i]; }
+  // Index of the frame the results belong to, -1 if nothing was read back yet
+  int GetResultsFrame() const { return _resultsFrame; }
+  // Index of the frame being recorded
+  int GetCurrentFrame() const { return _frameCounter; }
+  // Print the last results as "name gpu/cpu" pairs, returns the number of characters written
+  int Print(char *text, int maxLength) const;
+
+private:
+  // Scopes recorded within a single frame
+  struct Frame
+  {
+    // Begin and end timestamp query for each scope
+    GLuint queries[2 * MAX_SCOPES];
+    // Recorded scopes, GPU time is filled in when read back
+    ScopeTiming scopes[MAX_SCOPES];
+    // CPU time at the beginning of each scope
+    double cpuBegin[MAX_SCOPES];
+    // Index of the recorded frame
+    int frameNumber;
+    // Number of recorded scopes
+    int numScopes;
+    // Index of the last issued query
+    int lastQuery;
+    // Waiting for the GPU?
+    bool pending;
+  };
+
+  // All is private, instance is created in GetInstance()
+  Profiler();
+  ~Profiler();
+  // No copies allowed
+  Profiler(const Profiler &);
+  Profiler & operator = (const Profiler &);
+
+  // Current CPU time in milliseconds
+  static double GetCpuTime();
+  // Read back the frame if the GPU finished it
+  void ReadBack(Frame &frame);
+
+  // Ring of frames in flight
+  Frame _frames[NUM_FRAMES];
+  // Frame currently being recorded
+  int _frameIndex = 0;
+  // Stack of the open scopes
+  int _scopeStack[MAX_SCOPES];
+  // Number of the open scopes
+  int _stackDepth = 0;
+  // Results of the last frame read back
+  ScopeTiming _results[MAX_SCOPES];
+  // Number of the valid results
+  int _numResults = 0;
+  // Index of the frame the results belong to
+  int _resultsFrame = -1;
+  // Number of frames started so far
+  int _frameCounter = -1;
+  // Were query objects created?
+  bool _initialized = false;
+};
+
+// Helper for profiling the rest of the enclosing block
+class ProfilerScope
+{
+public:
+  ProfilerScope(const char *name) { Profiler::GetInstance().BeginScope(name); }
+  ~ProfilerScope() { Profiler::GetInstance().EndScope(); }
+};
@@ -0,0 +1,37 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+#include <cstddef>
+
+// Stores binaries of linked shader programs on the disk so that the following launches skip compiling and linking.
+// The cache is keyed by a hash of the shader sources and the driver identification, a change of either invalidates it.
+class ProgramCache
+{
+public:
+  // Start the cache key with the driver identification, requires valid OpenGL context
+  ProgramCache();
+
+  // Are program binaries supported by the context? Requires OpenGL 4.1 or ARB_get_program_binary
+  static bool IsSupported();
+
+  // Add all shader sources of the table to the cache key, call before Load() and Save()
+  void AddSources(const char *const source[], int count);
+  // Add any other data affecting the programs to the cache key, e.g., runtime feature flags
+  void AddData(const void *data, size_t size);
+
+  // Create all programs from the cache file, fails without creating any program if the cache is missing or stale.
+  // Programs are restored in the linked state only, uniform block bindings set after linking have to be set again
+  bool Load(const char fileName[], GLuint programs[], int numPrograms) const;
+  // Store binaries of all linked programs to the cache file, 0 entries are stored as missing programs
+  bool Save(const char fileName[], const GLuint programs[], int numPrograms) const;
+
+private:
+  // 64-bit FNV-1a hash of all the added data
+  unsigned long long _key;
+};
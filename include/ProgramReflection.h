@@ -0,0 +1,57 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// Cache of uniform locations and uniform block indices of a linked shader program, so that we don't
+// have to look them up by name every frame. Uniforms and blocks are addressed by indices into the name
+// tables passed to Reflect(), usually a per-sample enum.
+class ProgramReflection
+{
+public:
+  // Maximum number of cached uniforms and blocks
+  static const int MAX_UNIFORMS = 32;
+  static const int MAX_BLOCKS = 8;
+
+  // Query the locations of the named uniforms and indices of the named blocks, call after ShaderCompiler::LinkProgram().
+  // The name tables must outlive the reflection, names not active in the program are cached as missing
+  void Reflect(GLuint program, const char *const uniformNames[], int numUniforms, const char *const blockNames[] = nullptr, int numBlocks = 0);
+  // Reflected program
+  GLuint GetProgram() const { return _program; }
+  // Location of the uniform, -1 if the program doesn't use it
+  GLint GetLocation(int uniform) const { return (uniform < _numUniforms) ? _locations[uniform] : -1; }
+  // Index of the uniform block, GL_INVALID_INDEX if the program doesn't use it
+  GLuint GetBlockIndex(int block) const { return (block < _numBlocks) ? _blockIndices[block] : GL_INVALID_INDEX; }
+  // Does the program use the uniform?
+  bool HasUniform(int uniform) const { return GetLocation(uniform) >= 0; }
+  // Size of the uniform block in bytes, 0 if the program doesn't use it
+  GLint GetBlockSize(int block) const;
+  // Bind the uniform block to the binding point, ignored if the program doesn't use it
+  void BindBlock(int block, GLuint binding) const;
+
+  // Typed setters for the currently bound program, uniforms not used by the program are ignored
+  void Set(int uniform, int value) const;
+  void Set(int uniform, unsigned int value) const;
+  void Set(int uniform, float value) const;
+  void Set(int uniform, const glm::vec2 &value) const;
+  void Set(int uniform, const glm::vec3 &value) const;
+  void Set(int uniform, const glm::vec4 &value) const;
+  void Set(int uniform, const glm::mat4 &value) const;
+
+private:
+  // Reflected program handle
+  GLuint _program = 0;
+  // Cached uniform locations
+  GLint _locations[MAX_UNIFORMS] = {0};
+  // Number of cached uniforms
+  int _numUniforms = 0;
+  // Cached uniform block indices
+  GLuint _blockIndices[MAX_BLOCKS] = {0};
+  // Number of cached uniform blocks
+  int _numBlocks = 0;
+};
@@ -0,0 +1,61 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+// Ring buffer for reading GPU buffers back without stalling. Each frame copies the data to its own section guarded
+// by a fence, the sections are read in order once their fences are signaled, i.e., a few frames later, and a frame
+// is skipped when all the sections are still waiting. Uses persistently mapped storage if available (GL 4.4 or
+// ARB_buffer_storage), glGetBufferSubData() of the signaled section otherwise.
+class ReadbackBuffer
+{
+public:
+  // Number of frames the ring can hold in flight
+  static const int NUM_FRAMES = 3;
+
+  ReadbackBuffer() = default;
+  ~ReadbackBuffer();
+
+  // Create the buffer with a section of frameSize bytes for each frame, subsystem must be a string literal,
+  // requires valid OpenGL context
+  bool Init(GLsizeiptr frameSize, const char *subsystem);
+  // Release the buffer and the fences
+  void Release();
+  // Start copying to the next section of the ring, returns false if none is free as they're still waiting to be read
+  bool BeginFrame();
+  // Copy size bytes of the source buffer to the offset within the current section, call between BeginFrame() and
+  // EndFrame(), shader writes must be made visible by GL_BUFFER_UPDATE_BARRIER_BIT beforehand
+  void Copy(GLuint source, GLintptr sourceOffset, GLintptr offset, GLsizeiptr size);
+  // Fence the current section
+  void EndFrame();
+  // Copy size bytes of the oldest copied section to data and free the section, returns false if the GPU isn't done
+  // with it yet or there's nothing to read, never waits
+  bool Read(void *data, GLsizeiptr size);
+  // Number of sections copied but not read yet
+  int GetNumPending() const { return _numPending; }
+  // Is the buffer persistently mapped?
+  bool IsPersistent() const { return _mappedData != nullptr; }
+
+private:
+  // No copies allowed
+  ReadbackBuffer(const ReadbackBuffer &);
+  ReadbackBuffer & operator = (const ReadbackBuffer &);
+
+  // Buffer handle
+  GLuint _buffer = 0;
+  // Size of a single frame section
+  GLsizeiptr _frameSize = 0;
+  // Section currently being copied to, -1 outside of BeginFrame() and EndFrame()
+  int _frameIndex = -1;
+  // Oldest section waiting to be read and the number of waiting sections
+  int _readIndex = 0;
+  int _numPending = 0;
+  // Fences of the sections in flight
+  GLsync _fences[NUM_FRAMES] = {nullptr};
+  // Persistently mapped buffer memory, nullptr when reading with glGetBufferSubData()
+  const unsigned char *_mappedData = nullptr;
+};
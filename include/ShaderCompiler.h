@@ -7,6 +7,8 @@
 
 #include <glad/glad.h>
 
+#include <vector>
+
 // Simple class for compiling shaders
 class ShaderCompiler
 {
@@ -16,6 +18,45 @@ public:
 
   // Compiles shader of a specified type
   static GLuint CompileShader(const char* source[], int index, GLenum type);
+  // Compiles shader of a specified type with the defines injected right after the #version line
+  static GLuint CompileShader(const char* source[], int index, GLenum type, const char defines[]);
   // Links specified program
   static bool LinkProgram(GLuint program);
-};
\ No newline at end of file
+};
+
+// Compiles permutations of shared shader sources: each set feature bit is injected as a #define of the name with
+// the same index, so that the disabled branches are removed by the preprocessor. Compiled variants are cached,
+// i.e., programs sharing a variant of a stage compile it just once.
+class ShaderPermutations
+{
+public:
+  // Names of the feature bits, bit (1 << i) defines featureNames[i], the names have to outlive the permutations
+  ShaderPermutations(const char *const featureNames[], int numFeatures);
+  ~ShaderPermutations();
+
+  // Return the variant of the shader with the features, compiled on the first request, 0 if the compilation fails.
+  // Only the features in the mask affect the variant, the rest is ignored by this stage
+  GLuint GetShader(const char* source[], int index, GLenum type, unsigned int features, unsigned int mask = ~0u);
+  // Delete all compiled variants, programs already linked with them aren't affected
+  void Release();
+
+private:
+  // No copies allowed
+  ShaderPermutations(const ShaderPermutations &);
+  ShaderPermutations & operator = (const ShaderPermutations &);
+
+  // Single compiled variant
+  struct Variant
+  {
+    const char *source;
+    GLenum type;
+    unsigned int features;
+    GLuint shader;
+  };
+
+  // Names of the feature bits
+  const char *const *_featureNames;
+  int _numFeatures;
+  // All compiled variants
+  std::vector<Variant> _variants;
+};
@@ -0,0 +1,57 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Replaces the built-in shader sources with files in a directory and watches them for changes, so that the shaders can
+// be edited while the sample runs. Files missing in the directory are written out from the built-in sources first.
+class ShaderReloader
+{
+public:
+  // Register a table of shader sources, its entries are redirected to the files <names[i]><extension> once enabled,
+  // the table and the names have to outlive the reloader
+  void Watch(const char *source[], const char *const names[], int count, const char extension[]);
+  // Load all registered sources from the directory, it's created if it doesn't exist
+  bool Enable(const char directory[]);
+  // Point the tables back to the built-in sources
+  void Disable();
+  // Are the sources loaded from the files?
+  bool IsEnabled() const { return _enabled; }
+  // Reload the files modified since the last call, returns true when the programs should be rebuilt,
+  // the files are checked a few times per second at most so it's fine to call this every frame
+  bool Update();
+
+private:
+  // Single watched shader source
+  struct Entry
+  {
+    // Table entry pointing either to the built-in source or to the file contents
+    const char **source;
+    // Built-in source
+    const char *builtIn;
+    // Name of the file
+    std::string fileName;
+    // Modification time of the loaded file
+    long long fileTime;
+    // Loaded file contents
+    std::string contents;
+  };
+
+  // Read the file of the entry, fails if it doesn't exist
+  bool ReadFile(Entry &entry) const;
+
+  // All watched sources
+  std::vector<Entry> _entries;
+  // Directory of the shader files including the trailing separator
+  std::string _directory;
+  // Time of the last file check
+  std::chrono::steady_clock::time_point _lastCheck;
+  // Are the sources loaded from the files?
+  bool _enabled = false;
+};
@@ -0,0 +1,65 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <glad/glad.h>
+
+// Ring buffer for streaming per-frame data to the GPU. Each frame writes to its own section guarded
+// by a fence so that we never overwrite data the GPU is still reading. Uses persistently mapped
+// storage if available (GL 4.4 or ARB_buffer_storage), unsynchronized mapping of the written range otherwise.
+class StreamingBuffer
+{
+public:
+  // Number of frames the ring can hold in flight
+  static const int NUM_FRAMES = 3;
+
+  StreamingBuffer() = default;
+  ~StreamingBuffer();
+
+  // Create the buffer with a section for each frame fitting maxUploads ranges of frameSize bytes in total,
+  // requires valid OpenGL context
+  bool Init(GLsizeiptr frameSize, int maxUploads = 1);
+  // Release the buffer and the fences
+  void Release();
+  // Start writing to the next section of the ring, waits for the GPU if it's still using it
+  void BeginFrame();
+  // Fence the current section, call after the last draw call using this frame's data
+  void EndFrame();
+  // Copy size bytes of data to the current section reserving rangeSize bytes (>= size) for binding,
+  // returns false if the section is full
+  bool Upload(const void *data, GLsizeiptr size, GLsizeiptr rangeSize, GLintptr &offset);
+  // Reserve rangeSize bytes (>= size) of the current section like Upload() and return the first size bytes for writing
+  // the data in place, any thread may write there until Unmap(), returns nullptr if the section is full
+  void *Map(GLsizeiptr size, GLsizeiptr rangeSize, GLintptr &offset);
+  // Finish writing the range returned by Map(), call on the GL thread before the range is used
+  void Unmap();
+  // Bind the uploaded range to the indexed binding point of the target
+  void Bind(GLenum target, GLuint index, GLintptr offset, GLsizeiptr size) const;
+  // Is the buffer persistently mapped?
+  bool IsPersistent() const { return _mappedData != nullptr; }
+
+private:
+  // No copies allowed
+  StreamingBuffer(const StreamingBuffer &);
+  StreamingBuffer & operator = (const StreamingBuffer &);
+
+  // Buffer handle
+  GLuint _buffer = 0;
+  // Size of a single frame section
+  GLsizeiptr _frameSize = 0;
+  // Required offset alignment of the bound ranges
+  GLint _alignment = 1;
+  // Section currently being written
+  int _frameIndex = 0;
+  // Write position within the current section
+  GLsizeiptr _frameOffset = 0;
+  // Fences of the sections in flight
+  GLsync _fences[NUM_FRAMES] = {nullptr};
+  // Persistently mapped buffer memory, nullptr when mapping on each upload
+  unsigned char *_mappedData = nullptr;
+  // Is a range mapped by Map() waiting for Unmap()?
+  bool _rangeMapped = false;
+};
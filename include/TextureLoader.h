@@ -0,0 +1,89 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <Textures.h>
+
+#include <glad/glad.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Loads textures in the background: images are decoded and mip-mapped by a pool of worker threads while the GL thread
+// only uploads the finished mip chains through a pixel unpack buffer. Decoded mip chains are cached on the disk next to
+// the source files so that the following launches skip decoding entirely. Block compressed DDS file of the same name
+// is used instead of the source file if it exists and the context supports its format.
+class TextureLoader
+{
+public:
+  TextureLoader() = default;
+  ~TextureLoader();
+
+  // Start the decoding threads, 0 uses all hardware threads but one
+  bool Init(int numThreads = 0);
+  // Stop the decoding threads and drop all pending loads, the textures keep their placeholders
+  void Release();
+  // Queue the texture for loading, texture is set to a single color placeholder right away and replaced by the loaded
+  // texture in Update(), the placeholder is deleted then, the texture variable has to outlive the loader
+  void Load(const char name[], bool sRGB, GLuint *texture, unsigned char r = 127, unsigned char g = 127, unsigned char b = 127);
+  // Upload up to maxUploads decoded textures, call on the GL thread once per frame
+  void Update(int maxUploads = 1);
+  // Block until all queued textures are decoded and uploaded
+  void Finish();
+  // Number of queued textures not uploaded yet
+  int GetNumPending() const { return _numPending; }
+
+private:
+  // No copies allowed
+  TextureLoader(const TextureLoader &);
+  TextureLoader & operator = (const TextureLoader &);
+
+  // Single queued texture
+  struct Request
+  {
+    // Source file name
+    std::string name;
+    // Is the texture in sRGB?
+    bool sRGB;
+    // Where to put the texture once it's loaded
+    GLuint *texture;
+    // Dimensions of the first mip level, 0 when decoding failed
+    int width;
+    int height;
+    // RGBA8 data of all mip levels, the finest first
+    std::vector<unsigned char> mipChain;
+    // Block compressed mip chain, used instead of the one above if the internal format isn't 0
+    CompressedImage compressed;
+  };
+
+  // Worker thread loop
+  void DecodeLoop();
+  // Upload the decoded texture and replace the placeholder
+  void Upload(Request &request);
+
+  // Decoding threads
+  std::vector<std::thread> _threads;
+  // Guards both queues and the exit flag
+  std::mutex _mutex;
+  // Signaled when there is something to decode or when the threads should exit
+  std::condition_variable _decodeReady;
+  // Signaled when a texture is decoded
+  std::condition_variable _uploadReady;
+  // Textures waiting for decoding
+  std::deque<Request> _decodeQueue;
+  // Textures waiting for the upload
+  std::deque<Request> _uploadQueue;
+  // Should the threads exit?
+  bool _exit = false;
+  // Number of textures not uploaded yet
+  int _numPending = 0;
+  // Pixel unpack buffer used for the uploads, orphaned for each texture
+  GLuint _pbo = 0;
+};
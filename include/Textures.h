@@ -7,12 +7,27 @@
 
 #include <glad/glad.h>
 #include <glm/glm.hpp>
+#include <vector>
 
 enum class Sampler : int
 {
   Nearest, Bilinear, Trilinear, Anisotropic, AnisotropicClamp, AnisotropicMirrored, NumSamplers
 };
 
+// Block compressed image with its mip chain
+struct CompressedImage
+{
+  // Compressed internal format, e.g., GL_COMPRESSED_RGBA_BPTC_UNORM
+  GLenum internalFormat;
+  // Dimensions of the first mip level
+  int width;
+  int height;
+  // Size of each mip level in bytes, the finest first
+  std::vector<GLsizei> levelSizes;
+  // Data of all mip levels stored back to back
+  std::vector<unsigned char> data;
+};
+
 // Class for handling texture and sampler creation
 class Textures
 {
@@ -27,6 +42,21 @@ public:
   static GLuint CreateMipMapTestTexture();
   // Load texture from file stored on the disk
   static GLuint LoadTexture(const char name[], bool sRGB);
+  // Read BC1/BC3/BC4/BC5/BC7 compressed DDS file with all its mip levels, sRGB selects the sRGB variant of BC1/BC3/BC7,
+  // fails if the format isn't supported by the context
+  static bool ReadDDS(const char name[], bool sRGB, CompressedImage &image);
+  // Create texture from the compressed image, data points to image.data or is an offset if a pixel unpack buffer is bound
+  static GLuint CreateCompressedTexture(const CompressedImage &image, const void *data);
+  // Load compressed DDS texture with prebuilt mip-maps from file stored on the disk
+  static GLuint LoadCompressedTexture(const char name[], bool sRGB);
+  // Number of mip levels of the full chain down to 1x1
+  static GLsizei GetNumMipLevels(GLsizei width, GLsizei height);
+  // Create 2D texture with the final size and format of all mip levels, leaves it bound unless immutable storage is used
+  static GLuint CreateTexture2D(GLenum internalFormat, GLsizei width, GLsizei height, GLsizei numLevels);
+  // Upload GL_UNSIGNED_BYTE data of the texture mip level, data is an offset if a pixel unpack buffer is bound
+  static void UploadTexture2D(GLuint tex, GLint level, GLsizei width, GLsizei height, GLenum format, const void *data);
+  // Optionally fill in all lower mip levels from the first one, then unbind the texture if it was left bound
+  static void FinishTexture2D(GLuint tex, bool generateMipmaps);
   // Create all samplers
   void CreateSamplers();
   // Get sampler
@@ -0,0 +1,22 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <glm/glm.hpp>
+
+// Batched kernels writing the transposed model to world matrices of many instances, i.e., the 3 x vec4 rows the
+// instancing shaders read as mat3x4, directly to the destination memory which may be a mapped buffer,
+// 4 instances are computed at once with SSE when it's available
+class TransformKernels
+{
+public:
+  // Write transpose(translate(positions[i]) * rotate(angles[i], axis)) of count instances to dst,
+  // the instances are stride bytes apart, angles are in radians
+  static void TranslateRotate(const glm::vec3 *positions, const float *angles, const glm::vec3 &axis, int count, void *dst, size_t stride);
+  // Write transpose(translate(positions[i])) of count instances to dst, the instances are stride bytes apart
+  static void Translate(const glm::vec3 *positions, int count, void *dst, size_t stride);
+};
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <glad/glad.h>
+#include <glm/gtc/packing.hpp>
 
 // Vertex containing vec3 position
 struct Vertex_Pos
@@ -106,3 +107,38 @@ struct Vertex_Pos_Nrm_Tgt_Tex
     glEnableVertexAttribArray(3);
   }
 };
+
+// Vertex attributes without the position, i.e., the second stream of a SplitMesh, containing packed normal,
+// packed tangent and half float UV coords - 12 bytes instead of 32 in Vertex_Pos_Nrm_Tgt_Tex
+struct Vertex_Nrm_Tgt_Tex_Packed
+{
+  // Normal in GL_INT_2_10_10_10_REV format
+  GLuint normal;
+  // Tangent in GL_INT_2_10_10_10_REV format
+  GLuint tangent;
+  // Texture coordinates as 2 half floats
+  GLuint uv;
+
+  // Pack the non-position attributes of the full precision vertex
+  static Vertex_Nrm_Tgt_Tex_Packed Pack(const Vertex_Pos_Nrm_Tgt_Tex &vertex)
+  {
+    Vertex_Nrm_Tgt_Tex_Packed packed;
+    packed.normal = glm::packSnorm3x10_1x2(glm::vec4(vertex.nx, vertex.ny, vertex.nz, 0.0f));
+    packed.tangent = glm::packSnorm3x10_1x2(glm::vec4(vertex.tx, vertex.ty, vertex.tz, 0.0f));
+    packed.uv = glm::packHalf2x16(glm::vec2(vertex.u, vertex.v));
+    return packed;
+  }
+
+  static void BindVertexAttributes()
+  {
+    // Normals: 4 signed normalized components packed in an int, stride = 3 * sizeof(GLuint), offset = 0
+    glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(Vertex_Nrm_Tgt_Tex_Packed), reinterpret_cast<void*>(0));
+    glEnableVertexAttribArray(1);
+    // Tangents: 4 signed normalized components packed in an int, stride = 3 * sizeof(GLuint), offset = 1
+    glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(Vertex_Nrm_Tgt_Tex_Packed), reinterpret_cast<void*>(sizeof(GLuint)));
+    glEnableVertexAttribArray(2);
+    // Texture coordinates: 2 half floats, stride = 3 * sizeof(GLuint), offset = 2
+    glVertexAttribPointer(3, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(Vertex_Nrm_Tgt_Tex_Packed), reinterpret_cast<void*>(2 * sizeof(GLuint)));
+    glEnableVertexAttribArray(3);
+  }
+};
@@ -0,0 +1,299 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <AutoExposure.h>
+#include <ShaderCompiler.h>
+
+#include <cmath>
+#include <cstdio>
+
+namespace
+{
+  // Log2 luminance range covered by the histogram bins, darker and brighter pixels are clamped
+  const float MIN_LOG_LUMINANCE = -10.0f;
+  const float MAX_LOG_LUMINANCE = 6.0f;
+  // Only the pixels between these percentiles of the histogram contribute to the average luminance,
+  // so that a few dark corners or bright light sources don't change the exposure of the whole image
+  const float LOW_PERCENTILE = 0.5f;
+  const float HIGH_PERCENTILE = 0.95f;
+  // Speed of the adaptation to the target luminance, 1/s
+  const float ADAPTATION_SPEED = 1.5f;
+  // Limits of the exposure, i.e., how dark and how bright scenes we still adapt to
+  const float MIN_EXPOSURE = 0.05f;
+  const float MAX_EXPOSURE = 20.0f;
+  // Size of the histogram workgroup - must match the histogram compute shader!
+  const int HISTOGRAM_GROUP_SIZE = 16;
+
+  // Compute shader sources
+  const char* csSource[] = {
+// ----------------------------------------------------------------------------
+// Histogram of the log2 luminance, bin 0 counts the black pixels
+// ----------------------------------------------------------------------------
+R"(
+#version 430 core
+
+layout (local_size_x = 16, local_size_y = 16) in;
+
+#ifdef MULTISAMPLE
+layout (binding = 0) uniform sampler2DMS hdrBuffer;
+#else
+layout (binding = 0) uniform sampler2D hdrBuffer;
+#endif
+
+// Minimum log2 luminance and reciprocal of the range
+layout (location = 0) uniform vec2 logLuminance;
+// Rendered part of the HDR buffer starting at its origin
+layout (location = 1) uniform ivec2 size;
+
+layout (std430, binding = 0) buffer HistogramBuffer
+{
+  uint histogram[256];
+};
+
+shared uint bins[256];
+
+void main()
+{
+  bins[gl_LocalInvocationIndex] = 0;
+  barrier();
+
+  ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+  if (all(lessThan(texel, size)))
+  {
+    // First sample is enough for the exposure
+    vec3 hdr = texelFetch(hdrBuffer, texel, 0).rgb;
+    float luminance = dot(hdr, vec3(0.2126f, 0.7152f, 0.0722f));
+
+    uint bin = 0;
+    if (luminance > 1e-5f)
+      bin = 1 + uint(clamp((log2(luminance) - logLuminance.x) * logLuminance.y, 0.0f, 1.0f) * 254.0f);
+    atomicAdd(bins[bin], 1u);
+  }
+  barrier();
+
+  // Merge with the global histogram, skip the empty bins
+  uint count = bins[gl_LocalInvocationIndex];
+  if (count > 0)
+    atomicAdd(histogram[gl_LocalInvocationIndex], count);
+}
+)",
+// ----------------------------------------------------------------------------
+// Average luminance of the percentile range and its temporal adaptation
+// ----------------------------------------------------------------------------
+R"(
+#version 430 core
+
+layout (local_size_x = 256) in;
+
+// Minimum log2 luminance and the range
+layout (location = 0) uniform vec2 logLuminance;
+// Portion of the difference to the target luminance adapted this frame
+layout (location = 1) uniform float adaptation;
+// Percentiles of the pixels contributing to the average
+layout (location = 2) uniform vec2 percentiles;
+// Limits of the exposure
+layout (location = 3) uniform vec2 exposureRange;
+
+layout (std430, binding = 0) buffer HistogramBuffer
+{
+  uint histogram[256];
+};
+
+layout (std430, binding = 1) buffer ExposureBuffer
+{
+  float exposure;
+  float averageLuminance;
+};
+
+shared float counts[256];
+shared float weights[256];
+
+void main()
+{
+  uint bin = gl_LocalInvocationIndex;
+
+  // Clear the bin for the next frame right away, black pixels don't count
+  float count = bin > 0 ? float(histogram[bin]) : 0.0f;
+  histogram[bin] = 0;
+
+  // Inclusive prefix sum of the counts, i.e., the pixels up to the end of this bin
+  counts[bin] = count;
+  barrier();
+  for (uint offset = 1; offset < 256; offset <<= 1)
+  {
+    float previous = bin >= offset ? counts[bin - offset] : 0.0f;
+    barrier();
+    counts[bin] += previous;
+    barrier();
+  }
+
+  // Part of the bin within the percentile range weighted by the log luminance of its center
+  float total = counts[255];
+  float end = counts[bin];
+  float start = end - count;
+  float contribution = max(0.0f, min(end, percentiles.y * total) - max(start, percentiles.x * total));
+  float center = logLuminance.x + (float(bin) - 0.5f) / 254.0f * logLuminance.y;
+  barrier();
+  counts[bin] = contribution;
+  weights[bin] = contribution * center;
+  barrier();
+
+  // Sum both over the whole workgroup
+  for (uint stride = 128; stride > 0; stride >>= 1)
+  {
+    if (bin < stride)
+    {
+      counts[bin] += counts[bin + stride];
+      weights[bin] += weights[bin + stride];
+    }
+    barrier();
+  }
+
+  if (bin == 0)
+  {
+    // Keep the previous state if nothing contributed, e.g., for a completely black image
+    if (counts[0] <= 0.0f)
+      return;
+
+    float target = exp2(weights[0] / counts[0]);
+    float luminance = averageLuminance < 0.0f ? target : mix(averageLuminance, target, adaptation);
+    averageLuminance = luminance;
+    // Map the average to the middle grey
+    exposure = clamp(0.18f / luminance, exposureRange.x, exposureRange.y);
+  }
+}
+)",
+""};
+}
+
+AutoExposure::~AutoExposure()
+{
+  Release();
+}
+
+bool AutoExposure::Init()
+{
+  // Check if already initialized and return
+  if (_exposure)
+    return true;
+
+  // The exposure buffer exists even without the compute shaders so that the tonemapping can always read it
+  const ExposureData data = {1.0f, -1.0f, {0.0f, 0.0f}};
+  glGenBuffers(1, &_exposure);
+  glBindBuffer(GL_UNIFORM_BUFFER, _exposure);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(ExposureData), &data, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+  if (!GLAD_GL_VERSION_4_3)
+  {
+    printf("Compute shaders not supported, auto exposure disabled!\n");
+    return true;
+  }
+
+  // Histogram variants for the single and multisampled HDR buffer, the last program reduces the histogram
+  const char *defines[] = {"", "#define MULTISAMPLE 1\n", ""};
+  const int sources[] = {0, 0, 1};
+  GLuint programs[3] = {0};
+  for (int i = 0; i < 3; ++i)
+  {
+    GLuint shader = ShaderCompiler::CompileShader(csSource, sources[i], GL_COMPUTE_SHADER, defines[i]);
+    if (shader)
+    {
+      programs[i] = glCreateProgram();
+      glAttachShader(programs[i], shader);
+      glDeleteShader(shader);
+    }
+
+    if (!shader || !ShaderCompiler::LinkProgram(programs[i]))
+    {
+      // Leave the exposure buffer alone, just disable the adaptation
+      for (GLuint program : programs)
+        glDeleteProgram(program);
+      return false;
+    }
+  }
+
+  _histogramPrograms[0] = programs[0];
+  _histogramPrograms[1] = programs[1];
+  _averageProgram = programs[2];
+
+  // Bins start cleared, the reduction clears them after each use
+  const GLuint zeros[NUM_BINS] = {0};
+  glGenBuffers(1, &_histogram);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _histogram);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(zeros), zeros, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  return true;
+}
+
+void AutoExposure::Release()
+{
+  for (GLuint &program : _histogramPrograms)
+  {
+    glDeleteProgram(program);
+    program = 0;
+  }
+  glDeleteProgram(_averageProgram);
+  _averageProgram = 0;
+  glDeleteBuffers(1, &_histogram);
+  _histogram = 0;
+  glDeleteBuffers(1, &_exposure);
+  _exposure = 0;
+}
+
+void AutoExposure::Update(GLuint hdrTexture, bool multisampled, int width, int height, float dt)
+{
+  if (!IsSupported())
+    return;
+
+  const float range = MAX_LOG_LUMINANCE - MIN_LOG_LUMINANCE;
+
+  // The HDR buffer may have been written by image stores
+  glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _histogram);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _exposure);
+
+  glUseProgram(_histogramPrograms[multisampled ? 1 : 0]);
+  glUniform2f(0, MIN_LOG_LUMINANCE, 1.0f / range);
+  glUniform2i(1, width, height);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(multisampled ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D, hdrTexture);
+  glDispatchCompute((width + HISTOGRAM_GROUP_SIZE - 1) / HISTOGRAM_GROUP_SIZE, (height + HISTOGRAM_GROUP_SIZE - 1) / HISTOGRAM_GROUP_SIZE, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  // Framerate independent exponential adaptation
+  glUseProgram(_averageProgram);
+  glUniform2f(0, MIN_LOG_LUMINANCE, range);
+  glUniform1f(1, 1.0f - expf(-dt * ADAPTATION_SPEED));
+  glUniform2f(2, LOW_PERCENTILE, HIGH_PERCENTILE);
+  glUniform2f(3, MIN_EXPOSURE, MAX_EXPOSURE);
+  glDispatchCompute(1, 1, 1);
+
+  // Both the next histogram and the tonemapping read the results
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_UNIFORM_BARRIER_BIT);
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+  glBindTexture(multisampled ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D, 0);
+  glUseProgram(0);
+}
+
+void AutoExposure::Reset()
+{
+  if (!_exposure)
+    return;
+
+  const ExposureData data = {1.0f, -1.0f, {0.0f, 0.0f}};
+  glBindBuffer(GL_UNIFORM_BUFFER, _exposure);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ExposureData), &data);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void AutoExposure::Bind(GLuint index) const
+{
+  glBindBufferBase(GL_UNIFORM_BUFFER, index, _exposure);
+}
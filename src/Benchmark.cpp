@@ -0,0 +1,194 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <Benchmark.h>
+#include <MathSupport.h>
+#include <Profiler.h>
+
+#include <cstdlib>
+#include <cstring>
+
+Benchmark::~Benchmark()
+{
+  Close();
+}
+
+bool Benchmark::ParseCommandLine(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    const char *arg = argv[i];
+    if (strncmp(arg, "--", 2) != 0)
+    {
+      printf("Unknown argument: %s\n", arg);
+      return false;
+    }
+
+    if (strcmp(arg, "--benchmark") == 0)
+    {
+      _enabled = true;
+      continue;
+    }
+
+    // The rest of the options require a value
+    if (i + 1 >= argc)
+    {
+      printf("Missing value for: %s\n", arg);
+      return false;
+    }
+    const char *value = argv[++i];
+
+    if (strcmp(arg, "--frames") == 0)
+    {
+      _numFrames = atoi(value);
+    }
+    else if (strcmp(arg, "--warmup") == 0)
+    {
+      _numWarmupFrames = atoi(value);
+    }
+    else if (strcmp(arg, "--csv") == 0)
+    {
+      _fileName = value;
+    }
+    else
+    {
+      // Comma separated list of the swept values
+      std::vector<int> values;
+      const char *c = value;
+      while (*c)
+      {
+        char *end = nullptr;
+        long v = strtol(c, &end, 10);
+        if (end == c)
+        {
+          printf("Invalid value list for %s: %s\n", arg, value);
+          return false;
+        }
+        values.push_back((int)v);
+        c = (*end == ',') ? end + 1 : end;
+      }
+      _sweeps.emplace_back(arg + 2, values);
+    }
+  }
+
+  if (_numFrames <= 0 || _numWarmupFrames < 0)
+  {
+    printf("Invalid number of benchmark frames!\n");
+    return false;
+  }
+
+  return true;
+}
+
+std::vector<int> Benchmark::GetSweep(const char *name, int defaultValue) const
+{
+  for (const auto &sweep : _sweeps)
+  {
+    if (sweep.first == name && !sweep.second.empty())
+      return sweep.second;
+  }
+
+  return std::vector<int>(1, defaultValue);
+}
+
+bool Benchmark::Open()
+{
+  if (_file)
+    return true;
+
+  _file = fopen(_fileName.c_str(), "w");
+  if (!_file)
+  {
+    printf("Failed to open benchmark output: %s\n", _fileName.c_str());
+    return false;
+  }
+
+  // One row per scope and frame so that any scope can be filtered out easily
+  fprintf(_file, "config,frame,scope,depth,gpu_ms,cpu_ms\n");
+  return true;
+}
+
+void Benchmark::BeginRun(const char *config)
+{
+  _config = config;
+  _firstFrame = Profiler::GetInstance().GetCurrentFrame() + 1;
+  _lastFrame = _firstFrame - 1;
+  _gpuTotal = 0.0;
+  _cpuTotal = 0.0;
+  _numRecorded = 0;
+}
+
+void Benchmark::Record()
+{
+  const Profiler &profiler = Profiler::GetInstance();
+
+  // Nothing new was read back or it's still a warmup frame
+  int frame = profiler.GetResultsFrame();
+  if (frame <= _lastFrame)
+    return;
+  _lastFrame = frame;
+
+  frame -= _firstFrame + _numWarmupFrames;
+  if (frame < 0 || frame >= _numFrames)
+    return;
+
+  for (int i = 0; i < profiler.GetNumResults(); ++i)
+  {
+    const Profiler::ScopeTiming &result = profiler.GetResult(i);
+    if (_file)
+      fprintf(_file, "%s,%i,%s,%i,%.4f,%.4f\n", _config.c_str(), frame, result.name, result.depth, result.gpuTime, result.cpuTime);
+
+    if (result.depth == 0)
+    {
+      _gpuTotal += result.gpuTime;
+      _cpuTotal += result.cpuTime;
+    }
+  }
+  ++_numRecorded;
+}
+
+void Benchmark::EndRun()
+{
+  Profiler &profiler = Profiler::GetInstance();
+
+  // Let the GPU finish and cycle the profiler ring with empty frames to read back the rest
+  glFinish();
+  for (int i = 0; i < Profiler::NUM_FRAMES; ++i)
+  {
+    profiler.BeginFrame();
+    Record();
+    profiler.EndFrame();
+  }
+
+  if (_numRecorded > 0)
+  {
+    printf("%s: %i frames, GPU %.3fms, CPU %.3fms on average\n", _config.c_str(), _numRecorded, _gpuTotal / _numRecorded, _cpuTotal / _numRecorded);
+  }
+  else
+  {
+    printf("%s: no frames recorded!\n", _config.c_str());
+  }
+
+  if (_file)
+    fflush(_file);
+}
+
+void Benchmark::Close()
+{
+  if (_file)
+  {
+    fclose(_file);
+    _file = nullptr;
+  }
+}
+
+void Benchmark::SetCameraOnPath(Camera &camera, int frame, int numFrames, const glm::vec3 &center, float radius, float height)
+{
+  // Full circle around the center with a slow vertical bob so that the view isn't constant
+  float t = (numFrames > 0) ? (float)frame / (float)numFrames : 0.0f;
+  float angle = TWO_PI * t;
+  glm::vec3 eye = center + glm::vec3(radius * cosf(angle), height * (1.0f + 0.25f * sinf(2.0f * angle)), radius * sinf(angle));
+  camera.SetTransformation(eye, center, glm::vec3(0.0f, 1.0f, 0.0f));
+}
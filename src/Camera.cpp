@@ -11,7 +11,12 @@ Camera::Camera():
   _worldToView(1.0f),
   _projection(1.0f),
   _movementSpeed(5.0f),
-  _sensitivity(0.002f)
+  _sensitivity(0.002f),
+  _nearClip(0.1f),
+  _farClip(100.0f),
+  _fov(45.0f),
+  _aspect(1.0f),
+  _reverseZ(false)
 {}
 
 void Camera::SetTransformation(const glm::vec3& eye, const glm::vec3& lookAt, const glm::vec3& up)
@@ -22,10 +27,64 @@ void Camera::SetTransformation(const glm::vec3& eye, const glm::vec3& lookAt, co
 
 void Camera::SetProjection(float fov, float aspect, float nearClip, float farClip)
 {
-  // Make sure you convert from degrees to radians as glm uses radians from 0.9.6 version
-  _projection = glm::perspective(glm::radians(fov), aspect, nearClip, farClip);
   _nearClip = nearClip;
   _farClip = farClip;
+  _fov = fov;
+  _aspect = aspect;
+
+  if (!_reverseZ)
+  {
+    // Make sure you convert from degrees to radians as glm uses radians from 0.9.6 version
+    _projection = glm::perspective(glm::radians(fov), aspect, nearClip, farClip);
+    return;
+  }
+
+  // Clip space z is the near plane distance for all points, so the window depth is near / z after the perspective
+  // division: 1 at the near plane going to 0 at infinity. Together with the float depth buffer, that has most of its
+  // precision close to 0, the precision is spread almost evenly over the whole view depth range.
+  const float f = 1.0f / tanf(glm::radians(fov) * 0.5f);
+  _projection = glm::mat4x4(0.0f);
+  _projection[0][0] = f / aspect;
+  _projection[1][1] = f;
+  _projection[3][2] = nearClip;
+#ifdef GLM_FORCE_LEFT_HANDED
+  // Looking along +z
+  _projection[2][3] = 1.0f;
+#else
+  // Looking along -z
+  _projection[2][3] = -1.0f;
+#endif
+}
+
+void Camera::SetReverseZ(bool reverseZ)
+{
+  _reverseZ = reverseZ;
+  SetProjection(_fov, _aspect, _nearClip, _farClip);
+}
+
+void Camera::GetFrustumPlanes(glm::vec4 planes[6]) const
+{
+  // Gribb-Hartmann extraction from the rows of the world to clip space matrix
+  glm::mat4x4 m = glm::transpose(_projection * _worldToView);
+  planes[0] = m[3] + m[0];
+  planes[1] = m[3] - m[0];
+  planes[2] = m[3] + m[1];
+  planes[3] = m[3] - m[1];
+  if (_reverseZ)
+  {
+    // Depth 1 is the near plane, the far plane is at infinity, so just cull at the far clip plane distance
+    planes[4] = m[3] - m[2];
+    planes[5] = glm::vec4(0.0f, 0.0f, 0.0f, _farClip) - m[3];
+  }
+  else
+  {
+    planes[4] = m[3] + m[2];
+    planes[5] = m[3] - m[2];
+  }
+
+  // Normalize so that the plane distances are in world units
+  for (int i = 0; i < 6; ++i)
+    planes[i] /= glm::length(glm::vec3(planes[i]));
 }
 
 void Camera::Move(MovementDirections direction, const glm::vec2& mouseMove, float dt)
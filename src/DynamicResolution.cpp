@@ -0,0 +1,85 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <DynamicResolution.h>
+#include <Profiler.h>
+
+#include <algorithm>
+#include <cmath>
+
+void DynamicResolution::SetScaleRange(float minScale, float maxScale)
+{
+  _maxScale = std::max(maxScale, 0.01f);
+  _minScale = std::min(std::max(minScale, 0.01f), _maxScale);
+  _scale = std::min(std::max(_scale, _minScale), _maxScale);
+}
+
+void DynamicResolution::SetEnabled(bool enable)
+{
+  if (enable != _enabled)
+    Reset();
+  _enabled = enable;
+}
+
+void DynamicResolution::Reset()
+{
+  _scale = _maxScale;
+  _numSamples = 0;
+  _averageTime = 0.0f;
+  _scaleFrame = Profiler::GetInstance().GetCurrentFrame();
+}
+
+void DynamicResolution::Update()
+{
+  const Profiler &profiler = Profiler::GetInstance();
+  const int frame = profiler.GetResultsFrame();
+  if (frame == _lastFrame)
+    return;
+  _lastFrame = frame;
+
+  // Frames still rendered at the previous scale tell nothing about the current one
+  if (!_enabled || frame < _scaleFrame)
+    return;
+
+  // The outermost scopes cover the whole frame
+  double gpuTime = 0.0;
+  for (int i = 0; i < profiler.GetNumResults(); ++i)
+  {
+    const Profiler::ScopeTiming &timing = profiler.GetResult(i);
+    if (timing.depth == 0)
+      gpuTime += timing.gpuTime;
+  }
+  if (gpuTime <= 0.0)
+    return;
+
+  _samples[_numSamples++] = (float)gpuTime;
+  if (_numSamples < NUM_SAMPLES)
+    return;
+
+  float sum = 0.0f;
+  for (float sample : _samples)
+    sum += sample;
+  _averageTime = sum / NUM_SAMPLES;
+  _numSamples = 0;
+
+  // Shading cost follows the number of pixels, i.e., the square of the scale
+  float change = sqrtf(_target / _averageTime);
+  change = std::min(std::max(change, (float)MAX_DECREASE), (float)MAX_INCREASE);
+  const float scale = std::min(std::max(_scale * change, _minScale), _maxScale);
+  // Small steps up are skipped to avoid oscillation, frames over the budget are always scaled down
+  if (scale == _scale || (scale > _scale && scale - _scale < MIN_CHANGE && scale != _maxScale))
+    return;
+
+  // The frame being recorded is the first one at the new scale
+  _scale = scale;
+  _scaleFrame = profiler.GetCurrentFrame();
+}
+
+void DynamicResolution::GetScaledSize(int width, int height, int &scaledWidth, int &scaledHeight) const
+{
+  const float scale = GetScale();
+  scaledWidth = std::max((int)(width * scale + 0.5f), 1);
+  scaledHeight = std::max((int)(height * scale + 0.5f), 1);
+}
@@ -0,0 +1,590 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <FrameGraph.h>
+#include <GpuMemory.h>
+#include <Profiler.h>
+
+#include <algorithm>
+#include <cstdio>
+
+// Barrier making the shader writes visible to the access
+static GLbitfield getBarrierBit(ResourceAccess access)
+{
+  switch (access)
+  {
+  case ResourceAccess::Attachment:
+    return GL_FRAMEBUFFER_BARRIER_BIT;
+  case ResourceAccess::Texture:
+    return GL_TEXTURE_FETCH_BARRIER_BIT;
+  case ResourceAccess::Image:
+    return GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+  case ResourceAccess::Storage:
+    return GL_SHADER_STORAGE_BARRIER_BIT;
+  case ResourceAccess::Uniform:
+    return GL_UNIFORM_BARRIER_BIT;
+  case ResourceAccess::Indirect:
+    return GL_COMMAND_BARRIER_BIT;
+  default:
+    return 0;
+  }
+}
+
+FrameGraph::~FrameGraph()
+{
+  Release();
+}
+
+void FrameGraph::Release()
+{
+  for (const Framebuffer &framebuffer : _framebuffers)
+    glDeleteFramebuffers(1, &framebuffer.fbo);
+  for (const Texture &texture : _textures)
+  {
+    GpuMemory::GetInstance().UntrackTexture(texture.texture);
+    glDeleteTextures(1, &texture.texture);
+  }
+
+  _framebuffers.clear();
+  _textures.clear();
+  Reset();
+}
+
+void FrameGraph::Reset()
+{
+  _passes.clear();
+  _resources.clear();
+  _order.clear();
+}
+
+FrameResource FrameGraph::CreateTexture(const char *name, const FrameTextureDesc &desc)
+{
+  _resources.push_back({name, desc, 0, true, false, false, -1, -1, -1});
+  return (FrameResource)_resources.size() - 1;
+}
+
+FrameResource FrameGraph::ImportTexture(const char *name, GLuint texture, const FrameTextureDesc &desc)
+{
+  _resources.push_back({name, desc, texture, false, false, false, -1, -1, -1});
+  return (FrameResource)_resources.size() - 1;
+}
+
+FrameResource FrameGraph::ImportBackbuffer(const char *name, int width, int height)
+{
+  const FrameTextureDesc desc = {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_LINEAR, width, height, 1};
+  _resources.push_back({name, desc, 0, false, true, true, -1, -1, -1});
+  return (FrameResource)_resources.size() - 1;
+}
+
+FrameResource FrameGraph::ImportBuffer(const char *name, GLuint buffer)
+{
+  _resources.push_back({name, {}, buffer, false, false, false, -1, -1, -1});
+  return (FrameResource)_resources.size() - 1;
+}
+
+void FrameGraph::MarkOutput(FrameResource resource)
+{
+  if (resource >= 0 && resource < (FrameResource)_resources.size() && !_resources[resource].transient)
+    _resources[resource].output = true;
+}
+
+int FrameGraph::AddPass(const char *name, const PassJob &job)
+{
+  _passes.push_back({name, job, {}, 0, false, 0, 0, 0, 0, 0});
+  return (int)_passes.size() - 1;
+}
+
+void FrameGraph::Read(int pass, FrameResource resource, ResourceAccess access)
+{
+  if (resource >= 0 && resource < (FrameResource)_resources.size())
+    _passes[pass].accesses.push_back({resource, access, false});
+}
+
+void FrameGraph::Write(int pass, FrameResource resource, ResourceAccess access)
+{
+  if (resource >= 0 && resource < (FrameResource)_resources.size())
+    _passes[pass].accesses.push_back({resource, access, true});
+}
+
+void FrameGraph::SetViewport(int pass, int width, int height)
+{
+  _passes[pass].viewportWidth = width;
+  _passes[pass].viewportHeight = height;
+}
+
+bool FrameGraph::Compile()
+{
+  if (!SortPasses())
+  {
+    _order.clear();
+    return false;
+  }
+
+  CullPasses();
+
+  // Lifetimes of the resources within the execution order
+  for (int i = 0; i < (int)_order.size(); ++i)
+  {
+    for (const Access &access : _passes[_order[i]].accesses)
+    {
+      Resource &resource = _resources[access.resource];
+      if (resource.first < 0)
+        resource.first = i;
+      resource.last = i;
+    }
+  }
+
+  AllocateTextures();
+  CreateFramebuffers();
+  ComputeBarriers();
+  CollectGarbage();
+  return true;
+}
+
+void FrameGraph::Execute()
+{
+  Profiler &profiler = Profiler::GetInstance();
+  for (int index : _order)
+  {
+    const Pass &pass = _passes[index];
+    if (pass.barriers != 0)
+      glMemoryBarrier(pass.barriers);
+
+    if (pass.hasAttachments)
+    {
+      glBindFramebuffer(GL_FRAMEBUFFER, pass.fbo);
+      glViewport(0, 0, pass.width, pass.height);
+    }
+
+    profiler.BeginScope(pass.name);
+    pass.job(*this);
+    profiler.EndScope();
+  }
+}
+
+GLuint FrameGraph::GetTexture(FrameResource resource) const
+{
+  if (resource < 0 || resource >= (FrameResource)_resources.size())
+    return 0;
+
+  return _resources[resource].object;
+}
+
+void FrameGraph::BindTexture(GLuint unit, FrameResource resource) const
+{
+  const bool multisampled = resource >= 0 && resource < (FrameResource)_resources.size() && _resources[resource].desc.samples > 1;
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(multisampled ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D, GetTexture(resource));
+  glBindSampler(unit, 0);
+}
+
+bool FrameGraph::SortPasses()
+{
+  const int numPasses = (int)_passes.size();
+  std::vector<std::vector<int>> successors(numPasses);
+  std::vector<int> numDependencies(numPasses, 0);
+  auto addDependency = [&](int from, int to)
+  {
+    if (from == to)
+      return;
+
+    successors[from].push_back(to);
+    ++numDependencies[to];
+  };
+
+  // Walk the accesses of every resource in the order the passes were added: readers wait for the last writer and
+  // writers for the previous writer and its readers. Readers of a transient resource added before any of its writers
+  // are in the wrong order, they're moved after the first writer.
+  int reordered = 0;
+  int unwritten = 0;
+  const char *unwrittenPass = nullptr;
+  const char *unwrittenResource = nullptr;
+  for (FrameResource r = 0; r < (FrameResource)_resources.size(); ++r)
+  {
+    const bool transient = _resources[r].transient;
+    int lastWriter = -1;
+    std::vector<int> readers;
+    std::vector<int> earlyReaders;
+
+    for (int p = 0; p < numPasses; ++p)
+    {
+      bool reads = false;
+      bool writes = false;
+      for (const Access &access : _passes[p].accesses)
+      {
+        if (access.resource != r)
+          continue;
+        if (access.write)
+          writes = true;
+        else
+          reads = true;
+      }
+
+      if (reads)
+      {
+        if (lastWriter >= 0)
+        {
+          addDependency(lastWriter, p);
+          readers.push_back(p);
+        }
+        else if (transient)
+          earlyReaders.push_back(p);
+        else
+          readers.push_back(p);
+      }
+
+      if (writes)
+      {
+        if (lastWriter >= 0)
+          addDependency(lastWriter, p);
+        for (int reader : readers)
+          addDependency(reader, p);
+
+        if (lastWriter < 0)
+        {
+          for (int reader : earlyReaders)
+          {
+            if (reader != p)
+            {
+              addDependency(p, reader);
+              ++reordered;
+            }
+          }
+        }
+
+        lastWriter = p;
+        readers.clear();
+      }
+    }
+
+    if (lastWriter < 0 && !earlyReaders.empty())
+    {
+      ++unwritten;
+      unwrittenPass = _passes[earlyReaders[0]].name;
+      unwrittenResource = _resources[r].name;
+    }
+  }
+
+  // Report the problems only when they change, the same graph is built every frame
+  if (reordered != _reordered && reordered > 0)
+    printf("Frame graph: %i passes read resources before they were written, moved after their writers.\n", reordered);
+  if (unwritten != _unwritten && unwritten > 0)
+    printf("Frame graph: pass %s reads %s which no pass writes!\n", unwrittenPass, unwrittenResource);
+  _reordered = reordered;
+  _unwritten = unwritten;
+
+  // Topological sort keeping the order in which the passes were added wherever possible
+  _order.clear();
+  std::vector<bool> done(numPasses, false);
+  for (int i = 0; i < numPasses; ++i)
+  {
+    int next = -1;
+    for (int p = 0; p < numPasses; ++p)
+    {
+      if (!done[p] && numDependencies[p] == 0)
+      {
+        next = p;
+        break;
+      }
+    }
+
+    if (next < 0)
+    {
+      printf("Frame graph: cyclic dependency between the passes!\n");
+      return false;
+    }
+
+    done[next] = true;
+    _order.push_back(next);
+    for (int successor : successors[next])
+      --numDependencies[successor];
+  }
+
+  return true;
+}
+
+void FrameGraph::CullPasses()
+{
+  // Going from the back, a pass is needed if it writes the output or what a later needed pass reads
+  std::vector<bool> needed(_resources.size(), false);
+  std::vector<int> order;
+  for (int i = (int)_order.size() - 1; i >= 0; --i)
+  {
+    const Pass &pass = _passes[_order[i]];
+    bool alive = false;
+    for (const Access &access : pass.accesses)
+    {
+      if (access.write && (needed[access.resource] || _resources[access.resource].output))
+      {
+        alive = true;
+        break;
+      }
+    }
+
+    if (!alive)
+      continue;
+
+    for (const Access &access : pass.accesses)
+    {
+      if (!access.write)
+        needed[access.resource] = true;
+    }
+    order.push_back(_order[i]);
+  }
+
+  std::reverse(order.begin(), order.end());
+  _order.swap(order);
+}
+
+void FrameGraph::AllocateTextures()
+{
+  // Transient resources in the order of their first use
+  std::vector<FrameResource> resources;
+  for (FrameResource r = 0; r < (FrameResource)_resources.size(); ++r)
+  {
+    if (_resources[r].transient && _resources[r].first >= 0)
+      resources.push_back(r);
+  }
+  std::sort(resources.begin(), resources.end(), [this](FrameResource a, FrameResource b) { return _resources[a].first < _resources[b].first; });
+
+  for (Texture &texture : _textures)
+  {
+    texture.busyUntil = -1;
+    ++texture.unusedFrames;
+  }
+
+  _transientBytes = 0;
+  for (FrameResource r : resources)
+  {
+    Resource &resource = _resources[r];
+    _transientBytes += GetTextureBytes(resource.desc);
+
+    // Take a matching texture free since before the first use
+    int index = -1;
+    for (int i = 0; i < (int)_textures.size(); ++i)
+    {
+      if (_textures[i].desc == resource.desc && _textures[i].busyUntil < resource.first)
+      {
+        index = i;
+        break;
+      }
+    }
+
+    if (index < 0)
+    {
+      const FrameTextureDesc &desc = resource.desc;
+      GLuint texture = 0;
+      glGenTextures(1, &texture);
+      if (desc.samples > 1)
+      {
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, texture);
+        glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, desc.samples, desc.internalFormat, desc.width, desc.height, GL_TRUE);
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+      }
+      else
+      {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, desc.internalFormat, desc.width, desc.height, 0, desc.format, desc.type, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, desc.filter);
+        glBindTexture(GL_TEXTURE_2D, 0);
+      }
+
+      GpuMemory::GetInstance().TrackTexture(texture, GetTextureBytes(desc), "Render targets");
+      _textures.push_back({desc, texture, -1, 0});
+      index = (int)_textures.size() - 1;
+    }
+
+    Texture &texture = _textures[index];
+    texture.busyUntil = resource.last;
+    texture.unusedFrames = 0;
+    resource.object = texture.texture;
+    resource.texture = index;
+  }
+
+  _allocatedBytes = 0;
+  for (const Texture &texture : _textures)
+  {
+    if (texture.unusedFrames == 0)
+      _allocatedBytes += GetTextureBytes(texture.desc);
+  }
+}
+
+void FrameGraph::CreateFramebuffers()
+{
+  for (Framebuffer &framebuffer : _framebuffers)
+    ++framebuffer.unusedFrames;
+
+  for (int index : _order)
+  {
+    Pass &pass = _passes[index];
+
+    // Depth first, then the colors in the declared order
+    std::vector<GLuint> attachments(1, 0);
+    std::vector<FrameResource> attached;
+    bool backbuffer = false;
+    for (const Access &access : pass.accesses)
+    {
+      if (access.access != ResourceAccess::Attachment ||
+          std::find(attached.begin(), attached.end(), access.resource) != attached.end())
+        continue;
+
+      const Resource &resource = _resources[access.resource];
+      attached.push_back(access.resource);
+      pass.width = resource.desc.width;
+      pass.height = resource.desc.height;
+      backbuffer |= resource.backbuffer;
+      if (GetDepthAttachment(resource.desc.internalFormat) != 0)
+        attachments[0] = resource.object;
+      else
+        attachments.push_back(resource.object);
+    }
+
+    pass.hasAttachments = !attached.empty();
+    pass.fbo = 0;
+    if (pass.viewportWidth > 0 && pass.viewportHeight > 0)
+    {
+      pass.width = std::min(pass.width, pass.viewportWidth);
+      pass.height = std::min(pass.height, pass.viewportHeight);
+    }
+    if (!pass.hasAttachments || backbuffer)
+      continue;
+
+    auto it = std::find_if(_framebuffers.begin(), _framebuffers.end(), [&attachments](const Framebuffer &f) { return f.attachments == attachments; });
+    if (it != _framebuffers.end())
+    {
+      it->unusedFrames = 0;
+      pass.fbo = it->fbo;
+      continue;
+    }
+
+    GLuint fbo = 0;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+    GLenum drawBuffers[8];
+    GLsizei numDrawBuffers = 0;
+    for (FrameResource r : attached)
+    {
+      const Resource &resource = _resources[r];
+      GLenum attachment = GetDepthAttachment(resource.desc.internalFormat);
+      if (attachment == 0 && numDrawBuffers < 8)
+      {
+        attachment = GL_COLOR_ATTACHMENT0 + numDrawBuffers;
+        drawBuffers[numDrawBuffers++] = attachment;
+      }
+      glFramebufferTexture(GL_FRAMEBUFFER, attachment, resource.object, 0);
+    }
+
+    if (numDrawBuffers > 0)
+      glDrawBuffers(numDrawBuffers, drawBuffers);
+    else
+      glDrawBuffer(GL_NONE);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+      printf("Failed to create framebuffer of pass %s: 0x%04X\n", pass.name, status);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    _framebuffers.push_back({attachments, fbo, 0});
+    pass.fbo = fbo;
+  }
+}
+
+void FrameGraph::ComputeBarriers()
+{
+  // Aliased transient resources share the state of their texture
+  const int numResources = (int)_resources.size();
+  std::vector<bool> dirty(numResources + _textures.size(), false);
+  std::vector<GLbitfield> synced(numResources + _textures.size(), 0);
+  auto getSlot = [this, numResources](FrameResource r) { return _resources[r].transient ? numResources + _resources[r].texture : r; };
+
+  for (int index : _order)
+  {
+    Pass &pass = _passes[index];
+    pass.barriers = 0;
+    for (const Access &access : pass.accesses)
+    {
+      const int slot = getSlot(access.resource);
+      const GLbitfield bit = getBarrierBit(access.access);
+      if (dirty[slot] && !(synced[slot] & bit))
+        pass.barriers |= bit;
+    }
+
+    // Barriers are global, what they made visible stays visible until the next shader write
+    if (pass.barriers != 0)
+    {
+      for (size_t slot = 0; slot < synced.size(); ++slot)
+      {
+        if (dirty[slot])
+          synced[slot] |= pass.barriers;
+      }
+    }
+
+    for (const Access &access : pass.accesses)
+    {
+      if (access.write && (access.access == ResourceAccess::Image || access.access == ResourceAccess::Storage))
+      {
+        const int slot = getSlot(access.resource);
+        dirty[slot] = true;
+        synced[slot] = 0;
+      }
+    }
+  }
+}
+
+void FrameGraph::CollectGarbage()
+{
+  for (auto it = _framebuffers.begin(); it != _framebuffers.end();)
+  {
+    if (it->unusedFrames > MAX_UNUSED_FRAMES)
+    {
+      glDeleteFramebuffers(1, &it->fbo);
+      it = _framebuffers.erase(it);
+    }
+    else
+      ++it;
+  }
+
+  // The framebuffers of a texture are always unused for at least as long as the texture, they're already gone
+  for (int i = (int)_textures.size() - 1; i >= 0; --i)
+  {
+    if (_textures[i].unusedFrames <= MAX_UNUSED_FRAMES)
+      continue;
+
+    GpuMemory::GetInstance().UntrackTexture(_textures[i].texture);
+    glDeleteTextures(1, &_textures[i].texture);
+    _textures.erase(_textures.begin() + i);
+    for (Resource &resource : _resources)
+    {
+      if (resource.transient && resource.texture > i)
+        --resource.texture;
+    }
+  }
+}
+
+GLenum FrameGraph::GetDepthAttachment(GLint internalFormat)
+{
+  switch (internalFormat)
+  {
+  case GL_DEPTH_STENCIL:
+  case GL_DEPTH24_STENCIL8:
+  case GL_DEPTH32F_STENCIL8:
+    return GL_DEPTH_STENCIL_ATTACHMENT;
+  case GL_DEPTH_COMPONENT:
+  case GL_DEPTH_COMPONENT16:
+  case GL_DEPTH_COMPONENT24:
+  case GL_DEPTH_COMPONENT32:
+  case GL_DEPTH_COMPONENT32F:
+    return GL_DEPTH_ATTACHMENT;
+  default:
+    return 0;
+  }
+}
+
+size_t FrameGraph::GetTextureBytes(const FrameTextureDesc &desc)
+{
+  return GpuMemory::GetTextureBytes(desc.internalFormat, desc.width, desc.height, 1, 1, desc.samples);
+}
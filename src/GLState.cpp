@@ -0,0 +1,210 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <GLState.h>
+
+// Tracked OpenGL capabilities, GLState::NumCapabilities of them
+static const GLenum capabilityNames[] =
+{
+  GL_DEPTH_TEST, GL_DEPTH_CLAMP, GL_CULL_FACE, GL_BLEND, GL_STENCIL_TEST, GL_SCISSOR_TEST, GL_POLYGON_OFFSET_FILL, GL_RASTERIZER_DISCARD, GL_MULTISAMPLE
+};
+
+GLState& GLState::GetInstance()
+{
+  static GLState state;
+  return state;
+}
+
+void GLState::BeginFrame()
+{
+  _lastIssued = _issued;
+  _lastSkipped = _skipped;
+  _issued = 0;
+  _skipped = 0;
+  Invalidate();
+}
+
+void GLState::Invalidate()
+{
+  for (int i = 0; i < NumCapabilities; ++i)
+    _capabilities[i].valid = false;
+
+  _depthFunc.valid = false;
+  _depthMask.valid = false;
+  _cullMode.valid = false;
+  _blendEquation.valid = false;
+  _blendFunc.valid = false;
+  _polygonMode.valid = false;
+  _colorMask.valid = false;
+  for (int i = 0; i < 2; ++i)
+  {
+    _stencilFunc[i].valid = false;
+    _stencilOp[i].valid = false;
+  }
+  _program.valid = false;
+  _vao.valid = false;
+
+  for (int i = 0; i < MAX_BUFFER_BINDINGS; ++i)
+  {
+    _uniformBuffers[i].valid = false;
+    _storageBuffers[i].valid = false;
+  }
+}
+
+void GLState::Apply(const PipelineState &state)
+{
+  Set(GL_DEPTH_TEST, state.depthTest);
+  DepthFunc(state.depthFunc);
+  DepthMask(state.depthMask);
+  Set(GL_DEPTH_CLAMP, state.depthClamp);
+  Set(GL_CULL_FACE, state.cullFace);
+  CullFace(state.cullMode);
+  Set(GL_BLEND, state.blend);
+  BlendEquation(state.blendEquation);
+  BlendFunc(state.blendSrc, state.blendDst);
+  Set(GL_STENCIL_TEST, state.stencilTest);
+  PolygonMode(state.polygonMode);
+}
+
+bool GLState::Count(bool changed)
+{
+  if (changed)
+    ++_issued;
+  else
+    ++_skipped;
+
+  return changed;
+}
+
+int GLState::GetCapability(GLenum cap)
+{
+  for (int i = 0; i < NumCapabilities; ++i)
+  {
+    if (capabilityNames[i] == cap)
+      return i;
+  }
+
+  return NumCapabilities;
+}
+
+void GLState::Set(GLenum cap, bool enabled)
+{
+  const int i = GetCapability(cap);
+  if (!Count(i == NumCapabilities || _capabilities[i].Update(enabled)))
+    return;
+
+  if (enabled)
+    glEnable(cap);
+  else
+    glDisable(cap);
+}
+
+void GLState::DepthFunc(GLenum func)
+{
+  if (Count(_depthFunc.Update(func)))
+    glDepthFunc(func);
+}
+
+void GLState::DepthMask(GLboolean mask)
+{
+  if (Count(_depthMask.Update(mask)))
+    glDepthMask(mask);
+}
+
+void GLState::CullFace(GLenum mode)
+{
+  if (Count(_cullMode.Update(mode)))
+    glCullFace(mode);
+}
+
+void GLState::BlendEquation(GLenum mode)
+{
+  if (Count(_blendEquation.Update(mode)))
+    glBlendEquation(mode);
+}
+
+void GLState::BlendFunc(GLenum src, GLenum dst)
+{
+  // Blend factors fit 16 bits
+  if (Count(_blendFunc.Update((src << 16) | dst)))
+    glBlendFunc(src, dst);
+}
+
+void GLState::PolygonMode(GLenum mode)
+{
+  if (Count(_polygonMode.Update(mode)))
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+}
+
+void GLState::ColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a)
+{
+  const GLuint mask = (r ? 1 : 0) | (g ? 2 : 0) | (b ? 4 : 0) | (a ? 8 : 0);
+  if (Count(_colorMask.Update(mask)))
+    glColorMask(r, g, b, a);
+}
+
+void GLState::StencilFuncSeparate(GLenum face, GLenum func, GLint ref, GLuint mask)
+{
+  // Both faces have to be updated, don't short circuit
+  const StencilFuncState state = {func, ref, mask};
+  bool changed = false;
+  if (face != GL_BACK)
+    changed |= _stencilFunc[0].Update(state);
+  if (face != GL_FRONT)
+    changed |= _stencilFunc[1].Update(state);
+
+  if (Count(changed))
+    glStencilFuncSeparate(face, func, ref, mask);
+}
+
+void GLState::StencilOpSeparate(GLenum face, GLenum sfail, GLenum dpfail, GLenum dppass)
+{
+  const StencilOpState state = {sfail, dpfail, dppass};
+  bool changed = false;
+  if (face != GL_BACK)
+    changed |= _stencilOp[0].Update(state);
+  if (face != GL_FRONT)
+    changed |= _stencilOp[1].Update(state);
+
+  if (Count(changed))
+    glStencilOpSeparate(face, sfail, dpfail, dppass);
+}
+
+void GLState::UseProgram(GLuint program)
+{
+  if (Count(_program.Update(program)))
+    glUseProgram(program);
+}
+
+void GLState::BindVertexArray(GLuint vao)
+{
+  if (Count(_vao.Update(vao)))
+    glBindVertexArray(vao);
+}
+
+void GLState::BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+  Cached<BufferBinding> *bindings = nullptr;
+  if (target == GL_UNIFORM_BUFFER)
+    bindings = _uniformBuffers;
+  else if (target == GL_SHADER_STORAGE_BUFFER)
+    bindings = _storageBuffers;
+
+  // Unbinding doesn't care about the range
+  if (buffer == 0)
+  {
+    offset = 0;
+    size = 0;
+  }
+
+  const BufferBinding binding = {buffer, offset, size};
+  if (!Count(!bindings || index >= (GLuint)MAX_BUFFER_BINDINGS || bindings[index].Update(binding)))
+    return;
+
+  if (size == 0)
+    glBindBufferBase(target, index, buffer);
+  else
+    glBindBufferRange(target, index, buffer, offset, size);
+}
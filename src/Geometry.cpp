@@ -4,9 +4,31 @@
  */
 
 #include "Geometry.h"
+#include "MeshOptimizer.h"
 
+#include <algorithm>
+#include <map>
+#include <utility>
 #include <glm/glm.hpp>
 
+// Reorder the triangles for the vertex cache and overdraw and the vertices for the fetch locality, the ranges get
+// their new base vertices
+template <class VertexType>
+static void optimizeMesh(std::vector<VertexType> &vb, std::vector<GLuint> &ib, std::vector<MeshLod> &lods)
+{
+  std::vector<GLuint> remap;
+  MeshOptimizer::Optimize(ib, lods, &vb[0].x, sizeof(VertexType), vb.size(), remap);
+  MeshOptimizer::RemapVertices(vb, remap);
+}
+
+// Optimize the mesh with the whole index buffer as the only range
+template <class VertexType>
+static void optimizeMesh(std::vector<VertexType> &vb, std::vector<GLuint> &ib)
+{
+  std::vector<MeshLod> lods(1, {0, (GLsizei)ib.size(), 0});
+  optimizeMesh(vb, ib, lods);
+}
+
 Mesh<Vertex_Pos_Col> *Geometry::CreateQuadColor()
 {
   // Create the vertex buffer for a quad
@@ -33,6 +55,8 @@ Mesh<Vertex_Pos_Col> *Geometry::CreateQuadColor()
   ib.push_back(3);
   ib.push_back(0);
 
+  optimizeMesh(vb, ib);
+
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Col> *mesh = new Mesh<Vertex_Pos_Col>();
   mesh->Init(vb, ib);
@@ -65,16 +89,18 @@ Mesh<Vertex_Pos_Tex> *Geometry::CreateQuadTex()
   ib.push_back(3);
   ib.push_back(0);
 
+  optimizeMesh(vb, ib);
+
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Tex> *mesh = new Mesh<Vertex_Pos_Tex>();
   mesh->Init(vb, ib);
   return mesh;
 }
 
-Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateQuadNormalTangentTex()
+// Fill the vertex and index buffers with a quad with normals, tangents and texture coordinates
+static void getQuadNormalTangentTex(std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, std::vector<GLuint> &ib)
 {
   // Create the vertex buffer for a quad
-  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
   vb.reserve(4);
 
   // Create vertices
@@ -84,7 +110,6 @@ Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateQuadNormalTangentTex()
   vb.push_back({-0.5f, 0.0f,  0.5f, 0.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f});
 
   // Fill in the index buffer
-  std::vector<GLuint> ib;
   ib.reserve(6);
 
   // One triangle
@@ -96,6 +121,34 @@ Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateQuadNormalTangentTex()
   ib.push_back(2);
   ib.push_back(3);
   ib.push_back(0);
+}
+
+// Split the vertices into the position stream and the packed attribute stream and create the mesh
+static SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *createPackedMesh(const std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, const std::vector<GLuint> &ib,
+                                                              const std::vector<MeshLod> &lods)
+{
+  std::vector<Vertex_Pos> positions;
+  std::vector<Vertex_Nrm_Tgt_Tex_Packed> attributes;
+  positions.reserve(vb.size());
+  attributes.reserve(vb.size());
+  for (const Vertex_Pos_Nrm_Tgt_Tex &vertex : vb)
+  {
+    positions.push_back({vertex.x, vertex.y, vertex.z});
+    attributes.push_back(Vertex_Nrm_Tgt_Tex_Packed::Pack(vertex));
+  }
+
+  SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *mesh = new SplitMesh<Vertex_Nrm_Tgt_Tex_Packed>();
+  mesh->Init(positions, attributes, ib, lods);
+  return mesh;
+}
+
+Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateQuadNormalTangentTex()
+{
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
+  std::vector<GLuint> ib;
+  getQuadNormalTangentTex(vb, ib);
+
+  optimizeMesh(vb, ib);
 
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Nrm_Tgt_Tex> *mesh = new Mesh<Vertex_Pos_Nrm_Tgt_Tex>();
@@ -103,6 +156,24 @@ Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateQuadNormalTangentTex()
   return mesh;
 }
 
+SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *Geometry::CreateQuadNormalTangentTexPacked()
+{
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
+  std::vector<GLuint> ib;
+  getQuadNormalTangentTex(vb, ib);
+  optimizeMesh(vb, ib);
+  return createPackedMesh(vb, ib, std::vector<MeshLod>(1, {0, (GLsizei)ib.size(), 0}));
+}
+
+MeshLod Geometry::AddQuadNormalTangentTex(MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool)
+{
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
+  std::vector<GLuint> ib;
+  getQuadNormalTangentTex(vb, ib);
+  optimizeMesh(vb, ib);
+  return pool.Add(vb, ib);
+}
+
 Mesh<Vertex_Pos_Col> *Geometry::CreateCubeColor()
 {
   // Create the vertex buffer for a unit cube
@@ -163,6 +234,8 @@ Mesh<Vertex_Pos_Col> *Geometry::CreateCubeColor()
     ib.push_back(baseIndex);
   }
 
+  optimizeMesh(vb, ib);
+
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Col> *mesh = new Mesh<Vertex_Pos_Col>();
   mesh->Init(vb, ib);
@@ -239,6 +312,8 @@ Mesh<Vertex_Pos_Col> *Geometry::CreateCubeColorShared()
   ib.push_back(1);
   ib.push_back(4);
 
+  optimizeMesh(vb, ib);
+
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Col> *mesh = new Mesh<Vertex_Pos_Col>();
   mesh->Init(vb, ib);
@@ -357,9 +432,9 @@ Mesh<Vertex_Pos> *Geometry::CreateCubeAdjacency()
   ib.push_back(4);
   ib.push_back(7); // Adjacent vertex
 
-  // Create, initialize and return the mesh
+  // Create, initialize and return the mesh, the extrusion compute shader reads the adjacency as uints
   Mesh<Vertex_Pos> *mesh = new Mesh<Vertex_Pos>();
-  mesh->Init(vb, ib);
+  mesh->Init(vb, ib, false);
   return mesh;
 }
 
@@ -423,16 +498,18 @@ Mesh<Vertex_Pos_Tex> *Geometry::CreateCubeTex()
     ib.push_back(baseIndex);
   }
 
+  optimizeMesh(vb, ib);
+
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Tex> *mesh = new Mesh<Vertex_Pos_Tex>();
   mesh->Init(vb, ib);
   return mesh;
 }
 
-Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateCubeNormalTangentTex()
+// Fill the vertex and index buffers with a unit cube with normals, tangents and texture coordinates
+static void getCubeNormalTangentTex(std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, std::vector<GLuint> &ib)
 {
   // Create the vertex buffer for a unit cube
-  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
   vb.reserve(24);
 
   // Top face
@@ -472,7 +549,6 @@ Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateCubeNormalTangentTex()
   vb.push_back({0.5f,  0.5f, -0.5f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f}); // 23
 
   // Fill in the index buffer
-  std::vector<GLuint> ib;
   ib.reserve(36);
   for (int face = 0; face < 6; ++face)
   {
@@ -488,6 +564,15 @@ Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateCubeNormalTangentTex()
     ib.push_back(baseIndex + 3);
     ib.push_back(baseIndex);
   }
+}
+
+Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateCubeNormalTangentTex()
+{
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
+  std::vector<GLuint> ib;
+  getCubeNormalTangentTex(vb, ib);
+
+  optimizeMesh(vb, ib);
 
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Nrm_Tgt_Tex> *mesh = new Mesh<Vertex_Pos_Nrm_Tgt_Tex>();
@@ -495,6 +580,29 @@ Mesh<Vertex_Pos_Nrm_Tgt_Tex> *Geometry::CreateCubeNormalTangentTex()
   return mesh;
 }
 
+SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *Geometry::CreateCubeNormalTangentTexPacked()
+{
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
+  std::vector<GLuint> ib;
+  getCubeNormalTangentTex(vb, ib);
+  optimizeMesh(vb, ib);
+  return createPackedMesh(vb, ib, std::vector<MeshLod>(1, {0, (GLsizei)ib.size(), 0}));
+}
+
+MeshLod Geometry::AddCubeNormalTangentTex(MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool)
+{
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
+  std::vector<GLuint> ib;
+  getCubeNormalTangentTex(vb, ib);
+  optimizeMesh(vb, ib);
+  return pool.Add(vb, ib);
+}
+
+SplitMesh<Vertex_Nrm_Tgt_Tex_Packed> *Geometry::CreatePackedMesh(const MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool)
+{
+  return createPackedMesh(pool.GetVertices(), pool.GetIndices(), pool.GetRanges());
+}
+
 Mesh<Vertex_Pos_Nrm> *Geometry::CreateTetrahedron()
 {
   // Create the vertex buffer for a tetrahedron
@@ -552,16 +660,18 @@ Mesh<Vertex_Pos_Nrm> *Geometry::CreateTetrahedron()
     ib.push_back(baseIndex + 2);
   }
 
+  optimizeMesh(vb, ib);
+
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos_Nrm> *mesh = new Mesh<Vertex_Pos_Nrm>();
   mesh->Init(vb, ib);
   return mesh;
 }
 
-Mesh<Vertex_Pos> *Geometry::CreateIcosahedron()
+// Fill the vertex and index buffers with regular icosahedron with circumradius of 1
+static void getIcosahedron(std::vector<Vertex_Pos> &vb, std::vector<GLuint> &ib)
 {
   // Create the vertex buffer for an icosahedron
-  std::vector<Vertex_Pos> vb;
   vb.reserve(12);
 
   // Assume centering around origin, edge length of 2 -> circumradius is sqrt(phi + 2) = 1.902
@@ -590,7 +700,6 @@ Mesh<Vertex_Pos> *Geometry::CreateIcosahedron()
   vb.push_back({0.0f, -phi, -unit}); // 11
 
   // Fill in the index buffer
-  std::vector<GLuint> ib;
   ib.reserve(60);
 
   // Top half
@@ -675,9 +784,82 @@ Mesh<Vertex_Pos> *Geometry::CreateIcosahedron()
   ib.push_back(10);
   ib.push_back(5);
   ib.push_back(11);
+}
+
+Mesh<Vertex_Pos> *Geometry::CreateIcosahedron()
+{
+  std::vector<Vertex_Pos> vb;
+  std::vector<GLuint> ib;
+  getIcosahedron(vb, ib);
+
+  optimizeMesh(vb, ib);
 
   // Create, initialize and return the mesh
   Mesh<Vertex_Pos> *mesh = new Mesh<Vertex_Pos>();
   mesh->Init(vb, ib);
   return mesh;
 }
+
+Mesh<Vertex_Pos> *Geometry::CreateIcosphere(int numLods)
+{
+  // Start with the icosahedron as the coarsest level
+  std::vector<std::vector<Vertex_Pos>> levelVertices(std::max(numLods, 1));
+  std::vector<std::vector<GLuint>> levelIndices(levelVertices.size());
+  getIcosahedron(levelVertices[0], levelIndices[0]);
+
+  // Each finer level splits all triangles of the previous one into 4 and pushes the new vertices to the unit sphere
+  for (size_t level = 1; level < levelVertices.size(); ++level)
+  {
+    std::vector<Vertex_Pos> &vb = levelVertices[level];
+    std::vector<GLuint> &ib = levelIndices[level];
+    vb = levelVertices[level - 1];
+    const std::vector<GLuint> &coarse = levelIndices[level - 1];
+    ib.reserve(4 * coarse.size());
+
+    // Edge midpoints are shared by the neighbouring triangles
+    std::map<std::pair<GLuint, GLuint>, GLuint> midpoints;
+    auto getMidpoint = [&vb, &midpoints](GLuint i0, GLuint i1) -> GLuint
+    {
+      std::pair<GLuint, GLuint> edge(std::min(i0, i1), std::max(i0, i1));
+      auto it = midpoints.find(edge);
+      if (it != midpoints.end())
+        return it->second;
+
+      glm::vec3 p = glm::normalize(glm::vec3(vb[i0].x + vb[i1].x, vb[i0].y + vb[i1].y, vb[i0].z + vb[i1].z));
+      GLuint index = (GLuint)vb.size();
+      vb.push_back({p.x, p.y, p.z});
+      midpoints[edge] = index;
+      return index;
+    };
+
+    for (size_t t = 0; t < coarse.size(); t += 3)
+    {
+      GLuint i0 = coarse[t], i1 = coarse[t + 1], i2 = coarse[t + 2];
+      GLuint m01 = getMidpoint(i0, i1), m12 = getMidpoint(i1, i2), m20 = getMidpoint(i2, i0);
+
+      // Keep the winding of the original triangle
+      ib.insert(ib.end(), {i0, m01, m20});
+      ib.insert(ib.end(), {m01, i1, m12});
+      ib.insert(ib.end(), {m20, m12, i2});
+      ib.insert(ib.end(), {m01, m12, m20});
+    }
+  }
+
+  // Concatenate the levels from the finest to the coarsest one, indices stay local to each level
+  std::vector<Vertex_Pos> vb;
+  std::vector<GLuint> ib;
+  std::vector<MeshLod> lods;
+  for (size_t level = levelVertices.size(); level-- > 0;)
+  {
+    lods.push_back({(GLuint)ib.size(), (GLsizei)levelIndices[level].size(), (GLint)vb.size()});
+    vb.insert(vb.end(), levelVertices[level].begin(), levelVertices[level].end());
+    ib.insert(ib.end(), levelIndices[level].begin(), levelIndices[level].end());
+  }
+
+  optimizeMesh(vb, ib, lods);
+
+  // Create, initialize and return the mesh
+  Mesh<Vertex_Pos> *mesh = new Mesh<Vertex_Pos>();
+  mesh->Init(vb, ib, lods);
+  return mesh;
+}
@@ -0,0 +1,212 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <GpuMemory.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Memory info extensions aren't core, make sure we have the enums even with a core only loader
+#ifndef GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX
+#define GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX 0x9048
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+#endif
+#ifndef GL_TEXTURE_FREE_MEMORY_ATI
+#define GL_TEXTURE_FREE_MEMORY_ATI 0x87FC
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT 0x8C4D
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+#endif
+
+// Whether the format is made of 4x4 texel blocks
+static bool isBlockCompressed(GLenum internalFormat)
+{
+  switch (internalFormat)
+  {
+  case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+  case GL_COMPRESSED_RED_RGTC1:
+  case GL_COMPRESSED_RG_RGTC2:
+  case GL_COMPRESSED_RGBA_BPTC_UNORM:
+  case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+GpuMemory& GpuMemory::GetInstance()
+{
+  static GpuMemory memory;
+  return memory;
+}
+
+void GpuMemory::TrackBuffer(GLuint buffer, size_t bytes, const char *subsystem)
+{
+  if (buffer)
+    _buffers[buffer] = {bytes, subsystem};
+}
+
+void GpuMemory::TrackTexture(GLuint texture, size_t bytes, const char *subsystem)
+{
+  if (texture)
+    _textures[texture] = {bytes, subsystem};
+}
+
+void GpuMemory::Prune()
+{
+  for (auto it = _buffers.begin(); it != _buffers.end();)
+    it = glIsBuffer(it->first) ? std::next(it) : _buffers.erase(it);
+  for (auto it = _textures.begin(); it != _textures.end();)
+    it = glIsTexture(it->first) ? std::next(it) : _textures.erase(it);
+}
+
+size_t GpuMemory::GetTrackedBytes() const
+{
+  size_t bytes = 0;
+  for (const auto &buffer : _buffers)
+    bytes += buffer.second.bytes;
+  for (const auto &texture : _textures)
+    bytes += texture.second.bytes;
+  return bytes;
+}
+
+bool GpuMemory::QueryVideoMemory(GLint &totalKB, GLint &availableKB)
+{
+  if (GLAD_GL_NVX_gpu_memory_info)
+  {
+    glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &totalKB);
+    glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &availableKB);
+    return true;
+  }
+
+  if (GLAD_GL_ATI_meminfo)
+  {
+    // Total free memory of the pool followed by the largest free block and the same for the auxiliary memory,
+    // the total isn't reported at all
+    GLint info[4] = {0, 0, 0, 0};
+    glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, info);
+    totalKB = -1;
+    availableKB = info[0];
+    return true;
+  }
+
+  return false;
+}
+
+void GpuMemory::Dump()
+{
+  Prune();
+
+  // Sum the objects of each subsystem, the names are literals but compare them by the content anyway
+  struct Group
+  {
+    const char *subsystem;
+    size_t bufferBytes;
+    size_t textureBytes;
+    int numObjects;
+  };
+  std::vector<Group> groups;
+  auto add = [&groups](const Allocation &allocation, bool texture)
+  {
+    auto it = std::find_if(groups.begin(), groups.end(), [&allocation](const Group &group) { return strcmp(group.subsystem, allocation.subsystem) == 0; });
+    if (it == groups.end())
+      it = groups.insert(groups.end(), {allocation.subsystem, 0, 0, 0});
+    (texture ? it->textureBytes : it->bufferBytes) += allocation.bytes;
+    ++it->numObjects;
+  };
+  for (const auto &buffer : _buffers)
+    add(buffer.second, false);
+  for (const auto &texture : _textures)
+    add(texture.second, true);
+
+  std::sort(groups.begin(), groups.end(), [](const Group &a, const Group &b)
+  {
+    return a.bufferBytes + a.textureBytes > b.bufferBytes + b.textureBytes;
+  });
+
+  const double MB = 1.0 / (1024.0 * 1024.0);
+  printf("GPU memory tracked by subsystem:\n");
+  printf("  %-20s %10s %10s %8s\n", "Subsystem", "Buffers", "Textures", "Objects");
+  for (const Group &group : groups)
+    printf("  %-20s %8.2fMB %8.2fMB %8i\n", group.subsystem, group.bufferBytes * MB, group.textureBytes * MB, group.numObjects);
+  printf("  %-20s %8.2fMB in %i buffers and %i textures\n", "Total", GetTrackedBytes() * MB, (int)_buffers.size(), (int)_textures.size());
+
+  GLint totalKB = 0, availableKB = 0;
+  if (!QueryVideoMemory(totalKB, availableKB))
+    printf("Video memory isn't reported by the driver\n");
+  else if (totalKB < 0)
+    printf("Video memory: %.1fMB available\n", availableKB / 1024.0);
+  else
+    printf("Video memory: %.1fMB available of %.1fMB\n", availableKB / 1024.0, totalKB / 1024.0);
+}
+
+int GpuMemory::GetTexelBits(GLenum internalFormat)
+{
+  switch (internalFormat)
+  {
+  case GL_R8:
+    return 8;
+  case GL_RG8:
+  case GL_R16:
+  case GL_R16F:
+  case GL_DEPTH_COMPONENT16:
+    return 16;
+  case GL_RGBA16:
+  case GL_RGBA16F:
+  case GL_RGB16F:
+  case GL_RG32F:
+  case GL_DEPTH32F_STENCIL8:
+    return 64;
+  case GL_RGBA32F:
+  case GL_RGB32F:
+    return 128;
+  // BC1 and BC4 blocks are 8 bytes of 4x4 texels
+  case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_RED_RGTC1:
+    return 4;
+  // BC3, BC5, and BC7 blocks are 16 bytes
+  case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+  case GL_COMPRESSED_RG_RGTC2:
+  case GL_COMPRESSED_RGBA_BPTC_UNORM:
+  case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+    return 8;
+  // 3 component formats are padded to 4 bytes by the drivers as are the 24 bit depth formats
+  default:
+    return 32;
+  }
+}
+
+size_t GpuMemory::GetTextureBytes(GLenum internalFormat, GLsizei width, GLsizei height, GLsizei numLevels, GLsizei numLayers, GLsizei numSamples)
+{
+  // Compressed levels are made of whole 4x4 blocks
+  const int bits = GetTexelBits(internalFormat);
+  const bool compressed = isBlockCompressed(internalFormat);
+  size_t bytes = 0;
+  for (GLsizei level = 0; level < std::max(numLevels, 1); ++level)
+  {
+    size_t levelWidth = std::max(width >> level, 1);
+    size_t levelHeight = std::max(height >> level, 1);
+    if (compressed)
+    {
+      levelWidth = (levelWidth + 3) & ~(size_t)3;
+      levelHeight = (levelHeight + 3) & ~(size_t)3;
+    }
+    bytes += levelWidth * levelHeight * bits / 8;
+  }
+
+  return bytes * std::max(numLayers, 1) * std::max(numSamples, 1);
+}
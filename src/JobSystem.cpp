@@ -0,0 +1,148 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <JobSystem.h>
+
+#include <algorithm>
+
+JobSystem& JobSystem::GetInstance()
+{
+  static JobSystem jobSystem;
+  return jobSystem;
+}
+
+JobSystem::~JobSystem()
+{
+  Release();
+}
+
+bool JobSystem::Init(int numThreads)
+{
+  // Check if already initialized and return
+  if (_queues)
+    return true;
+
+  if (numThreads <= 0)
+    numThreads = std::max((int)std::thread::hardware_concurrency() - 1, 0);
+
+  _numQueues = numThreads + 1;
+  _queues.reset(new Queue[_numQueues]);
+  _numQueued = 0;
+  _exit = false;
+
+  for (int i = 0; i < numThreads; ++i)
+    _threads.push_back(std::thread(&JobSystem::WorkerLoop, this, i + 1));
+
+  return true;
+}
+
+void JobSystem::Release()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _exit = true;
+  }
+  _workReady.notify_all();
+
+  for (std::thread &thread : _threads)
+    thread.join();
+  _threads.clear();
+
+  _queues.reset();
+  _numQueues = 0;
+}
+
+void JobSystem::ParallelFor(int count, int batchSize, const RangeJob &job)
+{
+  if (count <= 0)
+    return;
+
+  // Not worth waking anybody
+  batchSize = std::max(batchSize, 1);
+  const int numBatches = (count + batchSize - 1) / batchSize;
+  if (_threads.empty() || numBatches == 1)
+  {
+    job(0, count);
+    return;
+  }
+
+  // Deal the batches round robin so that every thread starts with work of its own
+  std::atomic<int> remaining(numBatches);
+  for (int i = 0; i < numBatches; ++i)
+  {
+    Queue &queue = _queues[i % _numQueues];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.batches.push_back({&job, i * batchSize, std::min((i + 1) * batchSize, count), &remaining});
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _numQueued += numBatches;
+  }
+  _workReady.notify_all();
+
+  // Help with the loop until all batches are done, the last ones may still be running on the workers
+  while (remaining > 0)
+  {
+    if (!RunBatch(0))
+      std::this_thread::yield();
+  }
+}
+
+void JobSystem::WorkerLoop(int index)
+{
+  for (;;)
+  {
+    if (RunBatch(index))
+      continue;
+
+    // Sleep until there is something to steal
+    std::unique_lock<std::mutex> lock(_mutex);
+    _workReady.wait(lock, [this] { return _exit || _numQueued > 0; });
+    if (_exit)
+      return;
+  }
+}
+
+bool JobSystem::RunBatch(int index)
+{
+  Batch batch;
+  bool found = false;
+
+  // Own queue first, newest batch as it's the most likely to be in the cache
+  {
+    Queue &queue = _queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.batches.empty())
+    {
+      batch = queue.batches.back();
+      queue.batches.pop_back();
+      found = true;
+    }
+  }
+
+  // Steal the oldest batch of the others
+  for (int i = 1; i < _numQueues && !found; ++i)
+  {
+    Queue &queue = _queues[(index + i) % _numQueues];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.batches.empty())
+    {
+      batch = queue.batches.front();
+      queue.batches.pop_front();
+      found = true;
+    }
+  }
+
+  if (!found)
+    return false;
+
+  --_numQueued;
+  (*batch.job)(batch.begin, batch.end);
+
+  // The loop may return right after this, don't touch the batch anymore
+  --*batch.remaining;
+  return true;
+}
@@ -0,0 +1,172 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <KernelTuner.h>
+
+#include <cstdio>
+#include <cstring>
+
+std::vector<KernelTuner::Config> KernelTuner::GetCandidates(int minSize, int maxSize, int maxTile, int sharedBytesPerItem)
+{
+  std::vector<Config> candidates;
+  if (!GLAD_GL_VERSION_4_3)
+    return candidates;
+
+  GLint maxInvocations = 0, maxSizeX = 0, maxSharedBytes = 0;
+  glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+  glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSizeX);
+  glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &maxSharedBytes);
+
+  for (int size = minSize; size <= maxSize && size <= maxInvocations && size <= maxSizeX; size *= 2)
+  {
+    for (int tile = 1; tile <= maxTile; tile *= 2)
+    {
+      if ((long long)size * tile * sharedBytesPerItem <= maxSharedBytes)
+        candidates.push_back({size, tile});
+    }
+  }
+
+  return candidates;
+}
+
+bool KernelTuner::Tune(const std::vector<Config> &candidates, const SetUpFunc &setUp, const RunFunc &run, int numRuns, Config &fastest)
+{
+  GLuint query = 0;
+  glGenQueries(1, &query);
+
+  double bestTime = 0.0;
+  bool found = false;
+  for (const Config &config : candidates)
+  {
+    if (!setUp(config))
+      continue;
+
+    // Let the driver finish any lazy work on the new kernel first
+    run();
+    run();
+
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    for (int i = 0; i < numRuns; ++i)
+      run();
+    glEndQuery(GL_TIME_ELAPSED);
+
+    // Waits for the GPU, we're only tuning at startup
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+    const double time = elapsed * 1e-6 / numRuns;
+    printf("  work group size %4i, tile %i: %.3fms\n", config.workGroupSize, config.tileSize, time);
+
+    if (!found || time < bestTime)
+    {
+      bestTime = time;
+      fastest = config;
+      found = true;
+    }
+  }
+
+  glDeleteQueries(1, &query);
+  return found;
+}
+
+bool KernelTuner::IsValid(const Config &config, int maxTile, int sharedBytesPerItem)
+{
+  if (!GLAD_GL_VERSION_4_3)
+    return false;
+
+  // Same constraints as the candidates, power of two sizes within the limits of the kernel and the GPU
+  auto isPowerOfTwo = [](int value) { return value > 0 && (value & (value - 1)) == 0; };
+  if (!isPowerOfTwo(config.workGroupSize) || !isPowerOfTwo(config.tileSize) || config.tileSize > maxTile)
+    return false;
+
+  GLint maxInvocations = 0, maxSizeX = 0, maxSharedBytes = 0;
+  glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+  glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSizeX);
+  glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &maxSharedBytes);
+  return config.workGroupSize <= maxInvocations && config.workGroupSize <= maxSizeX &&
+    (long long)config.workGroupSize * config.tileSize * sharedBytesPerItem <= maxSharedBytes;
+}
+
+std::string KernelTuner::GetDriverId()
+{
+  std::string id;
+  const GLenum driverStrings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+  for (GLenum name : driverStrings)
+  {
+    const char *value = reinterpret_cast<const char*>(glGetString(name));
+    if (!id.empty())
+      id += " | ";
+    id += value ? value : "";
+  }
+
+  // Keep it on a single line of the file
+  for (char &c : id)
+  {
+    if (c == '\n' || c == '\r')
+      c = ' ';
+  }
+  return id;
+}
+
+bool KernelTuner::Load(const char fileName[])
+{
+  FILE *file = fopen(fileName, "r");
+  if (!file)
+    return false;
+
+  // First line identifies the driver the configurations were tuned with
+  char line[1024];
+  const std::string driverId = GetDriverId();
+  if (!fgets(line, sizeof(line), file) || strncmp(line, driverId.c_str(), driverId.size()) != 0 || (line[driverId.size()] != '\n' && line[driverId.size()] != '\0'))
+  {
+    printf("Kernel tuning file %s is from a different GPU or driver\n", fileName);
+    fclose(file);
+    return false;
+  }
+
+  _configs.clear();
+  while (fgets(line, sizeof(line), file))
+  {
+    char name[256];
+    Config config;
+    if (sscanf(line, "%255s %i %i", name, &config.workGroupSize, &config.tileSize) == 3)
+      _configs[name] = config;
+  }
+
+  fclose(file);
+  return true;
+}
+
+bool KernelTuner::Save(const char fileName[]) const
+{
+  FILE *file = fopen(fileName, "w");
+  if (!file)
+  {
+    printf("Failed to write the kernel tuning file %s\n", fileName);
+    return false;
+  }
+
+  fprintf(file, "%s\n", GetDriverId().c_str());
+  for (const auto &config : _configs)
+    fprintf(file, "%s %i %i\n", config.first.c_str(), config.second.workGroupSize, config.second.tileSize);
+
+  return fclose(file) == 0;
+}
+
+bool KernelTuner::Get(const char name[], int maxTile, int sharedBytesPerItem, Config &config) const
+{
+  auto it = _configs.find(name);
+  if (it == _configs.end())
+    return false;
+
+  // Ignore what the kernel can't run, it keeps its default configuration then
+  if (!IsValid(it->second, maxTile, sharedBytesPerItem))
+  {
+    printf("Ignoring invalid kernel configuration %s: work group size %i, tile %i\n", name, it->second.workGroupSize, it->second.tileSize);
+    return false;
+  }
+
+  config = it->second;
+  return true;
+}
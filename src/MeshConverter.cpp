@@ -0,0 +1,267 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <MeshConverter.h>
+#include <MeshFile.h>
+#include <MeshOptimizer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <glm/glm.hpp>
+
+// Turn the 1 based or negative relative OBJ index to 0 based one, -1 if it's missing or out of range
+static int resolveObjIndex(int index, size_t count)
+{
+  if (index > 0)
+    return index <= (int)count ? index - 1 : -1;
+  if (index < 0)
+    return -index <= (int)count ? (int)count + index : -1;
+  return -1;
+}
+
+bool MeshConverter::ConvertObj(const char *objName, const char *meshName, bool fitUnitCube)
+{
+  FILE *file = fopen(objName, "r");
+  if (!file)
+  {
+    printf("Failed to open the OBJ file %s\n", objName);
+    return false;
+  }
+
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec2> uvs;
+  std::vector<glm::vec3> normals;
+
+  // Vertices are the unique combinations of the position, texture coordinate, and normal indices
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb;
+  std::vector<GLuint> ib;
+  std::map<std::tuple<int, int, int>, GLuint> vertexMap;
+  // Position index of each vertex and whether the file gave it a normal
+  std::vector<int> vertexPositions;
+  std::vector<bool> hasNormal;
+
+  char line[4096];
+  std::vector<GLuint> polygon;
+  int numSkipped = 0;
+  while (fgets(line, sizeof(line), file))
+  {
+    if (strncmp(line, "v ", 2) == 0)
+    {
+      glm::vec3 p(0.0f);
+      sscanf(line + 2, "%f %f %f", &p.x, &p.y, &p.z);
+      positions.push_back(p);
+    }
+    else if (strncmp(line, "vt ", 3) == 0)
+    {
+      glm::vec2 uv(0.0f);
+      sscanf(line + 3, "%f %f", &uv.x, &uv.y);
+      uvs.push_back(uv);
+    }
+    else if (strncmp(line, "vn ", 3) == 0)
+    {
+      glm::vec3 n(0.0f);
+      sscanf(line + 3, "%f %f %f", &n.x, &n.y, &n.z);
+      normals.push_back(n);
+    }
+    else if (strncmp(line, "f ", 2) == 0)
+    {
+      polygon.clear();
+      bool valid = true;
+      for (char *token = strtok(line + 2, " \t\r\n"); token; token = strtok(nullptr, " \t\r\n"))
+      {
+        // Corners are v, v/vt, v//vn, or v/vt/vn
+        int v = 0, t = 0, n = 0;
+        if (sscanf(token, "%d/%d/%d", &v, &t, &n) != 3 && sscanf(token, "%d//%d", &v, &n) != 2 && sscanf(token, "%d/%d", &v, &t) != 2)
+          sscanf(token, "%d", &v);
+
+        std::tuple<int, int, int> key(resolveObjIndex(v, positions.size()), resolveObjIndex(t, uvs.size()), resolveObjIndex(n, normals.size()));
+        if (std::get<0>(key) < 0)
+        {
+          valid = false;
+          break;
+        }
+
+        auto it = vertexMap.find(key);
+        if (it == vertexMap.end())
+        {
+          const glm::vec3 &p = positions[std::get<0>(key)];
+          glm::vec2 uv = std::get<1>(key) >= 0 ? uvs[std::get<1>(key)] : glm::vec2(0.0f);
+          glm::vec3 normal = std::get<2>(key) >= 0 ? normals[std::get<2>(key)] : glm::vec3(0.0f);
+          it = vertexMap.insert(std::make_pair(key, (GLuint)vb.size())).first;
+          vb.push_back({p.x, p.y, p.z, normal.x, normal.y, normal.z, 0.0f, 0.0f, 0.0f, uv.x, uv.y});
+          vertexPositions.push_back(std::get<0>(key));
+          hasNormal.push_back(glm::length(normal) > 0.0f);
+        }
+        polygon.push_back(it->second);
+      }
+
+      if (!valid || polygon.size() < 3)
+      {
+        ++numSkipped;
+        continue;
+      }
+
+      for (size_t i = 2; i < polygon.size(); ++i)
+        ib.insert(ib.end(), {polygon[0], polygon[i - 1], polygon[i]});
+    }
+  }
+  fclose(file);
+
+  if (numSkipped > 0)
+    printf("Skipped %i invalid faces of the OBJ file %s\n", numSkipped, objName);
+  if (ib.empty())
+  {
+    printf("No triangles in the OBJ file %s\n", objName);
+    return false;
+  }
+
+  // Smooth normals of the vertices without them are the area weighted face normals around their positions
+  std::vector<glm::vec3> positionNormals(positions.size(), glm::vec3(0.0f));
+  std::vector<glm::vec3> tangents(vb.size(), glm::vec3(0.0f));
+  for (size_t i = 0; i < ib.size(); i += 3)
+  {
+    const Vertex_Pos_Nrm_Tgt_Tex *v[3] = {&vb[ib[i]], &vb[ib[i + 1]], &vb[ib[i + 2]]};
+    glm::vec3 e1 = glm::vec3(v[1]->x, v[1]->y, v[1]->z) - glm::vec3(v[0]->x, v[0]->y, v[0]->z);
+    glm::vec3 e2 = glm::vec3(v[2]->x, v[2]->y, v[2]->z) - glm::vec3(v[0]->x, v[0]->y, v[0]->z);
+    glm::vec3 faceNormal = glm::cross(e1, e2);
+    for (int k = 0; k < 3; ++k)
+      positionNormals[vertexPositions[ib[i + k]]] += faceNormal;
+
+    // Tangent follows the U direction of the texture coordinates
+    glm::vec2 d1(v[1]->u - v[0]->u, v[1]->v - v[0]->v);
+    glm::vec2 d2(v[2]->u - v[0]->u, v[2]->v - v[0]->v);
+    float det = d1.x * d2.y - d2.x * d1.y;
+    if (fabsf(det) > 1e-12f)
+    {
+      glm::vec3 tangent = (e1 * d2.y - e2 * d1.y) / det;
+      for (int k = 0; k < 3; ++k)
+        tangents[ib[i + k]] += tangent;
+    }
+  }
+
+  for (size_t i = 0; i < vb.size(); ++i)
+  {
+    Vertex_Pos_Nrm_Tgt_Tex &vertex = vb[i];
+    glm::vec3 normal(vertex.nx, vertex.ny, vertex.nz);
+    if (hasNormal[i])
+      normal = glm::normalize(normal);
+    else
+    {
+      const glm::vec3 &n = positionNormals[vertexPositions[i]];
+      normal = glm::length(n) > 0.0f ? glm::normalize(n) : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+
+    // Orthogonalize the tangent, pick any perpendicular direction without usable texture coordinates
+    glm::vec3 tangent = tangents[i] - normal * glm::dot(normal, tangents[i]);
+    if (glm::length(tangent) < 1e-6f)
+      tangent = glm::cross(normal, fabsf(normal.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f));
+    tangent = glm::normalize(tangent);
+
+    vertex.nx = normal.x; vertex.ny = normal.y; vertex.nz = normal.z;
+    vertex.tx = tangent.x; vertex.ty = tangent.y; vertex.tz = tangent.z;
+  }
+
+  if (fitUnitCube)
+  {
+    glm::vec3 minBounds(vb[0].x, vb[0].y, vb[0].z);
+    glm::vec3 maxBounds = minBounds;
+    for (const Vertex_Pos_Nrm_Tgt_Tex &vertex : vb)
+    {
+      minBounds = glm::min(minBounds, glm::vec3(vertex.x, vertex.y, vertex.z));
+      maxBounds = glm::max(maxBounds, glm::vec3(vertex.x, vertex.y, vertex.z));
+    }
+
+    glm::vec3 center = 0.5f * (minBounds + maxBounds);
+    glm::vec3 extent = maxBounds - minBounds;
+    float scale = 1.0f / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f));
+    for (Vertex_Pos_Nrm_Tgt_Tex &vertex : vb)
+    {
+      vertex.x = (vertex.x - center.x) * scale;
+      vertex.y = (vertex.y - center.y) * scale;
+      vertex.z = (vertex.z - center.z) * scale;
+    }
+  }
+
+  return Convert(vb, ib, meshName);
+}
+
+bool MeshConverter::Convert(std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, std::vector<GLuint> &ib, const char *meshName)
+{
+  if (vb.empty() || ib.empty())
+    return false;
+
+  const float sourceACMR = MeshOptimizer::GetACMR(ib.data(), ib.size(), vb.size());
+  std::vector<MeshLod> lods(1, {0, (GLsizei)ib.size(), 0});
+  std::vector<GLuint> remap;
+  MeshOptimizer::Optimize(ib, lods, &vb[0].x, sizeof(Vertex_Pos_Nrm_Tgt_Tex), vb.size(), remap);
+  MeshOptimizer::RemapVertices(vb, remap);
+
+  // Shadow volumes need the neighbours across the attribute seams, i.e., over the welded positions
+  std::vector<Vertex_Pos> positions;
+  std::vector<GLuint> weldedIb;
+  std::vector<GLuint> adjacencyIb;
+  WeldPositions(vb, ib, positions, weldedIb);
+  BuildAdjacency(weldedIb, adjacencyIb);
+
+  printf("Converted %s: %i vertices, %i triangles, ACMR %.2f -> %.2f, %i welded positions\n", meshName, (int)vb.size(), (int)ib.size() / 3,
+         sourceACMR, MeshOptimizer::GetACMR(ib.data(), ib.size(), vb.size()), (int)positions.size());
+  return MeshFile::Write(meshName, vb, ib, lods, positions, adjacencyIb);
+}
+
+void MeshConverter::WeldPositions(const std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, const std::vector<GLuint> &ib,
+                                  std::vector<Vertex_Pos> &positions, std::vector<GLuint> &weldedIb)
+{
+  std::map<std::tuple<float, float, float>, GLuint> positionMap;
+  std::vector<GLuint> welded(vb.size());
+  positions.clear();
+  for (size_t i = 0; i < vb.size(); ++i)
+  {
+    auto it = positionMap.insert(std::make_pair(std::make_tuple(vb[i].x, vb[i].y, vb[i].z), (GLuint)positions.size())).first;
+    if (it->second == positions.size())
+      positions.push_back({vb[i].x, vb[i].y, vb[i].z});
+    welded[i] = it->second;
+  }
+
+  weldedIb.resize(ib.size());
+  for (size_t i = 0; i < ib.size(); ++i)
+    weldedIb[i] = welded[ib[i]];
+}
+
+void MeshConverter::BuildAdjacency(const std::vector<GLuint> &ib, std::vector<GLuint> &adjacencyIb)
+{
+  // Vertex opposite to each directed edge, the neighbouring triangle has the same edge in the other direction
+  auto edgeKey = [](GLuint a, GLuint b) { return ((unsigned long long)a << 32) | b; };
+  std::unordered_map<unsigned long long, GLuint> opposite;
+  opposite.reserve(ib.size());
+  for (size_t i = 0; i < ib.size(); i += 3)
+  {
+    for (int k = 0; k < 3; ++k)
+      opposite[edgeKey(ib[i + k], ib[i + (k + 1) % 3])] = ib[i + (k + 2) % 3];
+  }
+
+  adjacencyIb.clear();
+  adjacencyIb.reserve(2 * ib.size());
+  for (size_t i = 0; i < ib.size(); i += 3)
+  {
+    // Triangles collapsed by the welding would only make degenerate volumes
+    if (ib[i] == ib[i + 1] || ib[i + 1] == ib[i + 2] || ib[i + 2] == ib[i])
+      continue;
+
+    // Each vertex is followed by the vertex adjacent to the edge starting at it
+    for (int k = 0; k < 3; ++k)
+    {
+      GLuint a = ib[i + k];
+      GLuint b = ib[i + (k + 1) % 3];
+      auto it = opposite.find(edgeKey(b, a));
+      adjacencyIb.push_back(a);
+      adjacencyIb.push_back(it != opposite.end() ? it->second : ib[i + (k + 2) % 3]);
+    }
+  }
+}
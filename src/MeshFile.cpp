@@ -0,0 +1,252 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <MeshFile.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const char MeshFile::MAGIC[4] = {'M', 'E', 'S', 'H'};
+
+MeshFile::~MeshFile()
+{
+  Close();
+}
+
+bool MeshFile::Open(const char *fileName)
+{
+  Close();
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  _fileHandle = file;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(Header))
+  {
+    Close();
+    return false;
+  }
+  _size = (size_t)size.QuadPart;
+
+  _mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (_mappingHandle)
+    _data = static_cast<const unsigned char *>(MapViewOfFile(_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+#else
+  int file = open(fileName, O_RDONLY);
+  if (file < 0)
+    return false;
+
+  struct stat info;
+  if (fstat(file, &info) == 0 && info.st_size >= (off_t)sizeof(Header))
+  {
+    _size = (size_t)info.st_size;
+    void *data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data != MAP_FAILED)
+      _data = static_cast<const unsigned char *>(data);
+  }
+
+  // The mapping stays valid without the descriptor
+  close(file);
+#endif
+
+  if (!_data)
+  {
+    printf("Failed to map the mesh file %s\n", fileName);
+    Close();
+    return false;
+  }
+
+  // Locate the blocks and check that they all fit in the file
+  _header = reinterpret_cast<const Header *>(_data);
+  const Header &header = *_header;
+  bool valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.version == VERSION &&
+    (header.indexSize == sizeof(GLushort) || header.indexSize == sizeof(GLuint)) && header.numLods > 0;
+
+  size_t offset = sizeof(Header);
+  const size_t blockSizes[] = {
+    header.numLods * sizeof(MeshLod), header.numVertices * sizeof(Vertex_Pos_Nrm_Tgt_Tex), header.numIndices * (size_t)header.indexSize,
+    header.numAdjacencyVertices * sizeof(Vertex_Pos), header.numAdjacencyIndices * sizeof(GLuint)
+  };
+  const void *blocks[5];
+  for (int i = 0; i < 5 && valid; ++i)
+  {
+    blocks[i] = _data + offset;
+    offset += GetBlockSize(blockSizes[i]);
+    valid = offset <= _size;
+  }
+
+  if (valid)
+  {
+    _lods = static_cast<const MeshLod *>(blocks[0]);
+    _vertices = static_cast<const Vertex_Pos_Nrm_Tgt_Tex *>(blocks[1]);
+    _indices = blocks[2];
+    _adjacencyVertices = static_cast<const Vertex_Pos *>(blocks[3]);
+    _adjacencyIndices = static_cast<const GLuint *>(blocks[4]);
+
+    // The ranges must stay within the blocks
+    for (unsigned int lod = 0; lod < header.numLods && valid; ++lod)
+      valid = _lods[lod].indexCount >= 0 && _lods[lod].baseVertex >= 0 &&
+              (size_t)_lods[lod].firstIndex + _lods[lod].indexCount <= header.numIndices && (unsigned int)_lods[lod].baseVertex < header.numVertices;
+
+    // So must the indices, they go straight to the GPU and the adjacency is read by the extrusion compute shader too
+    auto getIndex = [&header, this](size_t i) -> size_t
+    {
+      return header.indexSize == sizeof(GLushort) ? static_cast<const GLushort *>(_indices)[i] : static_cast<const GLuint *>(_indices)[i];
+    };
+    for (unsigned int lod = 0; lod < header.numLods && valid; ++lod)
+    {
+      const MeshLod &range = _lods[lod];
+      for (GLsizei i = 0; i < range.indexCount && valid; ++i)
+        valid = (size_t)range.baseVertex + getIndex(range.firstIndex + i) < header.numVertices;
+    }
+    for (unsigned int i = 0; i < header.numAdjacencyIndices && valid; ++i)
+      valid = _adjacencyIndices[i] < header.numAdjacencyVertices;
+  }
+
+  if (!valid)
+  {
+    printf("Invalid mesh file %s\n", fileName);
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+void MeshFile::Close()
+{
+#ifdef _WIN32
+  if (_data)
+    UnmapViewOfFile(_data);
+  if (_mappingHandle)
+    CloseHandle(_mappingHandle);
+  if (_fileHandle)
+    CloseHandle(_fileHandle);
+  _fileHandle = nullptr;
+  _mappingHandle = nullptr;
+#else
+  if (_data)
+    munmap(const_cast<unsigned char *>(_data), _size);
+#endif
+
+  _data = nullptr;
+  _size = 0;
+  _header = nullptr;
+  _lods = nullptr;
+  _vertices = nullptr;
+  _indices = nullptr;
+  _adjacencyVertices = nullptr;
+  _adjacencyIndices = nullptr;
+}
+
+bool MeshFile::Write(const char *fileName, const std::vector<Vertex_Pos_Nrm_Tgt_Tex> &vb, const std::vector<GLuint> &ib,
+                     const std::vector<MeshLod> &lods, const std::vector<Vertex_Pos> &adjacencyVb, const std::vector<GLuint> &adjacencyIb)
+{
+  FILE *file = fopen(fileName, "wb");
+  if (!file)
+  {
+    printf("Failed to create the mesh file %s\n", fileName);
+    return false;
+  }
+
+  // Indices are relative to the base vertices of the ranges, store them in 16 bits when possible
+  const bool shortIndices = !ib.empty() && *std::max_element(ib.begin(), ib.end()) <= 0xffff;
+  std::vector<GLushort> shortIb;
+  if (shortIndices)
+  {
+    shortIb.reserve(ib.size());
+    for (GLuint index : ib)
+      shortIb.push_back((GLushort)index);
+  }
+
+  Header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.numLods = (unsigned int)lods.size();
+  header.numVertices = (unsigned int)vb.size();
+  header.numIndices = (unsigned int)ib.size();
+  header.indexSize = shortIndices ? sizeof(GLushort) : sizeof(GLuint);
+  header.numAdjacencyVertices = (unsigned int)adjacencyVb.size();
+  header.numAdjacencyIndices = (unsigned int)adjacencyIb.size();
+
+  const void *blocks[] = {&header, lods.data(), vb.data(), shortIndices ? (const void *)shortIb.data() : ib.data(), adjacencyVb.data(), adjacencyIb.data()};
+  const size_t blockSizes[] = {
+    sizeof(Header), lods.size() * sizeof(MeshLod), vb.size() * sizeof(Vertex_Pos_Nrm_Tgt_Tex), ib.size() * (size_t)header.indexSize,
+    adjacencyVb.size() * sizeof(Vertex_Pos), adjacencyIb.size() * sizeof(GLuint)
+  };
+
+  bool written = true;
+  const unsigned char padding[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 6 && written; ++i)
+  {
+    if (blockSizes[i] > 0)
+      written = fwrite(blocks[i], 1, blockSizes[i], file) == blockSizes[i];
+    size_t paddingSize = GetBlockSize(blockSizes[i]) - blockSizes[i];
+    if (paddingSize > 0 && written)
+      written = fwrite(padding, 1, paddingSize, file) == paddingSize;
+  }
+
+  fclose(file);
+  if (!written)
+  {
+    printf("Failed to write the mesh file %s\n", fileName);
+    remove(fileName);
+  }
+  return written;
+}
+
+Mesh<Vertex_Pos_Nrm_Tgt_Tex> *MeshFile::CreateMesh() const
+{
+  if (!_header)
+    return nullptr;
+
+  Mesh<Vertex_Pos_Nrm_Tgt_Tex> *mesh = new Mesh<Vertex_Pos_Nrm_Tgt_Tex>();
+  mesh->Init(_vertices, _header->numVertices, _indices, _header->numIndices,
+             _header->indexSize == sizeof(GLushort) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT,
+             std::vector<MeshLod>(_lods, _lods + _header->numLods));
+  return mesh;
+}
+
+Mesh<Vertex_Pos> *MeshFile::CreateAdjacencyMesh() const
+{
+  if (!HasAdjacency())
+    return nullptr;
+
+  Mesh<Vertex_Pos> *mesh = new Mesh<Vertex_Pos>();
+  mesh->Init(_adjacencyVertices, _header->numAdjacencyVertices, _adjacencyIndices, _header->numAdjacencyIndices, GL_UNSIGNED_INT,
+             std::vector<MeshLod>(1, {0, (GLsizei)_header->numAdjacencyIndices, 0}));
+  return mesh;
+}
+
+MeshLod MeshFile::AddTo(MeshPool<Vertex_Pos_Nrm_Tgt_Tex> &pool) const
+{
+  if (!_header)
+    return {0, 0, 0};
+
+  // The pool keeps 32 bit indices relative to the start of the added vertices
+  const MeshLod &lod = _lods[0];
+  std::vector<Vertex_Pos_Nrm_Tgt_Tex> vb(_vertices + lod.baseVertex, _vertices + _header->numVertices);
+  std::vector<GLuint> ib(lod.indexCount);
+  for (GLsizei i = 0; i < lod.indexCount; ++i)
+  {
+    ib[i] = _header->indexSize == sizeof(GLushort) ? static_cast<const GLushort *>(_indices)[lod.firstIndex + i] :
+                                                     static_cast<const GLuint *>(_indices)[lod.firstIndex + i];
+  }
+  return pool.Add(vb, ib);
+}
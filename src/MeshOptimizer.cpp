@@ -0,0 +1,351 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <MeshOptimizer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+
+// Scoring constants of the vertex cache optimization as proposed by Forsyth
+static const float CACHE_DECAY_POWER = 1.5f;
+static const float LAST_TRIANGLE_SCORE = 0.75f;
+static const float VALENCE_BOOST_SCALE = 2.0f;
+static const float VALENCE_BOOST_POWER = 0.5f;
+
+// Marks the vertices not yet renumbered
+static const GLuint INVALID_INDEX = 0xffffffff;
+
+// Score of the vertex, the higher the sooner its triangles should be emitted
+static float getVertexScore(int cachePosition, int remainingTriangles)
+{
+  // Nothing to emit anymore
+  if (remainingTriangles == 0)
+    return -1.0f;
+
+  float score = 0.0f;
+  if (cachePosition >= 0)
+  {
+    // The vertices of the last triangle get a fixed score so that the strip like order isn't preferred too much
+    if (cachePosition < 3)
+      score = LAST_TRIANGLE_SCORE;
+    else
+      score = powf(1.0f - (float)(cachePosition - 3) / (MeshOptimizer::CACHE_SIZE - 3), CACHE_DECAY_POWER);
+  }
+
+  // Prefer the vertices with few triangles left so that they don't stay alone
+  score += VALENCE_BOOST_SCALE * powf((float)remainingTriangles, -VALENCE_BOOST_POWER);
+  return score;
+}
+
+// Position of the vertex
+static glm::vec3 getPosition(const float *positions, size_t stride, GLuint vertex)
+{
+  const float *p = reinterpret_cast<const float *>(reinterpret_cast<const char *>(positions) + vertex * stride);
+  return glm::vec3(p[0], p[1], p[2]);
+}
+
+void MeshOptimizer::Optimize(std::vector<GLuint> &indices, std::vector<MeshLod> &ranges, const float *positions, size_t stride, size_t numVertices,
+                             std::vector<GLuint> &remap)
+{
+  for (const MeshLod &range : ranges)
+  {
+    GLuint *rangeIndices = &indices[range.firstIndex];
+    const float *rangePositions = reinterpret_cast<const float *>(reinterpret_cast<const char *>(positions) + range.baseVertex * stride);
+    size_t rangeVertices = numVertices - range.baseVertex;
+    OptimizeVertexCache(rangeIndices, range.indexCount, rangeVertices);
+    OptimizeOverdraw(rangeIndices, range.indexCount, rangePositions, stride, rangeVertices);
+  }
+
+  OptimizeVertexFetch(indices, ranges, numVertices, remap);
+}
+
+void MeshOptimizer::OptimizeVertexCache(GLuint *indices, size_t numIndices, size_t numVertices)
+{
+  const size_t numTriangles = numIndices / 3;
+  if (numTriangles == 0)
+    return;
+
+  // Triangles using each vertex, the ones already emitted are moved past the remaining count
+  std::vector<int> remaining(numVertices, 0);
+  for (size_t i = 0; i < numTriangles * 3; ++i)
+    ++remaining[indices[i]];
+
+  std::vector<size_t> firstTriangle(numVertices + 1, 0);
+  for (size_t v = 0; v < numVertices; ++v)
+    firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+
+  std::vector<GLuint> vertexTriangles(numTriangles * 3);
+  std::vector<size_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+  for (size_t t = 0; t < numTriangles; ++t)
+  {
+    for (int k = 0; k < 3; ++k)
+      vertexTriangles[fill[indices[3 * t + k]]++] = (GLuint)t;
+  }
+
+  // Initial scores with the cache empty
+  std::vector<int> cachePosition(numVertices, -1);
+  std::vector<float> vertexScore(numVertices);
+  for (size_t v = 0; v < numVertices; ++v)
+    vertexScore[v] = getVertexScore(-1, remaining[v]);
+
+  std::vector<float> triangleScore(numTriangles);
+  std::vector<bool> emitted(numTriangles, false);
+  int best = 0;
+  for (size_t t = 0; t < numTriangles; ++t)
+  {
+    triangleScore[t] = vertexScore[indices[3 * t]] + vertexScore[indices[3 * t + 1]] + vertexScore[indices[3 * t + 2]];
+    if (triangleScore[t] > triangleScore[best])
+      best = (int)t;
+  }
+
+  // The cache holds 3 more vertices while the new triangle is being put in
+  GLuint cache[CACHE_SIZE + 3];
+  GLuint newCache[CACHE_SIZE + 3];
+  int cacheCount = 0;
+
+  std::vector<GLuint> output;
+  output.reserve(numTriangles * 3);
+  size_t cursor = 0;
+  while (output.size() < numTriangles * 3)
+  {
+    // Nothing in the cache has any triangles left, continue with the first triangle not emitted yet
+    if (best < 0)
+    {
+      while (emitted[cursor])
+        ++cursor;
+      best = (int)cursor;
+    }
+
+    const GLuint *triangle = indices + 3 * best;
+    emitted[best] = true;
+    output.insert(output.end(), triangle, triangle + 3);
+
+    // Remove the triangle from its vertices and put them to the front of the cache
+    int newCount = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+      GLuint v = triangle[k];
+      auto begin = vertexTriangles.begin() + firstTriangle[v];
+      auto end = begin + remaining[v];
+      std::iter_swap(std::find(begin, end, (GLuint)best), end - 1);
+      --remaining[v];
+
+      if (std::find(newCache, newCache + newCount, v) == newCache + newCount)
+        newCache[newCount++] = v;
+    }
+
+    for (int i = 0; i < cacheCount; ++i)
+    {
+      GLuint v = cache[i];
+      if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+        newCache[newCount++] = v;
+    }
+
+    // Update the scores, the vertices past the cache size fall out
+    for (int i = 0; i < newCount; ++i)
+    {
+      GLuint v = newCache[i];
+      cachePosition[v] = i < CACHE_SIZE ? i : -1;
+      vertexScore[v] = getVertexScore(cachePosition[v], remaining[v]);
+    }
+
+    cacheCount = newCount < CACHE_SIZE ? newCount : CACHE_SIZE;
+    std::copy(newCache, newCache + cacheCount, cache);
+
+    // Only the triangles of the touched vertices changed, the best of them goes next
+    best = -1;
+    float bestScore = 0.0f;
+    for (int i = 0; i < newCount; ++i)
+    {
+      GLuint v = newCache[i];
+      for (size_t j = firstTriangle[v], end = firstTriangle[v] + remaining[v]; j < end; ++j)
+      {
+        GLuint t = vertexTriangles[j];
+        const GLuint *tri = indices + 3 * t;
+        triangleScore[t] = vertexScore[tri[0]] + vertexScore[tri[1]] + vertexScore[tri[2]];
+        if (triangleScore[t] > bestScore)
+        {
+          bestScore = triangleScore[t];
+          best = (int)t;
+        }
+      }
+    }
+  }
+
+  std::copy(output.begin(), output.end(), indices);
+}
+
+void MeshOptimizer::OptimizeOverdraw(GLuint *indices, size_t numIndices, const float *positions, size_t stride, size_t numVertices,
+                                     float threshold)
+{
+  const size_t numTriangles = numIndices / 3;
+  if (numTriangles < 2)
+    return;
+
+  // Cache misses of each triangle in the current order, FIFO cache simulated by the timestamps of the vertices
+  std::vector<size_t> timestamp(numVertices, 0);
+  size_t time = CACHE_SIZE + 1;
+  std::vector<int> misses(numTriangles, 0);
+  for (size_t t = 0; t < numTriangles; ++t)
+  {
+    for (int k = 0; k < 3; ++k)
+    {
+      GLuint v = indices[3 * t + k];
+      if (time - timestamp[v] > (size_t)CACHE_SIZE)
+      {
+        timestamp[v] = time++;
+        ++misses[t];
+      }
+    }
+  }
+
+  // Triangles missing all vertices start over with a cold cache anyway, those are the hard cluster boundaries, the
+  // clusters are further split wherever the cache efficiency got close enough to the one of the whole hard cluster
+  std::vector<size_t> clusters;
+  for (size_t start = 0; start < numTriangles;)
+  {
+    size_t end = start + 1;
+    int hardMisses = misses[start];
+    while (end < numTriangles && misses[end] < 3)
+      hardMisses += misses[end++];
+    const float hardACMR = (float)hardMisses / (end - start);
+
+    // Every soft cluster starts with a cold cache as it may follow any other after the sort
+    size_t softStart = start;
+    int softMisses = 0;
+    time += CACHE_SIZE + 1;
+    for (size_t t = start; t < end; ++t)
+    {
+      for (int k = 0; k < 3; ++k)
+      {
+        GLuint v = indices[3 * t + k];
+        if (time - timestamp[v] > (size_t)CACHE_SIZE)
+        {
+          timestamp[v] = time++;
+          ++softMisses;
+        }
+      }
+
+      if (t + 1 < end && (float)softMisses / (t + 1 - softStart) <= threshold * hardACMR)
+      {
+        clusters.push_back(softStart);
+        softStart = t + 1;
+        softMisses = 0;
+        time += CACHE_SIZE + 1;
+      }
+    }
+
+    clusters.push_back(softStart);
+    start = end;
+  }
+  clusters.push_back(numTriangles);
+
+  // Area weighted centroids and normals of the clusters and of the whole mesh
+  const size_t numClusters = clusters.size() - 1;
+  std::vector<glm::vec3> centroids(numClusters, glm::vec3(0.0f));
+  std::vector<glm::vec3> normals(numClusters, glm::vec3(0.0f));
+  glm::vec3 meshCentroid(0.0f);
+  float meshArea = 0.0f;
+  for (size_t c = 0; c < numClusters; ++c)
+  {
+    float area = 0.0f;
+    for (size_t t = clusters[c]; t < clusters[c + 1]; ++t)
+    {
+      glm::vec3 p0 = getPosition(positions, stride, indices[3 * t]);
+      glm::vec3 p1 = getPosition(positions, stride, indices[3 * t + 1]);
+      glm::vec3 p2 = getPosition(positions, stride, indices[3 * t + 2]);
+      glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+      float a = glm::length(n);
+      centroids[c] += (p0 + p1 + p2) * (a / 3.0f);
+      normals[c] += n;
+      area += a;
+    }
+
+    meshCentroid += centroids[c];
+    meshArea += area;
+    if (area > 0.0f)
+      centroids[c] /= area;
+  }
+
+  if (meshArea > 0.0f)
+    meshCentroid /= meshArea;
+
+  // Clusters facing away from the center are likely to occlude the rest, draw them first
+  std::vector<float> sortKeys(numClusters);
+  for (size_t c = 0; c < numClusters; ++c)
+  {
+    float length = glm::length(normals[c]);
+    sortKeys[c] = length > 0.0f ? glm::dot(centroids[c] - meshCentroid, normals[c] / length) : 0.0f;
+  }
+
+  std::vector<size_t> order(numClusters);
+  for (size_t c = 0; c < numClusters; ++c)
+    order[c] = c;
+  std::stable_sort(order.begin(), order.end(), [&sortKeys](size_t a, size_t b) { return sortKeys[a] > sortKeys[b]; });
+
+  std::vector<GLuint> output;
+  output.reserve(numTriangles * 3);
+  for (size_t c : order)
+    output.insert(output.end(), indices + 3 * clusters[c], indices + 3 * clusters[c + 1]);
+  std::copy(output.begin(), output.end(), indices);
+}
+
+void MeshOptimizer::OptimizeVertexFetch(std::vector<GLuint> &indices, std::vector<MeshLod> &ranges, size_t numVertices, std::vector<GLuint> &remap)
+{
+  // Number the vertices in the order the ranges first reference them
+  remap.assign(numVertices, INVALID_INDEX);
+  GLuint next = 0;
+  for (MeshLod &range : ranges)
+  {
+    GLuint base = INVALID_INDEX;
+    for (GLsizei i = 0; i < range.indexCount; ++i)
+    {
+      GLuint &index = indices[range.firstIndex + i];
+      GLuint v = index + range.baseVertex;
+      if (remap[v] == INVALID_INDEX)
+        remap[v] = next++;
+      index = remap[v];
+      base = std::min(base, index);
+    }
+
+    // Keep the indices relative to the first vertex of the range
+    if (base == INVALID_INDEX)
+      continue;
+    for (GLsizei i = 0; i < range.indexCount; ++i)
+      indices[range.firstIndex + i] -= base;
+    range.baseVertex = (GLint)base;
+  }
+
+  // Unused vertices go last
+  for (size_t v = 0; v < numVertices; ++v)
+  {
+    if (remap[v] == INVALID_INDEX)
+      remap[v] = next++;
+  }
+}
+
+float MeshOptimizer::GetACMR(const GLuint *indices, size_t numIndices, size_t numVertices, int cacheSize)
+{
+  const size_t numTriangles = numIndices / 3;
+  if (numTriangles == 0)
+    return 0.0f;
+
+  // FIFO cache, a vertex is cached unless more than cacheSize other vertices were loaded since its own load
+  std::vector<size_t> timestamp(numVertices, 0);
+  size_t time = cacheSize + 1;
+  size_t misses = 0;
+  for (size_t i = 0; i < numTriangles * 3; ++i)
+  {
+    GLuint v = indices[i];
+    if (time - timestamp[v] > (size_t)cacheSize)
+    {
+      timestamp[v] = time++;
+      ++misses;
+    }
+  }
+
+  return (float)misses / numTriangles;
+}
@@ -0,0 +1,119 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <OverdrawCounter.h>
+
+OverdrawCounter::~OverdrawCounter()
+{
+  Release();
+}
+
+void OverdrawCounter::Init()
+{
+  // Check if already initialized and return
+  if (_initialized)
+    return;
+
+  for (int i = 0; i < NUM_FRAMES; ++i)
+  {
+    glGenQueries(MAX_QUERIES, _frames[i].queries);
+    _frames[i].targetSamples = 0;
+    _frames[i].numQueries = 0;
+    _frames[i].overflow = false;
+    _frames[i].pending = false;
+  }
+
+  _samples = 0;
+  _overdraw = -1.0;
+  _initialized = true;
+}
+
+void OverdrawCounter::Release()
+{
+  if (!_initialized)
+    return;
+
+  for (int i = 0; i < NUM_FRAMES; ++i)
+    glDeleteQueries(MAX_QUERIES, _frames[i].queries);
+
+  _counting = false;
+  _initialized = false;
+}
+
+void OverdrawCounter::BeginFrame()
+{
+  if (!_initialized)
+    return;
+
+  // Move to the oldest frame in the ring and try to read it back before reusing it
+  _frameIndex = (_frameIndex + 1) % NUM_FRAMES;
+  Frame &frame = _frames[_frameIndex];
+  if (frame.pending)
+    ReadBack(frame);
+
+  frame.numQueries = 0;
+  frame.overflow = false;
+  frame.pending = false;
+}
+
+void OverdrawCounter::EndFrame(GLint64 targetSamples)
+{
+  if (!_initialized)
+    return;
+
+  // Close the range left open so that the frame can be read back
+  if (_counting)
+    End();
+
+  Frame &frame = _frames[_frameIndex];
+  frame.targetSamples = targetSamples;
+  frame.pending = frame.numQueries > 0 && !frame.overflow;
+}
+
+void OverdrawCounter::Begin()
+{
+  if (!_initialized || _counting)
+    return;
+
+  Frame &frame = _frames[_frameIndex];
+  if (frame.numQueries >= MAX_QUERIES)
+  {
+    frame.overflow = true;
+    return;
+  }
+
+  glBeginQuery(GL_SAMPLES_PASSED, frame.queries[frame.numQueries++]);
+  _counting = true;
+}
+
+void OverdrawCounter::End()
+{
+  if (!_counting)
+    return;
+
+  glEndQuery(GL_SAMPLES_PASSED);
+  _counting = false;
+}
+
+void OverdrawCounter::ReadBack(Frame &frame)
+{
+  // Queries finish in order, if the last one is available the rest is as well
+  GLint available = 0;
+  glGetQueryObjectiv(frame.queries[frame.numQueries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available)
+    return;
+
+  GLuint64 samples = 0;
+  for (int i = 0; i < frame.numQueries; ++i)
+  {
+    GLuint64 count = 0;
+    glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &count);
+    samples += count;
+  }
+
+  _samples = samples;
+  _overdraw = (frame.targetSamples > 0) ? (double)samples / (double)frame.targetSamples : -1.0;
+  frame.pending = false;
+}
@@ -0,0 +1,164 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <Profiler.h>
+
+#include <chrono>
+#include <cstdio>
+
+Profiler::Profiler() : _frames{}, _scopeStack{0}, _results{}
+{
+
+}
+
+Profiler::~Profiler()
+{
+  // Release the query objects
+  if (_initialized)
+  {
+    for (int i = 0; i < NUM_FRAMES; ++i)
+      glDeleteQueries(2 * MAX_SCOPES, _frames[i].queries);
+  }
+}
+
+Profiler& Profiler::GetInstance()
+{
+  static Profiler instance;
+  return instance;
+}
+
+void Profiler::Init()
+{
+  // Check if already initialized and return
+  if (_initialized)
+    return;
+
+  for (int i = 0; i < NUM_FRAMES; ++i)
+  {
+    glGenQueries(2 * MAX_SCOPES, _frames[i].queries);
+    _frames[i].frameNumber = -1;
+    _frames[i].numScopes = 0;
+    _frames[i].lastQuery = -1;
+    _frames[i].pending = false;
+  }
+
+  _initialized = true;
+}
+
+double Profiler::GetCpuTime()
+{
+  using namespace std::chrono;
+  return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+void Profiler::BeginFrame()
+{
+  if (!_initialized)
+    return;
+
+  // Move to the oldest frame in the ring and try to read it back before reusing it
+  _frameIndex = (_frameIndex + 1) % NUM_FRAMES;
+  Frame &frame = _frames[_frameIndex];
+  if (frame.pending)
+    ReadBack(frame);
+
+  frame.frameNumber = ++_frameCounter;
+  frame.numScopes = 0;
+  frame.lastQuery = -1;
+  frame.pending = false;
+  _stackDepth = 0;
+}
+
+void Profiler::EndFrame()
+{
+  if (!_initialized)
+    return;
+
+  // Close scopes left open so that the frame can be read back
+  while (_stackDepth > 0)
+    EndScope();
+
+  Frame &frame = _frames[_frameIndex];
+  frame.pending = frame.numScopes > 0;
+}
+
+void Profiler::BeginScope(const char *name)
+{
+  if (!_initialized || _stackDepth >= MAX_SCOPES)
+    return;
+
+  Frame &frame = _frames[_frameIndex];
+
+  // Too many scopes in this frame, keep the stack balanced, but don't measure
+  if (frame.numScopes >= MAX_SCOPES)
+  {
+    _scopeStack[_stackDepth++] = -1;
+    return;
+  }
+
+  int scope = frame.numScopes++;
+  frame.scopes[scope] = {name, _stackDepth, 0.0, 0.0};
+  frame.cpuBegin[scope] = GetCpuTime();
+
+  // Timestamp queries can be nested unlike GL_TIME_ELAPSED ones
+  glQueryCounter(frame.queries[2 * scope], GL_TIMESTAMP);
+  frame.lastQuery = 2 * scope;
+
+  _scopeStack[_stackDepth++] = scope;
+}
+
+void Profiler::EndScope()
+{
+  if (!_initialized || _stackDepth == 0)
+    return;
+
+  int scope = _scopeStack[--_stackDepth];
+  if (scope < 0)
+    return;
+
+  Frame &frame = _frames[_frameIndex];
+  glQueryCounter(frame.queries[2 * scope + 1], GL_TIMESTAMP);
+  frame.lastQuery = 2 * scope + 1;
+  frame.scopes[scope].cpuTime = GetCpuTime() - frame.cpuBegin[scope];
+}
+
+void Profiler::ReadBack(Frame &frame)
+{
+  // Queries finish in order, if the last one is available the rest is as well
+  GLint available = 0;
+  glGetQueryObjectiv(frame.queries[frame.lastQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available)
+    return;
+
+  for (int i = 0; i < frame.numScopes; ++i)
+  {
+    GLuint64 begin = 0, end = 0;
+    glGetQueryObjectui64v(frame.queries[2 * i], GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(frame.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+
+    // Timestamps are in nanoseconds
+    _results[i] = frame.scopes[i];
+    _results[i].gpuTime = (end > begin) ? (double)(end - begin) * 1e-6 : 0.0;
+  }
+  _numResults = frame.numScopes;
+  _resultsFrame = frame.frameNumber;
+  frame.pending = false;
+}
+
+int Profiler::Print(char *text, int maxLength) const
+{
+  int length = 0;
+  text[0] = '\0';
+  for (int i = 0; i < _numResults && length < maxLength; ++i)
+  {
+    const ScopeTiming &result = _results[i];
+    int written = snprintf(text + length, maxLength - length, "%s%s %.2f/%.2fms", (i > 0) ? ", " : "", result.name, result.gpuTime, result.cpuTime);
+    if (written < 0)
+      break;
+    length += written;
+  }
+
+  return (length < maxLength) ? length : maxLength - 1;
+}
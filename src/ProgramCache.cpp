@@ -0,0 +1,167 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <ProgramCache.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Identification of the cache files, bump the version when the layout changes
+static const char CACHE_MAGIC[4] = {'P', 'R', 'G', 'C'};
+static const unsigned int CACHE_VERSION = 1;
+
+// FNV-1a hash parameters
+static const unsigned long long FNV_OFFSET = 14695981039346656037ull;
+static const unsigned long long FNV_PRIME = 1099511628211ull;
+
+// Header of the cache file, followed by numPrograms entries of binary format, length and the binary itself
+struct CacheHeader
+{
+  char magic[4];
+  unsigned int version;
+  // Hash of the sources and the driver
+  unsigned long long key;
+  // Number of stored programs
+  int numPrograms;
+};
+
+ProgramCache::ProgramCache() : _key(FNV_OFFSET)
+{
+  // Binaries are only valid for the exact driver they were created with
+  const GLenum driverStrings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION};
+  for (GLenum name : driverStrings)
+  {
+    const char *value = reinterpret_cast<const char*>(glGetString(name));
+    if (value)
+      AddData(value, strlen(value));
+  }
+}
+
+bool ProgramCache::IsSupported()
+{
+  if (!GLAD_GL_VERSION_4_1 && !GLAD_GL_ARB_get_program_binary)
+    return false;
+
+  // Drivers may support the API without providing any binary format
+  GLint numFormats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+  return numFormats > 0;
+}
+
+void ProgramCache::AddSources(const char *const source[], int count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    // Hash the terminating zero as well so that the boundaries between the sources matter
+    AddData(source[i], strlen(source[i]) + 1);
+  }
+}
+
+void ProgramCache::AddData(const void *data, size_t size)
+{
+  const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; ++i)
+  {
+    _key ^= bytes[i];
+    _key *= FNV_PRIME;
+  }
+}
+
+bool ProgramCache::Load(const char fileName[], GLuint programs[], int numPrograms) const
+{
+  if (!IsSupported())
+    return false;
+
+  FILE *file = fopen(fileName, "rb");
+  if (!file)
+    return false;
+
+  CacheHeader header;
+  bool valid = fread(&header, sizeof(CacheHeader), 1, file) == 1 &&
+    memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && header.version == CACHE_VERSION &&
+    header.key == _key && header.numPrograms == numPrograms;
+
+  std::vector<unsigned char> binary;
+  for (int i = 0; valid && i < numPrograms; ++i)
+  {
+    GLenum format = 0;
+    GLint length = 0;
+    valid = fread(&format, sizeof(GLenum), 1, file) == 1 && fread(&length, sizeof(GLint), 1, file) == 1 && length >= 0;
+    if (!valid || length == 0)
+    {
+      programs[i] = 0;
+      continue;
+    }
+
+    binary.resize(length);
+    valid = fread(binary.data(), 1, binary.size(), file) == binary.size();
+    if (!valid)
+      break;
+
+    // The driver may still reject the binary, e.g., after an update keeping the version string
+    programs[i] = glCreateProgram();
+    glProgramBinary(programs[i], format, binary.data(), length);
+
+    GLint status = 0;
+    glGetProgramiv(programs[i], GL_LINK_STATUS, &status);
+    valid = status == GL_TRUE;
+  }
+
+  fclose(file);
+
+  if (!valid)
+  {
+    // Don't leave half of the programs behind, they're all going to be compiled again
+    printf("Shader program cache %s is stale, recompiling shaders.\n", fileName);
+    for (int i = 0; i < numPrograms; ++i)
+    {
+      glDeleteProgram(programs[i]);
+      programs[i] = 0;
+    }
+  }
+
+  return valid;
+}
+
+bool ProgramCache::Save(const char fileName[], const GLuint programs[], int numPrograms) const
+{
+  if (!IsSupported())
+    return false;
+
+  FILE *file = fopen(fileName, "wb");
+  if (!file)
+  {
+    printf("Failed to write the shader program cache %s!\n", fileName);
+    return false;
+  }
+
+  CacheHeader header;
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.key = _key;
+  header.numPrograms = numPrograms;
+  fwrite(&header, sizeof(CacheHeader), 1, file);
+
+  std::vector<unsigned char> binary;
+  for (int i = 0; i < numPrograms; ++i)
+  {
+    GLenum format = 0;
+    GLint length = 0;
+    if (programs[i])
+      glGetProgramiv(programs[i], GL_PROGRAM_BINARY_LENGTH, &length);
+
+    binary.resize(length);
+    if (length > 0)
+      glGetProgramBinary(programs[i], length, &length, &format, binary.data());
+
+    fwrite(&format, sizeof(GLenum), 1, file);
+    fwrite(&length, sizeof(GLint), 1, file);
+    fwrite(binary.data(), 1, length, file);
+  }
+
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <cstdio>
+#include <ProgramReflection.h>
+#include <glm/gtc/type_ptr.hpp>
+
+void ProgramReflection::Reflect(GLuint program, const char *const uniformNames[], int numUniforms, const char *const blockNames[], int numBlocks)
+{
+  if (numUniforms > MAX_UNIFORMS || numBlocks > MAX_BLOCKS)
+  {
+    printf("Too many uniforms (%i) or uniform blocks (%i) to reflect!\n", numUniforms, numBlocks);
+    numUniforms = (numUniforms > MAX_UNIFORMS) ? MAX_UNIFORMS : numUniforms;
+    numBlocks = (numBlocks > MAX_BLOCKS) ? MAX_BLOCKS : numBlocks;
+  }
+
+  _program = program;
+
+  // The string lookups happen only once here
+  _numUniforms = numUniforms;
+  for (int i = 0; i < _numUniforms; ++i)
+    _locations[i] = glGetUniformLocation(program, uniformNames[i]);
+
+  _numBlocks = blockNames ? numBlocks : 0;
+  for (int i = 0; i < _numBlocks; ++i)
+    _blockIndices[i] = glGetUniformBlockIndex(program, blockNames[i]);
+}
+
+GLint ProgramReflection::GetBlockSize(int block) const
+{
+  GLuint index = GetBlockIndex(block);
+  if (index == GL_INVALID_INDEX)
+    return 0;
+
+  GLint size = 0;
+  glGetActiveUniformBlockiv(_program, index, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+  return size;
+}
+
+void ProgramReflection::BindBlock(int block, GLuint binding) const
+{
+  GLuint index = GetBlockIndex(block);
+  if (index != GL_INVALID_INDEX)
+    glUniformBlockBinding(_program, index, binding);
+}
+
+void ProgramReflection::Set(int uniform, int value) const
+{
+  GLint loc = GetLocation(uniform);
+  if (loc >= 0)
+    glUniform1i(loc, value);
+}
+
+void ProgramReflection::Set(int uniform, unsigned int value) const
+{
+  GLint loc = GetLocation(uniform);
+  if (loc >= 0)
+    glUniform1ui(loc, value);
+}
+
+void ProgramReflection::Set(int uniform, float value) const
+{
+  GLint loc = GetLocation(uniform);
+  if (loc >= 0)
+    glUniform1f(loc, value);
+}
+
+void ProgramReflection::Set(int uniform, const glm::vec2 &value) const
+{
+  GLint loc = GetLocation(uniform);
+  if (loc >= 0)
+    glUniform2fv(loc, 1, glm::value_ptr(value));
+}
+
+void ProgramReflection::Set(int uniform, const glm::vec3 &value) const
+{
+  GLint loc = GetLocation(uniform);
+  if (loc >= 0)
+    glUniform3fv(loc, 1, glm::value_ptr(value));
+}
+
+void ProgramReflection::Set(int uniform, const glm::vec4 &value) const
+{
+  GLint loc = GetLocation(uniform);
+  if (loc >= 0)
+    glUniform4fv(loc, 1, glm::value_ptr(value));
+}
+
+void ProgramReflection::Set(int uniform, const glm::mat4 &value) const
+{
+  GLint loc = GetLocation(uniform);
+  if (loc >= 0)
+    glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(value));
+}
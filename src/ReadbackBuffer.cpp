@@ -0,0 +1,141 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <ReadbackBuffer.h>
+#include <GpuMemory.h>
+
+#include <cstdio>
+#include <cstring>
+
+ReadbackBuffer::~ReadbackBuffer()
+{
+  Release();
+}
+
+bool ReadbackBuffer::Init(GLsizeiptr frameSize, const char *subsystem)
+{
+  // Check if already initialized and return
+  if (_buffer)
+    return true;
+
+  // Keep the sections aligned for the copies
+  _frameSize = (frameSize + 15) & ~(GLsizeiptr)15;
+  const GLsizeiptr bufferSize = NUM_FRAMES * _frameSize;
+
+  glGenBuffers(1, &_buffer);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+
+  if (GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage)
+  {
+    // Immutable storage in the client memory mapped once for the whole lifetime, coherent so that the copies
+    // are visible once the fence is signaled
+    const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_COPY_WRITE_BUFFER, bufferSize, nullptr, flags | GL_CLIENT_STORAGE_BIT);
+    _mappedData = reinterpret_cast<const unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bufferSize, flags));
+    if (!_mappedData)
+      printf("Failed to persistently map the readback buffer, falling back to reading on each frame!\n");
+  }
+  else
+  {
+    // Mutable storage, the fences tell us when the data can be read without waiting
+    glBufferData(GL_COPY_WRITE_BUFFER, bufferSize, nullptr, GL_STREAM_READ);
+  }
+
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  GpuMemory::GetInstance().TrackBuffer(_buffer, (size_t)bufferSize, subsystem);
+
+  _frameIndex = -1;
+  _readIndex = 0;
+  _numPending = 0;
+  return true;
+}
+
+void ReadbackBuffer::Release()
+{
+  for (int i = 0; i < NUM_FRAMES; ++i)
+  {
+    if (_fences[i])
+    {
+      glDeleteSync(_fences[i]);
+      _fences[i] = nullptr;
+    }
+  }
+
+  // Deleting the buffer unmaps it as well
+  GpuMemory::GetInstance().UntrackBuffer(_buffer);
+  glDeleteBuffers(1, &_buffer);
+  _buffer = 0;
+  _mappedData = nullptr;
+  _frameSize = 0;
+  _frameIndex = -1;
+  _readIndex = 0;
+  _numPending = 0;
+}
+
+bool ReadbackBuffer::BeginFrame()
+{
+  // Rather skip the frame than wait for the oldest section to be read
+  if (!_buffer || _numPending == NUM_FRAMES)
+    return false;
+
+  _frameIndex = (_readIndex + _numPending) % NUM_FRAMES;
+  return true;
+}
+
+void ReadbackBuffer::Copy(GLuint source, GLintptr sourceOffset, GLintptr offset, GLsizeiptr size)
+{
+  if (_frameIndex < 0 || offset + size > _frameSize)
+    return;
+
+  glBindBuffer(GL_COPY_READ_BUFFER, source);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, sourceOffset, _frameIndex * _frameSize + offset, size);
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void ReadbackBuffer::EndFrame()
+{
+  if (_frameIndex < 0)
+    return;
+
+  _fences[_frameIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  _frameIndex = -1;
+  ++_numPending;
+}
+
+bool ReadbackBuffer::Read(void *data, GLsizeiptr size)
+{
+  if (_numPending == 0 || size > _frameSize)
+    return false;
+
+  // Just poll the fence, flushing so that it's guaranteed to be signaled eventually
+  GLsync &fence = _fences[_readIndex];
+  GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  if (result == GL_TIMEOUT_EXPIRED)
+    return false;
+  if (result == GL_WAIT_FAILED)
+    printf("Failed to poll the readback buffer fence!\n");
+
+  glDeleteSync(fence);
+  fence = nullptr;
+
+  const GLintptr offset = _readIndex * _frameSize;
+  if (_mappedData)
+  {
+    memcpy(data, _mappedData + offset, size);
+  }
+  else
+  {
+    // Copy is done, reading the range doesn't stall anymore
+    glBindBuffer(GL_COPY_READ_BUFFER, _buffer);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, offset, size, data);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  }
+
+  _readIndex = (_readIndex + 1) % NUM_FRAMES;
+  --_numPending;
+  return true;
+}
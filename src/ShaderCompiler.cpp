@@ -4,13 +4,29 @@
  */
 
 #include <cstdio>
+#include <cstring>
+#include <string>
 #include <ShaderCompiler.h>
 
 GLuint ShaderCompiler::CompileShader(const char* source[], int index, GLenum type)
 {
+  return CompileShader(source, index, type, nullptr);
+}
+
+GLuint ShaderCompiler::CompileShader(const char* source[], int index, GLenum type, const char defines[])
+{
+  // The defines have to follow the #version line, split the source there
+  const char *body = source[index];
+  const char *version = strstr(body, "#version");
+  const char *afterVersion = version ? strchr(version, '\n') : nullptr;
+  const GLint headerLength = afterVersion ? (GLint)(afterVersion + 1 - body) : 0;
+
+  const char *strings[] = {body, defines ? defines : "", body + headerLength};
+  const GLint lengths[] = {headerLength, -1, -1};
+
   // Create and compile the shader
   GLuint shader = glCreateShader(type);
-  glShaderSource(shader, 1, source + index, nullptr);
+  glShaderSource(shader, 3, strings, lengths);
   glCompileShader(shader);
 
   // Check that compilation was a success
@@ -29,6 +45,10 @@ GLuint ShaderCompiler::CompileShader(const char* source[], int index, GLenum typ
 
 bool ShaderCompiler::LinkProgram(GLuint program)
 {
+  // Let the driver know we may want to store the program binary, see ProgramCache
+  if (GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary)
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
   glLinkProgram(program);
 
   // Check that linkage was a success
@@ -44,3 +64,50 @@ bool ShaderCompiler::LinkProgram(GLuint program)
 
   return true;
 }
+
+ShaderPermutations::ShaderPermutations(const char *const featureNames[], int numFeatures) :
+  _featureNames(featureNames), _numFeatures(numFeatures)
+{
+
+}
+
+ShaderPermutations::~ShaderPermutations()
+{
+  Release();
+}
+
+GLuint ShaderPermutations::GetShader(const char* source[], int index, GLenum type, unsigned int features, unsigned int mask)
+{
+  // Features ignored by this stage don't make a new variant
+  features &= mask & ((1u << _numFeatures) - 1);
+
+  for (const Variant &variant : _variants)
+  {
+    if (variant.source == source[index] && variant.type == type && variant.features == features)
+      return variant.shader;
+  }
+
+  std::string defines;
+  for (int i = 0; i < _numFeatures; ++i)
+  {
+    if (features & (1u << i))
+      defines += std::string("#define ") + _featureNames[i] + " 1\n";
+  }
+
+  GLuint shader = ShaderCompiler::CompileShader(source, index, type, defines.c_str());
+  if (!shader)
+  {
+    printf("Failed permutation: %s", defines.empty() ? "no features\n" : defines.c_str());
+    return 0;
+  }
+
+  _variants.push_back({source[index], type, features, shader});
+  return shader;
+}
+
+void ShaderPermutations::Release()
+{
+  for (const Variant &variant : _variants)
+    glDeleteShader(variant.shader);
+  _variants.clear();
+}
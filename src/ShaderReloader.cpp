@@ -0,0 +1,134 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <ShaderReloader.h>
+
+#include <cstdio>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Minimum time between two checks of the files
+static const std::chrono::milliseconds checkInterval(250);
+
+// Modification time of the file, -1 if it doesn't exist
+static long long getFileTime(const std::string &fileName)
+{
+  struct stat info;
+  if (stat(fileName.c_str(), &info) != 0)
+    return -1;
+  return (long long)info.st_mtime;
+}
+
+void ShaderReloader::Watch(const char *source[], const char *const names[], int count, const char extension[])
+{
+  for (int i = 0; i < count; ++i)
+    _entries.push_back({source + i, source[i], std::string(names[i]) + extension, -1, std::string()});
+}
+
+bool ShaderReloader::Enable(const char directory[])
+{
+  if (_enabled)
+    return true;
+
+  // Create the directory, failing likely means it already exists
+#ifdef _WIN32
+  _mkdir(directory);
+#else
+  mkdir(directory, 0755);
+#endif
+  _directory = std::string(directory) + "/";
+
+  for (Entry &entry : _entries)
+  {
+    // Start with the built-in source so that there is something to edit
+    std::string fileName = _directory + entry.fileName;
+    if (getFileTime(fileName) < 0)
+    {
+      FILE *file = fopen(fileName.c_str(), "wb");
+      if (file)
+      {
+        fputs(entry.builtIn, file);
+        fclose(file);
+      }
+    }
+
+    if (!ReadFile(entry))
+    {
+      printf("Failed to read shader file %s!\n", fileName.c_str());
+      Disable();
+      return false;
+    }
+  }
+
+  // The contents of all entries are final now, we can point the tables to them
+  for (Entry &entry : _entries)
+    *entry.source = entry.contents.c_str();
+
+  printf("Loading shaders from %s, edit the files to reload them.\n", directory);
+  _lastCheck = std::chrono::steady_clock::now();
+  _enabled = true;
+  return true;
+}
+
+void ShaderReloader::Disable()
+{
+  for (Entry &entry : _entries)
+  {
+    *entry.source = entry.builtIn;
+    entry.contents.clear();
+    entry.fileTime = -1;
+  }
+  _enabled = false;
+}
+
+bool ShaderReloader::Update()
+{
+  if (!_enabled)
+    return false;
+
+  // Don't stat the files every frame
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (now - _lastCheck < checkInterval)
+    return false;
+  _lastCheck = now;
+
+  bool changed = false;
+  for (Entry &entry : _entries)
+  {
+    // Keep the previous contents when the file disappears, e.g., while the editor is saving it
+    long long fileTime = getFileTime(_directory + entry.fileName);
+    if (fileTime < 0 || fileTime == entry.fileTime)
+      continue;
+
+    if (ReadFile(entry))
+    {
+      *entry.source = entry.contents.c_str();
+      printf("Shader file %s changed.\n", entry.fileName.c_str());
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+bool ShaderReloader::ReadFile(Entry &entry) const
+{
+  FILE *file = fopen((_directory + entry.fileName).c_str(), "rb");
+  if (!file)
+    return false;
+
+  std::string contents;
+  char buffer[4096];
+  size_t size = 0;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents.append(buffer, size);
+  fclose(file);
+
+  entry.contents.swap(contents);
+  entry.fileTime = getFileTime(_directory + entry.fileName);
+  return true;
+}
@@ -0,0 +1,188 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <StreamingBuffer.h>
+#include <GLState.h>
+#include <GpuMemory.h>
+
+#include <cstdio>
+#include <cstring>
+
+StreamingBuffer::~StreamingBuffer()
+{
+  Release();
+}
+
+bool StreamingBuffer::Init(GLsizeiptr frameSize, int maxUploads)
+{
+  // Check if already initialized and return
+  if (_buffer)
+    return true;
+
+  // Bound ranges have to satisfy the alignment of both uniform and storage buffers
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &_alignment);
+  if (GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_shader_storage_buffer_object)
+  {
+    GLint alignment = 1;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    if (alignment > _alignment)
+      _alignment = alignment;
+  }
+
+  // Each upload may need padding to the alignment, keep all sections aligned as well
+  frameSize += maxUploads * (_alignment - 1);
+  _frameSize = (frameSize + _alignment - 1) / _alignment * _alignment;
+  const GLsizeiptr bufferSize = NUM_FRAMES * _frameSize;
+
+  glGenBuffers(1, &_buffer);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+
+  if (GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage)
+  {
+    // Immutable storage mapped once for the whole lifetime, coherent so that we don't need to flush
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_COPY_WRITE_BUFFER, bufferSize, nullptr, flags);
+    _mappedData = reinterpret_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bufferSize, flags));
+    if (!_mappedData)
+      printf("Failed to persistently map the streaming buffer, falling back to mapping on each upload!\n");
+  }
+  else
+  {
+    // Mutable storage, fences still guard the sections so we can map unsynchronized
+    glBufferData(GL_COPY_WRITE_BUFFER, bufferSize, nullptr, GL_STREAM_DRAW);
+  }
+
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  GpuMemory::GetInstance().TrackBuffer(_buffer, (size_t)bufferSize, "Streaming buffers");
+
+  _frameIndex = 0;
+  _frameOffset = 0;
+  return true;
+}
+
+void StreamingBuffer::Release()
+{
+  for (int i = 0; i < NUM_FRAMES; ++i)
+  {
+    if (_fences[i])
+    {
+      glDeleteSync(_fences[i]);
+      _fences[i] = nullptr;
+    }
+  }
+
+  // Deleting the buffer unmaps it as well
+  GpuMemory::GetInstance().UntrackBuffer(_buffer);
+  glDeleteBuffers(1, &_buffer);
+  _buffer = 0;
+  _mappedData = nullptr;
+  _rangeMapped = false;
+  _frameSize = 0;
+}
+
+void StreamingBuffer::BeginFrame()
+{
+  if (!_buffer)
+    return;
+
+  // Move to the oldest section in the ring and wait until the GPU is done with it
+  _frameIndex = (_frameIndex + 1) % NUM_FRAMES;
+  _frameOffset = 0;
+
+  GLsync &fence = _fences[_frameIndex];
+  if (!fence)
+    return;
+
+  // Flush on the first try only so that the fence is guaranteed to be signaled eventually
+  GLbitfield waitFlags = GL_SYNC_FLUSH_COMMANDS_BIT;
+  for (;;)
+  {
+    GLenum result = glClientWaitSync(fence, waitFlags, 1000000000);
+    if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+      break;
+    if (result == GL_WAIT_FAILED)
+    {
+      printf("Failed to wait for the streaming buffer fence!\n");
+      break;
+    }
+    waitFlags = 0;
+  }
+
+  glDeleteSync(fence);
+  fence = nullptr;
+}
+
+void StreamingBuffer::EndFrame()
+{
+  if (!_buffer)
+    return;
+
+  // Nothing written, no need to guard the section
+  if (_frameOffset == 0)
+    return;
+
+  _fences[_frameIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool StreamingBuffer::Upload(const void *data, GLsizeiptr size, GLsizeiptr rangeSize, GLintptr &offset)
+{
+  void *ptr = Map(size, rangeSize, offset);
+  if (!ptr)
+    return false;
+
+  memcpy(ptr, data, size);
+  Unmap();
+  return true;
+}
+
+void *StreamingBuffer::Map(GLsizeiptr size, GLsizeiptr rangeSize, GLintptr &offset)
+{
+  if (!_buffer || size > rangeSize || _rangeMapped)
+    return nullptr;
+
+  // Reserve an aligned range in the current section
+  GLsizeiptr alignedSize = (rangeSize + _alignment - 1) / _alignment * _alignment;
+  if (_frameOffset + rangeSize > _frameSize)
+  {
+    printf("Streaming buffer section is full, %i bytes requested!\n", (int)rangeSize);
+    return nullptr;
+  }
+
+  offset = _frameIndex * _frameSize + _frameOffset;
+  _frameOffset += alignedSize;
+
+  // Coherent mapping, the data is visible to the GPU right away
+  if (_mappedData)
+    return _mappedData + offset;
+
+  // Nothing to write, still return a valid pointer
+  static unsigned char empty;
+  if (size == 0)
+    return &empty;
+
+  // The range isn't in use by the GPU thanks to the fences, so we may skip the implicit synchronization
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+  void *ptr = glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  _rangeMapped = ptr != nullptr;
+  return ptr;
+}
+
+void StreamingBuffer::Unmap()
+{
+  if (!_rangeMapped)
+    return;
+
+  glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+  glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  _rangeMapped = false;
+}
+
+void StreamingBuffer::Bind(GLenum target, GLuint index, GLintptr offset, GLsizeiptr size) const
+{
+  // Indexed bindings go through the state cache, the same range is often bound by several passes
+  GLState::GetInstance().BindBufferRange(target, index, _buffer, offset, size);
+}
@@ -0,0 +1,389 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <TextureLoader.h>
+#include <GpuMemory.h>
+
+#include <stb/stb_image.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+// Identification of the cache files, bump the version when the layout changes
+static const char CACHE_MAGIC[4] = {'M', 'I', 'P', 'C'};
+static const unsigned int CACHE_VERSION = 1;
+
+// Header of the cached mip chain
+struct CacheHeader
+{
+  char magic[4];
+  unsigned int version;
+  // Size and modification time of the source file the cache was created from
+  long long sourceSize;
+  long long sourceTime;
+  // Dimensions of the first mip level
+  int width;
+  int height;
+  // Size of the following RGBA8 data of all mip levels
+  long long dataSize;
+};
+
+// Name of the cache file, sRGB and linear textures are filtered differently
+static std::string getCacheName(const std::string &name, bool sRGB)
+{
+  return name + (sRGB ? ".srgb.mips" : ".linear.mips");
+}
+
+// Total size of RGBA8 mip chain
+static size_t getMipChainSize(int width, int height)
+{
+  size_t size = 0;
+  for (int level = 0; level < Textures::GetNumMipLevels(width, height); ++level)
+    size += 4 * std::max(width >> level, 1) * std::max(height >> level, 1);
+  return size;
+}
+
+// Try to read the mip chain from the cache, fails if it is missing or older than the source file
+static bool readCache(const std::string &name, bool sRGB, const struct stat &source, int &width, int &height, std::vector<unsigned char> &mipChain)
+{
+  FILE *file = fopen(getCacheName(name, sRGB).c_str(), "rb");
+  if (!file)
+    return false;
+
+  CacheHeader header;
+  bool valid = fread(&header, sizeof(CacheHeader), 1, file) == 1 &&
+    memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && header.version == CACHE_VERSION &&
+    header.sourceSize == (long long)source.st_size && header.sourceTime == (long long)source.st_mtime &&
+    header.width > 0 && header.height > 0 && header.dataSize == (long long)getMipChainSize(header.width, header.height);
+
+  if (valid)
+  {
+    mipChain.resize((size_t)header.dataSize);
+    valid = fread(mipChain.data(), 1, mipChain.size(), file) == mipChain.size();
+    width = header.width;
+    height = header.height;
+  }
+
+  fclose(file);
+  return valid;
+}
+
+// Store the mip chain to the cache, failing to do so isn't an error, we'll just decode the source next time again
+static void writeCache(const std::string &name, bool sRGB, const struct stat &source, int width, int height, const std::vector<unsigned char> &mipChain)
+{
+  FILE *file = fopen(getCacheName(name, sRGB).c_str(), "wb");
+  if (!file)
+    return;
+
+  CacheHeader header;
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.sourceSize = (long long)source.st_size;
+  header.sourceTime = (long long)source.st_mtime;
+  header.width = width;
+  header.height = height;
+  header.dataSize = (long long)mipChain.size();
+
+  fwrite(&header, sizeof(CacheHeader), 1, file);
+  fwrite(mipChain.data(), 1, mipChain.size(), file);
+  fclose(file);
+}
+
+// Conversion of sRGB encoded value to linear space
+static float toLinear(unsigned char value)
+{
+  float c = value / 255.0f;
+  return (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+// Conversion of linear value to sRGB encoding
+static unsigned char toSRGB(float value)
+{
+  float c = (value <= 0.0031308f) ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+  return (unsigned char)std::min(std::max(c * 255.0f + 0.5f, 0.0f), 255.0f);
+}
+
+// Fill in the lower mip levels of the RGBA8 mip chain with the first level already in place using 2x2 box filter,
+// sRGB color channels are filtered in linear space
+static void generateMipChain(int width, int height, bool sRGB, std::vector<unsigned char> &mipChain)
+{
+  float linear[256];
+  for (int i = 0; i < 256; ++i)
+    linear[i] = sRGB ? toLinear((unsigned char)i) : i / 255.0f;
+
+  size_t srcOffset = 0;
+  int srcWidth = width;
+  int srcHeight = height;
+  for (int level = 1; level < Textures::GetNumMipLevels(width, height); ++level)
+  {
+    const int dstWidth = std::max(srcWidth >> 1, 1);
+    const int dstHeight = std::max(srcHeight >> 1, 1);
+    const size_t dstOffset = srcOffset + 4 * srcWidth * srcHeight;
+    const unsigned char *src = mipChain.data() + srcOffset;
+    unsigned char *dst = mipChain.data() + dstOffset;
+
+    for (int y = 0; y < dstHeight; ++y)
+    {
+      // Odd dimensions just clamp to the last row and column
+      const int y0 = std::min(2 * y, srcHeight - 1);
+      const int y1 = std::min(2 * y + 1, srcHeight - 1);
+      for (int x = 0; x < dstWidth; ++x)
+      {
+        const int x0 = std::min(2 * x, srcWidth - 1);
+        const int x1 = std::min(2 * x + 1, srcWidth - 1);
+        const unsigned char *texels[4] = {
+          src + 4 * (y0 * srcWidth + x0), src + 4 * (y0 * srcWidth + x1),
+          src + 4 * (y1 * srcWidth + x0), src + 4 * (y1 * srcWidth + x1)
+        };
+
+        unsigned char *out = dst + 4 * (y * dstWidth + x);
+        for (int c = 0; c < 4; ++c)
+        {
+          // Alpha is always linear
+          if (c < 3)
+          {
+            float sum = 0.0f;
+            for (int t = 0; t < 4; ++t)
+              sum += linear[texels[t][c]];
+            out[c] = sRGB ? toSRGB(0.25f * sum) : (unsigned char)(0.25f * sum * 255.0f + 0.5f);
+          }
+          else
+          {
+            out[c] = (unsigned char)((texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c] + 2) / 4);
+          }
+        }
+      }
+    }
+
+    srcOffset = dstOffset;
+    srcWidth = dstWidth;
+    srcHeight = dstHeight;
+  }
+}
+
+// Decode the texture from the compressed DDS file, the cache or the source file, returns false if none is available
+static bool decodeTexture(const std::string &name, bool sRGB, int &width, int &height, std::vector<unsigned char> &mipChain, CompressedImage &compressed)
+{
+  // Prefer the offline compressed variant with the prebuilt mip chain
+  std::string ddsName = name.substr(0, name.find_last_of('.')) + ".dds";
+  struct stat dds;
+  if (stat(ddsName.c_str(), &dds) == 0 && Textures::ReadDDS(ddsName.c_str(), sRGB, compressed))
+  {
+    width = compressed.width;
+    height = compressed.height;
+    return true;
+  }
+  compressed.internalFormat = 0;
+
+  struct stat source;
+  if (stat(name.c_str(), &source) != 0)
+    return false;
+
+  if (readCache(name, sRGB, source, width, height, mipChain))
+    return true;
+
+  // Always decode to RGBA so that the rows of all mip levels satisfy the default unpack alignment
+  int numChannels;
+  unsigned char *data = stbi_load(name.c_str(), &width, &height, &numChannels, 4);
+  if (!data)
+    return false;
+
+  mipChain.resize(getMipChainSize(width, height));
+  memcpy(mipChain.data(), data, 4 * width * height);
+  stbi_image_free(data);
+
+  generateMipChain(width, height, sRGB, mipChain);
+  writeCache(name, sRGB, source, width, height, mipChain);
+  return true;
+}
+
+TextureLoader::~TextureLoader()
+{
+  Release();
+}
+
+bool TextureLoader::Init(int numThreads)
+{
+  // Check if already initialized and return
+  if (!_threads.empty())
+    return true;
+
+  // Make sure the shared stb_image settings are in place before the decoding starts
+  Textures::GetInstance();
+
+  if (numThreads <= 0)
+    numThreads = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+
+  _exit = false;
+  for (int i = 0; i < numThreads; ++i)
+    _threads.emplace_back(&TextureLoader::DecodeLoop, this);
+
+  return true;
+}
+
+void TextureLoader::Release()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _exit = true;
+    _decodeQueue.clear();
+  }
+  _decodeReady.notify_all();
+
+  for (std::thread &thread : _threads)
+    thread.join();
+  _threads.clear();
+
+  _uploadQueue.clear();
+  _numPending = 0;
+
+  GpuMemory::GetInstance().UntrackBuffer(_pbo);
+  glDeleteBuffers(1, &_pbo);
+  _pbo = 0;
+}
+
+void TextureLoader::Load(const char name[], bool sRGB, GLuint *texture, unsigned char r, unsigned char g, unsigned char b)
+{
+  *texture = Textures::CreateSingleColorTexture(r, g, b);
+
+  // Not initialized, the placeholder is all we can do
+  if (_threads.empty())
+  {
+    printf("Texture loader not initialized, can't load texture: %s\n", name);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _decodeQueue.push_back({name, sRGB, texture, 0, 0, {}, {0, 0, 0, {}, {}}});
+  }
+  ++_numPending;
+  _decodeReady.notify_one();
+}
+
+void TextureLoader::Update(int maxUploads)
+{
+  for (int i = 0; i < maxUploads; ++i)
+  {
+    Request request;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_uploadQueue.empty())
+        return;
+      request = std::move(_uploadQueue.front());
+      _uploadQueue.pop_front();
+    }
+
+    Upload(request);
+  }
+}
+
+void TextureLoader::Finish()
+{
+  while (_numPending > 0)
+  {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _uploadReady.wait(lock, [this] { return !_uploadQueue.empty(); });
+      request = std::move(_uploadQueue.front());
+      _uploadQueue.pop_front();
+    }
+
+    Upload(request);
+  }
+}
+
+void TextureLoader::DecodeLoop()
+{
+  for (;;)
+  {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _decodeReady.wait(lock, [this] { return _exit || !_decodeQueue.empty(); });
+      if (_exit)
+        return;
+      request = std::move(_decodeQueue.front());
+      _decodeQueue.pop_front();
+    }
+
+    if (!decodeTexture(request.name, request.sRGB, request.width, request.height, request.mipChain, request.compressed))
+    {
+      request.width = 0;
+      request.height = 0;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _uploadQueue.push_back(std::move(request));
+    }
+    _uploadReady.notify_one();
+  }
+}
+
+void TextureLoader::Upload(Request &request)
+{
+  --_numPending;
+
+  // Keep the placeholder if the texture couldn't be loaded
+  if (request.width == 0)
+  {
+    printf("Failed to load texture: %s\n", request.name.c_str());
+    return;
+  }
+
+  // Orphan the previous storage so that we don't wait for the previous upload to finish
+  const bool compressed = request.compressed.internalFormat != 0;
+  const std::vector<unsigned char> &data = compressed ? request.compressed.data : request.mipChain;
+  if (!_pbo)
+    glGenBuffers(1, &_pbo);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+  const GLsizeiptr size = (GLsizeiptr)data.size();
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+  GpuMemory::GetInstance().TrackBuffer(_pbo, (size_t)size, "Texture loader");
+  void *ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (!ptr)
+  {
+    printf("Failed to map the texture upload buffer: %s\n", request.name.c_str());
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return;
+  }
+  memcpy(ptr, data.data(), data.size());
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+  if (compressed)
+  {
+    // Prebuilt mip levels are read from the start of the buffer
+    GLuint tex = Textures::CreateCompressedTexture(request.compressed, nullptr);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    GpuMemory::GetInstance().UntrackTexture(*request.texture);
+    glDeleteTextures(1, request.texture);
+    *request.texture = tex;
+    return;
+  }
+
+  // All mip levels are ready, the copies from the buffer are asynchronous, alpha channel is dropped as with LoadTexture()
+  const GLsizei numLevels = Textures::GetNumMipLevels(request.width, request.height);
+  GLuint tex = Textures::CreateTexture2D(request.sRGB ? GL_SRGB8 : GL_RGB8, request.width, request.height, numLevels);
+  size_t offset = 0;
+  for (GLsizei level = 0; level < numLevels; ++level)
+  {
+    const int width = std::max(request.width >> level, 1);
+    const int height = std::max(request.height >> level, 1);
+    Textures::UploadTexture2D(tex, level, width, height, GL_RGBA, reinterpret_cast<void*>(offset));
+    offset += 4 * width * height;
+  }
+  Textures::FinishTexture2D(tex, false);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  // Swap the placeholder for the loaded texture
+  GpuMemory::GetInstance().UntrackTexture(*request.texture);
+  glDeleteTextures(1, request.texture);
+  *request.texture = tex;
+}
@@ -4,10 +4,99 @@
  */
 
 #include <Textures.h>
+#include <GpuMemory.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// S3TC formats aren't core, make sure we have the enums even with a core only loader
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT 0x8C4D
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+#endif
+
+// DDS file layout, see the DirectX documentation of DDS_HEADER and DDS_HEADER_DXT10
+struct DDSPixelFormat
+{
+  uint32_t size;
+  uint32_t flags;
+  uint32_t fourCC;
+  uint32_t rgbBitCount;
+  uint32_t bitMasks[4];
+};
+
+struct DDSHeader
+{
+  uint32_t size;
+  uint32_t flags;
+  uint32_t height;
+  uint32_t width;
+  uint32_t pitchOrLinearSize;
+  uint32_t depth;
+  uint32_t mipMapCount;
+  uint32_t reserved1[11];
+  DDSPixelFormat pixelFormat;
+  uint32_t caps[4];
+  uint32_t reserved2;
+};
+
+struct DDSHeaderDX10
+{
+  uint32_t dxgiFormat;
+  uint32_t resourceDimension;
+  uint32_t miscFlag;
+  uint32_t arraySize;
+  uint32_t miscFlags2;
+};
+
+// Largest DDS texture we accept, the minimum GL_MAX_TEXTURE_SIZE of GL 4, the limit itself can't be queried as the
+// files are also read on the texture loader threads
+static const uint32_t MAX_DDS_SIZE = 16384;
+
+// Little endian four character code
+static uint32_t makeFourCC(const char code[4])
+{
+  return (uint32_t)code[0] | ((uint32_t)code[1] << 8) | ((uint32_t)code[2] << 16) | ((uint32_t)code[3] << 24);
+}
+
+// Which compressed formats can the context handle?
+static bool isCompressedFormatSupported(GLenum format)
+{
+  switch (format)
+  {
+  case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+    // sRGB variants come with EXT_texture_sRGB which every S3TC capable desktop GPU has
+    return GLAD_GL_EXT_texture_compression_s3tc != 0;
+  case GL_COMPRESSED_RED_RGTC1:
+  case GL_COMPRESSED_RG_RGTC2:
+    // Core since GL 3.0
+    return true;
+  case GL_COMPRESSED_RGBA_BPTC_UNORM:
+  case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+    return GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_compression_bptc;
+  default:
+    return false;
+  }
+}
+
+// Use immutable storage and DSA for texture creation if available (GL 4.5 or ARB_direct_state_access)
+static bool useTextureStorage()
+{
+  return GLAD_GL_VERSION_4_5 || GLAD_GL_ARB_direct_state_access;
+}
+
 Textures::Textures() : _samplers{0}
 {
   stbi_set_flip_vertically_on_load(true);
@@ -25,15 +114,226 @@ Textures& Textures::GetInstance()
   return instance;
 }
 
-GLuint Textures::CreateCheckerBoardTexture(unsigned int textureSize, unsigned int checkerSize, glm::vec3 oddColor, glm::vec3 evenColor, bool sRGB)
+bool Textures::ReadDDS(const char name[], bool sRGB, CompressedImage &image)
 {
-  // Generate the texture name
+  FILE *file = fopen(name, "rb");
+  if (!file)
+    return false;
+
+  // Read and check the headers
+  char magic[4];
+  DDSHeader header;
+  bool valid = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, "DDS ", sizeof(magic)) == 0 &&
+    fread(&header, sizeof(DDSHeader), 1, file) == 1 && header.size == sizeof(DDSHeader) &&
+    header.width > 0 && header.height > 0 && header.width <= MAX_DDS_SIZE && header.height <= MAX_DDS_SIZE;
+
+  // Legacy four character codes written by older tools, DX10 header otherwise
+  GLenum format = 0;
+  GLsizei blockSize = 16;
+  if (valid)
+  {
+    uint32_t fourCC = header.pixelFormat.fourCC;
+    if (fourCC == makeFourCC("DXT1"))
+    {
+      format = sRGB ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+      blockSize = 8;
+    }
+    else if (fourCC == makeFourCC("DXT5"))
+    {
+      format = sRGB ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    }
+    else if (fourCC == makeFourCC("ATI1") || fourCC == makeFourCC("BC4U"))
+    {
+      format = GL_COMPRESSED_RED_RGTC1;
+      blockSize = 8;
+    }
+    else if (fourCC == makeFourCC("ATI2") || fourCC == makeFourCC("BC5U"))
+    {
+      format = GL_COMPRESSED_RG_RGTC2;
+    }
+    else if (fourCC == makeFourCC("DX10"))
+    {
+      DDSHeaderDX10 headerDX10;
+      valid = fread(&headerDX10, sizeof(DDSHeaderDX10), 1, file) == 1 && headerDX10.arraySize <= 1;
+      switch (valid ? headerDX10.dxgiFormat : 0)
+      {
+      // DXGI_FORMAT_BC1_UNORM(_SRGB)
+      case 71: case 72:
+        format = sRGB ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+        blockSize = 8;
+        break;
+      // DXGI_FORMAT_BC3_UNORM(_SRGB)
+      case 77: case 78:
+        format = sRGB ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        break;
+      // DXGI_FORMAT_BC4_UNORM
+      case 80:
+        format = GL_COMPRESSED_RED_RGTC1;
+        blockSize = 8;
+        break;
+      // DXGI_FORMAT_BC5_UNORM
+      case 83:
+        format = GL_COMPRESSED_RG_RGTC2;
+        break;
+      // DXGI_FORMAT_BC7_UNORM(_SRGB)
+      case 98: case 99:
+        format = sRGB ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM : GL_COMPRESSED_RGBA_BPTC_UNORM;
+        break;
+      }
+    }
+  }
+
+  if (!valid || !format || !isCompressedFormatSupported(format))
+  {
+    printf("Unsupported DDS texture: %s\n", name);
+    fclose(file);
+    return false;
+  }
+
+  // Compute the sizes of all stored mip levels, the file may not contain the whole chain
+  image.internalFormat = format;
+  image.width = (int)header.width;
+  image.height = (int)header.height;
+  image.levelSizes.clear();
+  const GLsizei numLevels = std::min(std::max((GLsizei)header.mipMapCount, 1), GetNumMipLevels(image.width, image.height));
+  size_t dataSize = 0;
+  for (GLsizei level = 0; level < numLevels; ++level)
+  {
+    const GLsizei blocksX = (std::max(image.width >> level, 1) + 3) / 4;
+    const GLsizei blocksY = (std::max(image.height >> level, 1) + 3) / 4;
+    image.levelSizes.push_back(blocksX * blocksY * blockSize);
+    dataSize += image.levelSizes.back();
+  }
+
+  // Don't allocate more than what's left in the file
+  const long dataOffset = ftell(file);
+  valid = dataOffset >= 0 && fseek(file, 0, SEEK_END) == 0;
+  const long fileSize = valid ? ftell(file) : -1;
+  valid = valid && fileSize >= dataOffset && dataSize <= (size_t)(fileSize - dataOffset) && fseek(file, dataOffset, SEEK_SET) == 0;
+  if (valid)
+  {
+    image.data.resize(dataSize);
+    valid = fread(image.data.data(), 1, dataSize, file) == dataSize;
+  }
+  fclose(file);
+
+  if (!valid)
+    printf("Truncated DDS texture: %s\n", name);
+  return valid;
+}
+
+GLuint Textures::CreateCompressedTexture(const CompressedImage &image, const void *data)
+{
+  const GLsizei numLevels = (GLsizei)image.levelSizes.size();
+
   GLuint tex;
-  glGenTextures(1, &tex);
+  if (useTextureStorage())
+  {
+    glCreateTextures(GL_TEXTURE_2D, 1, &tex);
+    glTextureStorage2D(tex, numLevels, image.internalFormat, image.width, image.height);
+  }
+  else
+  {
+    // Generate the texture name and create the texture object (first bind call for this name)
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+  }
+
+  // Mip levels are already prebuilt, just upload them
+  uintptr_t offset = reinterpret_cast<uintptr_t>(data);
+  for (GLsizei level = 0; level < numLevels; ++level)
+  {
+    const GLsizei width = std::max(image.width >> level, 1);
+    const GLsizei height = std::max(image.height >> level, 1);
+    const void *levelData = reinterpret_cast<const void*>(offset);
+    if (useTextureStorage())
+      glCompressedTextureSubImage2D(tex, level, 0, 0, width, height, image.internalFormat, image.levelSizes[level], levelData);
+    else
+      glCompressedTexImage2D(GL_TEXTURE_2D, level, image.internalFormat, width, height, 0, image.levelSizes[level], levelData);
+    offset += image.levelSizes[level];
+  }
 
-  // Create the texture object (first bind call for this name)
-  glBindTexture(GL_TEXTURE_2D, tex);
+  if (!useTextureStorage())
+    glBindTexture(GL_TEXTURE_2D, 0);
 
+  size_t bytes = 0;
+  for (GLsizei level = 0; level < numLevels; ++level)
+    bytes += image.levelSizes[level];
+  GpuMemory::GetInstance().TrackTexture(tex, bytes, "Textures");
+  return tex;
+}
+
+GLuint Textures::LoadCompressedTexture(const char name[], bool sRGB)
+{
+  CompressedImage image;
+  if (!ReadDDS(name, sRGB, image))
+  {
+    printf("Failed to load texture: %s\n", name);
+    return 0;
+  }
+
+  return CreateCompressedTexture(image, image.data.data());
+}
+
+GLsizei Textures::GetNumMipLevels(GLsizei width, GLsizei height)
+{
+  GLsizei numLevels = 1;
+  for (GLsizei size = std::max(width, height); size > 1; size >>= 1)
+    ++numLevels;
+  return numLevels;
+}
+
+GLuint Textures::CreateTexture2D(GLenum internalFormat, GLsizei width, GLsizei height, GLsizei numLevels)
+{
+  GLuint tex;
+  if (useTextureStorage())
+  {
+    glCreateTextures(GL_TEXTURE_2D, 1, &tex);
+    glTextureStorage2D(tex, numLevels, internalFormat, width, height);
+  }
+  else
+  {
+    // Generate the texture name and create the texture object (first bind call for this name)
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+
+    // Mip levels are specified one by one, limit the chain so that the texture is complete
+    for (GLsizei level = 0; level < numLevels; ++level)
+    {
+      glTexImage2D(GL_TEXTURE_2D, level, internalFormat, std::max(width >> level, 1), std::max(height >> level, 1), 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+  }
+  GpuMemory::GetInstance().TrackTexture(tex, GpuMemory::GetTextureBytes(internalFormat, width, height, numLevels), "Textures");
+  return tex;
+}
+
+void Textures::UploadTexture2D(GLuint tex, GLint level, GLsizei width, GLsizei height, GLenum format, const void *data)
+{
+  if (useTextureStorage())
+    glTextureSubImage2D(tex, level, 0, 0, width, height, format, GL_UNSIGNED_BYTE, data);
+  else
+    glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, format, GL_UNSIGNED_BYTE, data);
+}
+
+void Textures::FinishTexture2D(GLuint tex, bool generateMipmaps)
+{
+  if (useTextureStorage())
+  {
+    if (generateMipmaps)
+      glGenerateTextureMipmap(tex);
+  }
+  else
+  {
+    if (generateMipmaps)
+      glGenerateMipmap(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+}
+
+GLuint Textures::CreateCheckerBoardTexture(unsigned int textureSize, unsigned int checkerSize, glm::vec3 oddColor, glm::vec3 evenColor, bool sRGB)
+{
   // Generate texture RGB data
   const int stride = 3;
   unsigned char *data = new unsigned char[stride * textureSize * textureSize];
@@ -53,12 +353,10 @@ GLuint Textures::CreateCheckerBoardTexture(unsigned int textureSize, unsigned in
     }
   }
 
-  // Upload texture data: 2D texture, mip level 0, internal format RGB, width, height, border, input format RGB, type, data
-  glTexImage2D(GL_TEXTURE_2D, 0, sRGB ? GL_SRGB : GL_RGB, textureSize, textureSize, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-  glGenerateMipmap(GL_TEXTURE_2D);
-
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
+  // Create the texture with the full mip chain and upload the first level
+  GLuint tex = CreateTexture2D(sRGB ? GL_SRGB8 : GL_RGB8, textureSize, textureSize, GetNumMipLevels(textureSize, textureSize));
+  UploadTexture2D(tex, 0, textureSize, textureSize, GL_RGB, data);
+  FinishTexture2D(tex, true);
 
   // Delete the temporary buffer
   delete[] data;
@@ -69,31 +367,20 @@ GLuint Textures::CreateCheckerBoardTexture(unsigned int textureSize, unsigned in
 
 GLuint Textures::CreateSingleColorTexture(unsigned char r, unsigned char g, unsigned char b)
 {
-  // Generate the texture name
-  GLuint tex;
-  glGenTextures(1, &tex);
-
-  // Create the texture object (first bind call for this name)
-  glBindTexture(GL_TEXTURE_2D, tex);
-
   unsigned char data[] = {r, g, b};
 
-  // Upload texture data: 2D texture, mip level 0, internal format RGB, width, height, border, input format RGB, type, data
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
+  // Single texel texture with just one mip level
+  GLuint tex = CreateTexture2D(GL_RGB8, 1, 1, 1);
+  UploadTexture2D(tex, 0, 1, 1, GL_RGB, data);
+  FinishTexture2D(tex, false);
 
   return tex;
 }
 
 GLuint Textures::CreateMipMapTestTexture()
-{  // Generate the texture name
-  GLuint tex;
-  glGenTextures(1, &tex);
-
-  // Create the texture object (first bind call for this name)
-  glBindTexture(GL_TEXTURE_2D, tex);
+{
+  // Every mip level has its own color
+  GLuint tex = CreateTexture2D(GL_RGB8, 256, 256, GetNumMipLevels(256, 256));
 
   const unsigned int stride = 3;
   unsigned char colors[] = {
@@ -123,15 +410,14 @@ GLuint Textures::CreateMipMapTestTexture()
       }
     }
 
-    // Upload texture data: 2D texture, mip level, internal format RGB, width, height, border, input format RGB, type, data
-    glTexImage2D(GL_TEXTURE_2D, mip, GL_RGB, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+    // Upload texture data of the mip level
+    UploadTexture2D(tex, mip, size, size, GL_RGB, data);
 
     // Delete the intermediate buffer
     delete[] data;
   }
 
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
+  FinishTexture2D(tex, false);
 
   return tex;
 }
@@ -149,28 +435,23 @@ GLuint Textures::LoadTexture(const char name[], bool sRGB)
     return 0;
   }
 
-  // Generate the texture name
-  GLuint tex;
-  glGenTextures(1, &tex);
-
-  // Create the texture object (first bind call for this name)
-  glBindTexture(GL_TEXTURE_2D, tex);
-
-  // Upload texture data: 2D texture, mip level 0, internal format RGB, width, height, border, input format RGB, type, data
-  glTexImage2D(GL_TEXTURE_2D, 0, sRGB ? GL_SRGB : GL_RGB, width, height, 0, numChannels == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, data);
-  glGenerateMipmap(GL_TEXTURE_2D);
+  // Create the texture with the full mip chain and upload the first level, alpha channel is dropped
+  GLuint tex = CreateTexture2D(sRGB ? GL_SRGB8 : GL_RGB8, width, height, GetNumMipLevels(width, height));
+  UploadTexture2D(tex, 0, width, height, numChannels == 4 ? GL_RGBA : GL_RGB, data);
+  FinishTexture2D(tex, true);
 
   // Free the image data, we don't need them anymore
   stbi_image_free(data);
 
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
-
   return tex;
 }
 
 void Textures::CreateSamplers()
 {
+  // Samplers are shared, create them only once
+  if (_samplers[0])
+    return;
+
   // Generate symbolic names for all samplers
   glGenSamplers((GLsizei)Sampler::NumSamplers, _samplers);
 
@@ -0,0 +1,130 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <TransformKernels.h>
+
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#define TRANSFORM_KERNELS_SSE 1
+#include <xmmintrin.h>
+#else
+#define TRANSFORM_KERNELS_SSE 0
+#endif
+
+// Rows of the rotation around the unit axis followed by the translation, the same matrix glm::rotate() builds
+static void writeTranslateRotate(const glm::vec3 &position, float angle, const glm::vec3 &a, float *rows)
+{
+  const float c = cosf(angle);
+  const float s = sinf(angle);
+  const float t = 1.0f - c;
+
+  rows[0] = t * a.x * a.x + c;
+  rows[1] = t * a.x * a.y - s * a.z;
+  rows[2] = t * a.x * a.z + s * a.y;
+  rows[3] = position.x;
+
+  rows[4] = t * a.x * a.y + s * a.z;
+  rows[5] = t * a.y * a.y + c;
+  rows[6] = t * a.y * a.z - s * a.x;
+  rows[7] = position.y;
+
+  rows[8] = t * a.x * a.z - s * a.y;
+  rows[9] = t * a.y * a.z + s * a.x;
+  rows[10] = t * a.z * a.z + c;
+  rows[11] = position.z;
+}
+
+void TransformKernels::TranslateRotate(const glm::vec3 *positions, const float *angles, const glm::vec3 &axis, int count, void *dst, size_t stride)
+{
+  const glm::vec3 a = glm::normalize(axis);
+  unsigned char *out = static_cast<unsigned char*>(dst);
+  int i = 0;
+
+#if TRANSFORM_KERNELS_SSE
+  const __m128 ax = _mm_set1_ps(a.x);
+  const __m128 ay = _mm_set1_ps(a.y);
+  const __m128 az = _mm_set1_ps(a.z);
+  const __m128 one = _mm_set1_ps(1.0f);
+
+  for (; i + 4 <= count; i += 4)
+  {
+    // Only the sines and cosines are scalar, every lane of the rest is one instance
+    float sines[4], cosines[4], px[4], py[4], pz[4];
+    for (int j = 0; j < 4; ++j)
+    {
+      sines[j] = sinf(angles[i + j]);
+      cosines[j] = cosf(angles[i + j]);
+      px[j] = positions[i + j].x;
+      py[j] = positions[i + j].y;
+      pz[j] = positions[i + j].z;
+    }
+
+    const __m128 s = _mm_loadu_ps(sines);
+    const __m128 c = _mm_loadu_ps(cosines);
+    const __m128 t = _mm_sub_ps(one, c);
+    const __m128 tx = _mm_mul_ps(t, ax);
+    const __m128 ty = _mm_mul_ps(t, ay);
+    const __m128 sx = _mm_mul_ps(s, ax);
+    const __m128 sy = _mm_mul_ps(s, ay);
+    const __m128 sz = _mm_mul_ps(s, az);
+    const __m128 txy = _mm_mul_ps(tx, ay);
+    const __m128 txz = _mm_mul_ps(tx, az);
+    const __m128 tyz = _mm_mul_ps(ty, az);
+
+    __m128 m00 = _mm_add_ps(_mm_mul_ps(tx, ax), c);
+    __m128 m01 = _mm_sub_ps(txy, sz);
+    __m128 m02 = _mm_add_ps(txz, sy);
+    __m128 m03 = _mm_loadu_ps(px);
+
+    __m128 m10 = _mm_add_ps(txy, sz);
+    __m128 m11 = _mm_add_ps(_mm_mul_ps(ty, ay), c);
+    __m128 m12 = _mm_sub_ps(tyz, sx);
+    __m128 m13 = _mm_loadu_ps(py);
+
+    __m128 m20 = _mm_sub_ps(txz, sy);
+    __m128 m21 = _mm_add_ps(tyz, sx);
+    __m128 m22 = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(t, az), az), c);
+    __m128 m23 = _mm_loadu_ps(pz);
+
+    // Go from a lane per instance to a register per row of each instance
+    _MM_TRANSPOSE4_PS(m00, m01, m02, m03);
+    _MM_TRANSPOSE4_PS(m10, m11, m12, m13);
+    _MM_TRANSPOSE4_PS(m20, m21, m22, m23);
+
+    const __m128 rows[3][4] = {{m00, m01, m02, m03}, {m10, m11, m12, m13}, {m20, m21, m22, m23}};
+    for (int j = 0; j < 4; ++j)
+    {
+      float *instance = reinterpret_cast<float*>(out + (i + j) * stride);
+      _mm_storeu_ps(instance + 0, rows[0][j]);
+      _mm_storeu_ps(instance + 4, rows[1][j]);
+      _mm_storeu_ps(instance + 8, rows[2][j]);
+    }
+  }
+#endif
+
+  // The rest of the instances one by one
+  for (; i < count; ++i)
+    writeTranslateRotate(positions[i], angles[i], a, reinterpret_cast<float*>(out + i * stride));
+}
+
+void TransformKernels::Translate(const glm::vec3 *positions, int count, void *dst, size_t stride)
+{
+  unsigned char *out = static_cast<unsigned char*>(dst);
+  for (int i = 0; i < count; ++i)
+  {
+    float *rows = reinterpret_cast<float*>(out + i * stride);
+#if TRANSFORM_KERNELS_SSE
+    // Whole rows at once, the destination is likely write combined memory
+    _mm_storeu_ps(rows + 0, _mm_setr_ps(1.0f, 0.0f, 0.0f, positions[i].x));
+    _mm_storeu_ps(rows + 4, _mm_setr_ps(0.0f, 1.0f, 0.0f, positions[i].y));
+    _mm_storeu_ps(rows + 8, _mm_setr_ps(0.0f, 0.0f, 1.0f, positions[i].z));
+#else
+    const float values[12] = {1.0f, 0.0f, 0.0f, positions[i].x, 0.0f, 1.0f, 0.0f, positions[i].y, 0.0f, 0.0f, 1.0f, positions[i].z};
+    for (int j = 0; j < 12; ++j)
+      rows[j] = values[j];
+#endif
+  }
+}
@@ -0,0 +1,55 @@
+/*
+ * Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+ * Licensed under the zlib license, see LICENSE.txt in the root directory.
+ */
+
+#include <MeshConverter.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// ----------------------------------------------------------------------------
+
+// Offline conversion of the OBJ meshes to the binary mesh files loaded by MeshFile
+int main(int argc, char *argv[])
+{
+  bool fitUnitCube = false;
+  const char *input = nullptr;
+  const char *output = nullptr;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-fit") == 0)
+      fitUnitCube = true;
+    else if (!input)
+      input = argv[i];
+    else if (!output)
+      output = argv[i];
+  }
+
+  if (!input)
+  {
+    printf("Usage: MeshConverter [-fit] input.obj [output.mesh]\n");
+    printf("  -fit  center the mesh and scale it to fit the unit cube\n");
+    return -1;
+  }
+
+  // Replace the extension by default
+  std::string meshName = output ? output : input;
+  if (!output)
+  {
+    size_t dot = meshName.find_last_of('.');
+    size_t slash = meshName.find_last_of("/\\");
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+      meshName.erase(dot);
+    meshName += ".mesh";
+  }
+
+  if (!MeshConverter::ConvertObj(input, meshName.c_str(), fitUnitCube))
+  {
+    printf("Failed to convert %s!\n", input);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,26 @@
+@echo off
+rem Source code for the NPGR019 lab practices. Copyright Martin Kahoun 2021.
+rem Licensed under the zlib license, see LICENSE.txt in the root directory.
+rem
+rem Offline conversion of the texture set in bin\data to block compressed DDS files with full mip chains.
+rem Requires texconv from DirectXTex (https://github.com/microsoft/DirectXTex) in PATH.
+rem Images are flipped vertically to match the bottom-up orientation the samples load the source files with.
+
+setlocal
+set DATA=%~dp0..\bin\data
+set TEXCONV=texconv -nologo -y -vflip -m 0 -o "%DATA%"
+
+rem Diffuse in BC7 with sRGB encoding
+%TEXCONV% -srgb -f BC7_UNORM_SRGB "%DATA%\Terracotta_Tiles_002_Base_Color.jpg" || goto :error
+rem Normal map needs just two channels in BC5, Z is reconstructed in the shaders
+%TEXCONV% -f BC5_UNORM "%DATA%\Terracotta_Tiles_002_Normal.jpg" || goto :error
+rem Single channel maps in BC4
+%TEXCONV% -f BC4_UNORM "%DATA%\Terracotta_Tiles_002_Roughness.jpg" || goto :error
+%TEXCONV% -f BC4_UNORM "%DATA%\Terracotta_Tiles_002_ambientOcclusion.jpg" || goto :error
+
+echo Textures converted.
+exit /b 0
+
+:error
+echo Texture conversion failed!
+exit /b 1